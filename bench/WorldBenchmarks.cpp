@@ -0,0 +1,744 @@
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <glm/vec3.hpp>
+#include <glm/gtc/constants.hpp>
+#include "ProceduralLoader.h"
+#include "VoxLoader.h"
+#include "UncompressedGridWorld.h"
+#include "PaletteBricks.h"
+#include "GreedyMeshWorld.h"
+#include "ColumnWorld.h"
+#include "SvoWorld.h"
+#include "SvoAnimation.h"
+#include "OutOfCoreSvoBuilder.h"
+#include "MeshVoxelizer.h"
+#include "RawVolume.h"
+#include "WorldQuery.h"
+#include "InstanceBvh.h"
+#include "JobSystem.h"
+#include "Noise.h"
+
+#ifdef CUBIK_MODEL_DIRECTORY
+constexpr const char* MODEL_DIRECTORY = CUBIK_MODEL_DIRECTORY;
+#else
+constexpr const char* MODEL_DIRECTORY = "../models/";
+#endif
+constexpr int PROCEDURAL_SIZES[] = { 64, 128, 256 };
+constexpr int LOOKUP_COUNT = 1 << 16; // Random positions, cycled through by the lookup benchmarks
+constexpr int NEIGHBOURHOOD_SIZE = 8; // Side of the cubes of positions the batched lookups read
+constexpr int REGION_SIZE = 32; // Side of the boxes visited
+constexpr int QUERY_COUNT = 1024; // Rays and sweeps, cycled through
+constexpr const char* DEFAULT_OUTPUT = "hik-voxel-bench.json";
+// Scene the job system scaling runs on, the biggest one loaded when it isn't in the models directory
+constexpr const char* SCALING_SCENE = "pieta512";
+constexpr int GENERATOR_SIZE = 256;
+constexpr int VOXELIZER_RESOLUTIONS[] = { 256, 1024, 4096 };
+constexpr int TORUS_RINGS = 1024; // The voxelized torus has twice this many times TORUS_SEGMENTS triangles
+constexpr int TORUS_SEGMENTS = 512;
+constexpr int VOLUME_SIZE = 256;
+constexpr int VOLUME_ISO_LEVELS[] = { 1000, 2000, 3000 }; // Shells of the synthetic volume, the last one thinnest
+constexpr int INSTANCE_COUNTS[] = { 100, 1000, 10000 };
+constexpr int ANIMATION_FRAMES = 30;
+constexpr std::pair<cubik::SvoNodeOrder, const char*> NODE_ORDERS[] = {
+  { cubik::SvoNodeOrder::DepthFirst, "depthFirst" },
+  { cubik::SvoNodeOrder::BreadthFirst, "breadthFirst" },
+  { cubik::SvoNodeOrder::SiblingGrouped, "siblingGrouped" },
+  { cubik::SvoNodeOrder::VanEmdeBoas, "vanEmdeBoas" }
+};
+constexpr size_t OUT_OF_CORE_BUDGET = 64 << 20; // Small enough for the bigger scenes to spill runs to disk
+
+namespace {
+  struct Scene {
+    std::string name;
+    std::vector<int> voxels;
+    int size;
+  };
+
+  std::vector<std::string> find_models() {
+    std::vector<std::string> paths;
+    for (const auto& entry : std::filesystem::directory_iterator(MODEL_DIRECTORY)) {
+      if (entry.path().extension() == ".vox") paths.push_back(entry.path().string());
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+  }
+
+  std::vector<Scene> load_scenes(const std::vector<std::string>& models) {
+    std::vector<Scene> scenes;
+    for (int size : PROCEDURAL_SIZES) {
+      scenes.push_back({ "staircase" + std::to_string(size), cubik::loadStaircase(size), size });
+    }
+    for (const std::string& path : models) {
+      Scene scene { std::filesystem::path(path).stem().string() };
+      scene.voxels = cubik::loadVoxFile(path.c_str(), scene.size);
+      scenes.push_back(std::move(scene));
+    }
+    return scenes;
+  }
+
+  std::vector<glm::ivec3> random_positions(int worldSize) {
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<int> coordinate(0, worldSize - 1);
+    std::vector<glm::ivec3> positions(LOOKUP_COUNT);
+    for (auto& position : positions) {
+      position = { coordinate(generator), coordinate(generator), coordinate(generator) };
+    }
+    return positions;
+  }
+
+  void get_random(benchmark::State& state, const cubik::World& world) {
+    std::vector<glm::ivec3> positions = random_positions(world.getSize());
+    size_t i = 0;
+    for (auto _ : state) {
+      benchmark::DoNotOptimize(world.get(positions[i++ % LOOKUP_COUNT]));
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  // Walks the grid x first, the order neighbouring rays and the serializers touch it in
+  void get_coherent(benchmark::State& state, const cubik::World& world) {
+    int size = world.getSize();
+    glm::ivec3 position(0);
+    for (auto _ : state) {
+      benchmark::DoNotOptimize(world.get(position));
+      if (++position.x == size) {
+        position.x = 0;
+        if (++position.y == size) {
+          position.y = 0;
+          position.z = (position.z + 1) % size;
+        }
+      }
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  // Keeps the world's values but none of its structure, so the queries fall back to one get per voxel
+  class VoxelByVoxel : public cubik::World {
+  public:
+    explicit VoxelByVoxel(const cubik::World& world) : _world(world) {}
+
+    size_t calculateSerializedSize() const override { return _world.calculateSerializedSize(); }
+    void serialize(void* target) const override { _world.serialize(target); }
+    const std::string& getCompatibleShader() const override { return _world.getCompatibleShader(); }
+    int get(glm::ivec3 position) const override { return _world.get(position); }
+    int getSize() const override { return _world.getSize(); }
+    int getDepth() const override { return _world.getDepth(); }
+
+  private:
+    const cubik::World& _world;
+  };
+
+  // Cubes of neighbouring positions around random centers, the way gameplay code looks around entities
+  std::vector<glm::ivec3> neighbourhood_positions(int worldSize) {
+    std::vector<glm::ivec3> centers = random_positions(worldSize - NEIGHBOURHOOD_SIZE);
+    std::vector<glm::ivec3> positions;
+    for (size_t i = 0; positions.size() < LOOKUP_COUNT; i++) {
+      for (int z = 0; z < NEIGHBOURHOOD_SIZE; z++) {
+        for (int y = 0; y < NEIGHBOURHOOD_SIZE; y++) {
+          for (int x = 0; x < NEIGHBOURHOOD_SIZE; x++) {
+            positions.push_back(centers[i] + glm::ivec3(x, y, z));
+          }
+        }
+      }
+    }
+    return positions;
+  }
+
+  void get_neighbourhood(benchmark::State& state, const cubik::World& world) {
+    std::vector<glm::ivec3> positions = neighbourhood_positions(world.getSize());
+    for (auto _ : state) {
+      for (glm::ivec3 position : positions) {
+        benchmark::DoNotOptimize(world.get(position));
+      }
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(positions.size()));
+  }
+
+  void get_batch(benchmark::State& state, const cubik::World& world) {
+    std::vector<glm::ivec3> positions = neighbourhood_positions(world.getSize());
+    std::vector<int> values(positions.size());
+    for (auto _ : state) {
+      world.getBatch(positions, values);
+      benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(positions.size()));
+  }
+
+  // Same walk as get_coherent
+  void cursor_coherent(benchmark::State& state, const cubik::SvoWorld& world) {
+    int size = world.getSize();
+    cubik::SvoCursor cursor = world.cursor();
+    glm::ivec3 position(0);
+    for (auto _ : state) {
+      benchmark::DoNotOptimize(cursor.get(position));
+      if (++position.x == size) {
+        position.x = 0;
+        if (++position.y == size) {
+          position.y = 0;
+          position.z = (position.z + 1) % size;
+        }
+      }
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  // Counts the solid voxels of random regions. Reported per voxel of the regions
+  void visit_boxes(benchmark::State& state, const cubik::World& world) {
+    std::vector<glm::ivec3> origins = random_positions(world.getSize() - REGION_SIZE);
+    size_t i = 0;
+    for (auto _ : state) {
+      glm::ivec3 min = origins[i++ % LOOKUP_COUNT];
+      glm::ivec3 max = min + REGION_SIZE;
+      int64_t solidVoxels = 0;
+      world.visitBoxes(min, max, [&](const cubik::WorldBox& box) {
+        if (box.value == 0) return;
+        glm::ivec3 overlap = glm::min(box.origin + box.size, max) - glm::max(box.origin, min);
+        solidVoxels += static_cast<int64_t>(overlap.x) * overlap.y * overlap.z;
+      });
+      benchmark::DoNotOptimize(solidVoxels);
+    }
+    state.SetItemsProcessed(state.iterations() * REGION_SIZE * REGION_SIZE * REGION_SIZE);
+  }
+
+  // Rays from random points of the world in random directions, across it at most
+  void raycast(benchmark::State& state, const cubik::World& world) {
+    std::mt19937 generator(42);
+    std::uniform_real_distribution<float> coordinate(0.f, static_cast<float>(world.getSize()));
+    std::normal_distribution<float> axis;
+    std::vector<std::pair<glm::vec3, glm::vec3>> rays(QUERY_COUNT);
+    for (auto& [origin, direction] : rays) {
+      origin = glm::vec3(coordinate(generator), coordinate(generator), coordinate(generator));
+      direction = glm::vec3(axis(generator), axis(generator), axis(generator));
+      direction = direction / std::sqrt(direction.x * direction.x + direction.y * direction.y + direction.z * direction.z);
+    }
+    size_t i = 0;
+    int64_t hits = 0;
+    for (auto _ : state) {
+      const auto& [origin, direction] = rays[i++ % QUERY_COUNT];
+      std::optional<cubik::RaycastHit> hit = cubik::raycast(world, origin, direction, 2.f * world.getSize());
+      hits += hit.has_value();
+      benchmark::DoNotOptimize(hit);
+    }
+    state.counters["hitRate"] = static_cast<double>(hits) / static_cast<double>(state.iterations());
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  // Player sized boxes moving up to a few voxels per query
+  void sweep(benchmark::State& state, const cubik::World& world) {
+    std::mt19937 generator(42);
+    std::uniform_real_distribution<float> coordinate(0.f, static_cast<float>(world.getSize() - 8));
+    std::uniform_real_distribution<float> step(-4.f, 4.f);
+    std::vector<std::pair<cubik::Aabb, glm::vec3>> sweeps(QUERY_COUNT);
+    for (auto& [box, motion] : sweeps) {
+      box.min = glm::vec3(coordinate(generator), coordinate(generator), coordinate(generator));
+      box.max = box.min + glm::vec3(0.6f, 1.8f, 0.6f);
+      motion = glm::vec3(step(generator), step(generator), step(generator));
+    }
+    size_t i = 0;
+    for (auto _ : state) {
+      const auto& [box, motion] = sweeps[i++ % QUERY_COUNT];
+      benchmark::DoNotOptimize(cubik::sweep(world, box, motion));
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  void register_query_benchmarks(const std::string& name, const cubik::World& world) {
+    benchmark::RegisterBenchmark(("query/getBatch/" + name).c_str(), get_batch, std::cref(world));
+    benchmark::RegisterBenchmark(("query/visitBoxes/" + name).c_str(), visit_boxes, std::cref(world));
+    benchmark::RegisterBenchmark(("query/raycast/" + name).c_str(), raycast, std::cref(world));
+    benchmark::RegisterBenchmark(("query/sweep/" + name).c_str(), sweep, std::cref(world));
+  }
+
+  void serialize(benchmark::State& state, const cubik::World& world) {
+    std::vector<char> target(world.calculateSerializedSize());
+    for (auto _ : state) {
+      world.serialize(target.data());
+      benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * target.size());
+  }
+
+  // Runs the body with every thread count from 1 to one per core, for scaling curves
+  template<typename Body>
+  void register_scaling_benchmark(const std::string& name, Body body) {
+    int maxThreads = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u));
+    benchmark::RegisterBenchmark(("scaling/" + name).c_str(), [body](benchmark::State& state) {
+      cubik::JobSystem::global().set_thread_count(static_cast<int>(state.range(0)));
+      for (auto _ : state) {
+        body();
+      }
+      state.counters["threads"] = static_cast<double>(state.range(0));
+    })->DenseRange(1, maxThreads)->Unit(benchmark::kMillisecond)->UseRealTime();
+  }
+
+  // Evaluates every brick of the source in parallel, the way the builders take them
+  void generate(benchmark::State& state, const cubik::VoxelSource& source) {
+    int bricksPerSide = source.getSize() / cubik::BRICK_SIZE;
+    for (auto _ : state) {
+      std::atomic<int> uniformBricks {0};
+      cubik::JobSystem::global().parallel_for(glm::ivec3(bricksPerSide), 64, [&](glm::ivec3 begin, glm::ivec3 end) {
+        std::array<int, cubik::BRICK_VOLUME> brick;
+        for (int z = begin.z; z < end.z; z++) {
+          for (int y = begin.y; y < end.y; y++) {
+            for (int x = begin.x; x < end.x; x++) {
+              if (source.fillBrick(glm::ivec3(x, y, z) * cubik::BRICK_SIZE, brick)) uniformBricks++;
+              benchmark::DoNotOptimize(brick);
+            }
+          }
+        }
+      });
+      state.counters["uniformBricks"] = uniformBricks.load();
+    }
+    // Reported as voxels per second
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(source.getSize()) * source.getSize() * source.getSize());
+  }
+
+  // Feeds the solid voxels in grid order, not Morton order, so the sort does its usual work. Reported per solid voxel,
+  // which should stay flat as the scenes grow
+  void build_out_of_core(benchmark::State& state, const Scene& scene) {
+    auto path = std::filesystem::temp_directory_path() / "hik-voxel-bench.svo";
+    int64_t solidVoxels = std::count_if(scene.voxels.begin(), scene.voxels.end(), [](int voxel) { return voxel != 0; });
+    for (auto _ : state) {
+      cubik::OutOfCoreSvoBuilder builder(scene.size, path, OUT_OF_CORE_BUDGET);
+      for (int z = 0; z < scene.size; z++) {
+        for (int y = 0; y < scene.size; y++) {
+          for (int x = 0; x < scene.size; x++) {
+            builder.add(glm::ivec3(x, y, z), scene.voxels[x + y * scene.size + z * scene.size * scene.size]);
+          }
+        }
+      }
+      benchmark::DoNotOptimize(builder.finish());
+    }
+    state.SetItemsProcessed(state.iterations() * solidVoxels);
+    std::filesystem::remove(path);
+  }
+
+  // Closed torus lying on the xy plane, with shared vertices so the solid fill works
+  cubik::Mesh make_torus(int rings, int segments) {
+    constexpr float MAJOR_RADIUS = 1.f, MINOR_RADIUS = 0.35f;
+    cubik::Mesh mesh;
+    for (int ring = 0; ring < rings; ring++) {
+      float around = glm::two_pi<float>() * ring / rings;
+      for (int segment = 0; segment < segments; segment++) {
+        float across = glm::two_pi<float>() * segment / segments;
+        float distance = MAJOR_RADIUS + MINOR_RADIUS * std::cos(across);
+        mesh.positions.emplace_back(distance * std::cos(around), distance * std::sin(around), MINOR_RADIUS * std::sin(across));
+      }
+    }
+    for (int ring = 0; ring < rings; ring++) {
+      for (int segment = 0; segment < segments; segment++) {
+        int a = ring * segments + segment;
+        int b = ((ring + 1) % rings) * segments + segment;
+        int c = ((ring + 1) % rings) * segments + (segment + 1) % segments;
+        int d = ring * segments + (segment + 1) % segments;
+        mesh.triangles.emplace_back(a, b, c);
+        mesh.triangles.emplace_back(a, c, d);
+      }
+    }
+    return mesh;
+  }
+
+  // Fills every brick the surface goes through, in parallel like the builders do. Reported per voxel of those bricks
+  void voxelize_surface(benchmark::State& state, const cubik::MeshVoxelizer& voxelizer) {
+    std::vector<glm::ivec3> bricks = voxelizer.getSurfaceBricks();
+    for (auto _ : state) {
+      std::atomic<int64_t> solidVoxels {0};
+      cubik::JobSystem::global().parallel_for(static_cast<int>(bricks.size()), 256, [&](int begin, int end) {
+        std::array<int, cubik::BRICK_VOLUME> brick;
+        int64_t solid = 0;
+        for (int i = begin; i < end; i++) {
+          std::optional<int> uniform = voxelizer.fillBrick(bricks[i], brick);
+          solid += uniform ? *uniform * cubik::BRICK_VOLUME : std::count(brick.begin(), brick.end(), 1);
+        }
+        solidVoxels += solid;
+      });
+      state.counters["solidVoxels"] = static_cast<double>(solidVoxels.load());
+    }
+    state.counters["surfaceBricks"] = static_cast<double>(bricks.size());
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(bricks.size()) * cubik::BRICK_VOLUME);
+  }
+
+  // 16 bit field falling off from the center with some ripples, so iso levels cut wrinkled shells like a CT would.
+  // Written next to its MetaImage header in the temp directory
+  std::filesystem::path write_volume(int size) {
+    auto directory = std::filesystem::temp_directory_path();
+    std::vector<uint16_t> samples(static_cast<size_t>(size) * size * size);
+    for (int z = 0; z < size; z++) {
+      for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+          glm::vec3 offset = (glm::vec3(x, y, z) + 0.5f) / static_cast<float>(size) - 0.5f;
+          float distance = std::sqrt(offset.x * offset.x + offset.y * offset.y + offset.z * offset.z);
+          float ripple = std::sin(offset.x * 40.f) * std::sin(offset.y * 40.f) * std::sin(offset.z * 40.f);
+          samples[x + static_cast<size_t>(y) * size + static_cast<size_t>(z) * size * size] =
+            static_cast<uint16_t>(std::clamp(4000.f * (1.f - 2.f * distance) + 300.f * ripple, 0.f, 65535.f));
+        }
+      }
+    }
+    std::ofstream(directory / "hik-voxel-bench.raw", std::ios::binary)
+      .write(reinterpret_cast<const char*>(samples.data()), static_cast<std::streamsize>(samples.size() * sizeof(uint16_t)));
+    std::ofstream(directory / "hik-voxel-bench.mhd") << "NDims = 3\nDimSize = " << size << " " << size << " " << size
+      << "\nElementType = MET_USHORT\nElementDataFile = hik-voxel-bench.raw\n";
+    return directory / "hik-voxel-bench.mhd";
+  }
+
+  // Boxes of a few voxels to a few dozen scattered over a big scene, and each one nudged a little for the next frame
+  std::vector<cubik::Aabb> scatter_instances(int count, std::mt19937& random) {
+    std::uniform_real_distribution<float> position(0.f, 4096.f), size(4.f, 48.f);
+    std::vector<cubik::Aabb> bounds(count);
+    for (cubik::Aabb& box : bounds) {
+      glm::vec3 origin(position(random), position(random), position(random));
+      box = { origin, origin + glm::vec3(size(random), size(random), size(random)) };
+    }
+    return bounds;
+  }
+
+  void instance_bvh_build(benchmark::State& state, int count) {
+    std::mt19937 random(count);
+    std::vector<cubik::Aabb> bounds = scatter_instances(count, random);
+    cubik::InstanceBvh bvh;
+    for (auto _ : state) {
+      bvh.build(bounds);
+    }
+    state.counters["cost"] = bvh.getCost();
+    state.SetItemsProcessed(state.iterations() * count);
+  }
+
+  // A frame of instances moving by up to a voxel, alternating between two poses so the tree doesn't drift
+  void instance_bvh_refit(benchmark::State& state, int count) {
+    std::mt19937 random(count);
+    std::vector<cubik::Aabb> poses[2] = { scatter_instances(count, random), {} };
+    std::uniform_real_distribution<float> step(-1.f, 1.f);
+    poses[1] = poses[0];
+    for (cubik::Aabb& box : poses[1]) {
+      glm::vec3 motion(step(random), step(random), step(random));
+      box = { box.min + motion, box.max + motion };
+    }
+    cubik::InstanceBvh bvh;
+    bvh.build(poses[0]);
+    int frame = 0;
+    for (auto _ : state) {
+      bvh.refit(poses[++frame % 2]);
+    }
+    state.counters["cost"] = bvh.getCost();
+    state.SetItemsProcessed(state.iterations() * count);
+  }
+
+  // Writes a ball over the terrain in the ball's bounding box, inside it or the terrain's voxels elsewhere
+  void draw_ball(std::vector<int>& grid, const std::vector<int>& terrain, int size, glm::vec3 center, float radius, bool isVisible) {
+    glm::ivec3 min = glm::max(glm::ivec3(center - radius), glm::ivec3(0));
+    glm::ivec3 max = glm::min(glm::ivec3(center + radius) + 1, glm::ivec3(size));
+    for (int z = min.z; z < max.z; z++) {
+      for (int y = min.y; y < max.y; y++) {
+        for (int x = min.x; x < max.x; x++) {
+          size_t index = x + y * static_cast<size_t>(size) + z * static_cast<size_t>(size) * size;
+          glm::vec3 offset = glm::vec3(x, y, z) + 0.5f - center;
+          grid[index] = isVisible && glm::dot(offset, offset) < radius * radius ? 1 : terrain[index];
+        }
+      }
+    }
+  }
+
+  // A ball rolling over the terrain a voxel per frame, so most of each frame is the frame before it. The counters are
+  // the node bytes each frame adds to the shared pool, and what it would take as an octree of its own
+  void animation_build(benchmark::State& state, const std::vector<int>& terrain, int size) {
+    std::vector<int> grid = terrain;
+    float radius = size / 8.f;
+    auto center = [&](int frame) { return glm::vec3(size / 4.f + frame, size / 2.f, size / 2.f); };
+    std::optional<cubik::SvoAnimation> animation;
+    for (auto _ : state) {
+      animation.emplace(size);
+      for (int frame = 0; frame < ANIMATION_FRAMES; frame++) {
+        draw_ball(grid, terrain, size, center(frame), radius, true);
+        animation->addFrame(grid);
+        draw_ball(grid, terrain, size, center(frame), radius, false);
+      }
+      benchmark::DoNotOptimize(*animation);
+    }
+    size_t treeNodes = 0;
+    for (int i = 0; i < animation->getFrameCount(); i++) treeNodes += animation->getFrame(i).treeNodes;
+    state.counters["bytesPerFrame"] = animation->getNodes().size() * sizeof(cubik::LinearOctreeNode) / static_cast<double>(ANIMATION_FRAMES);
+    state.counters["treeBytesPerFrame"] = treeNodes * sizeof(cubik::LinearOctreeNode) / static_cast<double>(ANIMATION_FRAMES);
+    state.SetItemsProcessed(state.iterations() * ANIMATION_FRAMES);
+  }
+
+  // Meshes the grid the way GreedyMeshWorld does. The counters are what it would upload, to compare with serialized_size
+  void greedy_mesh_build(benchmark::State& state, const cubik::World& world) {
+    cubik::GreedyMesh mesh;
+    for (auto _ : state) {
+      mesh = cubik::buildGreedyMesh(world);
+      benchmark::DoNotOptimize(mesh);
+    }
+    cubik::GreedyMeshHeader header {
+      .size = world.getSize(),
+      .vertexCount = static_cast<uint32_t>(mesh.vertices.size()),
+      .indexCount = static_cast<uint32_t>(mesh.indices.size()),
+      .drawCount = static_cast<uint32_t>(mesh.draws.size())
+    };
+    state.counters["quads"] = static_cast<double>(mesh.indices.size() / 6);
+    state.counters["bytes"] = static_cast<double>(header.byteSize());
+  }
+
+  // Packs the grid the way UncompressedGridWorld uploads it. The counters are its memory per voxel and how many
+  // bricks got each index width
+  void palette_brick_build(benchmark::State& state, const Scene& scene) {
+    std::optional<cubik::PaletteBrickGrid> grid;
+    for (auto _ : state) {
+      grid.emplace(scene.voxels, scene.size);
+      benchmark::DoNotOptimize(*grid);
+    }
+    state.counters["bytesPerVoxel"] = grid->getBytesPerVoxel();
+    std::array<int, cubik::PALETTE_BRICK_BITS.size()> histogram = grid->getBitsHistogram();
+    for (size_t i = 0; i < histogram.size(); i++) {
+      state.counters["bricks" + std::to_string(cubik::PALETTE_BRICK_BITS[i]) + "bit"] = histogram[i];
+    }
+  }
+
+  // What the renderer uploads for the world
+  void serialized_size(benchmark::State& state, const cubik::World& world) {
+    size_t size = 0;
+    for (auto _ : state) {
+      size = world.calculateSerializedSize();
+      benchmark::DoNotOptimize(size);
+    }
+    state.counters["bytes"] = static_cast<double>(size);
+    int worldSize = world.getSize();
+    state.counters["bytesPerVoxel"] = static_cast<double>(size) / (static_cast<double>(worldSize) * worldSize * worldSize);
+  }
+
+  // The scene's octree is shared with the other benchmarks, so it's laid out in the order for the run and put back after
+  void node_order(benchmark::State& state, cubik::SvoWorld& world, cubik::SvoNodeOrder order,
+                  void (*lookups)(benchmark::State&, const cubik::World&)) {
+    cubik::SvoNodeOrder previousOrder = world.getNodeOrder();
+    world.relinearize(order);
+    lookups(state, world);
+    world.relinearize(previousOrder);
+  }
+
+  void register_world_benchmarks(const std::string& name, const cubik::World& world) {
+    benchmark::RegisterBenchmark(("get_random/" + name).c_str(), get_random, std::cref(world));
+    benchmark::RegisterBenchmark(("get_coherent/" + name).c_str(), get_coherent, std::cref(world));
+    benchmark::RegisterBenchmark(("serialize/" + name).c_str(), serialize, std::cref(world))->Unit(benchmark::kMicrosecond);
+    benchmark::RegisterBenchmark(("serializedSize/" + name).c_str(), serialized_size, std::cref(world));
+  }
+}
+
+// Results go to hik-voxel-bench.json unless --benchmark_out says otherwise, so runs can be compared across commits
+// with Google Benchmark's compare.py
+int main(int argc, char** argv) {
+  std::vector<std::string> models = find_models();
+  std::vector<Scene> scenes = load_scenes(models);
+
+  for (const std::string& path : models) {
+    benchmark::RegisterBenchmark(("loadVoxFile/" + std::filesystem::path(path).stem().string()).c_str(), [path](benchmark::State& state) {
+      for (auto _ : state) {
+        int size;
+        benchmark::DoNotOptimize(cubik::loadVoxFile(path.c_str(), size));
+      }
+    })->Unit(benchmark::kMillisecond);
+  }
+
+  std::vector<std::unique_ptr<cubik::UncompressedGridWorld>> gridWorlds;
+  std::vector<std::unique_ptr<cubik::SvoWorld>> svoWorlds;
+  std::vector<std::unique_ptr<cubik::SvoWorld>> leafBrickWorlds;
+  std::vector<std::unique_ptr<cubik::ColumnWorld>> columnWorlds;
+  std::vector<std::unique_ptr<VoxelByVoxel>> naiveWorlds;
+  for (const Scene& scene : scenes) {
+    benchmark::RegisterBenchmark(("SvoWorld/build/" + scene.name).c_str(), [&scene](benchmark::State& state) {
+      for (auto _ : state) {
+        cubik::SvoWorld world(scene.voxels, scene.size);
+        benchmark::DoNotOptimize(world);
+      }
+    })->Unit(benchmark::kMillisecond);
+
+    const auto& svoWorld = svoWorlds.emplace_back(std::make_unique<cubik::SvoWorld>(scene.voxels, scene.size));
+    benchmark::RegisterBenchmark(("SvoWorld/buildLinearizedSvo/" + scene.name).c_str(), [world = svoWorld.get()](benchmark::State& state) {
+      for (auto _ : state) {
+        world->relinearize();
+      }
+    })->Unit(benchmark::kMillisecond);
+
+    // Same octree with its bottom level compressed, compare with SvoWorld/<scene> for what the decoding costs
+    benchmark::RegisterBenchmark(("SvoWorld/leafBricks/build/" + scene.name).c_str(), [&scene](benchmark::State& state) {
+      for (auto _ : state) {
+        cubik::SvoWorld world(scene.voxels, scene.size, cubik::SvoNodeOrder::DepthFirst, true);
+        benchmark::DoNotOptimize(world);
+      }
+    })->Unit(benchmark::kMillisecond);
+    const auto& leafBrickWorld = leafBrickWorlds.emplace_back(
+      std::make_unique<cubik::SvoWorld>(scene.voxels, scene.size, cubik::SvoNodeOrder::DepthFirst, true));
+
+    benchmark::RegisterBenchmark(("OutOfCoreSvoBuilder/build/" + scene.name).c_str(), build_out_of_core, std::cref(scene))
+      ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+    const auto& gridWorld = gridWorlds.emplace_back(std::make_unique<cubik::UncompressedGridWorld>(scene.voxels, scene.size));
+    register_world_benchmarks("UncompressedGridWorld/" + scene.name, *gridWorld);
+    register_world_benchmarks("SvoWorld/" + scene.name, *svoWorld);
+    register_world_benchmarks("SvoWorld/leafBricks/" + scene.name, *leafBrickWorld);
+    const auto& columnWorld = columnWorlds.emplace_back(std::make_unique<cubik::ColumnWorld>(scene.voxels, scene.size));
+    register_world_benchmarks("ColumnWorld/" + scene.name, *columnWorld);
+    for (auto [order, orderName] : NODE_ORDERS) {
+      std::string prefix = std::string("SvoWorld/nodeOrder/") + orderName;
+      benchmark::RegisterBenchmark((prefix + "/build/" + scene.name).c_str(), [world = svoWorld.get(), order](benchmark::State& state) {
+        cubik::SvoNodeOrder previousOrder = world->getNodeOrder();
+        for (auto _ : state) {
+          world->relinearize(order);
+        }
+        world->relinearize(previousOrder);
+      })->Unit(benchmark::kMillisecond);
+      benchmark::RegisterBenchmark((prefix + "/get_random/" + scene.name).c_str(), node_order, std::ref(*svoWorld), order, get_random);
+      benchmark::RegisterBenchmark((prefix + "/get_coherent/" + scene.name).c_str(), node_order, std::ref(*svoWorld), order, get_coherent);
+    }
+    benchmark::RegisterBenchmark(("GreedyMeshWorld/build/" + scene.name).c_str(), greedy_mesh_build, std::cref(*gridWorld))
+      ->Unit(benchmark::kMillisecond)->UseRealTime();
+    benchmark::RegisterBenchmark(("PaletteBrickGrid/build/" + scene.name).c_str(), palette_brick_build, std::cref(scene))
+      ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+    // The naive loops the queries replace, on the same octree
+    const auto& naiveWorld = naiveWorlds.emplace_back(std::make_unique<VoxelByVoxel>(*svoWorld));
+    benchmark::RegisterBenchmark(("query/get_neighbourhood/SvoWorld/" + scene.name).c_str(), get_neighbourhood, std::cref(*svoWorld));
+    benchmark::RegisterBenchmark(("query/cursor_coherent/SvoWorld/" + scene.name).c_str(), cursor_coherent, std::cref(*svoWorld));
+    register_query_benchmarks("SvoWorld/" + scene.name, *svoWorld);
+    register_query_benchmarks("SvoWorld/voxelByVoxel/" + scene.name, *naiveWorld);
+    register_query_benchmarks("UncompressedGridWorld/" + scene.name, *gridWorld);
+    register_query_benchmarks("ColumnWorld/" + scene.name, *columnWorld);
+  }
+
+  cubik::NoiseTerrainSource terrain(GENERATOR_SIZE);
+  cubik::CaveSource caves(GENERATOR_SIZE);
+  cubik::MengerSpongeSource menger(GENERATOR_SIZE);
+  std::pair<const char*, const cubik::VoxelSource*> sources[] = {
+    { "terrain", &terrain },
+    { "caves", &caves },
+    { "menger", &menger }
+  };
+  for (auto [name, source] : sources) {
+    std::string sceneName = std::string(name) + std::to_string(GENERATOR_SIZE);
+    benchmark::RegisterBenchmark(("generate/" + sceneName).c_str(), generate, std::cref(*source))->Unit(benchmark::kMillisecond)->UseRealTime();
+    benchmark::RegisterBenchmark(("SvoWorld/buildFromSource/" + sceneName).c_str(), [source](benchmark::State& state) {
+      for (auto _ : state) {
+        cubik::SvoWorld world(*source);
+        benchmark::DoNotOptimize(world);
+      }
+    })->Unit(benchmark::kMillisecond)->UseRealTime();
+    benchmark::RegisterBenchmark(("ColumnWorld/buildFromSource/" + sceneName).c_str(), [source](benchmark::State& state) {
+      for (auto _ : state) {
+        cubik::ColumnWorld world(*source);
+        benchmark::DoNotOptimize(world);
+      }
+    })->Unit(benchmark::kMillisecond)->UseRealTime();
+  }
+
+  // The backends side by side on the terrain, the scene the columns are meant for
+  std::string terrainName = "terrain" + std::to_string(GENERATOR_SIZE);
+  cubik::UncompressedGridWorld terrainGrid(cubik::loadSource(terrain), GENERATOR_SIZE);
+  cubik::SvoWorld terrainSvo(terrain);
+  cubik::ColumnWorld terrainColumns(terrain);
+  register_world_benchmarks("UncompressedGridWorld/" + terrainName, terrainGrid);
+  register_world_benchmarks("SvoWorld/" + terrainName, terrainSvo);
+  register_world_benchmarks("ColumnWorld/" + terrainName, terrainColumns);
+  register_query_benchmarks("SvoWorld/" + terrainName, terrainSvo);
+  register_query_benchmarks("ColumnWorld/" + terrainName, terrainColumns);
+
+  std::vector<int> terrainVoxels = cubik::loadSource(terrain);
+  benchmark::RegisterBenchmark(("SvoAnimation/build/" + terrainName).c_str(), animation_build, std::cref(terrainVoxels), GENERATOR_SIZE)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+  cubik::Mesh torus = make_torus(TORUS_RINGS, TORUS_SEGMENTS);
+  std::vector<std::unique_ptr<cubik::MeshVoxelizer>> voxelizers;
+  for (int resolution : VOXELIZER_RESOLUTIONS) {
+    std::string sceneName = "torus" + std::to_string(resolution);
+    benchmark::RegisterBenchmark(("voxelize/bin/" + sceneName).c_str(), [&torus, resolution](benchmark::State& state) {
+      for (auto _ : state) {
+        cubik::MeshVoxelizer voxelizer(torus, resolution);
+        benchmark::DoNotOptimize(voxelizer);
+      }
+      state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(torus.triangles.size()));
+    })->Unit(benchmark::kMillisecond)->UseRealTime();
+
+    const auto& voxelizer = voxelizers.emplace_back(std::make_unique<cubik::MeshVoxelizer>(torus, resolution));
+    benchmark::RegisterBenchmark(("voxelize/surface/" + sceneName).c_str(), voxelize_surface, std::cref(*voxelizer))
+      ->Unit(benchmark::kMillisecond)->UseRealTime();
+  }
+
+  std::filesystem::path volumeHeader = write_volume(VOLUME_SIZE);
+  std::string volumeName = "sphere" + std::to_string(VOLUME_SIZE);
+  benchmark::RegisterBenchmark(("RawVolume/pyramid/" + volumeName).c_str(), [&volumeHeader](benchmark::State& state) {
+    cubik::RawVolumeLayout layout = cubik::readMetaImageHeader(volumeHeader);
+    for (auto _ : state) {
+      cubik::RawVolume volume(layout);
+      benchmark::DoNotOptimize(volume);
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(VOLUME_SIZE) * VOLUME_SIZE * VOLUME_SIZE);
+  })->Unit(benchmark::kMillisecond)->UseRealTime();
+
+  // What changing the iso level at runtime costs, the pyramid is already built
+  cubik::RawVolume volume(cubik::readMetaImageHeader(volumeHeader));
+  for (int isoLevel : VOLUME_ISO_LEVELS) {
+    std::string name = "SvoWorld/buildFromVolume/" + volumeName + "/iso" + std::to_string(isoLevel);
+    benchmark::RegisterBenchmark(name.c_str(), [&volume, isoLevel](benchmark::State& state) {
+      volume.setIsoLevel(isoLevel);
+      for (auto _ : state) {
+        cubik::SvoWorld world(volume);
+        benchmark::DoNotOptimize(world);
+      }
+    })->Unit(benchmark::kMillisecond)->UseRealTime();
+  }
+
+  for (int count : INSTANCE_COUNTS) {
+    benchmark::RegisterBenchmark(("InstanceBvh/build/" + std::to_string(count)).c_str(), instance_bvh_build, count)->Unit(benchmark::kMicrosecond);
+    benchmark::RegisterBenchmark(("InstanceBvh/refit/" + std::to_string(count)).c_str(), instance_bvh_refit, count)->Unit(benchmark::kMicrosecond);
+  }
+
+  auto scalingScene = std::find_if(scenes.begin(), scenes.end(), [](const Scene& scene) { return scene.name == SCALING_SCENE; });
+  if (scalingScene == scenes.end()) {
+    scalingScene = std::max_element(scenes.begin(), scenes.end(), [](const Scene& a, const Scene& b) { return a.size < b.size; });
+  }
+  const Scene& scaling = *scalingScene;
+  auto scalingModel = std::find_if(models.begin(), models.end(), [&](const std::string& path) {
+    return std::filesystem::path(path).stem().string() == scaling.name;
+  });
+  if (scalingModel != models.end()) {
+    register_scaling_benchmark("loadVoxFile/" + scaling.name, [path = *scalingModel]() {
+      int size;
+      benchmark::DoNotOptimize(cubik::loadVoxFile(path.c_str(), size));
+    });
+  }
+  register_scaling_benchmark("SvoWorld/build/" + scaling.name, [&scaling]() {
+    cubik::SvoWorld world(scaling.voxels, scaling.size);
+    benchmark::DoNotOptimize(world);
+  });
+  register_scaling_benchmark("loadStaircase/" + std::to_string(scaling.size), [size = scaling.size]() {
+    benchmark::DoNotOptimize(cubik::loadStaircase(size));
+  });
+
+  std::vector<char*> arguments(argv, argv + argc);
+  std::string defaultOutput = std::string("--benchmark_out=") + DEFAULT_OUTPUT;
+  std::string defaultFormat = "--benchmark_out_format=json";
+  bool hasOutput = std::any_of(arguments.begin(), arguments.end(), [](const char* argument) {
+    return std::string(argument).starts_with("--benchmark_out=");
+  });
+  if (!hasOutput) {
+    arguments.push_back(defaultOutput.data());
+    arguments.push_back(defaultFormat.data());
+  }
+  int argumentCount = static_cast<int>(arguments.size());
+
+  benchmark::Initialize(&argumentCount, arguments.data());
+  if (benchmark::ReportUnrecognizedArguments(argumentCount, arguments.data())) return 1;
+  benchmark::AddCustomContext("noise", cubik::noise::is_vectorized() ? "avx2" : "scalar");
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
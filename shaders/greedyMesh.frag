@@ -0,0 +1,26 @@
+#version 460
+
+// Same sun as the marchers' resolve
+const vec3 SHADOW_COLOR = 0.3 * vec3(0.1490f, 0.3294f, 0.4863f);
+const vec3 SUN_DIRECTION = normalize(vec3(0, 1., -1.));
+
+// Indexed by the face, encoded like in the marchers' hit image
+const vec3 FACE_NORMALS[7] = vec3[](
+    vec3(0), vec3(1, 0, 0), vec3(-1, 0, 0), vec3(0, 1, 0), vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1)
+);
+
+layout(location = 0) flat in int face;
+layout(location = 1) flat in int material;
+layout(location = 0) out vec4 outColor;
+
+// The marchers' palette, RGBA8 colors indexed by material
+layout(set = 0, binding = 12) readonly buffer Palette {
+    uint colors[256];
+} palette;
+
+// Shaded like the marchers' flat quality, there are no shadows or ambient occlusion to sample
+void main() {
+    float light = dot(-FACE_NORMALS[face], SUN_DIRECTION);
+    vec3 albedo = unpackUnorm4x8(palette.colors[material]).rgb;
+    outColor = vec4(mix(SHADOW_COLOR, albedo, light), 1.);
+}
@@ -0,0 +1,31 @@
+#version 460
+
+// Near plane of the reverse Z depth shared with the marchers, mirrors DEPTH_NEAR_PLANE in the renderer
+const float DEPTH_NEAR_PLANE = 0.01;
+
+// Mirrors PackedVertex: x and y, 16 bits each, then z in 16 bits, the face and the material in 8 each
+layout(location = 0) in uvec2 packedVertex;
+layout(location = 0) flat out int face;
+layout(location = 1) flat out int material;
+
+layout(push_constant) uniform Constants {
+    mat4 objectToWorld; // Scales the voxels to world units
+    vec4 color;
+    vec3 cameraPosition;
+    float aspectRatio; // Width over height
+    vec3 cameraForward;
+    vec3 cameraUp;
+} constants;
+
+void main() {
+    uvec3 voxel = uvec3(packedVertex.x & 0xFFFFu, packedVertex.x >> 16, packedVertex.y & 0xFFFFu);
+    face = int((packedVertex.y >> 16) & 0xFFu);
+    material = int(packedVertex.y >> 24);
+    vec3 worldPosition = (constants.objectToWorld * vec4(voxel, 1)).xyz;
+
+    // Same projection as raster.vert, so the meshes drawn over the world depth test against it
+    vec3 view = worldPosition - constants.cameraPosition;
+    vec3 right = cross(constants.cameraUp, constants.cameraForward);
+    float viewDepth = dot(view, constants.cameraForward);
+    gl_Position = vec4(dot(view, right), dot(view, constants.cameraUp) * constants.aspectRatio, DEPTH_NEAR_PLANE, viewDepth);
+}
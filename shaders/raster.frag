@@ -0,0 +1,26 @@
+#version 460
+
+// Same sun and shadow color as the marchers' resolve
+const vec3 SHADOW_COLOR = 0.3 * vec3(0.1490f, 0.3294f, 0.4863f);
+const vec3 SUN_DIRECTION = normalize(vec3(0, 1., -1.));
+
+layout(location = 0) in vec3 worldPosition;
+layout(location = 0) out vec4 outColor;
+
+layout(push_constant) uniform Constants {
+    mat4 objectToWorld;
+    vec4 color;
+    vec3 cameraPosition;
+    float aspectRatio;
+    vec3 cameraForward;
+    vec3 cameraUp;
+} constants;
+
+void main() {
+    // Meshes have no normals, so they're flat shaded with the face's, turned towards the camera
+    vec3 normal = normalize(cross(dFdx(worldPosition), dFdy(worldPosition)));
+    if (dot(normal, worldPosition - constants.cameraPosition) > 0) normal = -normal;
+
+    float light = max(dot(-normal, SUN_DIRECTION), 0.);
+    outColor = vec4(mix(SHADOW_COLOR, constants.color.rgb, light), 1.);
+}
@@ -0,0 +1,27 @@
+#version 460
+
+// Near plane of the reverse Z depth shared with the marchers, mirrors DEPTH_NEAR_PLANE in the renderer
+const float DEPTH_NEAR_PLANE = 0.01;
+
+layout(location = 0) in vec3 position;
+layout(location = 0) out vec3 worldPosition;
+
+layout(push_constant) uniform Constants {
+    mat4 objectToWorld;
+    vec4 color;
+    vec3 cameraPosition;
+    float aspectRatio; // Width over height
+    vec3 cameraForward;
+    vec3 cameraUp;
+} constants;
+
+void main() {
+    worldPosition = (constants.objectToWorld * vec4(position, 1)).xyz;
+
+    // The marchers' pinhole camera: their primary ray through a pixel center hits the same point the
+    // triangle is sampled at, and both end up at the same depth
+    vec3 view = worldPosition - constants.cameraPosition;
+    vec3 right = cross(constants.cameraUp, constants.cameraForward);
+    float viewDepth = dot(view, constants.cameraForward);
+    gl_Position = vec4(dot(view, right), dot(view, constants.cameraUp) * constants.aspectRatio, DEPTH_NEAR_PLANE, viewDepth);
+}
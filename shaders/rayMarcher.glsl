@@ -0,0 +1,626 @@
+// Everything the ray marchers share but the world: its buffer, traceWorld and traverseAnyHit. The marchers define
+// the specialization constants and MAX_STEPS before including it, and the world after
+
+//size of a workgroup for compute
+layout (local_size_x = 16, local_size_y = 16) in;
+
+// Passes the renderer runs every frame, in this order
+const int PASS_PRIMARY = 0;
+const int PASS_SHADOWS = 1;
+const int PASS_AMBIENT_OCCLUSION = 2;
+const int PASS_RESOLVE = 3;
+// Only run when rays were submitted, over the queries instead of the image
+const int PASS_RAY_QUERY = 4;
+
+// What the primary pass shows
+const int VIEW_SHADED = 0;
+const int VIEW_STEP_HEATMAP = 1;
+const int VIEW_NODE_HEATMAP = 2;
+
+const vec3 SKY_COLOR = vec3(1.0f, 0.8196f, 0.4f);
+const vec3 SHADOW_COLOR = 0.3 * vec3(0.1490f, 0.3294f, 0.4863f);
+const vec3 SUN_DIRECTION = normalize(vec3(0, 1., -1.));
+const float SUN_ANGULAR_RADIUS = 0.02; // In radians, gives soft shadows once accumulated
+const float AO_MIN_LIGHT = 0.35;
+const float SECONDARY_RAY_OFFSET = 0.001 * VOXEL_SIZE;
+// Near plane of the reverse Z depth shared with the raster pass, mirrors DEPTH_NEAR_PLANE in the renderer
+const float DEPTH_NEAR_PLANE = 0.01;
+const float PI = 3.14159265;
+
+// Indexed by the face stored in the hit image. 7 means the ray started inside a solid voxel
+const vec3 FACE_NORMALS[8] = vec3[](
+    vec3(0), vec3(1, 0, 0), vec3(-1, 0, 0), vec3(0, 1, 0), vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1), vec3(0)
+);
+
+// Hits store the face plus 8 times the material in the hit image's w, which a float holds exactly
+int hitFace(float w) { return int(w) & 7; }
+int hitMaterial(float w) { return int(w) >> 3; }
+
+//descriptor bindings for the pipeline
+// Either the draw image or the swapchain image, so it has no format
+layout(set = 0, binding = 0) uniform writeonly image2D image;
+// Primary hit position, with the face it entered through in w. 0 is a miss and negative values carry a debug color
+layout(rgba32f, set = 0, binding = 2) uniform image2D hitImage;
+// Fraction of unoccluded rays for each effect, accumulated over frames
+layout(r16f, set = 0, binding = 3) uniform image2D shadowImage;
+layout(r16f, set = 0, binding = 4) uniform image2D aoImage;
+
+const int RAY_PRIMARY = 0;
+const int RAY_SECONDARY = 1;
+// Bucket i > 0 counts rays that took [2^(i-1), 2^i) steps, the last one everything above
+const int STEP_HISTOGRAM_BUCKETS = 16;
+
+struct RayStatistics {
+    uint64_t rays;
+    uint64_t steps;
+    uint64_t nodesFetched;
+    uint64_t raysOverBudget;
+    uint64_t stepHistogram[STEP_HISTOGRAM_BUCKETS];
+};
+
+// Cleared every frame, only written by variants with statistics
+layout(set = 0, binding = 5) buffer Statistics {
+    RayStatistics rayKinds[2];
+} statistics;
+
+struct RayQuery {
+    vec3 origin;
+    float maxDistance;
+    vec3 direction;
+    float padding;
+};
+
+// In world units, face is encoded like in the hit image
+struct RayQueryHit {
+    vec3 position;
+    float distance;
+    ivec3 voxel;
+    int face;
+    int instance; // -1 for the world
+    int material; // Palette index of the voxel, 0 on a miss
+};
+
+layout(set = 0, binding = 6) readonly buffer RayQueries {
+    RayQuery queries[];
+} rayQueries;
+
+layout(set = 0, binding = 7) writeonly buffer RayQueryHits {
+    RayQueryHit hits[];
+} rayQueryHits;
+
+// Models instanced into the scene are octrees in the layout of the SVO marcher's world, in their own voxels.
+// The array is only bound up to the models that finished uploading
+const int MAX_MODELS = 256;
+const int INSTANCE_STACK_SIZE = 32; // Deepest top level BVH the renderer builds
+
+struct SvoNode {
+    int LeafMask;
+    int childrenOffsets[8];
+};
+
+layout(set = 0, binding = 8) readonly buffer Model {
+    float voxelSize;
+    int size;
+    SvoNode data[];
+} models[MAX_MODELS];
+
+struct Instance {
+    mat4 worldToObject; // From world units to the model's voxels
+    int model;
+    int id; // Renderer handle, reported back by ray queries
+};
+
+// Siblings are next to each other, so inner nodes only point at the left one
+struct BvhNode {
+    vec3 min;
+    int leftOrFirst; // Left child of inner nodes, first instance of leaves
+    vec3 max;
+    int count; // Instances in a leaf, 0 for inner nodes
+};
+
+// Rebuilt or refitted every frame, with the instances in leaf order
+layout(set = 0, binding = 9) readonly buffer Instances {
+    Instance instances[];
+} instances;
+
+layout(set = 0, binding = 10) readonly buffer InstanceBvh {
+    BvhNode nodes[];
+} instanceBvh;
+
+// Depth of the primary hits, copied into the raster pass' depth attachment. Rows of the image, tightly packed
+layout(set = 0, binding = 11) writeonly buffer RayDepth {
+    float depths[];
+} rayDepth;
+
+// RGBA8 colors indexed by the voxel values, only read by the resolve
+layout(set = 0, binding = 12) readonly buffer Palette {
+    uint colors[256];
+} palette;
+
+// Work done by the ray being traced
+int rayStepCount;
+int rayNodeCount;
+bool rayOverBudget;
+
+layout(push_constant) uniform Constants {
+    vec3 cameraPosition;
+    vec3 cameraForward;
+    vec3 cameraUp;
+//    vec3 cameraRight;
+    int pass;
+    int shadowRays;
+    int aoRays;
+    float aoRadius;
+    float shadowHistoryWeight;
+    float aoHistoryWeight;
+    uint frameIndex;
+    int view;
+    uint rayQueryCount;
+    uint instanceNodeCount; // 0 when there are no instances
+} constants;
+
+struct Camera {
+    vec3 position;
+    vec3 forward;
+    vec3 up;
+    vec3 right;
+};
+
+struct Ray {
+    vec3 origin;
+    vec3 direction;
+};
+
+vec2 intersectAABB(Ray ray, vec3 boxMin, vec3 boxMax);
+bool anyHit(Ray ray, float maxDistance);
+void beginRay();
+void recordRay(int kind);
+vec3 heatmap(int count, int budget);
+int encodeFace(vec3 normal);
+void storeHit(ivec2 texelCoord, vec3 position, vec3 normal, int material);
+void storeMiss(ivec2 texelCoord);
+void storeDebugColor(ivec2 texelCoord, vec3 color);
+void traceShadows(ivec2 texelCoord);
+void traceAmbientOcclusion(ivec2 texelCoord);
+void resolve(ivec2 texelCoord);
+void traceRayQuery(uint index);
+
+// Closest hit of a ray, shared by the primary pass and the ray queries
+const int TRACE_MISS = 0;
+const int TRACE_HIT = 1;
+const int TRACE_FAILED = 2; // The traversal went wrong, debugColor says where
+
+struct Hit {
+    int result;
+    vec3 position;
+    vec3 normal;
+    ivec3 voxel;
+    float distance;
+    vec3 debugColor;
+    int instance; // -1 for the world
+    int material;
+};
+
+bool traceInstances(Ray ray, float maxDistance, bool isAnyHit, inout Hit hit);
+vec3 entryNormal(Ray ray, vec3 boxMin, vec3 boxMax);
+
+// Closest hit in the world, and whether anything in the world is nearer than maxDistance. Defined by each marcher for
+// its world's layout
+Hit traceWorld(Ray ray, float maxDistance);
+bool traverseAnyHit(Ray ray, float maxDistance);
+
+// Instances are only traced up to the world's hit, so the ones behind it cost a BVH test at most
+Hit traceClosest(Ray ray, float maxDistance) {
+    Hit hit = traceWorld(ray, maxDistance);
+    if (hit.result == TRACE_FAILED) return hit;
+
+    traceInstances(ray, hit.result == TRACE_HIT ? hit.distance : maxDistance, false, hit);
+    return hit;
+}
+
+void tracePrimary(ivec2 texelCoord) {
+    ivec2 size = imageSize(image);
+    // Through the pixel's center, where the raster pass samples its triangles
+    vec2 normalizedPosition = 2.0 * (vec2(texelCoord) + 0.5 - size / 2.0) / float(size.x);
+
+    Camera camera;
+    camera.position = constants.cameraPosition;
+    camera.forward = constants.cameraForward;
+    camera.up = constants.cameraUp;
+    camera.right = cross(camera.up, camera.forward);
+
+    Ray ray;
+    ray.origin = camera.position;
+    ray.direction = camera.forward + normalizedPosition.x * camera.right + normalizedPosition.y * camera.up;
+    ray.direction = normalize(ray.direction);
+
+    Hit hit = traceClosest(ray, 1e30);
+    if (hit.result == TRACE_HIT) storeHit(texelCoord, hit.position, hit.normal, hit.material);
+    else if (hit.result == TRACE_MISS) storeMiss(texelCoord);
+    else storeDebugColor(texelCoord, hit.debugColor);
+
+    // Reverse Z with an infinite far plane, from the distance along the view axis. Misses are at infinity
+    float depth = 0;
+    if (hit.result == TRACE_HIT) {
+        float viewDepth = hit.distance * dot(ray.direction, camera.forward);
+        depth = viewDepth > DEPTH_NEAR_PLANE ? DEPTH_NEAR_PLANE / viewDepth : 1.;
+    }
+    rayDepth.depths[texelCoord.y * size.x + texelCoord.x] = depth;
+}
+
+void main() {
+    if (constants.pass == PASS_RAY_QUERY) {
+        traceRayQuery(gl_WorkGroupID.x * gl_WorkGroupSize.x * gl_WorkGroupSize.y + gl_LocalInvocationIndex);
+        return;
+    }
+
+    ivec2 texelCoord = ivec2(gl_GlobalInvocationID.xy);
+    if (any(greaterThanEqual(texelCoord, imageSize(image)))) return;
+
+    switch (constants.pass) {
+        case PASS_PRIMARY:
+            beginRay();
+            tracePrimary(texelCoord);
+            if (constants.view == VIEW_STEP_HEATMAP) storeDebugColor(texelCoord, heatmap(rayStepCount, MAX_STEPS));
+            if (constants.view == VIEW_NODE_HEATMAP) storeDebugColor(texelCoord, heatmap(rayNodeCount, MAX_STEPS * max(TREE_DEPTH, 1)));
+            recordRay(RAY_PRIMARY);
+            break;
+        case PASS_SHADOWS: traceShadows(texelCoord); break;
+        case PASS_AMBIENT_OCCLUSION: traceAmbientOcclusion(texelCoord); break;
+        case PASS_RESOLVE: resolve(texelCoord); break;
+    }
+}
+
+// Adapted from https://gist.github.com/DomNomNom/46bb1ce47f68d255fd5d
+vec2 intersectAABB(Ray ray, vec3 boxMin, vec3 boxMax) {
+    vec3 tMin = (boxMin - ray.origin) / ray.direction;
+    vec3 tMax = (boxMax - ray.origin) / ray.direction;
+    vec3 t1 = min(tMin, tMax);
+    vec3 t2 = max(tMin, tMax);
+    float tNear = max(max(t1.x, t1.y), t1.z);
+    float tFar = min(min(t2.x, t2.y), t2.z);
+
+    return vec2(tNear, tFar);
+};
+
+// Any hit traversal for secondary rays. It returns on the first solid voxel without tracking the normal or hit distance
+bool anyHit(Ray ray, float maxDistance) {
+    beginRay();
+    Hit instanceHit;
+    bool hit = traverseAnyHit(ray, maxDistance) || traceInstances(ray, maxDistance, true, instanceHit);
+    recordRay(RAY_SECONDARY);
+    return hit;
+}
+
+// Same descent as the world's octree, but the model's depth is only known at runtime
+ivec2 getModelValueAt(int model, ivec3 position) {
+    ivec3 currentSearch = ivec3(0);
+    int currentLinearIndex = 0;
+
+    for (int currentSize = models[nonuniformEXT(model)].size >> 1; currentSize > 0; currentSize >>= 1) {
+        ivec3 offset = position - currentSearch;
+
+        int index = 0;
+        if (offset.x >= currentSize) index |= 1;
+        if (offset.y >= currentSize) index |= 2;
+        if (offset.z >= currentSize) index |= 4;
+
+        rayNodeCount++;
+        if ((models[nonuniformEXT(model)].data[currentLinearIndex].LeafMask & (1 << index)) != 0) {
+            return ivec2(models[nonuniformEXT(model)].data[currentLinearIndex].childrenOffsets[index], currentSize);
+        }
+
+        currentSearch += ivec3(
+            (index & 1) != 0 ? currentSize : 0,
+            (index & 2) != 0 ? currentSize : 0,
+            (index & 4) != 0 ? currentSize : 0
+        );
+        currentLinearIndex += models[nonuniformEXT(model)].data[currentLinearIndex].childrenOffsets[index];
+    }
+
+    return ivec2(1, 1);
+}
+
+// Normal of the box face the ray enters through
+vec3 entryNormal(Ray ray, vec3 boxMin, vec3 boxMax) {
+    vec3 t1 = min((boxMin - ray.origin) / ray.direction, (boxMax - ray.origin) / ray.direction);
+    float tNear = max(max(t1.x, t1.y), t1.z);
+    return -sign(ray.direction) * vec3(equal(t1, vec3(tNear)));
+}
+
+// Closest hit in a model with the ray in its voxels. The direction isn't normalized, so distances are still in
+// the units of the world ray
+Hit traceModel(int model, Ray ray, float maxDistance) {
+    Hit hit;
+    hit.result = TRACE_MISS;
+
+    int size = models[nonuniformEXT(model)].size;
+    vec2 bounds = intersectAABB(ray, vec3(0), vec3(size));
+    float tStart = max(bounds.x, 0.);
+    float tEnd = min(bounds.y, maxDistance);
+    if (tStart > tEnd) return hit;
+
+    ivec3 gridPosition = clamp(ivec3(floor(ray.origin + ray.direction * tStart)), ivec3(0), ivec3(size - 1));
+    for (int i = 0; i < 3 * size; i++) {
+        rayStepCount++;
+        ivec2 data = getModelValueAt(model, gridPosition);
+        int nodeSize = data.y;
+        vec3 minBounding = vec3((gridPosition / nodeSize) * nodeSize);
+        vec3 maxBounding = minBounding + vec3(nodeSize);
+        vec2 result = intersectAABB(ray, minBounding, maxBounding);
+
+        if (data.x > 0.1) {
+            hit.result = TRACE_HIT;
+            hit.distance = max(result.x, tStart);
+            hit.position = ray.origin + ray.direction * hit.distance;
+            // No normal when the ray starts inside the voxel, like the world traversal
+            hit.normal = result.x >= 0 ? entryNormal(ray, minBounding, maxBounding) : vec3(0);
+            hit.voxel = gridPosition;
+            hit.material = data.x;
+            return hit;
+        }
+        if (result.y >= tEnd) return hit;
+
+        gridPosition = ivec3(floor(ray.origin + (result.y + 0.001f) * ray.direction));
+        if (any(greaterThanEqual(gridPosition, ivec3(size))) || any(lessThan(gridPosition, ivec3(0)))) return hit;
+    }
+
+    rayOverBudget = true;
+    return hit;
+}
+
+bool intersectsNode(Ray ray, BvhNode node, float maxDistance, out float tNear) {
+    vec2 bounds = intersectAABB(ray, node.min, node.max);
+    tNear = max(bounds.x, 0.);
+    return bounds.x <= bounds.y && bounds.y >= 0 && bounds.x <= maxDistance;
+}
+
+// Walks the top level BVH nearest child first, so a hit culls the nodes behind it. Only the instances whose
+// nodes the ray reaches are transformed and traced. Fills hit with the closest one nearer than maxDistance,
+// or any one with isAnyHit
+bool traceInstances(Ray ray, float maxDistance, bool isAnyHit, inout Hit hit) {
+    if (constants.instanceNodeCount == 0) return false;
+
+    float tNear;
+    if (!intersectsNode(ray, instanceBvh.nodes[0], maxDistance, tNear)) return false;
+
+    int stack[INSTANCE_STACK_SIZE];
+    float stackNear[INSTANCE_STACK_SIZE];
+    int stackSize = 0;
+    int nodeIndex = 0;
+    bool isHit = false;
+    while (true) {
+        BvhNode node = instanceBvh.nodes[nodeIndex];
+        if (node.count > 0) {
+            for (int i = node.leftOrFirst; i < node.leftOrFirst + node.count; i++) {
+                Instance instance = instances.instances[i];
+                Ray objectRay;
+                objectRay.origin = (instance.worldToObject * vec4(ray.origin, 1)).xyz;
+                objectRay.direction = mat3(instance.worldToObject) * ray.direction;
+
+                Hit candidate = traceModel(instance.model, objectRay, maxDistance);
+                if (candidate.result != TRACE_HIT) continue;
+
+                isHit = true;
+                maxDistance = candidate.distance;
+                hit.result = TRACE_HIT;
+                hit.position = ray.origin + ray.direction * candidate.distance;
+                // Normals go back through the inverse transpose of the object to world transform
+                vec3 normal = transpose(mat3(instance.worldToObject)) * candidate.normal;
+                hit.normal = candidate.normal == vec3(0) ? vec3(0) : normalize(normal);
+                hit.voxel = candidate.voxel;
+                hit.material = candidate.material;
+                hit.distance = candidate.distance;
+                hit.instance = instance.id;
+                if (isAnyHit) return true;
+            }
+        } else {
+            float leftNear, rightNear;
+            bool isLeftHit = intersectsNode(ray, instanceBvh.nodes[node.leftOrFirst], maxDistance, leftNear);
+            bool isRightHit = intersectsNode(ray, instanceBvh.nodes[node.leftOrFirst + 1], maxDistance, rightNear);
+            if (isLeftHit && isRightHit) {
+                bool isLeftNearer = leftNear <= rightNear;
+                stack[stackSize] = node.leftOrFirst + (isLeftNearer ? 1 : 0);
+                stackNear[stackSize] = isLeftNearer ? rightNear : leftNear;
+                stackSize++;
+                nodeIndex = node.leftOrFirst + (isLeftNearer ? 0 : 1);
+                continue;
+            }
+            if (isLeftHit || isRightHit) {
+                nodeIndex = node.leftOrFirst + (isLeftHit ? 0 : 1);
+                continue;
+            }
+        }
+
+        // Nodes pushed before a closer hit was found may be behind it now
+        do {
+            if (stackSize == 0) return isHit;
+            stackSize--;
+        } while (stackNear[stackSize] > maxDistance);
+        nodeIndex = stack[stackSize];
+    }
+}
+
+// Rotated instances have normals off the axes, those are shaded as the closest one
+int encodeFace(vec3 normal) {
+    vec3 magnitude = abs(normal);
+    if (all(equal(magnitude, vec3(0)))) return 7;
+    if (magnitude.x >= magnitude.y && magnitude.x >= magnitude.z) return normal.x > 0 ? 1 : 2;
+    if (magnitude.y >= magnitude.z) return normal.y > 0 ? 3 : 4;
+    return normal.z > 0 ? 5 : 6;
+}
+
+void storeHit(ivec2 texelCoord, vec3 position, vec3 normal, int material) {
+    imageStore(hitImage, texelCoord, vec4(position, encodeFace(normal) + 8 * material));
+}
+
+// A failed traversal is reported as a miss, the query has no debug output
+void traceRayQuery(uint index) {
+    if (index >= constants.rayQueryCount) return;
+
+    RayQuery query = rayQueries.queries[index];
+    Ray ray;
+    ray.origin = query.origin;
+    ray.direction = normalize(query.direction);
+
+    beginRay();
+    Hit hit = traceClosest(ray, query.maxDistance);
+    if (hit.result == TRACE_HIT) {
+        rayQueryHits.hits[index] = RayQueryHit(hit.position, hit.distance, hit.voxel, encodeFace(hit.normal), hit.instance, hit.material);
+    } else {
+        rayQueryHits.hits[index] = RayQueryHit(vec3(0), query.maxDistance, ivec3(-1), 0, -1, 0);
+    }
+}
+
+void storeMiss(ivec2 texelCoord) {
+    imageStore(hitImage, texelCoord, vec4(0));
+}
+
+void storeDebugColor(ivec2 texelCoord, vec3 color) {
+    imageStore(hitImage, texelCoord, vec4(color, -1));
+}
+
+// PCG hash, from https://www.reedbeta.com/blog/hash-functions-for-gpu-rendering/
+uint hash(uint value) {
+    uint state = value * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Different for every pixel, ray and frame so accumulated frames keep adding new samples
+vec2 random2(ivec2 texelCoord, int rayIndex) {
+    uint seed = hash(uint(texelCoord.x) ^ hash(uint(texelCoord.y) ^ hash(constants.frameIndex * 64u + uint(rayIndex))));
+    return vec2(hash(seed), hash(seed ^ 0x9e3779b9u)) / 4294967295.0;
+}
+
+void buildBasis(vec3 normal, out vec3 tangent, out vec3 bitangent) {
+    tangent = normalize(cross(normal, abs(normal.x) > 0.5 ? vec3(0, 1, 0) : vec3(1, 0, 0)));
+    bitangent = cross(normal, tangent);
+}
+
+// Cosine weighted direction around the normal
+vec3 sampleHemisphere(vec3 normal, vec2 random) {
+    vec3 tangent, bitangent;
+    buildBasis(normal, tangent, bitangent);
+    float phi = 2 * PI * random.x;
+    float radius = sqrt(random.y);
+    return normalize(radius * (cos(phi) * tangent + sin(phi) * bitangent) + sqrt(1 - random.y) * normal);
+}
+
+// Uniform direction inside the cone around direction
+vec3 sampleCone(vec3 direction, float angle, vec2 random) {
+    vec3 tangent, bitangent;
+    buildBasis(direction, tangent, bitangent);
+    float phi = 2 * PI * random.x;
+    float cosTheta = mix(1., cos(angle), random.y);
+    float sinTheta = sqrt(1 - cosTheta * cosTheta);
+    return normalize(sinTheta * (cos(phi) * tangent + sin(phi) * bitangent) + cosTheta * direction);
+}
+
+// The first frames after a reset have no history, and the image may hold anything then
+float accumulate(float value, float history, float historyWeight) {
+    return historyWeight > 0 ? mix(value, history, historyWeight) : value;
+}
+
+void traceShadows(ivec2 texelCoord) {
+    vec4 hit = imageLoad(hitImage, texelCoord);
+    vec3 normal = FACE_NORMALS[hit.w > 0 ? hitFace(hit.w) : 0];
+
+    float visibility = 1;
+    // Faces turned away from the sun are dark already, and pixels without a normal can't offset their rays
+    if (hit.w > 0 && dot(-normal, SUN_DIRECTION) > 0) {
+        Ray ray;
+        ray.origin = hit.xyz + normal * SECONDARY_RAY_OFFSET;
+        int unoccluded = 0;
+        for (int i = 0; i < constants.shadowRays; i++) {
+            ray.direction = sampleCone(-SUN_DIRECTION, SUN_ANGULAR_RADIUS, random2(texelCoord, i));
+            if (!anyHit(ray, 1e30)) unoccluded++;
+        }
+        visibility = float(unoccluded) / constants.shadowRays;
+    }
+
+    float history = imageLoad(shadowImage, texelCoord).r;
+    imageStore(shadowImage, texelCoord, vec4(accumulate(visibility, history, constants.shadowHistoryWeight)));
+}
+
+void traceAmbientOcclusion(ivec2 texelCoord) {
+    vec4 hit = imageLoad(hitImage, texelCoord);
+    vec3 normal = FACE_NORMALS[hit.w > 0 ? hitFace(hit.w) : 0];
+
+    float visibility = 1;
+    if (hit.w > 0 && hitFace(hit.w) < 7) {
+        float maxDistance = constants.aoRadius > 0 ? constants.aoRadius * VOXEL_SIZE : 1e30;
+        Ray ray;
+        ray.origin = hit.xyz + normal * SECONDARY_RAY_OFFSET;
+        int unoccluded = 0;
+        for (int i = 0; i < constants.aoRays; i++) {
+            // Offset from the shadow rays so both effects don't share a sample pattern
+            ray.direction = sampleHemisphere(normal, random2(texelCoord, 32 + i));
+            if (!anyHit(ray, maxDistance)) unoccluded++;
+        }
+        visibility = float(unoccluded) / constants.aoRays;
+    }
+
+    float history = imageLoad(aoImage, texelCoord).r;
+    imageStore(aoImage, texelCoord, vec4(accumulate(visibility, history, constants.aoHistoryWeight)));
+}
+
+void resolve(ivec2 texelCoord) {
+    vec4 hit = imageLoad(hitImage, texelCoord);
+    if (hit.w < 0) {
+        imageStore(image, texelCoord, vec4(hit.xyz, 1.));
+        return;
+    }
+    if (hit.w == 0) {
+        imageStore(image, texelCoord, vec4(SKY_COLOR, 1.));
+        return;
+    }
+
+    vec3 normal = FACE_NORMALS[hitFace(hit.w)];
+    float light = dot(-normal, SUN_DIRECTION);
+    if (constants.shadowRays > 0 && light > 0) light *= imageLoad(shadowImage, texelCoord).r;
+
+    // Only the pixels that hit something look their color up
+    vec3 albedo = unpackUnorm4x8(palette.colors[hitMaterial(hit.w)]).rgb;
+    vec3 color = mix(SHADOW_COLOR, albedo, light);
+    if (constants.aoRays > 0) color *= mix(AO_MIN_LIGHT, 1., imageLoad(aoImage, texelCoord).r);
+    imageStore(image, texelCoord, vec4(color, 1.));
+}
+
+void beginRay() {
+    rayStepCount = 0;
+    rayNodeCount = 0;
+    rayOverBudget = false;
+}
+
+// Reduced over the subgroup first so a subgroup does one atomic per counter instead of one per ray
+void recordRay(int kind) {
+    if (!STATISTICS) return;
+
+    uint rays = subgroupBallotBitCount(subgroupBallot(true));
+    uint steps = subgroupAdd(uint(rayStepCount));
+    uint nodes = subgroupAdd(uint(rayNodeCount));
+    uint overBudget = subgroupBallotBitCount(subgroupBallot(rayOverBudget));
+    if (subgroupElect()) {
+        atomicAdd(statistics.rayKinds[kind].rays, uint64_t(rays));
+        atomicAdd(statistics.rayKinds[kind].steps, uint64_t(steps));
+        atomicAdd(statistics.rayKinds[kind].nodesFetched, uint64_t(nodes));
+        if (overBudget > 0) atomicAdd(statistics.rayKinds[kind].raysOverBudget, uint64_t(overBudget));
+    }
+
+    // Peels off one bucket per iteration, so rays in the same bucket share an atomic
+    int bucket = rayStepCount == 0 ? 0 : min(findMSB(rayStepCount) + 1, STEP_HISTOGRAM_BUCKETS - 1);
+    while (true) {
+        if (bucket == subgroupBroadcastFirst(bucket)) {
+            uint count = subgroupBallotBitCount(subgroupBallot(true));
+            if (subgroupElect()) atomicAdd(statistics.rayKinds[kind].stepHistogram[bucket], uint64_t(count));
+            break;
+        }
+    }
+}
+
+// Blue for cheap rays, through green, to red for rays at the budget. Log scale, most rays are cheap
+vec3 heatmap(int count, int budget) {
+    float t = clamp(log2(1. + count) / log2(1. + budget), 0., 1.);
+    return clamp(vec3(2 * t - 1, 1 - abs(2 * t - 1), 1 - 2 * t), 0., 1.);
+}
@@ -0,0 +1,185 @@
+#include "ColumnWorld.h"
+#include "JobSystem.h"
+#include "Trace.h"
+#include "spdlog/spdlog.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace cubik {
+  namespace {
+    // Extends the column's last run when the voxels continue it
+    void appendRun(std::vector<ColumnRun>& runs, int start, int length, int value) {
+      if (value == 0) return;
+
+      if (!runs.empty() && runs.back().end() == start && runs.back().material() == (value & 0xFF)) {
+        runs.back() = ColumnRun::make(runs.back().start(), runs.back().length() + length, value);
+      } else {
+        runs.push_back(ColumnRun::make(start, length, value));
+      }
+    }
+
+    ColumnSpan merge(ColumnSpan a, ColumnSpan b) {
+      return { std::min(a.bottom, b.bottom), std::max(a.top, b.top) };
+    }
+  }
+
+  ColumnWorld::ColumnWorld(const std::vector<int>& worldData, int worldSize) : _worldSize(worldSize), _depth(0) {
+    CUBIK_TRACE_ZONE("ColumnWorld");
+    size_t size = worldSize;
+    build([&](int z, std::vector<std::vector<ColumnRun>>& columns) {
+      for (int row = 0; row < std::min(BRICK_SIZE, worldSize - z); row++) {
+        for (int x = 0; x < worldSize; x++) {
+          std::vector<ColumnRun>& runs = columns[x + row * worldSize];
+          for (int y = 0; y < worldSize; y++) {
+            appendRun(runs, y, 1, worldData[x + y * size + (z + row) * size * size]);
+          }
+        }
+      }
+    });
+  }
+
+  ColumnWorld::ColumnWorld(const VoxelSource& source) : _worldSize(source.getSize()), _depth(0) {
+    CUBIK_TRACE_ZONE("ColumnWorld");
+    if (_worldSize < BRICK_SIZE) {
+      spdlog::error("Sources have to be at least a brick wide, got size {}", _worldSize);
+      abort();
+    }
+
+    build([&](int z, std::vector<std::vector<ColumnRun>>& columns) {
+      std::array<int, BRICK_VOLUME> brick;
+      for (int bx = 0; bx < _worldSize / BRICK_SIZE; bx++) {
+        // Bottom to top, so the runs come out sorted and grow across bricks
+        for (int by = 0; by < _worldSize / BRICK_SIZE; by++) {
+          glm::ivec3 origin(bx * BRICK_SIZE, by * BRICK_SIZE, z);
+          std::optional<int> uniform = source.fillBrick(origin, brick);
+          for (int row = 0; row < BRICK_SIZE; row++) {
+            for (int x = 0; x < BRICK_SIZE; x++) {
+              std::vector<ColumnRun>& runs = columns[origin.x + x + row * _worldSize];
+              if (uniform) {
+                appendRun(runs, origin.y, BRICK_SIZE, *uniform);
+                continue;
+              }
+              for (int y = 0; y < BRICK_SIZE; y++) {
+                appendRun(runs, origin.y + y, 1, brick[brickIndex(x, y, row)]);
+              }
+            }
+          }
+        }
+      }
+    });
+  }
+
+  // Rows of columns are filled in parallel, BRICK_SIZE at a time, then laid out back to back
+  void ColumnWorld::build(const std::function<void(int z, std::vector<std::vector<ColumnRun>>& columns)>& fillRows) {
+    if (_worldSize > MAX_COLUMN_WORLD_SIZE) {
+      spdlog::error("Column worlds can't be bigger than {}, got size {}", MAX_COLUMN_WORLD_SIZE, _worldSize);
+      abort();
+    }
+    while ((1 << _depth) < _worldSize) _depth++;
+
+    int slabCount = (_worldSize + BRICK_SIZE - 1) / BRICK_SIZE;
+    std::vector<std::vector<std::vector<ColumnRun>>> slabs(slabCount);
+    JobSystem::global().parallel_for(slabCount, 1, [&](int begin, int end) {
+      for (int slab = begin; slab < end; slab++) {
+        slabs[slab].resize(static_cast<size_t>(BRICK_SIZE) * _worldSize);
+        fillRows(slab * BRICK_SIZE, slabs[slab]);
+      }
+    });
+
+    size_t columnCount = static_cast<size_t>(_worldSize) * _worldSize;
+    size_t runCount = 0;
+    for (const auto& slab : slabs) {
+      for (const auto& column : slab) runCount += column.size();
+    }
+    _columnStarts.reserve(columnCount + 1);
+    _runs.reserve(runCount);
+    _mips.resize(_depth + 1);
+    _mips[0].reserve(columnCount);
+    for (const auto& slab : slabs) {
+      for (size_t i = 0; i < slab.size() && _columnStarts.size() < columnCount; i++) {
+        const std::vector<ColumnRun>& column = slab[i];
+        _columnStarts.push_back(static_cast<uint32_t>(_runs.size()));
+        _runs.insert(_runs.end(), column.begin(), column.end());
+        _mips[0].push_back(column.empty() ? ColumnSpan::empty()
+          : ColumnSpan { static_cast<uint16_t>(column.front().start()), static_cast<uint16_t>(column.back().end()) });
+      }
+    }
+    _columnStarts.push_back(static_cast<uint32_t>(_runs.size()));
+
+    for (int level = 1; level <= _depth; level++) {
+      int side = cellsPerSide(level), childSide = cellsPerSide(level - 1);
+      const std::vector<ColumnSpan>& children = _mips[level - 1];
+      std::vector<ColumnSpan>& cells = _mips[level];
+      cells.assign(static_cast<size_t>(side) * side, ColumnSpan::empty());
+      for (int z = 0; z < childSide; z++) {
+        for (int x = 0; x < childSide; x++) {
+          ColumnSpan& cell = cells[x / 2 + z / 2 * side];
+          cell = merge(cell, children[x + z * childSide]);
+        }
+      }
+    }
+  }
+
+  size_t ColumnWorld::calculateSerializedSize() const {
+    size_t words = _depth + 1 + _columnStarts.size() + _runs.size();
+    for (const auto& level : _mips) words += level.size();
+    return sizeof(_worldSize) + words * sizeof(uint32_t);
+  }
+
+  void ColumnWorld::serialize(void* target) const {
+    auto data = static_cast<char*>(target);
+    memcpy(data, &_worldSize, sizeof(_worldSize));
+    auto words = reinterpret_cast<uint32_t*>(data + sizeof(_worldSize));
+
+    // Offsets are in words from the end of the header, where the shader's data array starts
+    auto offset = static_cast<uint32_t>(_depth + 1 + _columnStarts.size());
+    for (int level = 0; level <= _depth; level++) {
+      words[level] = offset;
+      memcpy(&words[offset], _mips[level].data(), _mips[level].size() * sizeof(ColumnSpan));
+      offset += static_cast<uint32_t>(_mips[level].size());
+    }
+    for (size_t i = 0; i < _columnStarts.size(); i++) {
+      words[_depth + 1 + i] = offset + _columnStarts[i];
+    }
+    memcpy(&words[offset], _runs.data(), _runs.size() * sizeof(ColumnRun));
+  }
+
+  const std::string& ColumnWorld::getCompatibleShader() const {
+    static const std::string compatibleShader = COLUMN_SHADER;
+    return compatibleShader;
+  }
+
+  int ColumnWorld::get(glm::ivec3 position) const {
+    size_t column = position.x + static_cast<size_t>(position.z) * _worldSize;
+    auto first = _runs.begin() + _columnStarts[column];
+    auto last = _runs.begin() + _columnStarts[column + 1];
+    auto above = std::upper_bound(first, last, position.y, [](int y, ColumnRun run) { return y < run.start(); });
+    if (above == first) return 0;
+
+    ColumnRun run = *(above - 1);
+    return position.y < run.end() ? run.material() : 0;
+  }
+
+  WorldBox ColumnWorld::findBox(glm::ivec3 position) const {
+    if (!contains(position)) return World::findBox(position);
+
+    int value = get(position);
+    if (value != 0) return { position, 1, value };
+
+    for (int level = _depth; level > 0; level--) {
+      int size = 1 << level;
+      glm::ivec3 origin = position / size * size;
+      if (origin.x + size > _worldSize || origin.y + size > _worldSize || origin.z + size > _worldSize) continue;
+
+      ColumnSpan span = _mips[level][position.x / size + position.z / size * cellsPerSide(level)];
+      if (origin.y >= span.top || origin.y + size <= span.bottom) return { origin, size, 0 };
+    }
+    return { position, 1, 0 };
+  }
+
+  float ColumnWorld::getBytesPerVoxel() const {
+    double voxelCount = static_cast<double>(_worldSize) * _worldSize * _worldSize;
+    return static_cast<float>(calculateSerializedSize() / voxelCount);
+  }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "VoxelSource.h"
+#include "World.h"
+
+namespace cubik {
+  constexpr const char* COLUMN_SHADER = "columnRayMarcher";
+  constexpr int MAX_COLUMN_WORLD_SIZE = 4096; // Runs pack their start and length in 12 bits each
+
+  // Mirrors the runs columnRayMarcher reads. Solid voxels of one material stacked along y
+  struct ColumnRun {
+    uint32_t bits; // Start in the low 12 bits, then the length minus one, then the material
+
+    static constexpr int LENGTH_SHIFT = 12;
+    static constexpr int MATERIAL_SHIFT = 24;
+    static constexpr uint32_t FIELD_MASK = (1u << LENGTH_SHIFT) - 1;
+
+    static ColumnRun make(int start, int length, int material) {
+      return { static_cast<uint32_t>(start) | static_cast<uint32_t>(length - 1) << LENGTH_SHIFT
+               | static_cast<uint32_t>(material & 0xFF) << MATERIAL_SHIFT };
+    }
+
+    int start() const { return static_cast<int>(bits & FIELD_MASK); }
+    int length() const { return static_cast<int>((bits >> LENGTH_SHIFT) & FIELD_MASK) + 1; }
+    int end() const { return start() + length(); }
+    int material() const { return static_cast<int>(bits >> MATERIAL_SHIFT); }
+  };
+
+  // Lowest solid voxel and one past the highest of the columns under a mip cell. Empty cells have bottom above top
+  struct ColumnSpan {
+    uint16_t bottom;
+    uint16_t top;
+
+    static constexpr ColumnSpan empty() { return { 0xFFFF, 0 }; }
+  };
+  static_assert(sizeof(ColumnSpan) == sizeof(uint32_t), "columnRayMarcher reads a span as one word");
+
+  // Every (x, z) column as its sorted runs of solid voxels, empty space isn't stored. A 2D min/max height mip over
+  // the columns lets the marcher skip the cells a ray passes over or under. Meant for heightfield-like terrain, where
+  // most columns are a run or two. Serialized as the word offset of each mip level, the first run of each column,
+  // x fastest, with one past the last run at the end, then the mip levels and the runs
+  class ColumnWorld : public World {
+  public:
+    ColumnWorld(const std::vector<int>& worldData, int worldSize);
+
+    // Takes the source a row of bricks at a time, without a dense cube
+    explicit ColumnWorld(const VoxelSource& source);
+
+    [[nodiscard]] size_t calculateSerializedSize() const override;
+
+    void serialize(void* target) const override;
+
+    const std::string& getCompatibleShader() const override;
+
+    int get(glm::ivec3 position) const override;
+
+    // Empty boxes come from the mip, so a box holding a gap between runs is only found a voxel at a time
+    WorldBox findBox(glm::ivec3 position) const override;
+
+    int getSize() const override { return _worldSize; }
+
+    // Mip levels above the columns, the last one is a single cell
+    int getDepth() const override { return _depth; }
+
+    size_t getRunCount() const { return _runs.size(); }
+
+    float getBytesPerVoxel() const;
+
+  private:
+    int _worldSize;
+    int _depth;
+    std::vector<uint32_t> _columnStarts;
+    std::vector<ColumnRun> _runs;
+    std::vector<std::vector<ColumnSpan>> _mips; // Level 0 has a cell per column, each level above halves the side
+
+    void build(const std::function<void(int z, std::vector<std::vector<ColumnRun>>& columns)>& fillRows);
+
+    int cellsPerSide(int level) const { return (_worldSize + (1 << level) - 1) >> level; }
+  };
+}
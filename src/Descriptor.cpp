@@ -2,11 +2,11 @@
 #include "VulkanHelper.h"
 
 namespace vkutil {
-  DescriptorLayoutBuilder DescriptorLayoutBuilder::add_binding(uint32_t binding, VkDescriptorType type) {
+  DescriptorLayoutBuilder DescriptorLayoutBuilder::add_binding(uint32_t binding, VkDescriptorType type, uint32_t count) {
     bindings.push_back({
       .binding = binding,
       .descriptorType = type,
-      .descriptorCount = 1,
+      .descriptorCount = count,
     });
 
     return *this;
@@ -8,7 +8,7 @@ namespace vkutil {
   struct DescriptorLayoutBuilder {
     std::vector<VkDescriptorSetLayoutBinding> bindings;
 
-    DescriptorLayoutBuilder add_binding(uint32_t binding, VkDescriptorType type);
+    DescriptorLayoutBuilder add_binding(uint32_t binding, VkDescriptorType type, uint32_t count = 1);
     void clear();
     VkDescriptorSetLayout build(VkDevice device, VkShaderStageFlags shaderStages, void* pNext = nullptr, VkDescriptorSetLayoutCreateFlags flags = 0);
   };
@@ -0,0 +1,371 @@
+#include "FrameGraph.h"
+#include <algorithm>
+#include <numeric>
+
+namespace cubik {
+  constexpr VkAccessFlags2 WRITE_ACCESS = VK_ACCESS_2_SHADER_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT
+                                          | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+                                          | VK_ACCESS_2_TRANSFER_WRITE_BIT | VK_ACCESS_2_HOST_WRITE_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
+
+  static VkImageAspectFlags aspect_for_format(VkFormat format) {
+    switch (format) {
+      case VK_FORMAT_D16_UNORM:
+      case VK_FORMAT_D32_SFLOAT:
+      case VK_FORMAT_X8_D24_UNORM_PACK32:
+        return VK_IMAGE_ASPECT_DEPTH_BIT;
+      case VK_FORMAT_D24_UNORM_S8_UINT:
+      case VK_FORMAT_D32_SFLOAT_S8_UINT:
+        return VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+      default:
+        return VK_IMAGE_ASPECT_COLOR_BIT;
+    }
+  }
+
+  bool FrameGraph::TransientDescription::operator==(const TransientDescription& other) const {
+    return extent.width == other.extent.width && extent.height == other.extent.height && extent.depth == other.extent.depth
+           && format == other.format && usage == other.usage && firstPass == other.firstPass && lastPass == other.lastPass;
+  }
+
+  void FrameGraph::init(VkDevice device, VmaAllocator allocator) {
+    _device = device;
+    _allocator = allocator;
+  }
+
+  void FrameGraph::destroy() {
+    vkutil::DeletionQueue retired;
+    release_transients(retired);
+    retired.flush();
+  }
+
+  void FrameGraph::reset() {
+    _resources.clear();
+    _passes.clear();
+    _transientDescriptions.clear();
+  }
+
+  FrameResource FrameGraph::import_image(const char* name, VkImage image, VkImageView view, std::optional<ResourceState> initialState,
+                                         VkImageAspectFlags aspect) {
+    if (initialState) _importedImageStates[image] = *initialState;
+    _resources.push_back({
+      .name = name,
+      .isImage = true,
+      .image = image,
+      .view = view,
+      .aspect = aspect,
+      .state = _importedImageStates[image]
+    });
+    return _resources.size() - 1;
+  }
+
+  FrameResource FrameGraph::import_buffer(const char* name, VkBuffer buffer) {
+    _resources.push_back({
+      .name = name,
+      .isImage = false,
+      .buffer = buffer,
+      .state = _importedBufferStates[buffer]
+    });
+    return _resources.size() - 1;
+  }
+
+  FrameResource FrameGraph::create_image(const char* name, VkExtent3D extent, VkFormat format, VkImageUsageFlags usage) {
+    _transientDescriptions.push_back({
+      .extent = extent,
+      .format = format,
+      .usage = usage,
+      .firstPass = -1,
+      .lastPass = -1
+    });
+    _resources.push_back({
+      .name = name,
+      .isImage = true,
+      .aspect = aspect_for_format(format),
+      .transientIndex = static_cast<int>(_transientDescriptions.size() - 1)
+    });
+    return _resources.size() - 1;
+  }
+
+  void FrameGraph::add_pass(const char* name, std::vector<ResourceUse> uses, std::function<void(VkCommandBuffer)>&& record) {
+    int passIndex = _passes.size();
+    for (const ResourceUse& use : uses) {
+      int transientIndex = _resources[use.resource].transientIndex;
+      if (transientIndex < 0) continue;
+
+      TransientDescription& description = _transientDescriptions[transientIndex];
+      if (description.firstPass < 0) description.firstPass = passIndex;
+      description.lastPass = passIndex;
+    }
+    _passes.push_back({ .name = name, .uses = std::move(uses), .record = std::move(record) });
+  }
+
+  void FrameGraph::set_final_layout(FrameResource image, VkImageLayout layout) {
+    _resources[image].finalLayout = layout;
+  }
+
+  void FrameGraph::compile(vkutil::DeletionQueue& retired) {
+    if (_transientDescriptions != _allocatedDescriptions) {
+      release_transients(retired);
+      _allocatedDescriptions = _transientDescriptions;
+      allocate_transients();
+    }
+
+    for (Resource& resource : _resources) {
+      if (resource.transientIndex < 0) continue;
+
+      const TransientImage& transient = _transientImages[resource.transientIndex];
+      resource.image = transient.image;
+      resource.view = transient.view;
+    }
+  }
+
+  void FrameGraph::allocate_transients() {
+    _transientImages.resize(_allocatedDescriptions.size());
+    std::vector<VkMemoryRequirements> requirements(_allocatedDescriptions.size());
+
+    for (int i = 0; i < _allocatedDescriptions.size(); i++) {
+      const TransientDescription& description = _allocatedDescriptions[i];
+      VkImageCreateInfo imageInfo = vkutil::image_create_info(description.format, description.usage, description.extent);
+      VK_CHECK(vkCreateImage(_device, &imageInfo, nullptr, &_transientImages[i].image));
+      vkGetImageMemoryRequirements(_device, _transientImages[i].image, &requirements[i]);
+    }
+
+    // Greedy interval packing: each image takes the first slot whose last user is done before it starts
+    std::vector<int> order(_allocatedDescriptions.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+      return _allocatedDescriptions[a].firstPass < _allocatedDescriptions[b].firstPass;
+    });
+
+    std::vector<VkMemoryRequirements> slotRequirements;
+    for (int i : order) {
+      const TransientDescription& description = _allocatedDescriptions[i];
+      int slot = -1;
+      // Transients that no pass uses still get memory, but never share it
+      for (int candidate = 0; candidate < _slots.size() && description.firstPass >= 0; candidate++) {
+        bool isFree = _slots[candidate].lastPass < description.firstPass;
+        bool isCompatible = (slotRequirements[candidate].memoryTypeBits & requirements[i].memoryTypeBits) != 0;
+        if (isFree && isCompatible) {
+          slot = candidate;
+          break;
+        }
+      }
+
+      if (slot < 0) {
+        _slots.push_back({ .allocation = VK_NULL_HANDLE, .lastPass = description.lastPass });
+        slotRequirements.push_back(requirements[i]);
+        slot = _slots.size() - 1;
+      } else {
+        VkMemoryRequirements& shared = slotRequirements[slot];
+        shared.size = std::max(shared.size, requirements[i].size);
+        shared.alignment = std::max(shared.alignment, requirements[i].alignment);
+        shared.memoryTypeBits &= requirements[i].memoryTypeBits;
+        _slots[slot].lastPass = description.lastPass;
+      }
+      _transientImages[i].slot = slot;
+    }
+
+    VmaAllocationCreateInfo allocationInfo = {
+      .usage = VMA_MEMORY_USAGE_GPU_ONLY,
+      .requiredFlags = VkMemoryPropertyFlags(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+    };
+    VkDeviceSize unaliasedSize = 0;
+    VkDeviceSize allocatedSize = 0;
+    for (int slot = 0; slot < _slots.size(); slot++) {
+      VK_CHECK(vmaAllocateMemory(_allocator, &slotRequirements[slot], &allocationInfo, &_slots[slot].allocation, nullptr));
+      allocatedSize += slotRequirements[slot].size;
+    }
+
+    for (int i = 0; i < _transientImages.size(); i++) {
+      TransientImage& transient = _transientImages[i];
+      const TransientDescription& description = _allocatedDescriptions[i];
+      VK_CHECK(vmaBindImageMemory(_allocator, _slots[transient.slot].allocation, transient.image));
+
+      VkImageViewCreateInfo viewInfo = vkutil::imageview_create_info(description.format, transient.image, aspect_for_format(description.format));
+      VK_CHECK(vkCreateImageView(_device, &viewInfo, nullptr, &transient.view));
+      unaliasedSize += requirements[i].size;
+    }
+
+    spdlog::info("Frame graph placed {} transient images in {} allocations, {:.1f}MiB instead of {:.1f}MiB",
+                 _transientImages.size(), _slots.size(), allocatedSize / 1048576.f, unaliasedSize / 1048576.f);
+  }
+
+  void FrameGraph::release_transients(vkutil::DeletionQueue& retired) {
+    std::vector<TransientImage> images = std::move(_transientImages);
+    std::vector<MemorySlot> slots = std::move(_slots);
+    _transientImages.clear();
+    _slots.clear();
+    _allocatedDescriptions.clear();
+    if (images.empty()) return;
+
+    VkDevice device = _device;
+    VmaAllocator allocator = _allocator;
+    retired.push_function([=]() {
+      for (const TransientImage& transient : images) {
+        vkDestroyImageView(device, transient.view, nullptr);
+        vkDestroyImage(device, transient.image, nullptr);
+      }
+      for (const MemorySlot& slot : slots) {
+        vmaFreeMemory(allocator, slot.allocation);
+      }
+    });
+  }
+
+  bool FrameGraph::synchronize(ResourceState& state, const ResourceUse& use, bool isImage, VkPipelineStageFlags2& srcStage, VkAccessFlags2& srcAccess) const {
+    bool isWrite = (use.access & WRITE_ACCESS) != 0;
+    bool isTransition = isImage && use.layout != state.layout;
+
+    if (isWrite || isTransition) {
+      // Waits for the last write and for every read since, so nothing reads what this overwrites
+      srcStage = state.writeStages | state.readStages;
+      srcAccess = state.writeAccess;
+      bool needsBarrier = isTransition || srcStage != VK_PIPELINE_STAGE_2_NONE;
+
+      state = {
+        .layout = isImage ? use.layout : state.layout,
+        .writeStages = use.stage,
+        .writeAccess = use.access & WRITE_ACCESS,
+        .readStages = isWrite ? VK_PIPELINE_STAGE_2_NONE : use.stage,
+        .visibleStages = use.stage,
+        .visibleAccess = use.access
+      };
+      return needsBarrier;
+    }
+
+    // Reads only wait if the last write hasn't been made visible to them yet
+    bool isVisible = (use.stage & ~state.visibleStages) == 0 && (use.access & ~state.visibleAccess) == 0;
+    bool needsBarrier = state.writeStages != VK_PIPELINE_STAGE_2_NONE && !isVisible;
+    if (needsBarrier) {
+      srcStage = state.writeStages;
+      srcAccess = state.writeAccess;
+      state.visibleStages |= use.stage;
+      state.visibleAccess |= use.access;
+    }
+    state.readStages |= use.stage;
+    return needsBarrier;
+  }
+
+  void FrameGraph::execute(VkCommandBuffer cmd) {
+    std::vector<VkImageMemoryBarrier2> imageBarriers;
+    std::vector<VkBufferMemoryBarrier2> bufferBarriers;
+    auto flush_barriers = [&]() {
+      if (imageBarriers.empty() && bufferBarriers.empty()) return;
+
+      VkDependencyInfo dependencyInfo {
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .pNext = nullptr,
+        .bufferMemoryBarrierCount = static_cast<uint32_t>(bufferBarriers.size()),
+        .pBufferMemoryBarriers = bufferBarriers.data(),
+        .imageMemoryBarrierCount = static_cast<uint32_t>(imageBarriers.size()),
+        .pImageMemoryBarriers = imageBarriers.data()
+      };
+      vkCmdPipelineBarrier2(cmd, &dependencyInfo);
+      imageBarriers.clear();
+      bufferBarriers.clear();
+    };
+
+    auto add_barrier = [&](Resource& resource, VkImageLayout oldLayout, VkPipelineStageFlags2 srcStage, VkAccessFlags2 srcAccess,
+                           VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess) {
+      if (resource.isImage) {
+        imageBarriers.push_back({
+          .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+          .pNext = nullptr,
+          .srcStageMask = srcStage,
+          .srcAccessMask = srcAccess,
+          .dstStageMask = dstStage,
+          .dstAccessMask = dstAccess,
+          .oldLayout = oldLayout,
+          .newLayout = resource.state.layout,
+          .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .image = resource.image,
+          .subresourceRange = vkutil::image_subresource_range(resource.aspect)
+        });
+      } else {
+        bufferBarriers.push_back({
+          .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+          .pNext = nullptr,
+          .srcStageMask = srcStage,
+          .srcAccessMask = srcAccess,
+          .dstStageMask = dstStage,
+          .dstAccessMask = dstAccess,
+          .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .buffer = resource.buffer,
+          .offset = 0,
+          .size = VK_WHOLE_SIZE
+        });
+      }
+    };
+
+    for (int passIndex = 0; passIndex < _passes.size(); passIndex++) {
+      Pass& pass = _passes[passIndex];
+      // A transient starts from whatever its memory's last user left, which may be an earlier pass of this frame
+      for (const ResourceUse& use : pass.uses) {
+        Resource& resource = _resources[use.resource];
+        if (resource.transientIndex < 0 || _allocatedDescriptions[resource.transientIndex].firstPass != passIndex) continue;
+
+        // Whatever the memory held is discarded, but the last user of the memory still has to be done with it
+        const ResourceState& slotState = _slots[_transientImages[resource.transientIndex].slot].state;
+        resource.state = {
+          .layout = VK_IMAGE_LAYOUT_UNDEFINED,
+          .writeStages = slotState.writeStages | slotState.readStages,
+          .writeAccess = slotState.writeAccess
+        };
+      }
+
+      for (const ResourceUse& use : pass.uses) {
+        Resource& resource = _resources[use.resource];
+        VkImageLayout oldLayout = resource.state.layout;
+        VkPipelineStageFlags2 srcStage;
+        VkAccessFlags2 srcAccess;
+        if (synchronize(resource.state, use, resource.isImage, srcStage, srcAccess)) {
+          add_barrier(resource, oldLayout, srcStage, srcAccess, use.stage, use.access);
+        }
+      }
+      flush_barriers();
+
+      pass.record(cmd);
+
+      for (const ResourceUse& use : pass.uses) {
+        const Resource& resource = _resources[use.resource];
+        if (resource.transientIndex < 0 || _allocatedDescriptions[resource.transientIndex].lastPass != passIndex) continue;
+
+        _slots[_transientImages[resource.transientIndex].slot].state = resource.state;
+      }
+    }
+
+    for (Resource& resource : _resources) {
+      if (!resource.finalLayout || *resource.finalLayout == resource.state.layout) continue;
+
+      // Nothing in this command buffer uses the image afterwards, whatever does waits on a semaphore
+      VkImageLayout oldLayout = resource.state.layout;
+      VkPipelineStageFlags2 srcStage = resource.state.writeStages | resource.state.readStages;
+      VkAccessFlags2 srcAccess = resource.state.writeAccess;
+      resource.state = {
+        .layout = *resource.finalLayout,
+        .writeStages = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT
+      };
+      add_barrier(resource, oldLayout, srcStage, srcAccess, VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE);
+    }
+    flush_barriers();
+
+    // Carry the states over to the next frame. A slot's last user may still have had its final layout transition
+    for (Resource& resource : _resources) {
+      if (resource.transientIndex >= 0) {
+        MemorySlot& slot = _slots[_transientImages[resource.transientIndex].slot];
+        if (_allocatedDescriptions[resource.transientIndex].lastPass >= slot.lastPass) slot.state = resource.state;
+      } else if (resource.isImage) {
+        _importedImageStates[resource.image] = resource.state;
+      } else {
+        _importedBufferStates[resource.buffer] = resource.state;
+      }
+    }
+  }
+
+  VkImage FrameGraph::get_image(FrameResource resource) const {
+    return _resources[resource].image;
+  }
+
+  VkImageView FrameGraph::get_image_view(FrameResource resource) const {
+    return _resources[resource].view;
+  }
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <functional>
+#include <optional>
+#include "vulkan/vulkan_core.h"
+#include "vk_mem_alloc.h"
+#include "VulkanHelper.h"
+
+namespace cubik {
+  using FrameResource = uint32_t;
+
+  // How a pass touches a resource. The layout is ignored for buffers
+  struct ResourceUse {
+    FrameResource resource;
+    VkPipelineStageFlags2 stage;
+    VkAccessFlags2 access;
+    VkImageLayout layout {VK_IMAGE_LAYOUT_UNDEFINED};
+  };
+
+  // What the next access to a resource has to wait for
+  struct ResourceState {
+    VkImageLayout layout {VK_IMAGE_LAYOUT_UNDEFINED};
+    // Last write or layout transition
+    VkPipelineStageFlags2 writeStages {VK_PIPELINE_STAGE_2_NONE};
+    VkAccessFlags2 writeAccess {VK_ACCESS_2_NONE};
+    // Reads since then, which a later write has to wait for
+    VkPipelineStageFlags2 readStages {VK_PIPELINE_STAGE_2_NONE};
+    // Where the last write has already been made visible
+    VkPipelineStageFlags2 visibleStages {VK_PIPELINE_STAGE_2_NONE};
+    VkAccessFlags2 visibleAccess {VK_ACCESS_2_NONE};
+  };
+
+  // Rebuilt every frame: passes declare the resources they read and write, and execute() records them with
+  // the barriers those declarations need instead of full pipeline flushes. Transient images belong to the
+  // graph, and those whose lifetimes don't overlap share memory
+  class FrameGraph {
+  public:
+    void init(VkDevice device, VmaAllocator allocator);
+    void destroy();
+
+    // Drops the passes and resources of the last frame. Transient memory and the state of imported resources are kept
+    void reset();
+
+    // The state of an imported resource carries over between frames, unless initialState is given
+    FrameResource import_image(const char* name, VkImage image, VkImageView view, std::optional<ResourceState> initialState = {},
+                               VkImageAspectFlags aspect = VK_IMAGE_ASPECT_COLOR_BIT);
+    FrameResource import_buffer(const char* name, VkBuffer buffer);
+    FrameResource create_image(const char* name, VkExtent3D extent, VkFormat format, VkImageUsageFlags usage);
+
+    void add_pass(const char* name, std::vector<ResourceUse> uses, std::function<void(VkCommandBuffer)>&& record);
+    // Layout the image is left in after its last pass, like PRESENT_SRC_KHR for the swapchain
+    void set_final_layout(FrameResource image, VkImageLayout layout);
+
+    // Creates the transient images. Their memory is only replaced when the frame's transients change, and the old
+    // images are handed to retired since earlier frames may still be using them
+    void compile(vkutil::DeletionQueue& retired);
+    void execute(VkCommandBuffer cmd);
+
+    VkImage get_image(FrameResource resource) const;
+    VkImageView get_image_view(FrameResource resource) const;
+
+  private:
+    struct TransientDescription {
+      VkExtent3D extent;
+      VkFormat format;
+      VkImageUsageFlags usage;
+      int firstPass;
+      int lastPass;
+
+      bool operator==(const TransientDescription& other) const;
+    };
+
+    struct Resource {
+      const char* name;
+      bool isImage;
+      VkImage image {VK_NULL_HANDLE};
+      VkImageView view {VK_NULL_HANDLE};
+      VkBuffer buffer {VK_NULL_HANDLE};
+      VkImageAspectFlags aspect {VK_IMAGE_ASPECT_COLOR_BIT};
+      int transientIndex {-1};
+      std::optional<VkImageLayout> finalLayout;
+      ResourceState state;
+    };
+
+    struct Pass {
+      const char* name;
+      std::vector<ResourceUse> uses;
+      std::function<void(VkCommandBuffer)> record;
+    };
+
+    struct TransientImage {
+      VkImage image;
+      VkImageView view;
+      int slot;
+    };
+
+    // Memory shared by transient images, and the state its last user left it in
+    struct MemorySlot {
+      VmaAllocation allocation;
+      int lastPass;
+      ResourceState state;
+    };
+
+    VkDevice _device;
+    VmaAllocator _allocator;
+
+    std::vector<Resource> _resources;
+    std::vector<Pass> _passes;
+    std::vector<TransientDescription> _transientDescriptions;
+
+    std::vector<TransientDescription> _allocatedDescriptions;
+    std::vector<TransientImage> _transientImages;
+    std::vector<MemorySlot> _slots;
+
+    std::map<VkImage, ResourceState> _importedImageStates;
+    std::map<VkBuffer, ResourceState> _importedBufferStates;
+
+    void allocate_transients();
+    void release_transients(vkutil::DeletionQueue& retired);
+    // Updates the state for the access and says whether it needs a barrier, and what that barrier waits for
+    bool synchronize(ResourceState& state, const ResourceUse& use, bool isImage, VkPipelineStageFlags2& srcStage, VkAccessFlags2& srcAccess) const;
+  };
+}
@@ -0,0 +1,153 @@
+#include "GpuProfiler.h"
+#include "VulkanHelper.h"
+#include "Trace.h"
+#include "spdlog/fmt/fmt.h"
+
+namespace cubik {
+  void GpuProfiler::init(VkDevice device, VkPhysicalDevice physicalDevice, VkQueue queue, uint32_t queueFamily, uint32_t frameCount) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    _timestampPeriod = properties.limits.timestampPeriod;
+
+    uint32_t queueFamilyCount;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+
+    if (queueFamilies[queueFamily].timestampValidBits == 0) {
+      spdlog::warn("Queue family {} doesn't support timestamps, GPU zones won't be timed", queueFamily);
+      return;
+    }
+
+    VkQueryPoolCreateInfo poolInfo {
+      .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+      .pNext = nullptr,
+      .queryType = VK_QUERY_TYPE_TIMESTAMP,
+      .queryCount = MAX_ZONES * 2
+    };
+    _frames.resize(frameCount);
+    for (auto& frame : _frames) {
+      VK_CHECK(vkCreateQueryPool(device, &poolInfo, nullptr, &frame.pool));
+    }
+    _enabled = true;
+
+    calibrate(device, queue, queueFamily);
+  }
+
+  // Writes a single timestamp and takes the middle of the CPU time around it as its trace clock time. Good to a
+  // fraction of the submission latency, which is plenty for lining zones up in a trace
+  void GpuProfiler::calibrate(VkDevice device, VkQueue queue, uint32_t queueFamily) {
+    VkCommandPool commandPool;
+    VkCommandPoolCreateInfo commandPoolInfo = vkutil::command_pool_create_info(queueFamily, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+    VK_CHECK(vkCreateCommandPool(device, &commandPoolInfo, nullptr, &commandPool));
+    VkCommandBuffer cmd;
+    VkCommandBufferAllocateInfo cmdAllocInfo = vkutil::command_buffer_allocate_info(commandPool, 1);
+    VK_CHECK(vkAllocateCommandBuffers(device, &cmdAllocInfo, &cmd));
+    VkFence fence;
+    VkFenceCreateInfo fenceInfo = vkutil::fence_create_info();
+    VK_CHECK(vkCreateFence(device, &fenceInfo, nullptr, &fence));
+
+    VkQueryPool pool = _frames[0].pool;
+    VkCommandBufferBeginInfo beginInfo = vkutil::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    VK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
+    vkCmdResetQueryPool(cmd, pool, 0, 1);
+    vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, pool, 0);
+    VK_CHECK(vkEndCommandBuffer(cmd));
+
+    VkCommandBufferSubmitInfo cmdSubmitInfo = vkutil::command_buffer_submit_info(cmd);
+    VkSubmitInfo2 submit = vkutil::submit_info(&cmdSubmitInfo, nullptr, nullptr);
+    uint64_t submitTime = trace::now();
+    VK_CHECK(vkQueueSubmit2(queue, 1, &submit, fence));
+    VK_CHECK(vkWaitForFences(device, 1, &fence, true, 1000000000));
+    uint64_t completeTime = trace::now();
+
+    uint64_t timestamp;
+    VK_CHECK(vkGetQueryPoolResults(device, pool, 0, 1, sizeof(timestamp), &timestamp, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT));
+    _traceClockOffset = (submitTime + completeTime) / 2.0 - timestamp * static_cast<double>(_timestampPeriod);
+
+    vkDestroyFence(device, fence, nullptr);
+    vkDestroyCommandPool(device, commandPool, nullptr);
+  }
+
+  void GpuProfiler::destroy(VkDevice device) {
+    for (auto& frame : _frames) {
+      vkDestroyQueryPool(device, frame.pool, nullptr);
+    }
+    _frames.clear();
+    _enabled = false;
+  }
+
+  void GpuProfiler::begin_frame(VkDevice device, VkCommandBuffer cmd, uint32_t frameIndex) {
+    if (!_enabled) return;
+
+    _currentFrame = frameIndex;
+    FrameQueries& frame = _frames[frameIndex];
+    if (!frame.zones.empty()) {
+      collect(device, frame);
+      frame.zones.clear();
+
+      if (++_framesSinceReport >= REPORT_INTERVAL) report();
+    }
+
+    vkCmdResetQueryPool(cmd, frame.pool, 0, MAX_ZONES * 2);
+  }
+
+  void GpuProfiler::begin_zone(VkCommandBuffer cmd, const char* name) {
+    if (!_enabled) return;
+
+    FrameQueries& frame = _frames[_currentFrame];
+    if (frame.zones.size() >= MAX_ZONES) {
+      spdlog::error("Too many GPU zones in a frame, {} is not timed", name);
+      return;
+    }
+    vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, frame.pool, frame.zones.size() * 2);
+    frame.zones.push_back(name);
+  }
+
+  void GpuProfiler::end_zone(VkCommandBuffer cmd) {
+    if (!_enabled) return;
+
+    FrameQueries& frame = _frames[_currentFrame];
+    vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, frame.pool, frame.zones.size() * 2 - 1);
+  }
+
+  float GpuProfiler::average(const std::string& name) const {
+    auto stats = _stats.find(name);
+    return stats == _stats.end() ? 0.f : stats->second.lastAverage;
+  }
+
+  void GpuProfiler::collect(VkDevice device, FrameQueries& frame) {
+    uint64_t timestamps[MAX_ZONES * 2];
+    uint32_t queryCount = frame.zones.size() * 2;
+    // The frame's fence has been waited on, so the results are already available
+    VK_CHECK(vkGetQueryPoolResults(device, frame.pool, 0, queryCount, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT));
+
+    for (int i = 0; i < frame.zones.size(); i++) {
+      auto [stats, inserted] = _stats.try_emplace(frame.zones[i]);
+      if (inserted) _zoneOrder.push_back(frame.zones[i]);
+
+      stats->second.totalMilliseconds += (timestamps[i * 2 + 1] - timestamps[i * 2]) * _timestampPeriod / 1e6;
+      stats->second.samples++;
+
+      if (trace::is_recording()) {
+        trace::record_gpu_zone(frame.zones[i], static_cast<uint64_t>(_traceClockOffset + timestamps[i * 2] * static_cast<double>(_timestampPeriod)),
+                               static_cast<uint64_t>(_traceClockOffset + timestamps[i * 2 + 1] * static_cast<double>(_timestampPeriod)));
+      }
+    }
+  }
+
+  void GpuProfiler::report() {
+    std::string line;
+    for (const std::string& name : _zoneOrder) {
+      ZoneStats& stats = _stats[name];
+      stats.lastAverage = stats.samples > 0 ? static_cast<float>(stats.totalMilliseconds / stats.samples) : 0.f;
+      stats.totalMilliseconds = 0;
+      stats.samples = 0;
+
+      if (!line.empty()) line += ", ";
+      line += fmt::format("{} {:.3f}ms", name, stats.lastAverage);
+    }
+    spdlog::info("GPU frame over the last {} frames: {}", _framesSinceReport, line);
+    _framesSinceReport = 0;
+  }
+}
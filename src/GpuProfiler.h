@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include "vulkan/vulkan_core.h"
+
+namespace cubik {
+  // Times named zones of the frame command buffers with timestamp queries and logs their averages.
+  // Each frame in flight has its own query pool, read back once its fence has been waited on.
+  // While a trace is recording, the zones also go to its GPU track
+  class GpuProfiler {
+  public:
+    static constexpr uint32_t MAX_ZONES = 16;
+    static constexpr int REPORT_INTERVAL = 240; // In frames
+
+    void init(VkDevice device, VkPhysicalDevice physicalDevice, VkQueue queue, uint32_t queueFamily, uint32_t frameCount);
+    void destroy(VkDevice device);
+
+    // Collects the zones the frame recorded last time it was used and resets its queries.
+    // Has to be called after the frame's fence wait and before any zone is recorded
+    void begin_frame(VkDevice device, VkCommandBuffer cmd, uint32_t frameIndex);
+
+    void begin_zone(VkCommandBuffer cmd, const char* name);
+    void end_zone(VkCommandBuffer cmd);
+
+    // Average time of the zone in milliseconds over the last report interval, 0 if it wasn't recorded
+    float average(const std::string& name) const;
+
+  private:
+    struct FrameQueries {
+      VkQueryPool pool;
+      std::vector<const char*> zones;
+    };
+
+    struct ZoneStats {
+      double totalMilliseconds {0};
+      int samples {0};
+      float lastAverage {0};
+    };
+
+    bool _enabled {false};
+    float _timestampPeriod;
+    std::vector<FrameQueries> _frames;
+    uint32_t _currentFrame {0};
+    std::map<std::string, ZoneStats> _stats;
+    std::vector<std::string> _zoneOrder;
+    int _framesSinceReport {0};
+    // Trace clock time of GPU timestamp 0, in nanoseconds
+    double _traceClockOffset {0};
+
+    void calibrate(VkDevice device, VkQueue queue, uint32_t queueFamily);
+    void collect(VkDevice device, FrameQueries& frame);
+    void report();
+  };
+}
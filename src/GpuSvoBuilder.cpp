@@ -0,0 +1,232 @@
+#include "GpuSvoBuilder.h"
+#include "Pipeline.h"
+#include "VulkanHelper.h"
+#include <bit>
+#include <algorithm>
+
+namespace cubik {
+  constexpr uint32_t BUILD_GROUP_SIZE = 256;
+  constexpr uint32_t MAX_GROUPS_PER_DIMENSION = 65535;
+
+  // Every build shader takes at most this much push constant data
+  constexpr uint32_t BUILD_PUSH_CONSTANTS_SIZE = 48;
+
+  struct ReducePushConstants {
+    VkDeviceAddress source;
+    VkDeviceAddress destination;
+    int size;
+  };
+
+  struct FlagsPushConstants {
+    VkDeviceAddress level;
+    VkDeviceAddress flags;
+    int cellCount;
+    int isRoot;
+    int isLast;
+  };
+
+  struct ScanPushConstants {
+    VkDeviceAddress data;
+    VkDeviceAddress blockSums;
+    int count;
+    int blockCount; // The flattened dispatch can have more groups than blocks
+  };
+
+  struct EmitPushConstants {
+    VkDeviceAddress level;
+    VkDeviceAddress childLevel;
+    VkDeviceAddress nodeIndices;
+    VkDeviceAddress childNodeIndices;
+    VkDeviceAddress nodes;
+    int size;
+    int isRoot;
+  };
+
+  GpuSvoBuildLayout GpuSvoBuildLayout::plan(int worldSize) {
+    GpuSvoBuildLayout layout {
+      .worldSize = worldSize,
+      .depth = std::countr_zero(static_cast<unsigned int>(worldSize))
+    };
+
+    layout.pyramidCount = 0;
+    for (int level = 1; level <= layout.depth; level++) {
+      layout.levelOffsets.push_back(layout.pyramidCount);
+      layout.pyramidCount += layout.cellCount(level);
+    }
+
+    // Indexed by level - 1 like the pyramid, but laid out from the root down
+    layout.nodeOffsets.resize(layout.depth);
+    VkDeviceSize nodeCellCount = 0;
+    for (int level = layout.depth; level >= 1; level--) {
+      layout.nodeOffsets[level - 1] = nodeCellCount;
+      nodeCellCount += layout.cellCount(level);
+    }
+    layout.scanCount = nodeCellCount + 1;
+
+    layout.blockSumCount = 0;
+    VkDeviceSize count = layout.scanCount;
+    do {
+      count = (count + BUILD_GROUP_SIZE - 1) / BUILD_GROUP_SIZE;
+      layout.blockSumOffsets.push_back(layout.blockSumCount);
+      layout.blockSumCounts.push_back(count);
+      layout.blockSumCount += count;
+    } while (count > 1);
+
+    return layout;
+  }
+
+  void GpuSvoBuilder::init(VkDevice device, VkPipelineCache cache, const std::string& shaderDirectory) {
+    VkPushConstantRange pushConstant {
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+      .offset = 0,
+      .size = BUILD_PUSH_CONSTANTS_SIZE
+    };
+
+    VkPipelineLayoutCreateInfo layoutInfo {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .pNext = nullptr,
+      .setLayoutCount = 0,
+      .pushConstantRangeCount = 1,
+      .pPushConstantRanges = &pushConstant,
+    };
+    VK_CHECK(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &_pipelineLayout));
+
+    _reducePipeline = create_pipeline(device, cache, shaderDirectory + "svoBuildReduce.comp.spv");
+    _flagsPipeline = create_pipeline(device, cache, shaderDirectory + "svoBuildFlags.comp.spv");
+    _scanPipeline = create_pipeline(device, cache, shaderDirectory + "svoBuildScan.comp.spv");
+    _scanAddPipeline = create_pipeline(device, cache, shaderDirectory + "svoBuildScanAdd.comp.spv");
+    _emitPipeline = create_pipeline(device, cache, shaderDirectory + "svoBuildEmit.comp.spv");
+  }
+
+  void GpuSvoBuilder::destroy(VkDevice device) {
+    vkDestroyPipeline(device, _reducePipeline, nullptr);
+    vkDestroyPipeline(device, _flagsPipeline, nullptr);
+    vkDestroyPipeline(device, _scanPipeline, nullptr);
+    vkDestroyPipeline(device, _scanAddPipeline, nullptr);
+    vkDestroyPipeline(device, _emitPipeline, nullptr);
+    vkDestroyPipelineLayout(device, _pipelineLayout, nullptr);
+  }
+
+  VkPipeline GpuSvoBuilder::create_pipeline(VkDevice device, VkPipelineCache cache, const std::string& shaderPath) const {
+    VkShaderModule shaderModule;
+    if (!vkutil::load_shader_module(shaderPath.c_str(), device, &shaderModule)) {
+      spdlog::error("Failed to load {}", shaderPath);
+      abort();
+    }
+
+    VkComputePipelineCreateInfo pipelineInfo {
+      .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+      .pNext = nullptr,
+      .stage = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .pNext = nullptr,
+        .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+        .module = shaderModule,
+        .pName = "main"
+      },
+      .layout = _pipelineLayout
+    };
+
+    VkPipeline pipeline;
+    VK_CHECK(vkCreateComputePipelines(device, cache, 1, &pipelineInfo, nullptr, &pipeline));
+    vkDestroyShaderModule(device, shaderModule, nullptr);
+    return pipeline;
+  }
+
+  void GpuSvoBuilder::dispatch(VkCommandBuffer cmd, VkPipeline pipeline, const void* pushConstants, uint32_t pushConstantsSize, VkDeviceSize threadCount) const {
+    // Big levels need more groups than a single dimension allows, so the shaders flatten a 2D dispatch
+    auto groupCount = static_cast<uint32_t>((threadCount + BUILD_GROUP_SIZE - 1) / BUILD_GROUP_SIZE);
+    uint32_t groupsX = std::min(groupCount, MAX_GROUPS_PER_DIMENSION);
+    uint32_t groupsY = (groupCount + groupsX - 1) / groupsX;
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    vkCmdPushConstants(cmd, _pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, pushConstantsSize, pushConstants);
+    vkCmdDispatch(cmd, groupsX, groupsY, 1);
+
+    vkutil::memory_barrier(cmd,
+                           VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                           VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                           VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_TRANSFER_READ_BIT);
+  }
+
+  void GpuSvoBuilder::record_count(VkCommandBuffer cmd, const GpuSvoBuildLayout& layout, VkDeviceAddress input, VkDeviceAddress pyramid,
+                                   VkDeviceAddress scan, VkDeviceAddress blockSums) const {
+    auto levelAddress = [&](int level) {
+      return level == 0 ? input : pyramid + layout.levelOffsets[level - 1] * sizeof(int);
+    };
+
+    for (int level = 1; level <= layout.depth; level++) {
+      ReducePushConstants reduce {
+        .source = levelAddress(level - 1),
+        .destination = levelAddress(level),
+        .size = layout.worldSize >> level
+      };
+      dispatch(cmd, _reducePipeline, &reduce, sizeof(reduce), layout.cellCount(level));
+    }
+
+    for (int level = 1; level <= layout.depth; level++) {
+      FlagsPushConstants flags {
+        .level = levelAddress(level),
+        .flags = scan + layout.nodeOffsets[level - 1] * sizeof(int),
+        .cellCount = layout.cellCount(level),
+        .isRoot = level == layout.depth,
+        .isLast = level == 1
+      };
+      dispatch(cmd, _flagsPipeline, &flags, sizeof(flags), layout.cellCount(level));
+    }
+
+    // Scan each block, then the block totals, until a single block is left, and add the totals back on the way down
+    VkDeviceAddress data = scan;
+    VkDeviceSize count = layout.scanCount;
+    for (size_t i = 0; i < layout.blockSumCounts.size(); i++) {
+      VkDeviceAddress sums = blockSums + layout.blockSumOffsets[i] * sizeof(int);
+      ScanPushConstants scanBlocks {
+        .data = data,
+        .blockSums = sums,
+        .count = static_cast<int>(count),
+        .blockCount = static_cast<int>(layout.blockSumCounts[i])
+      };
+      dispatch(cmd, _scanPipeline, &scanBlocks, sizeof(scanBlocks), count);
+
+      data = sums;
+      count = layout.blockSumCounts[i];
+    }
+
+    // The last array scanned fit in a single block, so the adds start one array below it
+    for (int i = static_cast<int>(layout.blockSumCounts.size()) - 3; i >= -1; i--) {
+      VkDeviceAddress target = i < 0 ? scan : blockSums + layout.blockSumOffsets[i] * sizeof(int);
+      VkDeviceSize targetCount = i < 0 ? layout.scanCount : layout.blockSumCounts[i];
+      ScanPushConstants addBlocks {
+        .data = target,
+        .blockSums = blockSums + layout.blockSumOffsets[i + 1] * sizeof(int),
+        .count = static_cast<int>(targetCount),
+        .blockCount = static_cast<int>((targetCount + BUILD_GROUP_SIZE - 1) / BUILD_GROUP_SIZE)
+      };
+      dispatch(cmd, _scanAddPipeline, &addBlocks, sizeof(addBlocks), targetCount);
+    }
+  }
+
+  void GpuSvoBuilder::record_emit(VkCommandBuffer cmd, const GpuSvoBuildLayout& layout, VkDeviceAddress input, VkDeviceAddress pyramid,
+                                  VkDeviceAddress scan, VkDeviceAddress nodes) const {
+    auto levelAddress = [&](int level) {
+      return level == 0 ? input : pyramid + layout.levelOffsets[level - 1] * sizeof(int);
+    };
+    auto nodeIndexAddress = [&](int level) {
+      // Level 0 cells are never nodes, any valid address will do
+      return level == 0 ? scan : scan + layout.nodeOffsets[level - 1] * sizeof(int);
+    };
+
+    for (int level = layout.depth; level >= 1; level--) {
+      EmitPushConstants emit {
+        .level = levelAddress(level),
+        .childLevel = levelAddress(level - 1),
+        .nodeIndices = nodeIndexAddress(level),
+        .childNodeIndices = nodeIndexAddress(level - 1),
+        .nodes = nodes,
+        .size = layout.worldSize >> level,
+        .isRoot = level == layout.depth
+      };
+      dispatch(cmd, _emitPipeline, &emit, sizeof(emit), layout.cellCount(level));
+    }
+  }
+}
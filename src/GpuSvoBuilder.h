@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "vulkan/vulkan_core.h"
+
+namespace cubik {
+  // Sizes and offsets (in ints) of the scratch buffers a GPU build of a given world size needs
+  struct GpuSvoBuildLayout {
+    int worldSize;
+    int depth;
+
+    // Uniformity pyramid, levels 1 to depth. Level 0 is the input itself
+    std::vector<VkDeviceSize> levelOffsets;
+    VkDeviceSize pyramidCount;
+
+    // Node index scan, levels ordered from the root down so nodes come out breadth first.
+    // The extra element at the end holds the total node count once the scan is done
+    std::vector<VkDeviceSize> nodeOffsets;
+    VkDeviceSize scanCount;
+
+    std::vector<VkDeviceSize> blockSumOffsets;
+    std::vector<VkDeviceSize> blockSumCounts;
+    VkDeviceSize blockSumCount;
+
+    static GpuSvoBuildLayout plan(int worldSize);
+
+    int cellCount(int level) const { int size = worldSize >> level; return size * size * size; }
+  };
+
+  // Builds the linearized octree from a dense voxel grid with compute shaders, level by level, using a
+  // parallel prefix sum to allocate node indices. The result is breadth first instead of SvoWorld's depth
+  // first order, which svoRayMarcher doesn't care about since children are addressed by relative offsets
+  class GpuSvoBuilder {
+  public:
+    void init(VkDevice device, VkPipelineCache cache, const std::string& shaderDirectory);
+    void destroy(VkDevice device);
+
+    // Fills the pyramid and node index scan. The node count ends up at scan[layout.scanCount - 1]
+    void record_count(VkCommandBuffer cmd, const GpuSvoBuildLayout& layout, VkDeviceAddress input, VkDeviceAddress pyramid,
+                      VkDeviceAddress scan, VkDeviceAddress blockSums) const;
+
+    // Writes the nodes. Needs the buffers filled by record_count
+    void record_emit(VkCommandBuffer cmd, const GpuSvoBuildLayout& layout, VkDeviceAddress input, VkDeviceAddress pyramid,
+                     VkDeviceAddress scan, VkDeviceAddress nodes) const;
+
+  private:
+    VkPipelineLayout _pipelineLayout;
+    VkPipeline _reducePipeline;
+    VkPipeline _flagsPipeline;
+    VkPipeline _scanPipeline;
+    VkPipeline _scanAddPipeline;
+    VkPipeline _emitPipeline;
+
+    VkPipeline create_pipeline(VkDevice device, VkPipelineCache cache, const std::string& shaderPath) const;
+    void dispatch(VkCommandBuffer cmd, VkPipeline pipeline, const void* pushConstants, uint32_t pushConstantsSize, VkDeviceSize threadCount) const;
+  };
+}
@@ -0,0 +1,32 @@
+#include "GpuSvoWorld.h"
+#include "SvoWorld.h"
+#include <bit>
+#include <cstring>
+
+namespace cubik {
+  GpuSvoWorld::GpuSvoWorld(const std::vector<int> &worldData, int worldSize)
+    : UncompressedGridWorld(worldData, worldSize, false) {}
+
+  size_t GpuSvoWorld::calculateSerializedSize() const {
+    int worldSize = getSize();
+    return sizeof(worldSize) + sizeof(int) * getVoxels().size();
+  }
+
+  void GpuSvoWorld::serialize(void *target) const {
+    char *dataPtr = static_cast<char *>(target);
+    int worldSize = getSize();
+
+    memcpy(dataPtr, &worldSize, sizeof(worldSize));
+    dataPtr += sizeof(worldSize);
+    memcpy(dataPtr, getVoxels().data(), sizeof(int) * getVoxels().size());
+  }
+
+  const std::string& GpuSvoWorld::getCompatibleShader() const {
+    static const std::string compatibleShader = SVO_SHADER;
+    return compatibleShader;
+  }
+
+  int GpuSvoWorld::getDepth() const {
+    return std::countr_zero(static_cast<unsigned int>(getSize()));
+  }
+}
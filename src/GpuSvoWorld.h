@@ -0,0 +1,22 @@
+#pragma once
+
+#include "UncompressedGridWorld.h"
+
+namespace cubik {
+  // Dense grid that the renderer turns into a linearized octree on the GPU, skipping the CPU build
+  // and uploading 4 bytes per voxel instead of the node list. The build reads the plain ints, not palette bricks
+  class GpuSvoWorld : public UncompressedGridWorld {
+  public:
+    GpuSvoWorld(const std::vector<int> &worldData, int worldSize);
+
+    [[nodiscard]] size_t calculateSerializedSize() const override;
+
+    void serialize(void *target) const override;
+
+    const std::string& getCompatibleShader() const override;
+
+    int getDepth() const override;
+
+    bool isBuiltOnGpu() const override { return true; }
+  };
+}
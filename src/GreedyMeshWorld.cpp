@@ -0,0 +1,210 @@
+#include "GreedyMeshWorld.h"
+#include "JobSystem.h"
+#include "Trace.h"
+#include <algorithm>
+#include <cstring>
+
+namespace cubik {
+  namespace {
+    struct ChunkMesh {
+      std::vector<PackedVertex> vertices;
+      std::vector<uint32_t> indices;
+    };
+
+    // Scratch reused by every chunk a worker meshes
+    class ChunkMesher {
+    public:
+      ChunkMesher(const World& world, int chunkSize)
+        : _world(world), _chunkSize(chunkSize), _paddedSize(chunkSize + 2),
+          _materials(_paddedSize * _paddedSize * _paddedSize), _mask(chunkSize * chunkSize) {
+        _positions.reserve(_materials.size());
+        _values.resize(_materials.size());
+      }
+
+      void mesh(glm::ivec3 origin, ChunkMesh& output) {
+        load(origin);
+
+        for (int axis = 0; axis < 3; axis++) {
+          // u x v = axis, so quads wound a, a + u, a + u + v face towards +axis
+          int u = (axis + 1) % 3;
+          int v = (axis + 2) % 3;
+          for (int direction : { 1, -1 }) {
+            int face = 1 + 2 * axis + (direction > 0 ? 0 : 1);
+            for (int slice = 0; slice < _chunkSize; slice++) {
+              if (!fillMask(axis, u, v, direction, slice)) continue;
+              mergeMask(origin, axis, u, v, direction, slice, face, output);
+            }
+          }
+        }
+      }
+
+    private:
+      const World& _world;
+      int _chunkSize;
+      int _paddedSize;
+      std::vector<uint8_t> _materials; // The chunk and a voxel around it, which decides the faces on its border
+      std::vector<uint8_t> _mask; // Material of each face of the slice, 0 where there is none
+      std::vector<glm::ivec3> _positions;
+      std::vector<int> _values;
+
+      uint8_t materialAt(glm::ivec3 position) const {
+        position += 1;
+        return _materials[position.x + (position.y + position.z * _paddedSize) * _paddedSize];
+      }
+
+      // Positions outside the world come back empty, so the world's border gets faces too
+      void load(glm::ivec3 origin) {
+        _positions.clear();
+        for (int z = -1; z <= _chunkSize; z++) {
+          for (int y = -1; y <= _chunkSize; y++) {
+            for (int x = -1; x <= _chunkSize; x++) {
+              _positions.push_back(origin + glm::ivec3(x, y, z));
+            }
+          }
+        }
+        _world.getBatch(_positions, _values);
+        for (size_t i = 0; i < _values.size(); i++) {
+          _materials[i] = static_cast<uint8_t>(_values[i]);
+        }
+      }
+
+      // Faces of the slice's solid voxels whose neighbour in the direction is empty. Says whether there is any
+      bool fillMask(int axis, int u, int v, int direction, int slice) {
+        bool hasFaces = false;
+        glm::ivec3 position;
+        position[axis] = slice;
+        for (int j = 0; j < _chunkSize; j++) {
+          position[v] = j;
+          for (int i = 0; i < _chunkSize; i++) {
+            position[u] = i;
+            glm::ivec3 neighbour = position;
+            neighbour[axis] += direction;
+            uint8_t material = materialAt(neighbour) == 0 ? materialAt(position) : 0;
+            _mask[i + j * _chunkSize] = material;
+            hasFaces |= material != 0;
+          }
+        }
+        return hasFaces;
+      }
+
+      // Grows each face along u as far as its material goes, then along v while the whole row has it
+      void mergeMask(glm::ivec3 origin, int axis, int u, int v, int direction, int slice, int face, ChunkMesh& output) {
+        for (int j = 0; j < _chunkSize; j++) {
+          for (int i = 0; i < _chunkSize;) {
+            uint8_t material = _mask[i + j * _chunkSize];
+            if (material == 0) {
+              i++;
+              continue;
+            }
+
+            int width = 1;
+            while (i + width < _chunkSize && _mask[i + width + j * _chunkSize] == material) width++;
+            int height = 1;
+            for (; j + height < _chunkSize; height++) {
+              uint8_t* row = &_mask[i + (j + height) * _chunkSize];
+              if (std::find_if(row, row + width, [&](uint8_t face) { return face != material; }) != row + width) break;
+            }
+            for (int row = j; row < j + height; row++) {
+              std::fill_n(&_mask[i + row * _chunkSize], width, 0);
+            }
+
+            glm::ivec3 corner = origin;
+            corner[axis] += slice + (direction > 0 ? 1 : 0);
+            corner[u] += i;
+            corner[v] += j;
+            glm::ivec3 alongU {0}, alongV {0};
+            alongU[u] = width;
+            alongV[v] = height;
+            emitQuad(output, { corner, corner + alongU, corner + alongU + alongV, corner + alongV }, face, material, direction > 0);
+            i += width;
+          }
+        }
+      }
+
+      static void emitQuad(ChunkMesh& output, const glm::ivec3 (&corners)[4], int face, uint8_t material, bool isFrontWinding) {
+        auto first = static_cast<uint32_t>(output.vertices.size());
+        for (glm::ivec3 corner : corners) {
+          output.vertices.push_back({
+            static_cast<uint32_t>(corner.x) | static_cast<uint32_t>(corner.y) << 16,
+            static_cast<uint32_t>(corner.z) | static_cast<uint32_t>(face) << 16 | static_cast<uint32_t>(material) << 24
+          });
+        }
+        // Faces towards -axis are wound the other way round, so every quad is counter clockwise from outside
+        const uint32_t front[] = { 0, 1, 2, 0, 2, 3 };
+        const uint32_t back[] = { 0, 2, 1, 0, 3, 2 };
+        const uint32_t* order = isFrontWinding ? front : back;
+        for (int i = 0; i < 6; i++) {
+          output.indices.push_back(first + order[i]);
+        }
+      }
+    };
+  }
+
+  GreedyMesh buildGreedyMesh(const World& world, int chunkSize) {
+    CUBIK_TRACE_ZONE("buildGreedyMesh");
+    int chunksPerSide = (world.getSize() + chunkSize - 1) / chunkSize;
+    int chunkCount = chunksPerSide * chunksPerSide * chunksPerSide;
+
+    std::vector<ChunkMesh> chunks(chunkCount);
+    JobSystem::global().parallel_for(chunkCount, 1, [&](int begin, int end) {
+      ChunkMesher mesher(world, chunkSize);
+      for (int chunk = begin; chunk < end; chunk++) {
+        glm::ivec3 coordinates(chunk % chunksPerSide, (chunk / chunksPerSide) % chunksPerSide, chunk / (chunksPerSide * chunksPerSide));
+        mesher.mesh(coordinates * chunkSize, chunks[chunk]);
+      }
+    });
+
+    GreedyMesh mesh;
+    size_t vertexCount = 0, indexCount = 0;
+    for (const ChunkMesh& chunk : chunks) {
+      vertexCount += chunk.vertices.size();
+      indexCount += chunk.indices.size();
+    }
+    mesh.vertices.reserve(vertexCount);
+    mesh.indices.reserve(indexCount);
+    for (const ChunkMesh& chunk : chunks) {
+      if (chunk.indices.empty()) continue;
+
+      mesh.draws.push_back({
+        .indexCount = static_cast<uint32_t>(chunk.indices.size()),
+        .instanceCount = 1,
+        .firstIndex = static_cast<uint32_t>(mesh.indices.size()),
+        .vertexOffset = static_cast<int32_t>(mesh.vertices.size()),
+        .firstInstance = 0
+      });
+      mesh.vertices.insert(mesh.vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+      mesh.indices.insert(mesh.indices.end(), chunk.indices.begin(), chunk.indices.end());
+    }
+    return mesh;
+  }
+
+  GreedyMeshWorld::GreedyMeshWorld(const std::vector<int>& worldData, int worldSize)
+    : UncompressedGridWorld(worldData, worldSize, false), _mesh(buildGreedyMesh(*this)) {}
+
+  GreedyMeshHeader GreedyMeshWorld::getHeader() const {
+    return {
+      .size = getSize(),
+      .vertexCount = static_cast<uint32_t>(_mesh.vertices.size()),
+      .indexCount = static_cast<uint32_t>(_mesh.indices.size()),
+      .drawCount = static_cast<uint32_t>(_mesh.draws.size())
+    };
+  }
+
+  size_t GreedyMeshWorld::calculateSerializedSize() const {
+    return getHeader().byteSize();
+  }
+
+  void GreedyMeshWorld::serialize(void* target) const {
+    GreedyMeshHeader header = getHeader();
+    auto data = static_cast<char*>(target);
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + header.verticesOffset(), _mesh.vertices.data(), _mesh.vertices.size() * sizeof(PackedVertex));
+    memcpy(data + header.indicesOffset(), _mesh.indices.data(), _mesh.indices.size() * sizeof(uint32_t));
+    memcpy(data + header.drawsOffset(), _mesh.draws.data(), _mesh.draws.size() * sizeof(MeshDrawCommand));
+  }
+
+  const std::string& GreedyMeshWorld::getCompatibleShader() const {
+    static const std::string compatibleShader = GREEDY_MESH_SHADER;
+    return compatibleShader;
+  }
+}
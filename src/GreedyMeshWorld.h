@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "UncompressedGridWorld.h"
+
+namespace cubik {
+  constexpr int MESH_CHUNK_SIZE = 32;
+  constexpr const char* GREEDY_MESH_SHADER = "greedyMesh";
+
+  // Mirrors the vertex input of greedyMesh.vert. Corner of a quad, in voxels
+  struct PackedVertex {
+    uint32_t xy; // x in the low 16 bits, y in the high ones
+    uint32_t zFace; // z in the low 16 bits, then the face like the marchers' hit image (1 to 6), then the material
+  };
+
+  // Same layout as VkDrawIndexedIndirectCommand, so the commands are uploaded as they are
+  struct MeshDrawCommand {
+    uint32_t indexCount;
+    uint32_t instanceCount;
+    uint32_t firstIndex;
+    int32_t vertexOffset;
+    uint32_t firstInstance;
+  };
+
+  struct GreedyMesh {
+    std::vector<PackedVertex> vertices;
+    std::vector<uint32_t> indices; // Relative to the vertexOffset of their chunk's command
+    std::vector<MeshDrawCommand> draws; // One per chunk with faces
+  };
+
+  // Merges the faces between solid and empty voxels into rectangles, slice by slice in every direction. Only faces
+  // of the same material merge. Chunks are meshed in parallel on the job system and are independent, so quads
+  // never cross a chunk border
+  GreedyMesh buildGreedyMesh(const World& world, int chunkSize = MESH_CHUNK_SIZE);
+
+  // Start of the serialized mesh, followed by the vertices, indices and draw commands back to back
+  struct GreedyMeshHeader {
+    int size;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t drawCount;
+
+    size_t verticesOffset() const { return sizeof(GreedyMeshHeader); }
+    size_t indicesOffset() const { return verticesOffset() + vertexCount * sizeof(PackedVertex); }
+    size_t drawsOffset() const { return indicesOffset() + indexCount * sizeof(uint32_t); }
+    size_t byteSize() const { return drawsOffset() + drawCount * sizeof(MeshDrawCommand); }
+  };
+
+  // Rasterized instead of ray marched. The dense grid is kept for the queries, the renderer only gets the mesh.
+  // Meant for small dense worlds, where drawing a few thousand quads beats marching a ray per pixel
+  class GreedyMeshWorld : public UncompressedGridWorld {
+  public:
+    GreedyMeshWorld(const std::vector<int>& worldData, int worldSize);
+
+    [[nodiscard]] size_t calculateSerializedSize() const override;
+
+    void serialize(void* target) const override;
+
+    const std::string& getCompatibleShader() const override;
+
+    const GreedyMesh& getMesh() const { return _mesh; }
+
+  private:
+    GreedyMesh _mesh;
+
+    GreedyMeshHeader getHeader() const;
+  };
+}
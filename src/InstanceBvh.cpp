@@ -0,0 +1,161 @@
+#include "InstanceBvh.h"
+#include "Trace.h"
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <glm/common.hpp>
+
+namespace cubik {
+  namespace {
+    constexpr float INF = std::numeric_limits<float>::infinity();
+    const Aabb EMPTY_BOX { glm::vec3(INF), glm::vec3(-INF) };
+
+    void grow(Aabb& box, const Aabb& other) {
+      box.min = glm::min(box.min, other.min);
+      box.max = glm::max(box.max, other.max);
+    }
+
+    void grow(Aabb& box, glm::vec3 point) {
+      box.min = glm::min(box.min, point);
+      box.max = glm::max(box.max, point);
+    }
+
+    float area(glm::vec3 min, glm::vec3 max) {
+      glm::vec3 extent = glm::max(max - min, glm::vec3(0.f));
+      return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+    }
+
+    glm::vec3 center(const Aabb& box) {
+      return (box.min + box.max) * 0.5f;
+    }
+  }
+
+  bool InstanceBvh::update(std::span<const Aabb> bounds) {
+    if (bounds.size() == _order.size() && !_nodes.empty()) {
+      refit(bounds);
+      if (_cost <= _builtCost * REBUILD_COST_RATIO) return false;
+    }
+    build(bounds);
+    return true;
+  }
+
+  void InstanceBvh::build(std::span<const Aabb> bounds) {
+    CUBIK_TRACE_ZONE("InstanceBvh::build");
+    _nodes.clear();
+    _order.resize(bounds.size());
+    std::iota(_order.begin(), _order.end(), 0);
+    if (bounds.empty()) {
+      _cost = _builtCost = 0;
+      return;
+    }
+
+    _nodes.reserve(2 * bounds.size());
+    _nodes.emplace_back();
+    split(0, 0, static_cast<int>(bounds.size()), 0, bounds);
+    _cost = _builtCost = calculateCost();
+  }
+
+  void InstanceBvh::refit(std::span<const Aabb> bounds) {
+    CUBIK_TRACE_ZONE("InstanceBvh::refit");
+    // Children are always stored after their parent
+    for (int i = static_cast<int>(_nodes.size()) - 1; i >= 0; i--) {
+      BvhNode& node = _nodes[i];
+      Aabb box = EMPTY_BOX;
+      if (node.count > 0) {
+        for (int j = node.leftOrFirst; j < node.leftOrFirst + node.count; j++) {
+          grow(box, bounds[_order[j]]);
+        }
+      } else {
+        for (const BvhNode& child : { _nodes[node.leftOrFirst], _nodes[node.leftOrFirst + 1] }) {
+          grow(box, Aabb { child.min, child.max });
+        }
+      }
+      node.min = box.min;
+      node.max = box.max;
+    }
+    _cost = calculateCost();
+  }
+
+  void InstanceBvh::split(int nodeIndex, int first, int count, int depth, std::span<const Aabb> bounds) {
+    Aabb box = EMPTY_BOX, centers = EMPTY_BOX;
+    for (int i = first; i < first + count; i++) {
+      grow(box, bounds[_order[i]]);
+      grow(centers, center(bounds[_order[i]]));
+    }
+    _nodes[nodeIndex] = { box.min, first, box.max, count };
+    if (count <= 1 || depth + 1 >= MAX_DEPTH) return;
+
+    glm::vec3 extent = centers.max - centers.min;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+    // Every center is in the same spot, no split can separate them
+    if (extent[axis] <= 0.f) return;
+
+    struct Bin {
+      Aabb box = EMPTY_BOX;
+      int count = 0;
+    };
+    Bin bins[BIN_COUNT];
+    float scale = BIN_COUNT / extent[axis];
+    auto binOf = [&](int instance) {
+      return std::min(static_cast<int>((center(bounds[instance])[axis] - centers.min[axis]) * scale), BIN_COUNT - 1);
+    };
+    for (int i = first; i < first + count; i++) {
+      Bin& bin = bins[binOf(_order[i])];
+      grow(bin.box, bounds[_order[i]]);
+      bin.count++;
+    }
+
+    // Costs of splitting after each bin, sweeping from the right and then from the left
+    float rightCosts[BIN_COUNT];
+    Aabb right = EMPTY_BOX;
+    int rightCount = 0;
+    for (int i = BIN_COUNT - 1; i > 0; i--) {
+      grow(right, bins[i].box);
+      rightCount += bins[i].count;
+      rightCosts[i - 1] = rightCount > 0 ? area(right.min, right.max) * rightCount : 0.f;
+    }
+    int bestSplit = -1;
+    float bestCost = INF;
+    Aabb left = EMPTY_BOX;
+    int leftCount = 0;
+    for (int i = 0; i < BIN_COUNT - 1; i++) {
+      grow(left, bins[i].box);
+      leftCount += bins[i].count;
+      if (leftCount == 0 || leftCount == count) continue;
+      float cost = area(left.min, left.max) * leftCount + rightCosts[i];
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestSplit = i;
+      }
+    }
+
+    // Splitting costs a node visit, which pays off when it saves more instance visits than that
+    float leafCost = area(box.min, box.max) * count;
+    bool isLeafCheaper = bestCost + area(box.min, box.max) >= leafCost;
+    if (bestSplit < 0 || (count <= MAX_LEAF_SIZE && isLeafCheaper)) return;
+
+    auto middle = std::partition(_order.begin() + first, _order.begin() + first + count, [&](int instance) {
+      return binOf(instance) <= bestSplit;
+    });
+    int firstRight = static_cast<int>(middle - _order.begin());
+
+    int leftChild = static_cast<int>(_nodes.size());
+    _nodes[nodeIndex].leftOrFirst = leftChild;
+    _nodes[nodeIndex].count = 0;
+    _nodes.emplace_back();
+    _nodes.emplace_back();
+    split(leftChild, first, firstRight - first, depth + 1, bounds);
+    split(leftChild + 1, firstRight, first + count - firstRight, depth + 1, bounds);
+  }
+
+  float InstanceBvh::calculateCost() const {
+    float rootArea = area(_nodes[0].min, _nodes[0].max);
+    if (rootArea <= 0.f) return static_cast<float>(_order.size());
+
+    float cost = 0;
+    for (const BvhNode& node : _nodes) {
+      cost += area(node.min, node.max) / rootArea * (node.count > 0 ? node.count : 1);
+    }
+    return cost;
+  }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <span>
+#include <vector>
+#include <glm/vec3.hpp>
+#include "WorldQuery.h"
+
+namespace cubik {
+  // Mirrors BvhNode in the ray marchers. Siblings are next to each other, so inner nodes only point at the left one
+  struct BvhNode {
+    glm::vec3 min;
+    int leftOrFirst; // Left child of inner nodes, first instance of leaves
+    glm::vec3 max;
+    int count; // Instances in a leaf, 0 for inner nodes
+  };
+
+  // Top level of the instanced scene, over the instances' bounds. Small enough to rebuild on the CPU every frame,
+  // but refitting is cheaper while the instances only move a little
+  class InstanceBvh {
+  public:
+    static constexpr int MAX_DEPTH = 32; // The marchers' traversal stack holds this many nodes
+    static constexpr int MAX_LEAF_SIZE = 4;
+    static constexpr int BIN_COUNT = 12;
+    // A refitted tree is rebuilt once its cost grows this much over the cost it was built with
+    static constexpr float REBUILD_COST_RATIO = 1.5f;
+
+    // Refits when the instance count is the same and the tree hasn't degraded too much, rebuilds otherwise.
+    // Returns whether it rebuilt
+    bool update(std::span<const Aabb> bounds);
+    // Binned surface area heuristic over the centers of the bounds
+    void build(std::span<const Aabb> bounds);
+    // Keeps the tree and recomputes the node bounds from the leaves up
+    void refit(std::span<const Aabb> bounds);
+
+    // Expected nodes and instances a ray through the root visits, from the surface area heuristic
+    float getCost() const { return _cost; }
+    const std::vector<BvhNode>& getNodes() const { return _nodes; }
+    // Instances in leaf order, a leaf covers [leftOrFirst, leftOrFirst + count) of it
+    const std::vector<int>& getOrder() const { return _order; }
+
+  private:
+    std::vector<BvhNode> _nodes;
+    std::vector<int> _order;
+    float _cost {0};
+    float _builtCost {0};
+
+    void split(int nodeIndex, int first, int count, int depth, std::span<const Aabb> bounds);
+    float calculateCost() const;
+  };
+}
@@ -0,0 +1,194 @@
+#include "JobSystem.h"
+#include <algorithm>
+
+namespace cubik {
+  namespace {
+    // Which pool and queue the current thread belongs to. Threads outside any pool use queue 0
+    thread_local const JobSystem* currentSystem = nullptr;
+    thread_local int currentQueue = 0;
+
+    constexpr int BLOCKS_PER_THREAD = 4; // Some slack so stealing can even out uneven blocks
+  }
+
+  JobSystem& JobSystem::global() {
+    static JobSystem system(static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u)));
+    return system;
+  }
+
+  JobSystem::JobSystem(int threadCount) {
+    start_workers(threadCount);
+  }
+
+  JobSystem::~JobSystem() {
+    stop_workers();
+  }
+
+  void JobSystem::set_thread_count(int threadCount) {
+    stop_workers();
+    start_workers(threadCount);
+  }
+
+  void JobSystem::start_workers(int threadCount) {
+    threadCount = std::max(threadCount, 1);
+    for (int i = 0; i < threadCount; i++) {
+      _queues.push_back(std::make_unique<WorkerQueue>());
+    }
+    for (int i = 1; i < threadCount; i++) {
+      _workers.emplace_back(&JobSystem::worker_loop, this, i);
+    }
+  }
+
+  void JobSystem::stop_workers() {
+    {
+      std::lock_guard lock(_sleepMutex);
+      _isStopping = true;
+    }
+    _wakeUp.notify_all();
+    for (std::thread& worker : _workers) {
+      worker.join();
+    }
+    _workers.clear();
+    _queues.clear();
+    _isStopping = false;
+  }
+
+  void JobSystem::worker_loop(int queueIndex) {
+    currentSystem = this;
+    currentQueue = queueIndex;
+
+    while (!_isStopping) {
+      if (run_one(queueIndex)) continue;
+
+      std::unique_lock lock(_sleepMutex);
+      _wakeUp.wait(lock, [this]() { return _isStopping || _queuedJobs > 0; });
+    }
+  }
+
+  JobHandle JobSystem::submit(std::function<void()> work, const std::vector<JobHandle>& dependencies) {
+    auto job = std::make_shared<Job>();
+    job->work = std::move(work);
+    // Held until every dependency is registered, so one finishing meanwhile can't schedule the job early
+    job->pendingDependencies = static_cast<int>(dependencies.size()) + 1;
+
+    for (const JobHandle& dependency : dependencies) {
+      std::lock_guard lock(dependency->continuationsMutex);
+      if (dependency->isDone) {
+        job->pendingDependencies--;
+      } else {
+        dependency->continuations.push_back(job);
+      }
+    }
+
+    if (--job->pendingDependencies == 0) schedule(job);
+    return job;
+  }
+
+  void JobSystem::wait(const JobHandle& job) {
+    int queueIndex = currentSystem == this ? currentQueue : 0;
+    while (!job->isDone.load(std::memory_order_acquire)) {
+      if (!run_one(queueIndex)) std::this_thread::yield();
+    }
+  }
+
+  void JobSystem::schedule(JobHandle job) {
+    WorkerQueue& queue = *_queues[currentSystem == this ? currentQueue : 0];
+    {
+      std::lock_guard lock(queue.mutex);
+      queue.jobs.push_back(std::move(job));
+    }
+    {
+      // Taken so a worker between checking for jobs and sleeping can't miss the notification
+      std::lock_guard lock(_sleepMutex);
+      _queuedJobs++;
+    }
+    _wakeUp.notify_one();
+  }
+
+  bool JobSystem::run_one(int queueIndex) {
+    JobHandle job = pop_or_steal(queueIndex);
+    if (!job) return false;
+
+    _queuedJobs--;
+    job->work();
+    finish(*job);
+    return true;
+  }
+
+  JobHandle JobSystem::pop_or_steal(int queueIndex) {
+    {
+      WorkerQueue& own = *_queues[queueIndex];
+      std::lock_guard lock(own.mutex);
+      if (!own.jobs.empty()) {
+        JobHandle job = std::move(own.jobs.back());
+        own.jobs.pop_back();
+        return job;
+      }
+    }
+
+    for (size_t i = 1; i < _queues.size(); i++) {
+      WorkerQueue& victim = *_queues[(queueIndex + i) % _queues.size()];
+      std::lock_guard lock(victim.mutex);
+      if (!victim.jobs.empty()) {
+        JobHandle job = std::move(victim.jobs.front());
+        victim.jobs.pop_front();
+        return job;
+      }
+    }
+    return nullptr;
+  }
+
+  void JobSystem::finish(Job& job) {
+    std::vector<JobHandle> continuations;
+    {
+      std::lock_guard lock(job.continuationsMutex);
+      job.isDone.store(true, std::memory_order_release);
+      continuations.swap(job.continuations);
+    }
+
+    for (JobHandle& continuation : continuations) {
+      if (--continuation->pendingDependencies == 0) schedule(std::move(continuation));
+    }
+  }
+
+  void JobSystem::parallel_for(int count, int grainSize, const std::function<void(int begin, int end)>& body) {
+    if (count <= 0) return;
+
+    int blockCount = std::clamp(count / std::max(grainSize, 1), 1, get_thread_count() * BLOCKS_PER_THREAD);
+    if (blockCount == 1) {
+      body(0, count);
+      return;
+    }
+
+    std::vector<JobHandle> blocks;
+    blocks.reserve(blockCount);
+    for (int block = 0; block < blockCount; block++) {
+      int begin = static_cast<int>(static_cast<int64_t>(count) * block / blockCount);
+      int end = static_cast<int>(static_cast<int64_t>(count) * (block + 1) / blockCount);
+      blocks.push_back(submit([&body, begin, end]() { body(begin, end); }));
+    }
+    for (const JobHandle& block : blocks) {
+      wait(block);
+    }
+  }
+
+  void JobSystem::parallel_for(glm::ivec3 size, int grainSize, const std::function<void(glm::ivec3 begin, glm::ivec3 end)>& body) {
+    if (size.x <= 0 || size.y <= 0 || size.z <= 0) return;
+
+    // Whole z slices when they are small enough, rows of a slice otherwise
+    int sliceSize = size.x * size.y;
+    int rowsPerBlock = sliceSize <= grainSize ? size.y : std::max(grainSize / size.x, 1);
+    int blocksPerSlice = (size.y + rowsPerBlock - 1) / rowsPerBlock;
+
+    parallel_for(size.z * blocksPerSlice, std::max(grainSize / (rowsPerBlock * size.x), 1), [&](int begin, int end) {
+      if (blocksPerSlice == 1) {
+        body(glm::ivec3(0, 0, begin), glm::ivec3(size.x, size.y, end));
+        return;
+      }
+      for (int block = begin; block < end; block++) {
+        int z = block / blocksPerSlice;
+        int y = (block % blocksPerSlice) * rowsPerBlock;
+        body(glm::ivec3(0, y, z), glm::ivec3(size.x, std::min(y + rowsPerBlock, size.y), z + 1));
+      }
+    });
+  }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <glm/vec3.hpp>
+
+namespace cubik {
+  // Cells per block for loops that do a few operations per voxel
+  constexpr int LOADER_GRAIN_SIZE = 1 << 16;
+
+  struct Job;
+  using JobHandle = std::shared_ptr<Job>;
+
+  struct Job {
+    std::function<void()> work;
+    std::atomic<int> pendingDependencies {0};
+    std::atomic<bool> isDone {false};
+    std::mutex continuationsMutex;
+    std::vector<JobHandle> continuations; // Jobs waiting on this one
+  };
+
+  // Work-stealing thread pool shared by the loaders and world builders. Every worker has its own queue, takes its
+  // newest job first and steals the oldest jobs of the others when it runs out. Threads waiting on a job run other
+  // jobs in the meantime, so jobs can wait on the jobs they spawn
+  class JobSystem {
+  public:
+    // Shared by everything on the CPU side. Starts with one thread per core
+    static JobSystem& global();
+
+    explicit JobSystem(int threadCount);
+    ~JobSystem();
+
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    // Threads running jobs, counting the one waiting on them, so 1 runs everything on the waiting thread.
+    // Has to be called while no jobs are in flight
+    void set_thread_count(int threadCount);
+    int get_thread_count() const { return static_cast<int>(_queues.size()); }
+
+    // The job only starts once all of its dependencies are done
+    JobHandle submit(std::function<void()> work, const std::vector<JobHandle>& dependencies = {});
+    void wait(const JobHandle& job);
+
+    // Splits [0, count) into ranges of at least grainSize and waits for all of them
+    void parallel_for(int count, int grainSize, const std::function<void(int begin, int end)>& body);
+    // Splits the box along z, then y, into blocks of roughly grainSize cells and waits for all of them
+    void parallel_for(glm::ivec3 size, int grainSize, const std::function<void(glm::ivec3 begin, glm::ivec3 end)>& body);
+
+  private:
+    struct WorkerQueue {
+      std::mutex mutex;
+      std::deque<JobHandle> jobs;
+    };
+
+    // Queue 0 takes jobs submitted from outside the pool, the others belong to a worker thread each
+    std::vector<std::unique_ptr<WorkerQueue>> _queues;
+    std::vector<std::thread> _workers;
+    std::atomic<int> _queuedJobs {0};
+    std::atomic<bool> _isStopping {false};
+    std::mutex _sleepMutex;
+    std::condition_variable _wakeUp;
+
+    void start_workers(int threadCount);
+    void stop_workers();
+    void worker_loop(int queueIndex);
+    void schedule(JobHandle job);
+    bool run_one(int queueIndex);
+    JobHandle pop_or_steal(int queueIndex);
+    void finish(Job& job);
+  };
+}
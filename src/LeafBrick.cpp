@@ -0,0 +1,52 @@
+#include "LeafBrick.h"
+#include "Morton.h"
+#include <algorithm>
+#include <bit>
+
+namespace cubik {
+  void encodeLeafBrick(std::span<const int, BRICK_VOLUME> voxels, std::vector<uint32_t>& words) {
+    uint32_t occupancy[LEAF_BRICK_OCCUPANCY_WORDS] {};
+    std::vector<uint8_t> materials;
+    for (int code = 0; code < BRICK_VOLUME; code++) {
+      glm::ivec3 position = mortonDecode(code);
+      int value = voxels[brickIndex(position.x, position.y, position.z)];
+      if (value == 0) continue;
+      occupancy[code / 32] |= 1u << (code % 32);
+      materials.push_back(static_cast<uint8_t>(value));
+    }
+
+    bool isSingleMaterial = std::all_of(materials.begin(), materials.end(), [&](uint8_t material) { return material == materials[0]; });
+    words.push_back(isSingleMaterial ? (materials.empty() ? 0 : materials[0]) : LEAF_BRICK_HAS_MATERIALS_BIT);
+    words.insert(words.end(), std::begin(occupancy), std::end(occupancy));
+    if (isSingleMaterial) return;
+
+    size_t first = words.size();
+    words.resize(first + (materials.size() + 3) / 4);
+    for (size_t i = 0; i < materials.size(); i++) {
+      words[first + i / 4] |= static_cast<uint32_t>(materials[i]) << (8 * (i % 4));
+    }
+  }
+
+  WorldBox findLeafBrickBox(const uint32_t* brick, glm::ivec3 position) {
+    const uint32_t* occupancy = brick + 1;
+    auto code = static_cast<int>(mortonEncode(position));
+    uint32_t word = occupancy[code / 32];
+
+    if (word & (1u << (code % 32))) {
+      if (!(brick[0] & LEAF_BRICK_HAS_MATERIALS_BIT)) return { position, 1, static_cast<int>(brick[0] & LEAF_BRICK_MATERIAL_MASK) };
+
+      // Zero suppressed, the material's index is the number of solid voxels before this one
+      int index = std::popcount(word & ((1u << (code % 32)) - 1));
+      for (int i = 0; i < code / 32; i++) {
+        index += std::popcount(occupancy[i]);
+      }
+      const uint32_t* materials = occupancy + LEAF_BRICK_OCCUPANCY_WORDS;
+      return { position, 1, static_cast<int>((materials[index / 4] >> (8 * (index % 4))) & 0xFF) };
+    }
+
+    int size = 1;
+    if ((occupancy[code / 64 * 2] | occupancy[code / 64 * 2 + 1]) == 0) size = 4;
+    else if (((word >> (code % 32 & ~7)) & 0xFF) == 0) size = 2;
+    return { position & ~(size - 1), size, 0 };
+  }
+}
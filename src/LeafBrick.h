@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+#include "VoxelSource.h"
+#include "World.h"
+
+namespace cubik {
+  // A BRICK_SIZE node of the octree stored as one compressed payload instead of its subtree. A header word, the
+  // occupancy in Morton order, so every aligned box of the brick is a contiguous range of bits, then the material
+  // of each solid voxel in the same order, a byte each, unless they all share the header's
+  constexpr int LEAF_BRICK_OCCUPANCY_WORDS = BRICK_VOLUME / 32;
+  constexpr uint32_t LEAF_BRICK_MATERIAL_MASK = 0xFF; // Of the header, the material of every solid voxel
+  constexpr uint32_t LEAF_BRICK_HAS_MATERIALS_BIT = 1u << 8; // Set when the materials follow the occupancy instead
+
+  // Appends the brick's words. Voxels are in brickIndex order
+  void encodeLeafBrick(std::span<const int, BRICK_VOLUME> voxels, std::vector<uint32_t>& words);
+
+  // Biggest uniform box around the position the brick can tell without decoding, in the brick's voxels. Solid voxels
+  // come one at a time, empty space in aligned boxes of up to half the brick
+  WorldBox findLeafBrickBox(const uint32_t* brick, glm::ivec3 position);
+}
@@ -0,0 +1,74 @@
+#include "MappedFile.h"
+#include "spdlog/spdlog.h"
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace cubik {
+#ifdef _WIN32
+  MappedFile::MappedFile(const std::filesystem::path& path) {
+    _file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER size;
+    if (_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(_file, &size) || size.QuadPart == 0) {
+      spdlog::error("Failed to open {} for mapping", path.string());
+      abort();
+    }
+    _size = static_cast<size_t>(size.QuadPart);
+
+    _mapping = CreateFileMappingW(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (_mapping) _data = static_cast<const std::byte*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!_data) {
+      spdlog::error("Failed to map {}", path.string());
+      abort();
+    }
+  }
+
+  MappedFile::~MappedFile() {
+    UnmapViewOfFile(_data);
+    CloseHandle(_mapping);
+    CloseHandle(_file);
+  }
+
+  void MappedFile::release(size_t offset, size_t length) const {
+    // Unlocking pages that aren't locked takes them out of the working set
+    VirtualUnlock(const_cast<std::byte*>(_data + offset), length);
+  }
+#else
+  MappedFile::MappedFile(const std::filesystem::path& path) {
+    _file = open(path.c_str(), O_RDONLY);
+    struct stat status {};
+    if (_file < 0 || fstat(_file, &status) != 0 || status.st_size == 0) {
+      spdlog::error("Failed to open {} for mapping", path.string());
+      abort();
+    }
+    _size = static_cast<size_t>(status.st_size);
+
+    void* data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, _file, 0);
+    if (data == MAP_FAILED) {
+      spdlog::error("Failed to map {}", path.string());
+      abort();
+    }
+    _data = static_cast<const std::byte*>(data);
+  }
+
+  MappedFile::~MappedFile() {
+    munmap(const_cast<std::byte*>(_data), _size);
+    close(_file);
+  }
+
+  void MappedFile::release(size_t offset, size_t length) const {
+    // madvise wants page aligned ranges, the partial pages at the ends are kept
+    size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t begin = (offset + pageSize - 1) / pageSize * pageSize;
+    size_t end = (offset + length) / pageSize * pageSize;
+    if (end > begin) madvise(const_cast<std::byte*>(_data + begin), end - begin, MADV_DONTNEED);
+  }
+#endif
+}
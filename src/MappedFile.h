@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+
+namespace cubik {
+  // Read only mapping of a whole file. Pages are read in when first touched, so only what is used takes memory
+  class MappedFile {
+  public:
+    explicit MappedFile(const std::filesystem::path& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const std::byte* data() const { return _data; }
+    size_t size() const { return _size; }
+
+    // Lets the OS drop the pages of a range that was read, so a pass over the file doesn't keep all of it resident
+    void release(size_t offset, size_t length) const;
+
+  private:
+    const std::byte* _data { nullptr };
+    size_t _size { 0 };
+#ifdef _WIN32
+    void* _file { nullptr };
+    void* _mapping { nullptr };
+#else
+    int _file { -1 };
+#endif
+  };
+}
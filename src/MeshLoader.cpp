@@ -0,0 +1,220 @@
+#include "MeshLoader.h"
+#include "spdlog/spdlog.h"
+#include "Trace.h"
+#include <cctype>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace cubik {
+  namespace {
+    enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+    struct PlyProperty {
+      std::string name;
+      PlyType type;
+      bool isList = false;
+      PlyType countType = PlyType::UInt8;
+    };
+
+    struct PlyElement {
+      std::string name;
+      size_t count;
+      std::vector<PlyProperty> properties;
+    };
+
+    PlyType parsePlyType(const std::string& name, const char *filename) {
+      if (name == "char" || name == "int8") return PlyType::Int8;
+      if (name == "uchar" || name == "uint8") return PlyType::UInt8;
+      if (name == "short" || name == "int16") return PlyType::Int16;
+      if (name == "ushort" || name == "uint16") return PlyType::UInt16;
+      if (name == "int" || name == "int32") return PlyType::Int32;
+      if (name == "uint" || name == "uint32") return PlyType::UInt32;
+      if (name == "float" || name == "float32") return PlyType::Float32;
+      if (name == "double" || name == "float64") return PlyType::Float64;
+      spdlog::error("Unknown PLY property type {} in {}", name, filename);
+      abort();
+    }
+
+    template<typename T>
+    double readBinary(std::istream& file) {
+      T value;
+      file.read(reinterpret_cast<char*>(&value), sizeof(T));
+      return static_cast<double>(value);
+    }
+
+    double readPlyValue(std::istream& file, PlyType type, bool isBinary) {
+      if (!isBinary) {
+        double value;
+        file >> value;
+        return value;
+      }
+
+      switch (type) {
+        case PlyType::Int8: return readBinary<int8_t>(file);
+        case PlyType::UInt8: return readBinary<uint8_t>(file);
+        case PlyType::Int16: return readBinary<int16_t>(file);
+        case PlyType::UInt16: return readBinary<uint16_t>(file);
+        case PlyType::Int32: return readBinary<int32_t>(file);
+        case PlyType::UInt32: return readBinary<uint32_t>(file);
+        case PlyType::Float32: return readBinary<float>(file);
+        case PlyType::Float64: return readBinary<double>(file);
+      }
+      return 0;
+    }
+
+    void validate(const Mesh& mesh, const char *filename) {
+      for (const glm::ivec3& triangle : mesh.triangles) {
+        for (int i = 0; i < 3; i++) {
+          if (triangle[i] < 0 || triangle[i] >= static_cast<int>(mesh.positions.size())) {
+            spdlog::error("Face of {} points to vertex {}, but there are only {}", filename, triangle[i], mesh.positions.size());
+            abort();
+          }
+        }
+      }
+      spdlog::info("Loaded {} vertices and {} triangles from {}", mesh.positions.size(), mesh.triangles.size(), filename);
+    }
+  }
+
+  Mesh loadObjFile(const char *filename) {
+    CUBIK_TRACE_ZONE("loadObjFile");
+    std::ifstream file(filename);
+    if (!file) {
+      spdlog::error("Failed to open file {}", filename);
+      abort();
+    }
+
+    Mesh mesh;
+    std::string line;
+    std::vector<int> face;
+    while (std::getline(file, line)) {
+      const char *cursor = line.c_str();
+      char *end;
+      if (line.starts_with("v ")) {
+        float x = std::strtof(cursor + 2, &end);
+        float y = std::strtof(end, &end);
+        float z = std::strtof(end, &end);
+        mesh.positions.emplace_back(x, y, z);
+      } else if (line.starts_with("f ")) {
+        face.clear();
+        cursor += 2;
+        while (true) {
+          long index = std::strtol(cursor, &end, 10);
+          if (end == cursor) break;
+          // Negative indices count back from the last vertex read
+          face.push_back(static_cast<int>(index < 0 ? static_cast<long>(mesh.positions.size()) + index : index - 1));
+          // Skips the texture coordinate and normal indices
+          cursor = end;
+          while (*cursor && !std::isspace(static_cast<unsigned char>(*cursor))) cursor++;
+        }
+        for (size_t i = 1; i + 1 < face.size(); i++) {
+          mesh.triangles.emplace_back(face[0], face[i], face[i + 1]);
+        }
+      }
+    }
+
+    validate(mesh, filename);
+    return mesh;
+  }
+
+  Mesh loadPlyFile(const char *filename) {
+    CUBIK_TRACE_ZONE("loadPlyFile");
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+      spdlog::error("Failed to open file {}", filename);
+      abort();
+    }
+
+    std::string line;
+    std::getline(file, line);
+    if (!line.starts_with("ply")) {
+      spdlog::error("{} is not a PLY file", filename);
+      abort();
+    }
+
+    bool isBinary = false;
+    std::vector<PlyElement> elements;
+    while (std::getline(file, line)) {
+      if (!line.empty() && line.back() == '\r') line.pop_back();
+      std::istringstream tokens(line);
+      std::string keyword;
+      tokens >> keyword;
+      if (keyword == "end_header") break;
+
+      if (keyword == "format") {
+        std::string format;
+        tokens >> format;
+        if (format == "binary_big_endian") {
+          spdlog::error("Big endian PLY files aren't supported, {}", filename);
+          abort();
+        }
+        isBinary = format == "binary_little_endian";
+      } else if (keyword == "element") {
+        PlyElement& element = elements.emplace_back();
+        tokens >> element.name >> element.count;
+      } else if (keyword == "property" && !elements.empty()) {
+        PlyProperty property;
+        std::string type;
+        tokens >> type;
+        if (type == "list") {
+          std::string countType;
+          tokens >> countType >> type;
+          property.isList = true;
+          property.countType = parsePlyType(countType, filename);
+        }
+        property.type = parsePlyType(type, filename);
+        tokens >> property.name;
+        elements.back().properties.push_back(property);
+      }
+    }
+
+    Mesh mesh;
+    std::vector<int> face;
+    for (const PlyElement& element : elements) {
+      bool isVertex = element.name == "vertex";
+      bool isFace = element.name == "face";
+      for (size_t i = 0; i < element.count; i++) {
+        glm::vec3 position(0);
+        face.clear();
+        for (const PlyProperty& property : element.properties) {
+          if (property.isList) {
+            int count = static_cast<int>(readPlyValue(file, property.countType, isBinary));
+            bool isIndices = isFace && (property.name == "vertex_indices" || property.name == "vertex_index");
+            for (int j = 0; j < count; j++) {
+              double value = readPlyValue(file, property.type, isBinary);
+              if (isIndices) face.push_back(static_cast<int>(value));
+            }
+            continue;
+          }
+
+          double value = readPlyValue(file, property.type, isBinary);
+          if (isVertex && property.name == "x") position.x = static_cast<float>(value);
+          if (isVertex && property.name == "y") position.y = static_cast<float>(value);
+          if (isVertex && property.name == "z") position.z = static_cast<float>(value);
+        }
+
+        if (isVertex) mesh.positions.push_back(position);
+        for (size_t j = 1; j + 1 < face.size(); j++) {
+          mesh.triangles.emplace_back(face[0], face[j], face[j + 1]);
+        }
+      }
+    }
+
+    if (!file) {
+      spdlog::error("{} ended before all of its elements were read", filename);
+      abort();
+    }
+    validate(mesh, filename);
+    return mesh;
+  }
+
+  Mesh loadMeshFile(const char *filename) {
+    auto extension = std::filesystem::path(filename).extension();
+    if (extension == ".obj") return loadObjFile(filename);
+    if (extension == ".ply") return loadPlyFile(filename);
+    spdlog::error("No mesh loader for {}", filename);
+    abort();
+  }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <vector>
+#include <glm/vec3.hpp>
+
+namespace cubik {
+  struct Mesh {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::ivec3> triangles; // Indices into positions
+  };
+
+  // Polygons are triangulated as fans. Only positions and faces are read
+  Mesh loadObjFile(const char *filename);
+  // ASCII and little endian binary
+  Mesh loadPlyFile(const char *filename);
+  // Picks the loader from the extension
+  Mesh loadMeshFile(const char *filename);
+}
@@ -0,0 +1,326 @@
+#include "MeshVoxelizer.h"
+#include "JobSystem.h"
+#include "Morton.h"
+#include "spdlog/spdlog.h"
+#include "Trace.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cfloat>
+#include <cmath>
+#include <mutex>
+#include <glm/glm.hpp>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace cubik {
+  namespace {
+    constexpr int TRIANGLE_GRAIN_SIZE = 1024;
+  }
+
+  // One lane per voxel of a brick row
+  static_assert(BRICK_SIZE == 8);
+
+  MeshVoxelizer::MeshVoxelizer(const Mesh& mesh, int resolution, bool isSolid)
+    : _resolution(resolution), _isSolid(isSolid), _tilesPerSide(resolution / BRICK_SIZE) {
+    CUBIK_TRACE_ZONE("MeshVoxelizer");
+    if (resolution < BRICK_SIZE || !std::has_single_bit(static_cast<unsigned int>(resolution))) {
+      spdlog::error("Meshes can only be voxelized at power of two resolutions of at least {}, got {}", BRICK_SIZE, resolution);
+      abort();
+    }
+
+    // Uniform scale that fits the longest side of the mesh's bounds into the world
+    glm::vec3 minBounds(FLT_MAX), maxBounds(-FLT_MAX);
+    for (const glm::vec3& position : mesh.positions) {
+      minBounds = glm::min(minBounds, position);
+      maxBounds = glm::max(maxBounds, position);
+    }
+    glm::vec3 extent = maxBounds - minBounds;
+    float longestSide = std::max(extent.x, std::max(extent.y, extent.z));
+    float scale = longestSide > 0 ? resolution / longestSide : 1.f;
+
+    std::vector<std::pair<uint64_t, int>> brickBins;
+    std::vector<std::pair<int, int>> tileBins;
+    std::mutex binsMutex;
+    _triangles.resize(mesh.triangles.size());
+    JobSystem::global().parallel_for(static_cast<int>(mesh.triangles.size()), TRIANGLE_GRAIN_SIZE, [&](int begin, int end) {
+      std::vector<std::pair<uint64_t, int>> localBrickBins;
+      std::vector<std::pair<int, int>> localTileBins;
+      for (int i = begin; i < end; i++) {
+        glm::vec3 vertices[3];
+        for (int corner = 0; corner < 3; corner++) {
+          vertices[corner] = (mesh.positions[mesh.triangles[i][corner]] - minBounds) * scale;
+        }
+        const Triangle& triangle = _triangles[i] = setupTriangle(vertices, 1, resolution);
+        if (triangle.isDegenerate) continue;
+
+        // The same test against whole bricks keeps the bins of slanted triangles tight
+        Triangle brickTest = setupTriangle(vertices, BRICK_SIZE, resolution);
+        glm::ivec3 minBrick = triangle.minVoxel / BRICK_SIZE;
+        glm::ivec3 maxBrick = triangle.maxVoxel / BRICK_SIZE;
+        for (int z = minBrick.z; z <= maxBrick.z; z++) {
+          for (int y = minBrick.y; y <= maxBrick.y; y++) {
+            for (int x = minBrick.x; x <= maxBrick.x; x++) {
+              glm::ivec3 brick(x, y, z);
+              if (overlaps(brickTest, glm::vec3(brick * BRICK_SIZE))) localBrickBins.emplace_back(mortonEncode(brick), i);
+            }
+          }
+        }
+
+        // Triangles seen edge on from above never cross a column
+        if (!isSolid || triangle.normal.z == 0) continue;
+        for (int y = minBrick.y; y <= maxBrick.y; y++) {
+          for (int x = minBrick.x; x <= maxBrick.x; x++) {
+            localTileBins.emplace_back(x + y * _tilesPerSide, i);
+          }
+        }
+      }
+
+      std::lock_guard lock(binsMutex);
+      brickBins.insert(brickBins.end(), localBrickBins.begin(), localBrickBins.end());
+      tileBins.insert(tileBins.end(), localTileBins.begin(), localTileBins.end());
+    });
+
+    {
+      CUBIK_TRACE_ZONE("sortBins");
+      std::sort(brickBins.begin(), brickBins.end());
+      _brickTriangles.reserve(brickBins.size());
+      for (size_t i = 0; i < brickBins.size(); i++) {
+        if (i == 0 || brickBins[i].first != brickBins[i - 1].first) {
+          _brickCodes.push_back(brickBins[i].first);
+          _brickOffsets.push_back(i);
+        }
+        _brickTriangles.push_back(brickBins[i].second);
+      }
+      _brickOffsets.push_back(brickBins.size());
+
+      // Every tile gets an offset, there are only resolution / BRICK_SIZE squared of them
+      _tileOffsets.assign(static_cast<size_t>(_tilesPerSide) * _tilesPerSide + 1, 0);
+      for (const auto& [tile, triangle] : tileBins) {
+        _tileOffsets[tile + 1]++;
+      }
+      for (size_t i = 1; i < _tileOffsets.size(); i++) {
+        _tileOffsets[i] += _tileOffsets[i - 1];
+      }
+      _tileTriangles.resize(tileBins.size());
+      std::vector<size_t> tileEnds(_tileOffsets.begin(), _tileOffsets.end() - 1);
+      for (const auto& [tile, triangle] : tileBins) {
+        _tileTriangles[tileEnds[tile]++] = triangle;
+      }
+    }
+
+    spdlog::info("Binned {} triangles into {} surface bricks at {}^3", mesh.triangles.size(), _brickCodes.size(), resolution);
+  }
+
+  MeshVoxelizer::Triangle MeshVoxelizer::setupTriangle(const glm::vec3 (&vertices)[3], float boxSize, int resolution) {
+    Triangle triangle {};
+    for (int i = 0; i < 3; i++) {
+      triangle.vertices[i] = vertices[i];
+    }
+    glm::vec3 minVertex = glm::min(vertices[0], glm::min(vertices[1], vertices[2]));
+    glm::vec3 maxVertex = glm::max(vertices[0], glm::max(vertices[1], vertices[2]));
+    triangle.minVoxel = glm::clamp(glm::ivec3(glm::floor(minVertex)), glm::ivec3(0), glm::ivec3(resolution - 1));
+    triangle.maxVoxel = glm::clamp(glm::ivec3(glm::floor(maxVertex)), glm::ivec3(0), glm::ivec3(resolution - 1));
+
+    glm::vec3 edges[3] = { vertices[1] - vertices[0], vertices[2] - vertices[1], vertices[0] - vertices[2] };
+    glm::vec3 normal = glm::cross(edges[0], edges[1]);
+    triangle.normal = normal;
+    triangle.isDegenerate = normal == glm::vec3(0);
+
+    // The box corners furthest along and against the normal
+    glm::vec3 critical(normal.x > 0 ? boxSize : 0, normal.y > 0 ? boxSize : 0, normal.z > 0 ? boxSize : 0);
+    triangle.planeNear = glm::dot(normal, critical - vertices[0]);
+    triangle.planeFar = glm::dot(normal, glm::vec3(boxSize) - critical - vertices[0]);
+
+    // Edge normals point inwards in every projection, then get pushed out to the box corner that reaches furthest
+    float signX = normal.x >= 0 ? 1.f : -1.f;
+    float signY = normal.y >= 0 ? 1.f : -1.f;
+    float signZ = normal.z >= 0 ? 1.f : -1.f;
+    for (int i = 0; i < 3; i++) {
+      const glm::vec3& edge = edges[i];
+      const glm::vec3& vertex = vertices[i];
+
+      glm::vec3 xy(-edge.y * signZ, edge.x * signZ, 0);
+      xy.z = -(xy.x * vertex.x + xy.y * vertex.y) + std::max(0.f, boxSize * xy.x) + std::max(0.f, boxSize * xy.y);
+      glm::vec3 yz(-edge.z * signX, edge.y * signX, 0);
+      yz.z = -(yz.x * vertex.y + yz.y * vertex.z) + std::max(0.f, boxSize * yz.x) + std::max(0.f, boxSize * yz.y);
+      glm::vec3 zx(-edge.x * signY, edge.z * signY, 0);
+      zx.z = -(zx.x * vertex.z + zx.y * vertex.x) + std::max(0.f, boxSize * zx.x) + std::max(0.f, boxSize * zx.y);
+
+      triangle.edgesXy[i] = xy;
+      triangle.edgesYz[i] = yz;
+      triangle.edgesZx[i] = zx;
+    }
+    return triangle;
+  }
+
+  bool MeshVoxelizer::overlaps(const Triangle& triangle, glm::vec3 boxMin) {
+    float distance = glm::dot(triangle.normal, boxMin);
+    if ((distance + triangle.planeNear) * (distance + triangle.planeFar) > 0) return false;
+
+    for (int i = 0; i < 3; i++) {
+      const glm::vec3& xy = triangle.edgesXy[i];
+      const glm::vec3& yz = triangle.edgesYz[i];
+      const glm::vec3& zx = triangle.edgesZx[i];
+      if (xy.x * boxMin.x + xy.y * boxMin.y + xy.z < 0) return false;
+      if (yz.x * boxMin.y + yz.y * boxMin.z + yz.z < 0) return false;
+      if (zx.x * boxMin.z + zx.y * boxMin.x + zx.z < 0) return false;
+    }
+    return true;
+  }
+
+  int MeshVoxelizer::overlapRow(const Triangle& triangle, glm::ivec3 rowStart) {
+    auto y = static_cast<float>(rowStart.y);
+    auto z = static_cast<float>(rowStart.z);
+
+    // The yz projection is the same for the whole row
+    for (const glm::vec3& yz : triangle.edgesYz) {
+      if (yz.x * y + yz.y * z + yz.z < 0) return 0;
+    }
+    float rowDistance = triangle.normal.y * y + triangle.normal.z * z;
+
+#ifdef __AVX2__
+    __m256 x = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(rowStart.x)), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256 zero = _mm256_setzero_ps();
+    __m256 distance = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(triangle.normal.x), x), _mm256_set1_ps(rowDistance));
+    __m256 near = _mm256_add_ps(distance, _mm256_set1_ps(triangle.planeNear));
+    __m256 far = _mm256_add_ps(distance, _mm256_set1_ps(triangle.planeFar));
+    __m256 overlap = _mm256_cmp_ps(_mm256_mul_ps(near, far), zero, _CMP_LE_OQ);
+    for (int i = 0; i < 3; i++) {
+      const glm::vec3& xy = triangle.edgesXy[i];
+      const glm::vec3& zx = triangle.edgesZx[i];
+      __m256 xyEdge = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(xy.x), x), _mm256_set1_ps(xy.y * y + xy.z));
+      __m256 zxEdge = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(zx.y), x), _mm256_set1_ps(zx.x * z + zx.z));
+      overlap = _mm256_and_ps(overlap, _mm256_cmp_ps(xyEdge, zero, _CMP_GE_OQ));
+      overlap = _mm256_and_ps(overlap, _mm256_cmp_ps(zxEdge, zero, _CMP_GE_OQ));
+    }
+    return _mm256_movemask_ps(overlap);
+#else
+    int mask = 0;
+    for (int lane = 0; lane < BRICK_SIZE; lane++) {
+      auto x = static_cast<float>(rowStart.x + lane);
+      float distance = triangle.normal.x * x + rowDistance;
+      bool overlap = (distance + triangle.planeNear) * (distance + triangle.planeFar) <= 0;
+      for (int i = 0; i < 3; i++) {
+        const glm::vec3& xy = triangle.edgesXy[i];
+        const glm::vec3& zx = triangle.edgesZx[i];
+        overlap = overlap && xy.x * x + xy.y * y + xy.z >= 0 && zx.y * x + zx.x * z + zx.z >= 0;
+      }
+      mask |= overlap << lane;
+    }
+    return mask;
+#endif
+  }
+
+  bool MeshVoxelizer::crossZ(const Triangle& triangle, float x, float y, float& z) {
+    const glm::vec3& normal = triangle.normal;
+    if (normal.z == 0) return false;
+
+    // Counter clockwise seen from above
+    glm::vec3 a = triangle.vertices[0], b = triangle.vertices[1], c = triangle.vertices[2];
+    if (normal.z < 0) std::swap(b, c);
+    auto covers = [x, y](const glm::vec3& from, const glm::vec3& to) {
+      float edgeX = to.x - from.x, edgeY = to.y - from.y;
+      float side = edgeX * (y - from.y) - edgeY * (x - from.x);
+      // Of two triangles sharing an edge, only the one on its top left side gets the points on it
+      return side > 0 || (side == 0 && (edgeY < 0 || (edgeY == 0 && edgeX > 0)));
+    };
+    if (!covers(a, b) || !covers(b, c) || !covers(c, a)) return false;
+
+    const glm::vec3& origin = triangle.vertices[0];
+    z = origin.z - (normal.x * (x - origin.x) + normal.y * (y - origin.y)) / normal.z;
+    return true;
+  }
+
+  bool MeshVoxelizer::isInside(glm::ivec3 voxel) const {
+    glm::vec3 center = glm::vec3(voxel) + 0.5f;
+    size_t tile = voxel.x / BRICK_SIZE + static_cast<size_t>(voxel.y / BRICK_SIZE) * _tilesPerSide;
+    bool inside = false;
+    for (size_t i = _tileOffsets[tile]; i < _tileOffsets[tile + 1]; i++) {
+      float z;
+      if (crossZ(_triangles[_tileTriangles[i]], center.x, center.y, z) && z > center.z) inside = !inside;
+    }
+    return inside;
+  }
+
+  std::optional<int> MeshVoxelizer::fillBrick(glm::ivec3 origin, std::span<int, BRICK_VOLUME> voxels) const {
+    auto brick = std::lower_bound(_brickCodes.begin(), _brickCodes.end(), mortonEncode(origin / BRICK_SIZE));
+    if (brick == _brickCodes.end() || *brick != mortonEncode(origin / BRICK_SIZE)) {
+      return _isSolid && isInside(origin + BRICK_SIZE / 2) ? 1 : 0;
+    }
+
+    // A bit per voxel, rows along x for the surface and columns along z for the inside
+    std::array<uint8_t, BRICK_SIZE * BRICK_SIZE> surface {};
+    std::array<uint8_t, BRICK_SIZE * BRICK_SIZE> inside {};
+    size_t slot = brick - _brickCodes.begin();
+    for (size_t i = _brickOffsets[slot]; i < _brickOffsets[slot + 1]; i++) {
+      const Triangle& triangle = _triangles[_brickTriangles[i]];
+      glm::ivec3 first = glm::max(triangle.minVoxel - origin, glm::ivec3(0));
+      glm::ivec3 last = glm::min(triangle.maxVoxel - origin, glm::ivec3(BRICK_SIZE - 1));
+      int lanes = ((2 << last.x) - 1) & ~((1 << first.x) - 1);
+      for (int z = first.z; z <= last.z; z++) {
+        for (int y = first.y; y <= last.y; y++) {
+          surface[y + z * BRICK_SIZE] |= overlapRow(triangle, origin + glm::ivec3(0, y, z)) & lanes;
+        }
+      }
+    }
+
+    if (_isSolid) {
+      size_t tile = origin.x / BRICK_SIZE + static_cast<size_t>(origin.y / BRICK_SIZE) * _tilesPerSide;
+      for (size_t i = _tileOffsets[tile]; i < _tileOffsets[tile + 1]; i++) {
+        const Triangle& triangle = _triangles[_tileTriangles[i]];
+        // Crossings below the brick don't flip any of its voxels
+        if (triangle.maxVoxel.z < origin.z) continue;
+
+        glm::ivec3 first = glm::max(triangle.minVoxel - origin, glm::ivec3(0));
+        glm::ivec3 last = glm::min(triangle.maxVoxel - origin, glm::ivec3(BRICK_SIZE - 1));
+        for (int y = first.y; y <= last.y; y++) {
+          for (int x = first.x; x <= last.x; x++) {
+            float z;
+            if (!crossZ(triangle, origin.x + x + 0.5f, origin.y + y + 0.5f, z)) continue;
+            // Flips the voxels whose centers are below the crossing
+            float below = std::clamp(std::ceil(z - origin.z - 0.5f), 0.f, static_cast<float>(BRICK_SIZE));
+            inside[x + y * BRICK_SIZE] ^= (1 << static_cast<int>(below)) - 1;
+          }
+        }
+      }
+    }
+
+    int solidCount = 0;
+    for (int z = 0; z < BRICK_SIZE; z++) {
+      for (int y = 0; y < BRICK_SIZE; y++) {
+        for (int x = 0; x < BRICK_SIZE; x++) {
+          int solid = ((surface[y + z * BRICK_SIZE] >> x) | (inside[x + y * BRICK_SIZE] >> z)) & 1;
+          voxels[brickIndex(x, y, z)] = solid;
+          solidCount += solid;
+        }
+      }
+    }
+
+    if (solidCount == 0) return 0;
+    if (solidCount == BRICK_VOLUME) return 1;
+    return std::nullopt;
+  }
+
+  std::optional<int> MeshVoxelizer::classifyBox(glm::ivec3 origin, int size) const {
+    if (size < BRICK_SIZE || origin.x % size != 0 || origin.y % size != 0 || origin.z % size != 0) return std::nullopt;
+
+    uint64_t first = mortonEncode(origin / BRICK_SIZE);
+    uint64_t bricks = static_cast<uint64_t>(size / BRICK_SIZE) * (size / BRICK_SIZE) * (size / BRICK_SIZE);
+    auto surfaceBrick = std::lower_bound(_brickCodes.begin(), _brickCodes.end(), first);
+    if (surfaceBrick != _brickCodes.end() && *surfaceBrick < first + bricks) return std::nullopt;
+
+    // No surface in the box, so all of it is on the same side
+    return _isSolid && isInside(origin + size / 2) ? 1 : 0;
+  }
+
+  std::vector<glm::ivec3> MeshVoxelizer::getSurfaceBricks() const {
+    std::vector<glm::ivec3> origins;
+    origins.reserve(_brickCodes.size());
+    for (uint64_t code : _brickCodes) {
+      origins.push_back(mortonDecode(code) * BRICK_SIZE);
+    }
+    return origins;
+  }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <glm/vec3.hpp>
+#include "MeshLoader.h"
+#include "VoxelSource.h"
+
+namespace cubik {
+  // Conservative surface voxelization of a triangle mesh, scaled uniformly to fit a world of resolution voxels per
+  // side. Triangles are binned into the bricks they touch up front, in parallel, so each brick is filled from its own
+  // short list and the builders can fill bricks on as many threads as they like. Boxes no bin falls in are classified
+  // without looking at any triangle. Solid meshes also get their inside filled, from the parity of the surfaces above
+  // each voxel along z, which needs the mesh to be closed
+  class MeshVoxelizer : public VoxelSource {
+  public:
+    MeshVoxelizer(const Mesh& mesh, int resolution, bool isSolid = false);
+
+    int getSize() const override { return _resolution; }
+    std::optional<int> fillBrick(glm::ivec3 origin, std::span<int, BRICK_VOLUME> voxels) const override;
+    // Only answers for octree aligned boxes, which cover one contiguous range of brick codes
+    std::optional<int> classifyBox(glm::ivec3 origin, int size) const override;
+
+    // Origins of the bricks some triangle touches, in Morton order
+    std::vector<glm::ivec3> getSurfaceBricks() const;
+
+  private:
+    // Triangle/box overlap as plane tests at the box's min corner, after Schwarz and Seidel's voxelizer: the box has
+    // to straddle the triangle's plane and overlap its projections onto xy, yz and zx. Edges are (a, b, c) for
+    // a u + b v + c >= 0 over the two axes of their projection
+    struct Triangle {
+      glm::vec3 vertices[3];
+      glm::ivec3 minVoxel, maxVoxel;
+      glm::vec3 normal;
+      float planeNear, planeFar;
+      glm::vec3 edgesXy[3];
+      glm::vec3 edgesYz[3];
+      glm::vec3 edgesZx[3];
+      bool isDegenerate;
+    };
+
+    int _resolution;
+    bool _isSolid;
+    std::vector<Triangle> _triangles;
+    // Triangles of each surface brick, sorted by the brick's Morton code
+    std::vector<uint64_t> _brickCodes;
+    std::vector<size_t> _brickOffsets;
+    std::vector<int> _brickTriangles;
+    // Triangles over each brick wide column of the xy plane, for the solid fill
+    int _tilesPerSide;
+    std::vector<size_t> _tileOffsets;
+    std::vector<int> _tileTriangles;
+
+    static Triangle setupTriangle(const glm::vec3 (&vertices)[3], float boxSize, int resolution);
+    static bool overlaps(const Triangle& triangle, glm::vec3 boxMin);
+    // Bit x is set when the triangle overlaps voxel rowStart + (x, 0, 0)
+    static int overlapRow(const Triangle& triangle, glm::ivec3 rowStart);
+    // Where the line through (x, y) parallel to z crosses the triangle, each shared edge counted once
+    static bool crossZ(const Triangle& triangle, float x, float y, float& z);
+
+    bool isInside(glm::ivec3 voxel) const;
+  };
+}
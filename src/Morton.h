@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/vec3.hpp>
+
+namespace cubik {
+  // Spaces the low 21 bits of x three apart
+  inline uint64_t spreadBits(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+  }
+
+  // Inverse of spreadBits, gathers every third bit
+  inline uint64_t compactBits(uint64_t x) {
+    x &= 0x1249249249249249;
+    x = (x | x >> 2) & 0x10c30c30c30c30c3;
+    x = (x | x >> 4) & 0x100f00f00f00f00f;
+    x = (x | x >> 8) & 0x1f0000ff0000ff;
+    x = (x | x >> 16) & 0x1f00000000ffff;
+    x = (x | x >> 32) & 0x1fffff;
+    return x;
+  }
+
+  // x takes the lowest bit of every triple, matching the child order of the octree. The cells of an aligned
+  // power of two box are then one contiguous range of codes
+  inline uint64_t mortonEncode(glm::ivec3 position) {
+    return spreadBits(position.x) | spreadBits(position.y) << 1 | spreadBits(position.z) << 2;
+  }
+
+  inline glm::ivec3 mortonDecode(uint64_t code) {
+    return glm::ivec3(static_cast<int>(compactBits(code)), static_cast<int>(compactBits(code >> 1)), static_cast<int>(compactBits(code >> 2)));
+  }
+}
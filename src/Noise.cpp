@@ -0,0 +1,116 @@
+#include "Noise.h"
+#include <cmath>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace cubik::noise {
+  namespace {
+    constexpr uint32_t PRIME_X = 0x8da6b343;
+    constexpr uint32_t PRIME_Y = 0xd8163841;
+    constexpr uint32_t PRIME_Z = 0xcb1ab31f;
+    constexpr uint32_t MIX = 0x5bd1e995;
+    constexpr float HASH_SCALE = 2.f / 16777215.f; // Low 24 bits of the hash to [0, 2]
+
+    // Lattice value in [-1, 1]
+    float lattice(int x, int y, int z, uint32_t seed) {
+      uint32_t hash = seed ^ (static_cast<uint32_t>(x) * PRIME_X) ^ (static_cast<uint32_t>(y) * PRIME_Y) ^ (static_cast<uint32_t>(z) * PRIME_Z);
+      hash = (hash ^ (hash >> 13)) * MIX;
+      hash ^= hash >> 15;
+      return static_cast<float>(hash & 0xffffff) * HASH_SCALE - 1.f;
+    }
+
+    float smooth(float t) {
+      return t * t * (3.f - 2.f * t);
+    }
+
+    float lerp(float a, float b, float t) {
+      return a + (b - a) * t;
+    }
+
+    float value_noise(float x, float y, float z, uint32_t seed) {
+      float floorX = std::floor(x), floorY = std::floor(y), floorZ = std::floor(z);
+      int ix = static_cast<int>(floorX), iy = static_cast<int>(floorY), iz = static_cast<int>(floorZ);
+      float u = smooth(x - floorX), v = smooth(y - floorY), w = smooth(z - floorZ);
+
+      float x00 = lerp(lattice(ix, iy, iz, seed), lattice(ix + 1, iy, iz, seed), u);
+      float x10 = lerp(lattice(ix, iy + 1, iz, seed), lattice(ix + 1, iy + 1, iz, seed), u);
+      float x01 = lerp(lattice(ix, iy, iz + 1, seed), lattice(ix + 1, iy, iz + 1, seed), u);
+      float x11 = lerp(lattice(ix, iy + 1, iz + 1, seed), lattice(ix + 1, iy + 1, iz + 1, seed), u);
+      return lerp(lerp(x00, x10, v), lerp(x01, x11, v), w);
+    }
+
+#ifdef __AVX2__
+    __m256 lattice8(__m256i x, __m256i y, __m256i z, __m256i seed) {
+      __m256i hash = _mm256_xor_si256(seed, _mm256_mullo_epi32(x, _mm256_set1_epi32(static_cast<int>(PRIME_X))));
+      hash = _mm256_xor_si256(hash, _mm256_mullo_epi32(y, _mm256_set1_epi32(static_cast<int>(PRIME_Y))));
+      hash = _mm256_xor_si256(hash, _mm256_mullo_epi32(z, _mm256_set1_epi32(static_cast<int>(PRIME_Z))));
+      hash = _mm256_mullo_epi32(_mm256_xor_si256(hash, _mm256_srli_epi32(hash, 13)), _mm256_set1_epi32(static_cast<int>(MIX)));
+      hash = _mm256_xor_si256(hash, _mm256_srli_epi32(hash, 15));
+      __m256 value = _mm256_cvtepi32_ps(_mm256_and_si256(hash, _mm256_set1_epi32(0xffffff)));
+      return _mm256_sub_ps(_mm256_mul_ps(value, _mm256_set1_ps(HASH_SCALE)), _mm256_set1_ps(1.f));
+    }
+
+    __m256 smooth8(__m256 t) {
+      return _mm256_mul_ps(_mm256_mul_ps(t, t), _mm256_sub_ps(_mm256_set1_ps(3.f), _mm256_add_ps(t, t)));
+    }
+
+    __m256 lerp8(__m256 a, __m256 b, __m256 t) {
+      return _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), t));
+    }
+
+    __m256 value_noise8(__m256 x, __m256 y, __m256 z, __m256i seed) {
+      __m256 floorX = _mm256_floor_ps(x), floorY = _mm256_floor_ps(y), floorZ = _mm256_floor_ps(z);
+      __m256i ix = _mm256_cvttps_epi32(floorX), iy = _mm256_cvttps_epi32(floorY), iz = _mm256_cvttps_epi32(floorZ);
+      __m256 u = smooth8(_mm256_sub_ps(x, floorX)), v = smooth8(_mm256_sub_ps(y, floorY)), w = smooth8(_mm256_sub_ps(z, floorZ));
+      __m256i one = _mm256_set1_epi32(1);
+      __m256i ix1 = _mm256_add_epi32(ix, one), iy1 = _mm256_add_epi32(iy, one), iz1 = _mm256_add_epi32(iz, one);
+
+      __m256 x00 = lerp8(lattice8(ix, iy, iz, seed), lattice8(ix1, iy, iz, seed), u);
+      __m256 x10 = lerp8(lattice8(ix, iy1, iz, seed), lattice8(ix1, iy1, iz, seed), u);
+      __m256 x01 = lerp8(lattice8(ix, iy, iz1, seed), lattice8(ix1, iy, iz1, seed), u);
+      __m256 x11 = lerp8(lattice8(ix, iy1, iz1, seed), lattice8(ix1, iy1, iz1, seed), u);
+      return lerp8(lerp8(x00, x10, v), lerp8(x01, x11, v), w);
+    }
+#endif
+  }
+
+  float fbm(float x, float y, float z, int octaves, uint32_t seed) {
+    float sum = 0, amplitude = 1, totalAmplitude = 0;
+    for (int octave = 0; octave < octaves; octave++) {
+      sum += amplitude * value_noise(x, y, z, seed + octave);
+      totalAmplitude += amplitude;
+      x *= 2; y *= 2; z *= 2;
+      amplitude *= 0.5f;
+    }
+    return sum / totalAmplitude;
+  }
+
+  void fbm(const float x[LANES], float y, float z, int octaves, uint32_t seed, float out[LANES]) {
+#ifdef __AVX2__
+    __m256 px = _mm256_loadu_ps(x), py = _mm256_set1_ps(y), pz = _mm256_set1_ps(z);
+    __m256 sum = _mm256_setzero_ps();
+    float amplitude = 1, totalAmplitude = 0;
+    for (int octave = 0; octave < octaves; octave++) {
+      __m256i octaveSeed = _mm256_set1_epi32(static_cast<int>(seed + octave));
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(amplitude), value_noise8(px, py, pz, octaveSeed)));
+      totalAmplitude += amplitude;
+      px = _mm256_add_ps(px, px); py = _mm256_add_ps(py, py); pz = _mm256_add_ps(pz, pz);
+      amplitude *= 0.5f;
+    }
+    _mm256_storeu_ps(out, _mm256_div_ps(sum, _mm256_set1_ps(totalAmplitude)));
+#else
+    for (int lane = 0; lane < LANES; lane++) {
+      out[lane] = fbm(x[lane], y, z, octaves, seed);
+    }
+#endif
+  }
+
+  bool is_vectorized() {
+#ifdef __AVX2__
+    return true;
+#else
+    return false;
+#endif
+  }
+}
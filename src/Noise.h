@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+
+// Fractal value noise for the procedural sources. Evaluates 8 points at once, along a brick row, with AVX2 when
+// the build enables it and with the same math one lane at a time otherwise, so both give the same worlds
+namespace cubik::noise {
+  constexpr int LANES = 8;
+
+  // Sums octaves of value noise, each at twice the frequency and half the amplitude of the last. In [-1, 1]
+  void fbm(const float x[LANES], float y, float z, int octaves, uint32_t seed, float out[LANES]);
+  float fbm(float x, float y, float z, int octaves, uint32_t seed);
+
+  // Whether fbm runs 8 lanes wide, for the benchmarks
+  bool is_vectorized();
+}
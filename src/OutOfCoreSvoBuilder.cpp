@@ -0,0 +1,341 @@
+#include "OutOfCoreSvoBuilder.h"
+#include "spdlog/spdlog.h"
+#include "Trace.h"
+#include "Morton.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <queue>
+
+namespace cubik {
+  namespace {
+    constexpr int MAX_DEPTH = 21; // Three coordinates of this many bits fill a 64 bit Morton code
+    constexpr int RADIX_BITS = 8;
+    constexpr int RADIX_BUCKETS = 1 << RADIX_BITS;
+    constexpr size_t OUTPUT_BUFFER_NODES = 1 << 16;
+    constexpr size_t MIN_MERGE_BUFFER = 1 << 12; // Voxels read from each run at once, even if it goes over budget
+    constexpr size_t MAX_MERGE_FAN_IN = 64; // Runs open at once, more are merged in several passes
+  }
+
+  struct OutOfCoreSvoBuilder::RunReader {
+    std::ifstream file;
+    std::vector<MortonVoxel> buffer;
+    size_t count = 0;
+    size_t position = 0;
+
+    bool refill() {
+      file.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(buffer.size() * sizeof(MortonVoxel)));
+      count = static_cast<size_t>(file.gcount()) / sizeof(MortonVoxel);
+      position = 0;
+      return count > 0;
+    }
+
+    bool advance() {
+      return ++position < count || refill();
+    }
+
+    const MortonVoxel& current() const {
+      return buffer[position];
+    }
+  };
+
+  OutOfCoreSvoBuilder::OutOfCoreSvoBuilder(int worldSize, std::filesystem::path outputPath, size_t memoryBudget)
+    : _worldSize(worldSize), _depth(std::countr_zero(static_cast<unsigned int>(worldSize))), _outputPath(std::move(outputPath)),
+      _memoryBudget(memoryBudget), _runCapacity(std::max<size_t>(memoryBudget / (2 * sizeof(MortonVoxel)), 1)), _runCount(0), _nextNodeIndex(1) {
+    if (worldSize < 2 || !std::has_single_bit(static_cast<unsigned int>(worldSize)) || _depth > MAX_DEPTH) {
+      spdlog::error("Out of core builds need a power of two size between 2 and {}, got {}", 1 << MAX_DEPTH, worldSize);
+      abort();
+    }
+  }
+
+  OutOfCoreSvoBuilder::~OutOfCoreSvoBuilder() {
+    for (const auto& path : _runPaths) {
+      std::error_code error;
+      std::filesystem::remove(path, error);
+    }
+  }
+
+  void OutOfCoreSvoBuilder::add(glm::ivec3 position, int value) {
+    if (value == 0) return;
+    if (position.x < 0 || position.y < 0 || position.z < 0 || position.x >= _worldSize || position.y >= _worldSize || position.z >= _worldSize) {
+      spdlog::error("Voxel ({}, {}, {}) is outside of the {} world", position.x, position.y, position.z, _worldSize);
+      abort();
+    }
+
+    if (_voxels.capacity() == 0) _voxels.reserve(_runCapacity);
+    _voxels.push_back({ mortonEncode(position), value });
+    if (_voxels.size() == _runCapacity) spillRun();
+  }
+
+  void OutOfCoreSvoBuilder::addSource(const VoxelSource& source) {
+    CUBIK_TRACE_ZONE("OutOfCoreSvoBuilder::addSource");
+    if (source.getSize() != _worldSize) {
+      spdlog::error("Source of size {} doesn't match the {} world", source.getSize(), _worldSize);
+      abort();
+    }
+    addBox(source, glm::ivec3(0), _worldSize);
+  }
+
+  void OutOfCoreSvoBuilder::addBox(const VoxelSource& source, glm::ivec3 position, int size) {
+    std::optional<int> uniform = source.classifyBox(position, size);
+    if (size == BRICK_SIZE && !uniform) {
+      std::array<int, BRICK_VOLUME> brick;
+      if (std::optional<int> brickValue = source.fillBrick(position, brick)) {
+        uniform = brickValue;
+      } else {
+        for (int z = 0; z < BRICK_SIZE; z++) {
+          for (int y = 0; y < BRICK_SIZE; y++) {
+            for (int x = 0; x < BRICK_SIZE; x++) {
+              add(position + glm::ivec3(x, y, z), brick[brickIndex(x, y, z)]);
+            }
+          }
+        }
+        return;
+      }
+    }
+
+    if (uniform) {
+      if (*uniform == 0) return;
+      for (int z = 0; z < size; z++) {
+        for (int y = 0; y < size; y++) {
+          for (int x = 0; x < size; x++) {
+            add(position + glm::ivec3(x, y, z), *uniform);
+          }
+        }
+      }
+      return;
+    }
+
+    int halfSize = size / 2;
+    for (int i = 0; i < 8; ++i) {
+      glm::ivec3 offset((i & 1) ? halfSize : 0, (i & 2) ? halfSize : 0, (i & 4) ? halfSize : 0);
+      addBox(source, position + offset, halfSize);
+    }
+  }
+
+  void OutOfCoreSvoBuilder::sortVoxels() {
+    CUBIK_TRACE_ZONE("OutOfCoreSvoBuilder::sortVoxels");
+    // Radix sort, linear in the voxels and stable so later voxels stay after earlier ones at the same position
+    _sortScratch.resize(_voxels.size());
+    for (int shift = 0; shift < 3 * _depth; shift += RADIX_BITS) {
+      std::array<size_t, RADIX_BUCKETS> offsets {};
+      for (const MortonVoxel& voxel : _voxels) {
+        offsets[(voxel.code >> shift) & (RADIX_BUCKETS - 1)]++;
+      }
+      size_t sum = 0;
+      for (size_t& offset : offsets) {
+        size_t count = offset;
+        offset = sum;
+        sum += count;
+      }
+      for (const MortonVoxel& voxel : _voxels) {
+        _sortScratch[offsets[(voxel.code >> shift) & (RADIX_BUCKETS - 1)]++] = voxel;
+      }
+      _voxels.swap(_sortScratch);
+    }
+  }
+
+  std::filesystem::path OutOfCoreSvoBuilder::nextRunPath() {
+    std::filesystem::path path = _outputPath;
+    path += ".run" + std::to_string(_runCount++);
+    return path;
+  }
+
+  void OutOfCoreSvoBuilder::spillRun() {
+    sortVoxels();
+
+    CUBIK_TRACE_ZONE("OutOfCoreSvoBuilder::spillRun");
+    std::filesystem::path path = nextRunPath();
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(_voxels.data()), static_cast<std::streamsize>(_voxels.size() * sizeof(MortonVoxel)));
+    if (!file) {
+      spdlog::error("Failed to write the sorted run {}", path.string());
+      abort();
+    }
+    _runPaths.push_back(path);
+    _voxels.clear();
+  }
+
+  void OutOfCoreSvoBuilder::mergeRuns() {
+    CUBIK_TRACE_ZONE("OutOfCoreSvoBuilder::mergeRuns");
+    // The sort buffers aren't needed anymore, the budget goes to the runs' read buffers instead
+    std::vector<MortonVoxel>().swap(_voxels);
+    std::vector<MortonVoxel>().swap(_sortScratch);
+
+    // Consecutive runs are merged together, so voxels added later still come out after the earlier ones
+    while (_runPaths.size() > MAX_MERGE_FAN_IN) {
+      size_t bufferSize = std::max(_memoryBudget / ((MAX_MERGE_FAN_IN + 1) * sizeof(MortonVoxel)), MIN_MERGE_BUFFER);
+      std::vector<std::filesystem::path> mergedPaths;
+      for (size_t first = 0; first < _runPaths.size(); first += MAX_MERGE_FAN_IN) {
+        std::vector<std::filesystem::path> group(_runPaths.begin() + first, _runPaths.begin() + std::min(first + MAX_MERGE_FAN_IN, _runPaths.size()));
+        std::filesystem::path path = nextRunPath();
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        std::vector<MortonVoxel> merged;
+        merged.reserve(bufferSize);
+        auto writeMerged = [&]() {
+          file.write(reinterpret_cast<const char*>(merged.data()), static_cast<std::streamsize>(merged.size() * sizeof(MortonVoxel)));
+          merged.clear();
+        };
+        mergeGroup(group, bufferSize, [&](const MortonVoxel& voxel) {
+          merged.push_back(voxel);
+          if (merged.size() == bufferSize) writeMerged();
+        });
+        writeMerged();
+        if (!file) {
+          spdlog::error("Failed to write the merged run {}", path.string());
+          abort();
+        }
+        mergedPaths.push_back(path);
+      }
+      _runPaths = std::move(mergedPaths);
+    }
+
+    size_t bufferSize = std::max(_memoryBudget / (_runPaths.size() * sizeof(MortonVoxel)), MIN_MERGE_BUFFER);
+    mergeGroup(_runPaths, bufferSize, [&](const MortonVoxel& voxel) {
+      insert(voxel.code, voxel.value);
+    });
+    _runPaths.clear();
+  }
+
+  void OutOfCoreSvoBuilder::mergeGroup(const std::vector<std::filesystem::path>& paths, size_t bufferSize, const std::function<void(const MortonVoxel&)>& emit) {
+    // Ties go to the earlier run, so the value of the later one is emitted last and wins
+    using Head = std::pair<uint64_t, size_t>;
+    std::priority_queue<Head, std::vector<Head>, std::greater<>> heads;
+    std::vector<RunReader> runs(paths.size());
+    for (size_t i = 0; i < runs.size(); i++) {
+      runs[i].file.open(paths[i], std::ios::binary);
+      if (!runs[i].file) {
+        spdlog::error("Failed to open the sorted run {}", paths[i].string());
+        abort();
+      }
+      runs[i].buffer.resize(bufferSize);
+      if (runs[i].refill()) heads.emplace(runs[i].current().code, i);
+    }
+
+    while (!heads.empty()) {
+      size_t run = heads.top().second;
+      heads.pop();
+      emit(runs[run].current());
+      if (runs[run].advance()) heads.emplace(runs[run].current().code, run);
+    }
+
+    runs.clear();
+    for (const auto& path : paths) {
+      std::filesystem::remove(path);
+    }
+  }
+
+  size_t OutOfCoreSvoBuilder::finish() {
+    CUBIK_TRACE_ZONE("OutOfCoreSvoBuilder::finish");
+    beginBuild();
+    if (_runPaths.empty()) {
+      // Everything fit in one run, no need to go through the disk
+      sortVoxels();
+      for (const MortonVoxel& voxel : _voxels) {
+        insert(voxel.code, voxel.value);
+      }
+      std::vector<MortonVoxel>().swap(_voxels);
+      std::vector<MortonVoxel>().swap(_sortScratch);
+    } else {
+      if (!_voxels.empty()) spillRun();
+      spdlog::info("Merging {} sorted runs", _runPaths.size());
+      mergeRuns();
+    }
+    endBuild();
+
+    spdlog::info("Wrote {} nodes to {}", _nextNodeIndex, _outputPath.string());
+    return _nextNodeIndex;
+  }
+
+  void OutOfCoreSvoBuilder::beginBuild() {
+    _output.open(_outputPath, std::ios::binary | std::ios::trunc);
+    if (!_output) {
+      spdlog::error("Failed to open {}", _outputPath.string());
+      abort();
+    }
+    _output.write(reinterpret_cast<const char*>(&_worldSize), sizeof(_worldSize));
+    // Room for the root, which is only done once every other node is written
+    LinearOctreeNode root {};
+    _output.write(reinterpret_cast<const char*>(&root), sizeof(root));
+
+    _outputBuffer.reserve(OUTPUT_BUFFER_NODES);
+    _pending.assign(_depth, PendingNode {});
+    _pending[0] = { 0, true, 0xFF, {} };
+    _nextNodeIndex = 1;
+  }
+
+  void OutOfCoreSvoBuilder::insert(uint64_t code, int value) {
+    // Codes come in order, so every pending node below the first one the voxel isn't in is done
+    int divergence = _depth;
+    for (int level = 1; level < _depth; level++) {
+      uint64_t prefix = code >> (3 * (_depth - level));
+      if (!_pending[level].isActive || _pending[level].prefix != prefix) {
+        divergence = level;
+        break;
+      }
+    }
+
+    for (int level = _depth - 1; level >= divergence; level--) {
+      if (_pending[level].isActive) flush(level);
+    }
+    for (int level = divergence; level < _depth; level++) {
+      _pending[level] = { code >> (3 * (_depth - level)), true, 0xFF, {} };
+    }
+    _pending[_depth - 1].children[code & 7] = value;
+  }
+
+  void OutOfCoreSvoBuilder::flush(int level) {
+    PendingNode& node = _pending[level];
+    PendingNode& parent = _pending[level - 1];
+    int slot = static_cast<int>(node.prefix & 7);
+    node.isActive = false;
+
+    // Same rule as SvoWorld::collapse, nodes of identical leaves become a leaf
+    bool isUniform = node.leafMask == 0xFF && std::all_of(std::begin(node.children), std::end(node.children), [&](int child) {
+      return child == node.children[0];
+    });
+    if (isUniform) {
+      parent.children[slot] = node.children[0];
+      return;
+    }
+
+    int index = _nextNodeIndex++;
+    _outputBuffer.push_back(linearize(node, index));
+    if (_outputBuffer.size() == OUTPUT_BUFFER_NODES) writeBufferedNodes();
+    parent.children[slot] = index;
+    parent.leafMask &= ~(1 << slot);
+  }
+
+  LinearOctreeNode OutOfCoreSvoBuilder::linearize(const PendingNode& node, int index) const {
+    LinearOctreeNode linear {
+      .LeafMask = node.leafMask
+    };
+    for (int i = 0; i < 8; i++) {
+      linear.childrenOffsets[i] = (node.leafMask & (1 << i)) ? node.children[i] : node.children[i] - index;
+    }
+    return linear;
+  }
+
+  void OutOfCoreSvoBuilder::writeBufferedNodes() {
+    _output.write(reinterpret_cast<const char*>(_outputBuffer.data()), static_cast<std::streamsize>(_outputBuffer.size() * sizeof(LinearOctreeNode)));
+    _outputBuffer.clear();
+  }
+
+  void OutOfCoreSvoBuilder::endBuild() {
+    for (int level = _depth - 1; level > 0; level--) {
+      if (_pending[level].isActive) flush(level);
+    }
+    writeBufferedNodes();
+
+    // The root is never collapsed, like in SvoWorld
+    LinearOctreeNode root = linearize(_pending[0], 0);
+    _output.seekp(sizeof(_worldSize));
+    _output.write(reinterpret_cast<const char*>(&root), sizeof(root));
+    _output.close();
+    if (!_output) {
+      spdlog::error("Failed to write {}", _outputPath.string());
+      abort();
+    }
+    std::vector<LinearOctreeNode>().swap(_outputBuffer);
+  }
+}
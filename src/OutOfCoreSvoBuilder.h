@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <vector>
+#include <glm/vec3.hpp>
+#include "SvoWorld.h"
+#include "VoxelSource.h"
+
+namespace cubik {
+  constexpr size_t OUT_OF_CORE_MEMORY_BUDGET = size_t(2) << 30;
+
+  // Builds a linearized SVO file from voxels streamed in any order, for worlds whose dense grid doesn't fit in memory.
+  // Voxels are sorted in Morton order in runs that spill to disk, then merged into a single bottom-up pass that writes
+  // every node as soon as its last child is done. The file holds the world size followed by the nodes, the same
+  // layout SvoWorld serializes to, so SvoWorld::load can read it back. Nodes come before their parents except for the
+  // root, which is always first, so offsets below the root are negative
+  class OutOfCoreSvoBuilder {
+  public:
+    // memoryBudget bounds the sort buffers, runs are written next to the output
+    OutOfCoreSvoBuilder(int worldSize, std::filesystem::path outputPath, size_t memoryBudget = OUT_OF_CORE_MEMORY_BUDGET);
+    ~OutOfCoreSvoBuilder();
+
+    // Empty voxels can be left out. When a position is added twice the last value wins
+    void add(glm::ivec3 position, int value);
+
+    // Adds the solid voxels of a source, skipping the boxes it classifies as empty
+    void addSource(const VoxelSource& source);
+
+    // Sorts whatever is left, builds the octree into the output and returns how many nodes it has
+    size_t finish();
+
+  private:
+    struct MortonVoxel {
+      uint64_t code;
+      int value;
+    };
+    struct RunReader;
+
+    // Node whose children are still being filled in. Leaf children hold their value, the others their node's index
+    struct PendingNode {
+      uint64_t prefix;
+      bool isActive;
+      int leafMask;
+      int children[8];
+    };
+
+    int _worldSize;
+    int _depth;
+    std::filesystem::path _outputPath;
+    size_t _memoryBudget;
+    std::vector<MortonVoxel> _voxels;
+    std::vector<MortonVoxel> _sortScratch;
+    size_t _runCapacity;
+    std::vector<std::filesystem::path> _runPaths;
+    size_t _runCount;
+
+    std::ofstream _output;
+    std::vector<LinearOctreeNode> _outputBuffer;
+    std::vector<PendingNode> _pending;
+    int _nextNodeIndex;
+
+    void sortVoxels();
+    std::filesystem::path nextRunPath();
+    void spillRun();
+    void mergeRuns();
+    // Streams the union of sorted runs in order to emit, then deletes them
+    void mergeGroup(const std::vector<std::filesystem::path>& paths, size_t bufferSize, const std::function<void(const MortonVoxel&)>& emit);
+
+    void beginBuild();
+    void insert(uint64_t code, int value);
+    void flush(int level);
+    LinearOctreeNode linearize(const PendingNode& node, int index) const;
+    void writeBufferedNodes();
+    void endBuild();
+    void addBox(const VoxelSource& source, glm::ivec3 position, int size);
+  };
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace cubik {
+  // Voxel values are indices into the palette, 0 being empty. Every world keeps them under PALETTE_SIZE
+  constexpr int PALETTE_SIZE = 256;
+
+  // RGBA8 colors, red in the low byte like MagicaVoxel's, so the shaders read them with unpackUnorm4x8
+  using Palette = std::array<uint32_t, PALETTE_SIZE>;
+
+  inline constexpr uint32_t packColor(uint8_t r, uint8_t g, uint8_t b, uint8_t a = 255) {
+    return r | g << 8 | b << 16 | static_cast<uint32_t>(a) << 24;
+  }
+
+  // Every material in the color the marchers used before there were materials, for worlds that don't bring a palette
+  inline Palette defaultPalette() {
+    Palette palette;
+    palette.fill(packColor(239, 71, 111));
+    return palette;
+  }
+}
@@ -0,0 +1,142 @@
+#include "PaletteBricks.h"
+#include "JobSystem.h"
+#include "Trace.h"
+#include <bitset>
+#include <cstring>
+#include <spdlog/spdlog.h>
+
+namespace cubik {
+  namespace {
+    using MaterialSet = std::bitset<PALETTE_SIZE>;
+
+    int bitsFor(size_t uniqueCount) {
+      for (int bits : PALETTE_BRICK_BITS) {
+        if (uniqueCount <= (size_t(1) << bits)) return bits;
+      }
+      return PALETTE_BRICK_BITS.back();
+    }
+
+    // Voxels of the brick, x fastest. The part of edge bricks outside the world is empty
+    template<typename Visit>
+    void visitBrick(const std::vector<int>& worldData, int worldSize, glm::ivec3 origin, Visit visit) {
+      for (int z = 0; z < BRICK_SIZE; z++) {
+        for (int y = 0; y < BRICK_SIZE; y++) {
+          for (int x = 0; x < BRICK_SIZE; x++) {
+            glm::ivec3 position = origin + glm::ivec3(x, y, z);
+            bool isInside = position.x < worldSize && position.y < worldSize && position.z < worldSize;
+            visit(brickIndex(x, y, z), isInside ? worldData[position.x + (position.y + position.z * worldSize) * worldSize] : 0);
+          }
+        }
+      }
+    }
+  }
+
+  // The first pass finds each brick's materials, which sizes it. The second packs the bricks at their offsets
+  PaletteBrickGrid::PaletteBrickGrid(const std::vector<int>& worldData, int worldSize)
+    : _bricksPerSide((worldSize + BRICK_SIZE - 1) / BRICK_SIZE), _worldSize(worldSize) {
+    CUBIK_TRACE_ZONE("PaletteBrickGrid");
+    int brickCount = _bricksPerSide * _bricksPerSide * _bricksPerSide;
+    auto brickOrigin = [&](int brick) {
+      return BRICK_SIZE * glm::ivec3(brick % _bricksPerSide, (brick / _bricksPerSide) % _bricksPerSide, brick / (_bricksPerSide * _bricksPerSide));
+    };
+    constexpr int grainSize = LOADER_GRAIN_SIZE / BRICK_VOLUME;
+
+    std::vector<MaterialSet> materials(brickCount);
+    JobSystem::global().parallel_for(brickCount, grainSize, [&](int begin, int end) {
+      for (int brick = begin; brick < end; brick++) {
+        visitBrick(worldData, worldSize, brickOrigin(brick), [&](int, int value) {
+          if (value < 0 || value >= PALETTE_SIZE) {
+            spdlog::error("Voxel value {} is outside the palette", value);
+            abort();
+          }
+          materials[brick].set(value);
+        });
+      }
+    });
+
+    _bricks.resize(brickCount);
+    uint32_t indexWords = 0, paletteBytes = 0;
+    for (int brick = 0; brick < brickCount; brick++) {
+      int bits = bitsFor(materials[brick].count());
+      _bricks[brick].indices = indexWords | static_cast<uint32_t>(bits) << PaletteBrick::BITS_SHIFT | (materials[brick].test(0) ? PaletteBrick::HAS_EMPTY_BIT : 0);
+      _bricks[brick].palette = paletteBytes;
+      indexWords += BRICK_VOLUME * bits / 32;
+      paletteBytes += static_cast<uint32_t>(materials[brick].count());
+    }
+    // Serialized, the indices start after the headers
+    if (2 * static_cast<size_t>(brickCount) + indexWords > PaletteBrick::OFFSET_MASK) {
+      spdlog::error("Palette bricks don't fit {} index words", indexWords);
+      abort();
+    }
+    _indices.resize(indexWords);
+    _palettes.resize(paletteBytes);
+
+    JobSystem::global().parallel_for(brickCount, grainSize, [&](int begin, int end) {
+      std::array<uint8_t, PALETTE_SIZE> localIndices;
+      for (int brick = begin; brick < end; brick++) {
+        // Ascending, so empty is local index 0 whenever the brick has it
+        uint8_t* palette = &_palettes[_bricks[brick].palette];
+        int uniqueCount = 0;
+        for (int value = 0; value < PALETTE_SIZE; value++) {
+          if (!materials[brick].test(value)) continue;
+          localIndices[value] = static_cast<uint8_t>(uniqueCount);
+          palette[uniqueCount++] = static_cast<uint8_t>(value);
+        }
+
+        int bits = _bricks[brick].bitsPerVoxel();
+        if (bits == 0) continue;
+        uint32_t* words = &_indices[_bricks[brick].indicesOffset()];
+        visitBrick(worldData, worldSize, brickOrigin(brick), [&](int voxel, int value) {
+          words[voxel * bits / 32] |= static_cast<uint32_t>(localIndices[value]) << (voxel * bits % 32);
+        });
+      }
+    });
+  }
+
+  int PaletteBrickGrid::get(glm::ivec3 position) const {
+    glm::ivec3 brickPosition = position / BRICK_SIZE;
+    const PaletteBrick& brick = _bricks[brickPosition.x + (brickPosition.y + brickPosition.z * _bricksPerSide) * _bricksPerSide];
+    int bits = brick.bitsPerVoxel();
+    if (bits == 0) return _palettes[brick.palette];
+
+    glm::ivec3 local = position % BRICK_SIZE;
+    int voxel = brickIndex(local.x, local.y, local.z);
+    uint32_t localIndex = (_indices[brick.indicesOffset() + voxel * bits / 32] >> (voxel * bits % 32)) & ((1u << bits) - 1);
+    return _palettes[brick.palette + localIndex];
+  }
+
+  size_t PaletteBrickGrid::calculateSerializedSize() const {
+    size_t paletteWords = (_palettes.size() + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+    return sizeof(PaletteBrick) * _bricks.size() + sizeof(uint32_t) * (_indices.size() + paletteWords);
+  }
+
+  // The offsets are rebased from the starts of their arrays to the start of the headers
+  void PaletteBrickGrid::serialize(void* target) const {
+    auto data = static_cast<char*>(target);
+    auto indicesStart = static_cast<uint32_t>(_bricks.size() * sizeof(PaletteBrick) / sizeof(uint32_t));
+    auto palettesStart = static_cast<uint32_t>(sizeof(uint32_t) * (indicesStart + _indices.size()));
+
+    auto headers = reinterpret_cast<PaletteBrick*>(data);
+    for (size_t brick = 0; brick < _bricks.size(); brick++) {
+      headers[brick].indices = _bricks[brick].indices + indicesStart;
+      headers[brick].palette = _bricks[brick].palette + palettesStart;
+    }
+    memcpy(data + sizeof(uint32_t) * indicesStart, _indices.data(), sizeof(uint32_t) * _indices.size());
+    memset(data + palettesStart, 0, calculateSerializedSize() - palettesStart);
+    memcpy(data + palettesStart, _palettes.data(), _palettes.size());
+  }
+
+  std::array<int, PALETTE_BRICK_BITS.size()> PaletteBrickGrid::getBitsHistogram() const {
+    std::array<int, PALETTE_BRICK_BITS.size()> histogram {};
+    for (const PaletteBrick& brick : _bricks) {
+      for (size_t i = 0; i < PALETTE_BRICK_BITS.size(); i++) {
+        if (PALETTE_BRICK_BITS[i] == brick.bitsPerVoxel()) histogram[i]++;
+      }
+    }
+    return histogram;
+  }
+
+  float PaletteBrickGrid::getBytesPerVoxel() const {
+    return static_cast<float>(calculateSerializedSize()) / (static_cast<float>(_worldSize) * _worldSize * _worldSize);
+  }
+}
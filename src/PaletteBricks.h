@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+#include <glm/vec3.hpp>
+#include "Palette.h"
+#include "VoxelSource.h"
+
+namespace cubik {
+  // Mirrors the brick headers naiveRayMarcher reads
+  struct PaletteBrick {
+    uint32_t indices; // Word of the packed indices in the low 27 bits, bits per voxel above, then whether 0 is local index 0
+    uint32_t palette; // Byte of the local palette, as material indices
+
+    static constexpr uint32_t OFFSET_MASK = (1u << 27) - 1;
+    static constexpr int BITS_SHIFT = 27;
+    static constexpr uint32_t HAS_EMPTY_BIT = 1u << 31;
+
+    int bitsPerVoxel() const { return (indices >> BITS_SHIFT) & 0xF; }
+    uint32_t indicesOffset() const { return indices & OFFSET_MASK; }
+    bool hasEmpty() const { return (indices & HAS_EMPTY_BIT) != 0; }
+  };
+
+  // Bits per voxel a brick can be packed with, the fewest that fit its unique values
+  constexpr std::array<int, 5> PALETTE_BRICK_BITS = { 0, 1, 2, 4, 8 };
+
+  // Grid of BRICK_SIZE bricks, each with its own palette of the materials it holds and its voxels packed as indices
+  // into that palette. Uniform bricks store no indices at all. Serialized as the brick headers, the packed indices
+  // and the local palettes back to back, with offsets from the start of the headers
+  class PaletteBrickGrid {
+  public:
+    PaletteBrickGrid(const std::vector<int>& worldData, int worldSize);
+
+    int get(glm::ivec3 position) const;
+
+    [[nodiscard]] size_t calculateSerializedSize() const;
+
+    void serialize(void* target) const;
+
+    // Bricks packed with each of PALETTE_BRICK_BITS
+    std::array<int, PALETTE_BRICK_BITS.size()> getBitsHistogram() const;
+
+    float getBytesPerVoxel() const;
+
+  private:
+    int _bricksPerSide;
+    int _worldSize;
+    std::vector<PaletteBrick> _bricks;
+    std::vector<uint32_t> _indices;
+    std::vector<uint8_t> _palettes;
+  };
+}
@@ -1,6 +1,9 @@
 #include <fstream>
 #include <vector>
+#include <cstring>
+#include <SDL.h>
 #include "Pipeline.h"
+#include "VulkanHelper.h"
 
 namespace vkutil {
   bool vkutil::load_shader_module(const char* filePath, VkDevice device, VkShaderModule* outShaderModule)
@@ -17,11 +20,15 @@ namespace vkutil {
     file.read((char*)buffer.data(), fileSize);
     file.close();
 
+    return create_shader_module(buffer, device, outShaderModule);
+  }
+
+  bool create_shader_module(std::span<const uint32_t> spirv, VkDevice device, VkShaderModule* outShaderModule) {
     VkShaderModuleCreateInfo createInfo = {
       .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
       .pNext = nullptr,
-      .codeSize = buffer.size() * sizeof(uint32_t),
-      .pCode = buffer.data()
+      .codeSize = spirv.size() * sizeof(uint32_t),
+      .pCode = spirv.data()
     };
 
     VkShaderModule shaderModule;
@@ -32,4 +39,83 @@ namespace vkutil {
     return true;
   }
 
+  std::string pipeline_cache_path(VkPhysicalDevice physicalDevice) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+    std::string uuid;
+    for (uint8_t byte : properties.pipelineCacheUUID) {
+      uuid += fmt::format("{:02x}", byte);
+    }
+    std::string fileName = fmt::format("pipeline-{}-{:x}.cache", uuid, properties.driverVersion);
+
+    // Next to the executable, so it's found whatever directory the app is started from
+    char* basePath = SDL_GetBasePath();
+    if (!basePath) return fileName;
+    std::string path = basePath + fileName;
+    SDL_free(basePath);
+    return path;
+  }
+
+  // Some drivers crash instead of rejecting foreign cache data, so check the header before handing it over
+  static bool is_pipeline_cache_compatible(const std::vector<char>& data, VkPhysicalDevice physicalDevice) {
+    if (data.size() < sizeof(VkPipelineCacheHeaderVersionOne)) return false;
+
+    VkPipelineCacheHeaderVersionOne header;
+    memcpy(&header, data.data(), sizeof(header));
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+    return header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+      header.vendorID == properties.vendorID &&
+      header.deviceID == properties.deviceID &&
+      memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+  }
+
+  VkPipelineCache load_pipeline_cache(const char* filePath, VkPhysicalDevice physicalDevice, VkDevice device) {
+    std::vector<char> initialData;
+    std::ifstream file(filePath, std::ios::ate | std::ios::binary);
+    if (file.is_open()) {
+      initialData.resize((size_t)file.tellg());
+      file.seekg(0);
+      file.read(initialData.data(), (std::streamsize)initialData.size());
+      file.close();
+    }
+
+    if (!initialData.empty() && !is_pipeline_cache_compatible(initialData, physicalDevice)) {
+      spdlog::warn("Discarding pipeline cache {} written by another device", filePath);
+      initialData.clear();
+    }
+
+    VkPipelineCacheCreateInfo createInfo = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+      .pNext = nullptr,
+      .initialDataSize = initialData.size(),
+      .pInitialData = initialData.empty() ? nullptr : initialData.data()
+    };
+
+    VkPipelineCache cache;
+    if (vkCreatePipelineCache(device, &createInfo, nullptr, &cache) != VK_SUCCESS) {
+      spdlog::warn("Discarding unusable pipeline cache {}", filePath);
+      createInfo.initialDataSize = 0;
+      createInfo.pInitialData = nullptr;
+      VK_CHECK(vkCreatePipelineCache(device, &createInfo, nullptr, &cache));
+    }
+    spdlog::info("Loaded {} bytes of pipeline cache from {}", initialData.size(), filePath);
+    return cache;
+  }
+  void save_pipeline_cache(const char* filePath, VkDevice device, VkPipelineCache cache) {
+    size_t dataSize;
+    VK_CHECK(vkGetPipelineCacheData(device, cache, &dataSize, nullptr));
+    std::vector<char> data(dataSize);
+    VK_CHECK(vkGetPipelineCacheData(device, cache, &dataSize, data.data()));
+
+    std::ofstream file(filePath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+      spdlog::warn("Failed to write pipeline cache {}", filePath);
+      return;
+    }
+    file.write(data.data(), (std::streamsize)dataSize);
+  }
 }
@@ -1,7 +1,18 @@
 #pragma once
 
+#include <span>
+#include <string>
 #include "vulkan/vulkan_core.h"
 
 namespace vkutil {
   bool load_shader_module(const char* filePath, VkDevice device, VkShaderModule* outShaderModule);
+  bool create_shader_module(std::span<const uint32_t> spirv, VkDevice device, VkShaderModule* outShaderModule);
+
+  // Cache files sit next to the executable and are named after the device UUID and driver version, so switching GPUs
+  // or updating drivers starts cold
+  std::string pipeline_cache_path(VkPhysicalDevice physicalDevice);
+
+  // Creates a pipeline cache seeded with the contents of filePath (or an empty one if the file is missing or stale)
+  VkPipelineCache load_pipeline_cache(const char* filePath, VkPhysicalDevice physicalDevice, VkDevice device);
+  void save_pipeline_cache(const char* filePath, VkDevice device, VkPipelineCache cache);
 }
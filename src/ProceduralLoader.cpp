@@ -1,16 +1,195 @@
 #include "ProceduralLoader.h"
+#include "JobSystem.h"
+#include "Noise.h"
+#include "spdlog/spdlog.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
 
 namespace cubik {
+  constexpr int TERRAIN_OCTAVES = 6;
+  constexpr float TERRAIN_HILLS = 4; // Lowest octave periods across the world
+  constexpr float TERRAIN_BASE = 0.35; // Fractions of the world size
+  constexpr float TERRAIN_AMPLITUDE = 0.25;
+  constexpr int CAVE_OCTAVES = 3;
+  constexpr float CAVE_TUNNELS = 8;
+  constexpr float CAVE_WIDTH = 0.08; // Noise values closer to zero than this are carved out
+
   std::vector<int> loadStaircase(int size) {
     std::vector<int> voxelData(size * size * size, 0);
-    for (int i = 0; i < size; i++) {
-      for (int j = 0; j < size; j++) {
-        for (int k = 0 ; k < size; k++) {
-          voxelData[i * size * size + j * size + k] = k < j ? 1 : 0;
+    JobSystem::global().parallel_for(glm::ivec3(size), LOADER_GRAIN_SIZE, [&](glm::ivec3 begin, glm::ivec3 end) {
+      for (int i = begin.z; i < end.z; i++) {
+        for (int j = begin.y; j < end.y; j++) {
+          for (int k = begin.x; k < end.x; k++) {
+            voxelData[i * size * size + j * size + k] = k < j ? 1 : 0;
+          }
         }
       }
+    });
+
+    return voxelData;
+  }
+
+  std::vector<int> loadSource(const VoxelSource& source) {
+    int size = source.getSize();
+    if (size < BRICK_SIZE) {
+      spdlog::error("Sources have to be at least a brick wide, got size {}", size);
+      abort();
     }
 
+    std::vector<int> voxelData(static_cast<size_t>(size) * size * size, 0);
+    JobSystem::global().parallel_for(glm::ivec3(size / BRICK_SIZE), LOADER_GRAIN_SIZE / BRICK_VOLUME, [&](glm::ivec3 begin, glm::ivec3 end) {
+      std::array<int, BRICK_VOLUME> brick;
+      for (int bz = begin.z; bz < end.z; bz++) {
+        for (int by = begin.y; by < end.y; by++) {
+          for (int bx = begin.x; bx < end.x; bx++) {
+            glm::ivec3 origin = glm::ivec3(bx, by, bz) * BRICK_SIZE;
+            std::optional<int> uniform = source.fillBrick(origin, brick);
+            for (int z = 0; z < BRICK_SIZE; z++) {
+              for (int y = 0; y < BRICK_SIZE; y++) {
+                int* row = &voxelData[origin.x + (origin.y + y) * static_cast<size_t>(size) + (origin.z + z) * static_cast<size_t>(size) * size];
+                if (uniform) std::fill_n(row, BRICK_SIZE, *uniform);
+                else std::copy_n(&brick[brickIndex(0, y, z)], BRICK_SIZE, row);
+              }
+            }
+          }
+        }
+      }
+    });
     return voxelData;
   }
+
+  NoiseTerrainSource::NoiseTerrainSource(int size, uint32_t seed)
+    : _size(size), _seed(seed), _frequency(TERRAIN_HILLS / size),
+      _minHeight((TERRAIN_BASE - TERRAIN_AMPLITUDE) * size), _maxHeight((TERRAIN_BASE + TERRAIN_AMPLITUDE) * size) {
+
+  }
+
+  std::pair<float, float> NoiseTerrainSource::columnHeights(glm::ivec3 origin, float heights[BRICK_SIZE * BRICK_SIZE]) const {
+    float x[noise::LANES];
+    for (int lane = 0; lane < noise::LANES; lane++) {
+      x[lane] = (origin.x + lane) * _frequency;
+    }
+
+    float lowest = _maxHeight, highest = _minHeight;
+    for (int z = 0; z < BRICK_SIZE; z++) {
+      float* row = &heights[z * BRICK_SIZE];
+      noise::fbm(x, 0, (origin.z + z) * _frequency, TERRAIN_OCTAVES, _seed, row);
+      for (int lane = 0; lane < noise::LANES; lane++) {
+        row[lane] = (TERRAIN_BASE + TERRAIN_AMPLITUDE * row[lane]) * _size;
+        lowest = std::min(lowest, row[lane]);
+        highest = std::max(highest, row[lane]);
+      }
+    }
+    return { lowest, highest };
+  }
+
+  std::optional<int> NoiseTerrainSource::fillBrick(glm::ivec3 origin, std::span<int, BRICK_VOLUME> voxels) const {
+    float heights[BRICK_SIZE * BRICK_SIZE];
+    auto [lowest, highest] = columnHeights(origin, heights);
+    if (origin.y >= highest) return 0;
+    if (origin.y + BRICK_SIZE <= lowest) return 1;
+
+    for (int z = 0; z < BRICK_SIZE; z++) {
+      for (int y = 0; y < BRICK_SIZE; y++) {
+        for (int x = 0; x < BRICK_SIZE; x++) {
+          voxels[brickIndex(x, y, z)] = origin.y + y < heights[x + z * BRICK_SIZE];
+        }
+      }
+    }
+    return std::nullopt;
+  }
+
+  std::optional<int> NoiseTerrainSource::classifyBox(glm::ivec3 origin, int size) const {
+    if (origin.y >= _maxHeight) return 0;
+    if (origin.y + size <= _minHeight) return 1;
+    return std::nullopt;
+  }
+
+  CaveSource::CaveSource(int size, uint32_t seed)
+    : NoiseTerrainSource(size, seed), _caveFrequency(CAVE_TUNNELS / size) {
+
+  }
+
+  std::optional<int> CaveSource::fillBrick(glm::ivec3 origin, std::span<int, BRICK_VOLUME> voxels) const {
+    float heights[BRICK_SIZE * BRICK_SIZE];
+    auto [lowest, highest] = columnHeights(origin, heights);
+    if (origin.y >= highest) return 0;
+
+    float x[noise::LANES];
+    for (int lane = 0; lane < noise::LANES; lane++) {
+      x[lane] = (origin.x + lane) * _caveFrequency;
+    }
+
+    int solidCount = 0;
+    float caves[noise::LANES];
+    for (int z = 0; z < BRICK_SIZE; z++) {
+      const float* rowHeights = &heights[z * BRICK_SIZE];
+      float rowHighest = *std::max_element(rowHeights, rowHeights + BRICK_SIZE);
+      for (int y = 0; y < BRICK_SIZE; y++) {
+        int* row = &voxels[brickIndex(0, y, z)];
+        if (origin.y + y >= rowHighest) {
+          std::fill_n(row, BRICK_SIZE, 0);
+          continue;
+        }
+
+        // The cave seed is offset so tunnels don't follow the hills
+        noise::fbm(x, (origin.y + y) * _caveFrequency, (origin.z + z) * _caveFrequency, CAVE_OCTAVES, _seed + 0x9e3779b9, caves);
+        for (int lane = 0; lane < noise::LANES; lane++) {
+          row[lane] = origin.y + y < rowHeights[lane] && std::abs(caves[lane]) > CAVE_WIDTH;
+          solidCount += row[lane];
+        }
+      }
+    }
+
+    if (solidCount == 0) return 0;
+    if (solidCount == BRICK_VOLUME) return 1;
+    return std::nullopt;
+  }
+
+  std::optional<int> CaveSource::classifyBox(glm::ivec3 origin, int size) const {
+    // Tunnels can show up anywhere underground, so only the air above the hills is known
+    if (origin.y >= _maxHeight) return 0;
+    return std::nullopt;
+  }
+
+  MengerSpongeSource::MengerSpongeSource(int size)
+    : _size(size), _extent(1) {
+    while (_extent * 3 <= size) _extent *= 3;
+  }
+
+  bool MengerSpongeSource::isSolid(glm::ivec3 position) const {
+    if (position.x >= _extent || position.y >= _extent || position.z >= _extent) return false;
+
+    // Removed wherever at least two coordinates sit in the middle third of some level
+    for (int cell = _extent / 3; cell >= 1; cell /= 3) {
+      int middles = ((position.x / cell) % 3 == 1) + ((position.y / cell) % 3 == 1) + ((position.z / cell) % 3 == 1);
+      if (middles >= 2) return false;
+    }
+    return true;
+  }
+
+  std::optional<int> MengerSpongeSource::fillBrick(glm::ivec3 origin, std::span<int, BRICK_VOLUME> voxels) const {
+    if (classifyBox(origin, BRICK_SIZE)) return 0;
+
+    int solidCount = 0;
+    for (int z = 0; z < BRICK_SIZE; z++) {
+      for (int y = 0; y < BRICK_SIZE; y++) {
+        for (int x = 0; x < BRICK_SIZE; x++) {
+          int solid = isSolid(origin + glm::ivec3(x, y, z));
+          voxels[brickIndex(x, y, z)] = solid;
+          solidCount += solid;
+        }
+      }
+    }
+
+    if (solidCount == 0) return 0;
+    if (solidCount == BRICK_VOLUME) return 1;
+    return std::nullopt;
+  }
+
+  std::optional<int> MengerSpongeSource::classifyBox(glm::ivec3 origin, int size) const {
+    if (origin.x >= _extent || origin.y >= _extent || origin.z >= _extent) return 0;
+    return std::nullopt;
+  }
 }
@@ -1,7 +1,59 @@
 #pragma once
 
 #include <vector>
+#include <cstdint>
+#include "VoxelSource.h"
 
 namespace cubik {
   std::vector<int> loadStaircase(int size);
+
+  // Dense cube of any source, for the backends that need one. Bricks are filled in parallel
+  std::vector<int> loadSource(const VoxelSource& source);
+
+  // Rolling hills from a noise heightmap
+  class NoiseTerrainSource : public VoxelSource {
+  public:
+    NoiseTerrainSource(int size, uint32_t seed = 1);
+
+    int getSize() const override { return _size; }
+    std::optional<int> fillBrick(glm::ivec3 origin, std::span<int, BRICK_VOLUME> voxels) const override;
+    std::optional<int> classifyBox(glm::ivec3 origin, int size) const override;
+
+  protected:
+    int _size;
+    uint32_t _seed;
+    float _frequency;
+    float _minHeight, _maxHeight;
+
+    // Heights of the brick's BRICK_SIZE x BRICK_SIZE columns, x fastest. Returns their range
+    std::pair<float, float> columnHeights(glm::ivec3 origin, float heights[BRICK_SIZE * BRICK_SIZE]) const;
+  };
+
+  // The terrain with tunnels carved where 3D noise is close to zero
+  class CaveSource : public NoiseTerrainSource {
+  public:
+    CaveSource(int size, uint32_t seed = 1);
+
+    std::optional<int> fillBrick(glm::ivec3 origin, std::span<int, BRICK_VOLUME> voxels) const override;
+    std::optional<int> classifyBox(glm::ivec3 origin, int size) const override;
+
+  private:
+    float _caveFrequency;
+  };
+
+  // Menger sponge over the biggest power of three that fits, empty around it
+  class MengerSpongeSource : public VoxelSource {
+  public:
+    explicit MengerSpongeSource(int size);
+
+    int getSize() const override { return _size; }
+    std::optional<int> fillBrick(glm::ivec3 origin, std::span<int, BRICK_VOLUME> voxels) const override;
+    std::optional<int> classifyBox(glm::ivec3 origin, int size) const override;
+
+  private:
+    int _size;
+    int _extent;
+
+    bool isSolid(glm::ivec3 position) const;
+  };
 }
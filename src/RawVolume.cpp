@@ -0,0 +1,238 @@
+#include "RawVolume.h"
+#include "JobSystem.h"
+#include "spdlog/spdlog.h"
+#include "Trace.h"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace cubik {
+  namespace {
+    constexpr int PYRAMID_GRAIN_SIZE = 16; // Bricks per block when building the pyramid
+
+    bool parseBool(const std::string& value) {
+      return value == "True" || value == "true" || value == "1";
+    }
+  }
+
+  RawVolumeLayout readMetaImageHeader(const std::filesystem::path& headerPath) {
+    std::ifstream file(headerPath);
+    if (!file) {
+      spdlog::error("Failed to open file {}", headerPath.string());
+      abort();
+    }
+
+    RawVolumeLayout layout {};
+    long long headerSize = 0;
+    std::string line;
+    while (std::getline(file, line)) {
+      size_t separator = line.find('=');
+      if (separator == std::string::npos) continue;
+      std::istringstream key(line.substr(0, separator)), value(line.substr(separator + 1));
+      std::string name, text;
+      key >> name;
+
+      if (name == "NDims") {
+        int dimensionCount;
+        value >> dimensionCount;
+        if (dimensionCount != 3) {
+          spdlog::error("{} has {} dimensions, only volumes are supported", headerPath.string(), dimensionCount);
+          abort();
+        }
+      } else if (name == "DimSize") {
+        value >> layout.dimensions.x >> layout.dimensions.y >> layout.dimensions.z;
+      } else if (name == "ElementType") {
+        value >> text;
+        if (text == "MET_UCHAR" || text == "MET_CHAR") layout.bytesPerSample = 1;
+        else if (text == "MET_USHORT" || text == "MET_SHORT") layout.bytesPerSample = 2;
+        else {
+          spdlog::error("Unsupported element type {} in {}, only 8 and 16 bit integers are", text, headerPath.string());
+          abort();
+        }
+        layout.isSigned = text == "MET_CHAR" || text == "MET_SHORT";
+      } else if (name == "ElementDataFile") {
+        value >> text;
+        layout.dataPath = headerPath.parent_path() / text;
+      } else if (name == "HeaderSize") {
+        value >> headerSize;
+      } else if (name == "BinaryDataByteOrderMSB" || name == "ElementByteOrderMSB") {
+        value >> text;
+        layout.isBigEndian = parseBool(text);
+      }
+    }
+
+    if (layout.dataPath.empty() || layout.bytesPerSample == 0) {
+      spdlog::error("{} doesn't say where its samples are or how they're stored", headerPath.string());
+      abort();
+    }
+    // -1 means the samples are at the end of the data file, after a header of unknown size
+    if (headerSize == -1) {
+      size_t dataSize = static_cast<size_t>(layout.dimensions.x) * layout.dimensions.y * layout.dimensions.z * layout.bytesPerSample;
+      headerSize = static_cast<long long>(std::filesystem::file_size(layout.dataPath) - dataSize);
+    }
+    layout.headerSize = static_cast<size_t>(headerSize);
+    return layout;
+  }
+
+  RawVolume::RawVolume(const RawVolumeLayout& layout)
+    : _file(layout.dataPath), _samples(_file.data() + layout.headerSize), _dimensions(layout.dimensions),
+      _bytesPerSample(layout.bytesPerSample), _isBigEndian(layout.isBigEndian),
+      _sampleOffset(layout.isSigned ? 1 << (8 * layout.bytesPerSample - 1) : 0) {
+    size_t sampleCount = static_cast<size_t>(_dimensions.x) * _dimensions.y * _dimensions.z;
+    if (_dimensions.x <= 0 || _dimensions.y <= 0 || _dimensions.z <= 0 || (_bytesPerSample != 1 && _bytesPerSample != 2)) {
+      spdlog::error("Can't read {}x{}x{} volumes of {} byte samples", _dimensions.x, _dimensions.y, _dimensions.z, _bytesPerSample);
+      abort();
+    }
+    if (layout.headerSize + sampleCount * _bytesPerSample > _file.size()) {
+      spdlog::error("{} is too small for {}x{}x{} samples", layout.dataPath.string(), _dimensions.x, _dimensions.y, _dimensions.z);
+      abort();
+    }
+
+    int longestSide = std::max(_dimensions.x, std::max(_dimensions.y, _dimensions.z));
+    _size = std::max(BRICK_SIZE, static_cast<int>(std::bit_ceil(static_cast<unsigned int>(longestSide))));
+    buildPyramid();
+
+    auto [lowest, highest] = getSampleRange();
+    spdlog::info("Mapped a {}x{}x{} volume with samples from {} to {}", _dimensions.x, _dimensions.y, _dimensions.z, lowest, highest);
+  }
+
+  void RawVolume::setIsoLevel(int isoLevel) {
+    setTransferFunction({ { isoLevel, 1 } });
+  }
+
+  void RawVolume::setTransferFunction(std::vector<TransferBand> bands) {
+    for (TransferBand& band : bands) {
+      band.threshold += _sampleOffset;
+    }
+    std::stable_sort(bands.begin(), bands.end(), [](const TransferBand& a, const TransferBand& b) { return a.threshold < b.threshold; });
+    _bands = std::move(bands);
+  }
+
+  std::pair<int, int> RawVolume::getSampleRange() const {
+    Range range = _levels.back()[0];
+    return { range.min - _sampleOffset, range.max - _sampleOffset };
+  }
+
+  int RawVolume::sample(glm::ivec3 position) const {
+    size_t index = position.x + static_cast<size_t>(position.y) * _dimensions.x + static_cast<size_t>(position.z) * _dimensions.x * _dimensions.y;
+    // Flipping the sign bit of a two's complement sample offsets it by half the range, making it unsigned
+    if (_bytesPerSample == 1) return std::to_integer<int>(_samples[index]) ^ _sampleOffset;
+
+    uint16_t value;
+    std::memcpy(&value, _samples + index * 2, sizeof(value));
+    if (_isBigEndian) value = static_cast<uint16_t>(value >> 8 | value << 8);
+    return value ^ _sampleOffset;
+  }
+
+  int RawVolume::classify(int sample) const {
+    int value = 0;
+    for (const TransferBand& band : _bands) {
+      if (sample < band.threshold) break;
+      value = band.value;
+    }
+    return value;
+  }
+
+  bool RawVolume::isUniform(Range range) const {
+    for (const TransferBand& band : _bands) {
+      if (range.min < band.threshold && band.threshold <= range.max) return false;
+    }
+    return true;
+  }
+
+  void RawVolume::buildPyramid() {
+    CUBIK_TRACE_ZONE("RawVolume::buildPyramid");
+    glm::ivec3 bricks = (_dimensions + (BRICK_SIZE - 1)) / BRICK_SIZE;
+    _levelSizes.push_back(bricks);
+    std::vector<Range>& bottom = _levels.emplace_back(static_cast<size_t>(bricks.x) * bricks.y * bricks.z);
+
+    // One slab of bricks at a time, which is all the samples that have to be resident at once
+    size_t sliceBytes = static_cast<size_t>(_dimensions.x) * _dimensions.y * _bytesPerSample;
+    size_t headerSize = _samples - _file.data();
+    for (int slab = 0; slab < bricks.z; slab++) {
+      JobSystem::global().parallel_for(glm::ivec3(bricks.x, bricks.y, 1), PYRAMID_GRAIN_SIZE, [&](glm::ivec3 begin, glm::ivec3 end) {
+        for (int by = begin.y; by < end.y; by++) {
+          for (int bx = begin.x; bx < end.x; bx++) {
+            glm::ivec3 first = glm::ivec3(bx, by, slab) * BRICK_SIZE;
+            glm::ivec3 last = glm::min(first + BRICK_SIZE, _dimensions);
+            Range range { UINT16_MAX, 0 };
+            for (int z = first.z; z < last.z; z++) {
+              for (int y = first.y; y < last.y; y++) {
+                for (int x = first.x; x < last.x; x++) {
+                  auto value = static_cast<uint16_t>(sample(glm::ivec3(x, y, z)));
+                  range.min = std::min(range.min, value);
+                  range.max = std::max(range.max, value);
+                }
+              }
+            }
+            bottom[bx + static_cast<size_t>(by) * bricks.x + static_cast<size_t>(slab) * bricks.x * bricks.y] = range;
+          }
+        }
+      });
+
+      int firstSlice = slab * BRICK_SIZE;
+      int lastSlice = std::min(firstSlice + BRICK_SIZE, _dimensions.z);
+      _file.release(headerSize + firstSlice * sliceBytes, (lastSlice - firstSlice) * sliceBytes);
+    }
+
+    while (_levelSizes.back().x > 1 || _levelSizes.back().y > 1 || _levelSizes.back().z > 1) {
+      glm::ivec3 childSize = _levelSizes.back();
+      glm::ivec3 size = (childSize + 1) / 2;
+      std::vector<Range> level(static_cast<size_t>(size.x) * size.y * size.z, Range { UINT16_MAX, 0 });
+      const std::vector<Range>& children = _levels.back();
+      for (int z = 0; z < childSize.z; z++) {
+        for (int y = 0; y < childSize.y; y++) {
+          for (int x = 0; x < childSize.x; x++) {
+            const Range& child = children[x + static_cast<size_t>(y) * childSize.x + static_cast<size_t>(z) * childSize.x * childSize.y];
+            Range& parent = level[x / 2 + static_cast<size_t>(y / 2) * size.x + static_cast<size_t>(z / 2) * size.x * size.y];
+            parent.min = std::min(parent.min, child.min);
+            parent.max = std::max(parent.max, child.max);
+          }
+        }
+      }
+      _levels.push_back(std::move(level));
+      _levelSizes.push_back(size);
+    }
+  }
+
+  std::optional<int> RawVolume::classifyBox(glm::ivec3 origin, int size) const {
+    if (size < BRICK_SIZE || origin.x % size != 0 || origin.y % size != 0 || origin.z % size != 0) return std::nullopt;
+    auto level = static_cast<size_t>(std::countr_zero(static_cast<unsigned int>(size / BRICK_SIZE)));
+    if (level >= _levels.size()) return std::nullopt;
+
+    glm::ivec3 cell = origin / size;
+    glm::ivec3 levelSize = _levelSizes[level];
+    if (cell.x >= levelSize.x || cell.y >= levelSize.y || cell.z >= levelSize.z) return 0;
+
+    Range range = _levels[level][cell.x + static_cast<size_t>(cell.y) * levelSize.x + static_cast<size_t>(cell.z) * levelSize.x * levelSize.y];
+    if (!isUniform(range)) return std::nullopt;
+
+    // Voxels past the end of the volume are empty, whatever the samples are
+    int value = classify(range.min);
+    bool isClipped = origin.x + size > _dimensions.x || origin.y + size > _dimensions.y || origin.z + size > _dimensions.z;
+    if (isClipped && value != 0) return std::nullopt;
+    return value;
+  }
+
+  std::optional<int> RawVolume::fillBrick(glm::ivec3 origin, std::span<int, BRICK_VOLUME> voxels) const {
+    if (std::optional<int> uniform = classifyBox(origin, BRICK_SIZE)) return uniform;
+
+    bool isUniform = true;
+    for (int z = 0; z < BRICK_SIZE; z++) {
+      for (int y = 0; y < BRICK_SIZE; y++) {
+        for (int x = 0; x < BRICK_SIZE; x++) {
+          glm::ivec3 position = origin + glm::ivec3(x, y, z);
+          bool isInVolume = position.x < _dimensions.x && position.y < _dimensions.y && position.z < _dimensions.z;
+          int value = isInVolume ? classify(sample(position)) : 0;
+          voxels[brickIndex(x, y, z)] = value;
+          isUniform = isUniform && value == voxels[0];
+        }
+      }
+    }
+    if (isUniform) return voxels[0];
+    return std::nullopt;
+  }
+}
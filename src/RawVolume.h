@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+#include <glm/vec3.hpp>
+#include "MappedFile.h"
+#include "VoxelSource.h"
+
+namespace cubik {
+  // Where the samples of a raw volume are and how they're stored
+  struct RawVolumeLayout {
+    std::filesystem::path dataPath;
+    glm::ivec3 dimensions;
+    int bytesPerSample; // 1 or 2
+    bool isSigned = false;
+    bool isBigEndian = false;
+    size_t headerSize = 0; // Bytes before the first sample
+  };
+
+  // Reads a MetaImage (.mhd) header, the usual companion of CT and MRI .raw files
+  RawVolumeLayout readMetaImageHeader(const std::filesystem::path& headerPath);
+
+  // Samples at or above threshold, and below the next band's, get value
+  struct TransferBand {
+    int threshold;
+    int value;
+  };
+
+  // 8 or 16 bit scalar field classified into voxel values by an iso level or a transfer function. The samples are
+  // mapped, not loaded, and read once up front slab by slab to build a min/max pyramid over bricks. Boxes whose range
+  // doesn't cross a band threshold are classified from the pyramid alone, so changing the classification and building
+  // again only reads the bricks the new thresholds cut through
+  class RawVolume : public VoxelSource {
+  public:
+    explicit RawVolume(const RawVolumeLayout& layout);
+
+    // Samples at or above isoLevel become solid
+    void setIsoLevel(int isoLevel);
+    // Bands in increasing threshold order, samples below the first one are empty. Not while a build reads the volume
+    void setTransferFunction(std::vector<TransferBand> bands);
+
+    int getSize() const override { return _size; }
+    std::optional<int> fillBrick(glm::ivec3 origin, std::span<int, BRICK_VOLUME> voxels) const override;
+    // Only answers for octree aligned boxes, which are a cell of one of the pyramid's levels
+    std::optional<int> classifyBox(glm::ivec3 origin, int size) const override;
+
+    glm::ivec3 getDimensions() const { return _dimensions; }
+    // Lowest and highest sample of the whole volume, for picking iso levels
+    std::pair<int, int> getSampleRange() const;
+
+  private:
+    // Samples are stored offset to be unsigned, signed volumes included
+    struct Range {
+      uint16_t min;
+      uint16_t max;
+    };
+
+    MappedFile _file;
+    const std::byte* _samples;
+    glm::ivec3 _dimensions;
+    int _bytesPerSample;
+    bool _isBigEndian;
+    int _sampleOffset;
+    int _size;
+    std::vector<TransferBand> _bands; // Thresholds offset like the samples
+    // Level 0 has the range of every brick, every other level merges 2x2x2 cells of the one below
+    std::vector<std::vector<Range>> _levels;
+    std::vector<glm::ivec3> _levelSizes;
+
+    int sample(glm::ivec3 position) const;
+    int classify(int sample) const;
+    bool isUniform(Range range) const;
+    void buildPyramid();
+  };
+}
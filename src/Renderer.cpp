@@ -1,17 +1,27 @@
 #include "Renderer.h"
 #include "VkBootstrap.h"
 #include "spdlog/spdlog.h"
+#include <chrono>
+#include <algorithm>
+#include <bit>
+#include <limits>
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/string_cast.hpp>
+#include <glm/common.hpp>
+#include <glm/matrix.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 
 #define VMA_IMPLEMENTATION
 #include "vk_mem_alloc.h"
 #include "Pipeline.h"
+#include "SvoWorld.h"
+#include "Trace.h"
 
 namespace cubik {
-  Renderer::Renderer(const Window& window, const World& world)
+  Renderer::Renderer(const Window& window)
   : DisplayWindow(window) {
+    CUBIK_TRACE_ZONE("Renderer init");
     vkb::InstanceBuilder vulkanBuilder;
 
     auto vulkanInstanceResult = vulkanBuilder.set_app_name("Example Vulkan Application")
@@ -38,6 +48,16 @@ namespace cubik {
     VkPhysicalDeviceVulkan12Features features12{ .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
     features12.bufferDeviceAddress = true;
     features12.descriptorIndexing = true;
+    // The model array is indexed per instance and only bound up to the models that are ready
+    features12.descriptorBindingPartiallyBound = true;
+    features12.shaderStorageBufferArrayNonUniformIndexing = true;
+    features12.timelineSemaphore = true;
+    features12.shaderBufferInt64Atomics = true; // Traversal statistics
+    VkPhysicalDeviceFeatures features10 {};
+    // The output binding has no format so the marcher can write to either the draw image or the swapchain
+    features10.shaderStorageImageWriteWithoutFormat = true;
+    features10.shaderInt64 = true;
+    features10.multiDrawIndirect = true; // Greedy meshes draw each chunk with its own indirect command
 
 
     vkb::PhysicalDeviceSelector selector{ vkb };
@@ -45,6 +65,7 @@ namespace cubik {
       .set_minimum_version(1, 3)
       .set_required_features_13(features)
       .set_required_features_12(features12)
+      .set_required_features(features10)
       .set_surface(_surface)
       .select();
 
@@ -61,6 +82,18 @@ namespace cubik {
     _graphicsQueue = vkbDevice.get_queue(vkb::QueueType::graphics).value();
     _graphicsQueueFamily = vkbDevice.get_queue_index(vkb::QueueType::graphics).value();
 
+    // World uploads and builds go to a separate family when there is one so they overlap with rendering
+    auto asyncQueueResult = vkbDevice.get_queue(vkb::QueueType::compute);
+    if (asyncQueueResult) {
+      _asyncQueue = asyncQueueResult.value();
+      _asyncQueueFamily = vkbDevice.get_queue_index(vkb::QueueType::compute).value();
+      spdlog::info("Using queue family {} for async compute", _asyncQueueFamily);
+    } else {
+      spdlog::info("No separate compute queue family, async work will share the graphics queue");
+      _asyncQueue = _graphicsQueue;
+      _asyncQueueFamily = _graphicsQueueFamily;
+    }
+
     VmaAllocatorCreateInfo allocatorInfo = {
       .flags = VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT,
       .physicalDevice = _chosenGPU,
@@ -73,21 +106,31 @@ namespace cubik {
     });
 
     create_swapchain(DisplayWindow.Size);
-    init_world(world);
     init_commands();
     init_sync_structures();
     init_descriptors();
-    init_pipelines(world);
+    {
+      CUBIK_TRACE_ZONE("init_pipelines");
+      init_pipelines();
+    }
   }
 
   void Renderer::create_swapchain(glm::ivec2 size) {
     vkb::SwapchainBuilder swapchainBuilder{ _chosenGPU,_device,_surface };
 
+    // The marcher can skip the intermediate image and its blit when the swapchain takes storage writes
+    VkSurfaceCapabilitiesKHR surfaceCapabilities;
+    VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(_chosenGPU, _surface, &surfaceCapabilities));
+    VkFormatProperties displayFormatProperties;
+    vkGetPhysicalDeviceFormatProperties(_chosenGPU, DisplayFormat, &displayFormatProperties);
+    bool isStorageSupported = (surfaceCapabilities.supportedUsageFlags & VK_IMAGE_USAGE_STORAGE_BIT)
+                              && (displayFormatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT);
+
     vkb::Swapchain vkbSwapchain = swapchainBuilder
         .set_desired_format(VkSurfaceFormatKHR{ .format = DisplayFormat, .colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR })
         .set_desired_present_mode(VK_PRESENT_MODE_FIFO_KHR)
         .set_desired_extent(size.x, size.y)
-        .add_image_usage_flags(VK_IMAGE_USAGE_TRANSFER_DST_BIT)
+        .add_image_usage_flags(VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | (isStorageSupported ? VK_IMAGE_USAGE_STORAGE_BIT : 0))
         .build()
         .value();
 
@@ -96,70 +139,488 @@ namespace cubik {
     _swapchainImages = vkbSwapchain.get_images().value();
     _swapchainImageViews = vkbSwapchain.get_image_views().value();
 
-
-    VkExtent3D drawImageExtent = {
+    _drawExtent = {
       static_cast<uint32_t>(size.x), // TODO: Review
-      static_cast<uint32_t>(size.y),
-      1
+      static_cast<uint32_t>(size.y)
     };
+    _writesToSwapchain = isStorageSupported && vkbSwapchain.image_format == DisplayFormat
+                         && _swapchainExtent.width == _drawExtent.width && _swapchainExtent.height == _drawExtent.height;
+    spdlog::info("Ray marching {}", _writesToSwapchain ? "straight into the swapchain" : "into an intermediate image");
 
-    //hardcoding the draw format to 32 bit float
-    _drawImage.imageFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
-    _drawImage.imageExtent = drawImageExtent;
+    VkExtent3D visibilityExtent = { _drawExtent.width, _drawExtent.height, 1 };
+    _shadowImage = create_image(visibilityExtent, VK_FORMAT_R16_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT);
+    _aoImage = create_image(visibilityExtent, VK_FORMAT_R16_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT);
+    _rayDepth = create_buffer(static_cast<size_t>(_drawExtent.width) * _drawExtent.height * sizeof(float),
+                              VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
 
-    VkImageUsageFlags drawImageUsages{};
-    drawImageUsages |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
-    drawImageUsages |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-    drawImageUsages |= VK_IMAGE_USAGE_STORAGE_BIT;
-    drawImageUsages |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    // TODO: Review this syntax
+    _mainDeletionQueue.push_function([=]() {
+      destroy_image(_shadowImage);
+      destroy_image(_aoImage);
+      destroy_buffer(_rayDepth);
+    });
+  }
+
+  AllocatedImage Renderer::create_image(VkExtent3D extent, VkFormat format, VkImageUsageFlags usage) {
+    AllocatedImage image {
+      .imageExtent = extent,
+      .imageFormat = format
+    };
 
-    VkImageCreateInfo rawImgInfo = vkutil::image_create_info(_drawImage.imageFormat, drawImageUsages, drawImageExtent);
-    VmaAllocationCreateInfo rawImgAllocInfo = {
+    VkImageCreateInfo imageInfo = vkutil::image_create_info(format, usage, extent);
+    VmaAllocationCreateInfo allocationInfo = {
       .usage = VMA_MEMORY_USAGE_GPU_ONLY,
       .requiredFlags = VkMemoryPropertyFlags(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
     };
-    vmaCreateImage(_allocator, &rawImgInfo, &rawImgAllocInfo, &_drawImage.image, &_drawImage.allocation, nullptr);
-    VkImageViewCreateInfo rawViewIndo = vkutil::imageview_create_info(_drawImage.imageFormat, _drawImage.image, VK_IMAGE_ASPECT_COLOR_BIT);
-    VK_CHECK(vkCreateImageView(_device, &rawViewIndo, nullptr, &_drawImage.imageView));
+    VK_CHECK(vmaCreateImage(_allocator, &imageInfo, &allocationInfo, &image.image, &image.allocation, nullptr));
+    VkImageViewCreateInfo viewInfo = vkutil::imageview_create_info(format, image.image, VK_IMAGE_ASPECT_COLOR_BIT);
+    VK_CHECK(vkCreateImageView(_device, &viewInfo, nullptr, &image.imageView));
 
-    // TODO: Review this syntax
-    _mainDeletionQueue.push_function([=]() {
-      vkDestroyImageView(_device, _drawImage.imageView, nullptr);
-      vmaDestroyImage(_allocator, _drawImage.image, _drawImage.allocation);
-    });
+    return image;
   }
 
-  void Renderer::init_world(const World& world) {
-    size_t bufferSize = sizeof(VOXEL_SIZE) + world.calculateSerializedSize();
+  void Renderer::destroy_image(const AllocatedImage& image) {
+    vkDestroyImageView(_device, image.imageView, nullptr);
+    vmaDestroyImage(_allocator, image.image, image.allocation);
+  }
+
+  AllocatedBuffer Renderer::create_buffer(size_t size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage, VmaAllocationCreateFlags flags, bool sharedWithAsyncQueue) {
+    uint32_t queueFamilies[] = { _graphicsQueueFamily, _asyncQueueFamily };
+    bool isConcurrent = sharedWithAsyncQueue && _graphicsQueueFamily != _asyncQueueFamily;
 
     VkBufferCreateInfo bufferInfo = {
       .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-      .size = bufferSize,
-      .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-      .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+      .pNext = nullptr,
+      .size = size,
+      .usage = usage,
+      .sharingMode = isConcurrent ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = isConcurrent ? 2u : 0u,
+      .pQueueFamilyIndices = isConcurrent ? queueFamilies : nullptr
+    };
+    VmaAllocationCreateInfo allocInfo = {
+      .flags = flags,
+      .usage = memoryUsage
     };
 
-    VK_CHECK(vkCreateBuffer(_device, &bufferInfo, nullptr, &_worldBuffer));
+    AllocatedBuffer newBuffer;
+    VK_CHECK(vmaCreateBuffer(_allocator, &bufferInfo, &allocInfo, &newBuffer.buffer, &newBuffer.allocation, &newBuffer.info));
+    return newBuffer;
+  }
 
-    VkMemoryRequirements memRequirements;
-    vkGetBufferMemoryRequirements(_device, _worldBuffer, &memRequirements);
+  void Renderer::destroy_buffer(const AllocatedBuffer& buffer) {
+    vmaDestroyBuffer(_allocator, buffer.buffer, buffer.allocation);
+  }
 
-    VkMemoryAllocateInfo allocInfo = {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .allocationSize = memRequirements.size,
-      .memoryTypeIndex = vkutil::findMemoryType(memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, _chosenGPU)
+  VkDeviceAddress Renderer::get_buffer_address(const AllocatedBuffer& buffer) const {
+    VkBufferDeviceAddressInfo addressInfo {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+      .pNext = nullptr,
+      .buffer = buffer.buffer
     };
+    return vkGetBufferDeviceAddress(_device, &addressInfo);
+  }
+
+  uint64_t Renderer::submit_async(std::function<void(VkCommandBuffer)>&& record, vkutil::DeletionQueue&& onComplete) {
+    VkCommandBuffer cmd;
+    VkCommandBufferAllocateInfo cmdAllocInfo = vkutil::command_buffer_allocate_info(_asyncCommandPool, 1);
+    VK_CHECK(vkAllocateCommandBuffers(_device, &cmdAllocInfo, &cmd));
+
+    VkCommandBufferBeginInfo cmdBeginInfo = vkutil::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
+    record(cmd);
+    VK_CHECK(vkEndCommandBuffer(cmd));
+
+    uint64_t timelineValue = ++_asyncTimelineValue;
+    VkCommandBufferSubmitInfo cmdSubmitInfo = vkutil::command_buffer_submit_info(cmd);
+    VkSemaphoreSubmitInfo signalInfo = vkutil::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, _asyncTimeline, timelineValue);
+    VkSubmitInfo2 submit = vkutil::submit_info(&cmdSubmitInfo, &signalInfo, nullptr);
+    VK_CHECK(vkQueueSubmit2(_asyncQueue, 1, &submit, VK_NULL_HANDLE));
+
+    _asyncSubmissions.push_back({
+      .commandBuffer = cmd,
+      .timelineValue = timelineValue,
+      .deletionQueue = std::move(onComplete)
+    });
+    return timelineValue;
+  }
+
+  bool Renderer::is_async_complete(uint64_t timelineValue) const {
+    uint64_t completedValue;
+    VK_CHECK(vkGetSemaphoreCounterValue(_device, _asyncTimeline, &completedValue));
+    return completedValue >= timelineValue;
+  }
+
+  void Renderer::wait_async(uint64_t timelineValue) {
+    VkSemaphoreWaitInfo waitInfo {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+      .pNext = nullptr,
+      .semaphoreCount = 1,
+      .pSemaphores = &_asyncTimeline,
+      .pValues = &timelineValue
+    };
+    VK_CHECK(vkWaitSemaphores(_device, &waitInfo, UINT64_MAX));
+  }
+
+  void Renderer::retire_async_submissions() {
+    uint64_t completedValue;
+    VK_CHECK(vkGetSemaphoreCounterValue(_device, _asyncTimeline, &completedValue));
+
+    while (!_asyncSubmissions.empty() && _asyncSubmissions.front().timelineValue <= completedValue) {
+      AsyncSubmission& submission = _asyncSubmissions.front();
+      vkFreeCommandBuffers(_device, _asyncCommandPool, 1, &submission.commandBuffer);
+      submission.deletionQueue.flush();
+      _asyncSubmissions.pop_front();
+    }
+  }
+
+  void Renderer::update_world(const World& world) {
+    begin_world_upload(world);
+  }
+
+  void Renderer::begin_world_upload(const World& world) {
+    if (_pendingWorld) {
+      // A newer world replaces the one still uploading
+      discard_pending_world();
+    }
+
+    size_t bufferSize = sizeof(VOXEL_SIZE) + world.calculateSerializedSize();
+    WorldUpload upload {
+      .stagingBuffer = create_buffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, VMA_ALLOCATION_CREATE_MAPPED_BIT),
+      .variant = {
+        .shaderName = world.getCompatibleShader(),
+        .worldSize = world.getSize(),
+        .treeDepth = world.getDepth(),
+        .collectStatistics = _collectStatistics
+      },
+      .source = &world
+    };
+
+    if (world.isBuiltOnGpu()) {
+      upload.gpuBuild = std::make_unique<GpuSvoBuild>();
+      upload.gpuBuild->layout = GpuSvoBuildLayout::plan(world.getSize());
+    } else {
+      // Greedy meshes are drawn straight out of the world buffer
+      VkBufferUsageFlags meshUsage = upload.variant.isRasterized()
+        ? VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT : 0;
+      upload.buffer = create_buffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | meshUsage, VMA_MEMORY_USAGE_GPU_ONLY, 0, true);
+    }
+
+    // Serializing a big world takes long enough to drop frames, so it happens on a worker thread
+    void* data = upload.stagingBuffer.info.pMappedData;
+    const World* source = &world;
+    upload.serialization = std::async(std::launch::async, [data, source]() {
+      CUBIK_TRACE_ZONE("serialize world");
+      memcpy(data, &VOXEL_SIZE, sizeof(VOXEL_SIZE));
+      source->serialize(static_cast<char*>(data) + sizeof(VOXEL_SIZE));
+    });
+
+    if (!upload.variant.isRasterized()) {
+      get_background_pipeline(upload.variant);
+#ifdef CUBIK_SHADER_HOT_RELOAD
+      _shaderWatcher.watch(upload.variant.shaderName);
+#endif
+    }
+    _pendingWorld = std::move(upload);
+  }
+
+  void Renderer::set_animation(const SvoAnimation& animation) {
+    if (_pendingWorld) {
+      discard_pending_world();
+    }
+
+    if (_worldGeneration > 0) {
+      // The last drawn frame is the last one to read the old buffer, it's freed once that frame's fence is waited on
+      AllocatedBuffer oldBuffer = _worldBuffer;
+      _frames[(_frameNumber + FRAME_OVERLAP - 1) % FRAME_OVERLAP]._deletionQueue.push_function([=, this]() {
+        destroy_buffer(oldBuffer);
+      });
+    }
+
+    PipelineVariantKey variant {
+      .shaderName = animation.getCompatibleShader(),
+      .worldSize = animation.getSize(),
+      .treeDepth = animation.getDepth(),
+      .collectStatistics = _collectStatistics
+    };
+    _worldBuffer = create_buffer(sizeof(VOXEL_SIZE) + animation.calculateSerializedSize(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+    _worldGeneration++;
+    _activeBackgroundVariant = variant;
+    _worldMesh = {};
+    _gradientPipeline = get_background_pipeline(variant);
+#ifdef CUBIK_SHADER_HOT_RELOAD
+    _shaderWatcher.watch(variant.shaderName);
+#endif
+
+    _animation = &animation;
+    _animationFrame = 0;
+    _residentAnimationNodes = 0;
+    _residentAnimationRoot = -1;
+  }
+
+  void Renderer::discard_pending_world() {
+    WorldUpload& upload = *_pendingWorld;
+    upload.serialization.wait();
+
+    uint64_t lastSubmission = upload.timelineValue;
+    if (lastSubmission == 0 && upload.gpuBuild) lastSubmission = upload.gpuBuild->countValue;
+
+    // The staging buffer is freed by the first submission, so it only needs freeing here if nothing was submitted
+    if (lastSubmission == 0) {
+      destroy_buffer(upload.stagingBuffer);
+    } else {
+      wait_async(lastSubmission);
+      retire_async_submissions();
+    }
+
+    if (upload.buffer.buffer != VK_NULL_HANDLE) destroy_buffer(upload.buffer);
+    if (upload.gpuBuild) release_gpu_svo_build(*upload.gpuBuild);
+    _pendingWorld.reset();
+  }
+
+  void Renderer::poll_world_upload() {
+    if (!_pendingWorld) return;
+    WorldUpload& upload = *_pendingWorld;
+
+    if (upload.timelineValue == 0) {
+      if (upload.gpuBuild && upload.gpuBuild->countValue != 0) {
+        if (!is_async_complete(upload.gpuBuild->countValue)) return;
+        submit_gpu_svo_emit(upload);
+      } else {
+        if (upload.serialization.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+        upload.serialization.get();
+
+        if (upload.variant.isRasterized()) {
+          memcpy(&upload.meshHeader, static_cast<char*>(upload.stagingBuffer.info.pMappedData) + sizeof(VOXEL_SIZE), sizeof(GreedyMeshHeader));
+        }
+
+        if (upload.gpuBuild) {
+          submit_gpu_svo_count(upload);
+          return;
+        }
+
+        VkBuffer source = upload.stagingBuffer.buffer;
+        VkBuffer destination = upload.buffer.buffer;
+        VkDeviceSize size = upload.stagingBuffer.info.size;
+        AllocatedBuffer stagingBuffer = upload.stagingBuffer;
+
+        vkutil::DeletionQueue onComplete;
+        onComplete.push_function([=, this]() {
+          destroy_buffer(stagingBuffer);
+        });
+        upload.timelineValue = submit_async([=](VkCommandBuffer cmd) {
+          VkBufferCopy copyRegion { .srcOffset = 0, .dstOffset = 0, .size = size };
+          vkCmdCopyBuffer(cmd, source, destination, 1, &copyRegion);
+        }, std::move(onComplete));
+      }
+    }
+
+    // The first world is swapped in right away and the GPU waits for its copy. Later ones are swapped once
+    // their copy is done, so the frames in between keep drawing the old world instead of stalling
+    bool hasWorld = _worldGeneration > 0;
+    if (hasWorld && !is_async_complete(upload.timelineValue)) return;
+
+    if (hasWorld) {
+      // Both frames rebind before this frame's deletion queue is flushed again
+      AllocatedBuffer oldBuffer = _worldBuffer;
+      get_current_frame()._deletionQueue.push_function([=, this]() {
+        destroy_buffer(oldBuffer);
+      });
+    }
+
+    if (upload.gpuBuild) {
+      if (VALIDATE_GPU_SVO_BUILDS) {
+        wait_async(upload.timelineValue);
+        validate_gpu_svo_build(upload);
+      }
+      // Only what the emit submission doesn't free itself, the first world is swapped in before it's done
+      release_gpu_svo_build(*upload.gpuBuild);
+    }
+
+    _worldBuffer = upload.buffer;
+    _worldReadyValue = upload.timelineValue;
+    _animation = nullptr;
+    _worldGeneration++;
+    _activeBackgroundVariant = upload.variant;
+    _worldMesh = upload.meshHeader;
+    _gradientPipeline = upload.variant.isRasterized() ? VK_NULL_HANDLE : get_background_pipeline(upload.variant);
+    _pendingWorld.reset();
+  }
+
+  void Renderer::submit_gpu_svo_count(WorldUpload& upload) {
+    GpuSvoBuild& build = *upload.gpuBuild;
+    const GpuSvoBuildLayout& layout = build.layout;
+    build.startTime = std::chrono::high_resolution_clock::now();
+
+    constexpr VkBufferUsageFlags scratchUsage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+    VkDeviceSize inputSize = upload.stagingBuffer.info.size - WORLD_HEADER_SIZE;
+    build.input = create_buffer(inputSize, scratchUsage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+    build.pyramid = create_buffer(layout.pyramidCount * sizeof(int), scratchUsage, VMA_MEMORY_USAGE_GPU_ONLY);
+    build.scan = create_buffer(layout.scanCount * sizeof(int), scratchUsage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+    build.blockSums = create_buffer(layout.blockSumCount * sizeof(int), scratchUsage, VMA_MEMORY_USAGE_GPU_ONLY);
+    build.readback = create_buffer(sizeof(int), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+
+    VkBuffer stagingBuffer = upload.stagingBuffer.buffer;
+    VkBuffer inputBuffer = build.input.buffer;
+    VkBuffer scanBuffer = build.scan.buffer;
+    VkBuffer readbackBuffer = build.readback.buffer;
+    VkDeviceAddress input = get_buffer_address(build.input);
+    VkDeviceAddress pyramid = get_buffer_address(build.pyramid);
+    VkDeviceAddress scan = get_buffer_address(build.scan);
+    VkDeviceAddress blockSums = get_buffer_address(build.blockSums);
+
+    AllocatedBuffer staging = upload.stagingBuffer;
+    vkutil::DeletionQueue onComplete;
+    onComplete.push_function([=, this]() {
+      destroy_buffer(staging);
+    });
+
+    build.countValue = submit_async([=, this](VkCommandBuffer cmd) {
+      // Only the voxels go to the GPU, the header is written again with the nodes
+      VkBufferCopy inputRegion { .srcOffset = WORLD_HEADER_SIZE, .dstOffset = 0, .size = inputSize };
+      vkCmdCopyBuffer(cmd, stagingBuffer, inputBuffer, 1, &inputRegion);
+      vkutil::memory_barrier(cmd,
+                             VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                             VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+
+      _svoBuilder.record_count(cmd, layout, input, pyramid, scan, blockSums);
+
+      VkBufferCopy countRegion { .srcOffset = (layout.scanCount - 1) * sizeof(int), .dstOffset = 0, .size = sizeof(int) };
+      vkCmdCopyBuffer(cmd, scanBuffer, readbackBuffer, 1, &countRegion);
+    }, std::move(onComplete));
+  }
+
+  void Renderer::submit_gpu_svo_emit(WorldUpload& upload) {
+    GpuSvoBuild& build = *upload.gpuBuild;
+    const GpuSvoBuildLayout& layout = build.layout;
+
+    VK_CHECK(vmaInvalidateAllocation(_allocator, build.readback.allocation, 0, VK_WHOLE_SIZE));
+    memcpy(&build.nodeCount, build.readback.info.pMappedData, sizeof(int));
+
+    size_t bufferSize = WORLD_HEADER_SIZE + build.nodeCount * sizeof(LinearOctreeNode);
+    upload.buffer = create_buffer(bufferSize,
+                                  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                                  VMA_MEMORY_USAGE_GPU_ONLY, 0, true);
+    if (VALIDATE_GPU_SVO_BUILDS) {
+      build.validation = create_buffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+    }
+
+    VkBuffer worldBuffer = upload.buffer.buffer;
+    VkBuffer validationBuffer = build.validation.buffer;
+    VkDeviceAddress input = get_buffer_address(build.input);
+    VkDeviceAddress pyramid = get_buffer_address(build.pyramid);
+    VkDeviceAddress scan = get_buffer_address(build.scan);
+    VkDeviceAddress nodes = get_buffer_address(upload.buffer) + WORLD_HEADER_SIZE;
+    struct { float voxelSize; int worldSize; } header { VOXEL_SIZE, layout.worldSize };
+
+    // The emit passes read the scratch buffers until the submission completes, which is also when the build is timed.
+    // Completions are only noticed once a frame, so the time can be a frame late
+    AllocatedBuffer scratch[] = { build.input, build.pyramid, build.scan, build.blockSums, build.readback };
+    int nodeCount = build.nodeCount;
+    auto startTime = build.startTime;
+    vkutil::DeletionQueue onComplete;
+    onComplete.push_function([=, this]() {
+      std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+      spdlog::info("Built a {} node octree on the GPU in {:.2f}ms", nodeCount, elapsed.count());
+      for (const AllocatedBuffer& buffer : scratch) {
+        destroy_buffer(buffer);
+      }
+    });
+    build.input = build.pyramid = build.scan = build.blockSums = build.readback = {};
+
+    upload.timelineValue = submit_async([=, this](VkCommandBuffer cmd) {
+      vkCmdUpdateBuffer(cmd, worldBuffer, 0, sizeof(header), &header);
+      _svoBuilder.record_emit(cmd, layout, input, pyramid, scan, nodes);
+
+      if (VALIDATE_GPU_SVO_BUILDS) {
+        VkBufferCopy validationRegion { .srcOffset = 0, .dstOffset = 0, .size = bufferSize };
+        vkCmdCopyBuffer(cmd, worldBuffer, validationBuffer, 1, &validationRegion);
+      }
+    }, std::move(onComplete));
+  }
 
-    VK_CHECK(vkAllocateMemory(_device, &allocInfo, nullptr, &_worldBufferMemory));
+  void Renderer::release_gpu_svo_build(GpuSvoBuild& build) {
+    for (AllocatedBuffer* buffer : { &build.input, &build.pyramid, &build.scan, &build.blockSums, &build.readback, &build.validation }) {
+      if (buffer->buffer != VK_NULL_HANDLE) destroy_buffer(*buffer);
+      *buffer = {};
+    }
+  }
+
+  void Renderer::validate_gpu_svo_build(const WorldUpload& upload) {
+    const GpuSvoBuild& build = *upload.gpuBuild;
+    VK_CHECK(vmaInvalidateAllocation(_allocator, build.validation.allocation, 0, VK_WHOLE_SIZE));
+    std::span<const LinearOctreeNode> nodes(
+      reinterpret_cast<const LinearOctreeNode*>(static_cast<const char*>(build.validation.info.pMappedData) + WORLD_HEADER_SIZE),
+      build.nodeCount);
+
+    int worldSize = build.layout.worldSize;
+    int mismatches = 0;
+    for (int x = 0; x < worldSize; x++) {
+      for (int y = 0; y < worldSize; y++) {
+        for (int z = 0 ; z < worldSize; z++) {
+          auto position = glm::ivec3(x, y, z);
+          int expected = upload.source->get(position);
+          int built = SvoWorld::lookup(nodes, worldSize, position);
+          if (expected != built && mismatches++ < 10) {
+            spdlog::error("{}: expected {} but the GPU octree has {}", glm::to_string(position), expected, built);
+          }
+        }
+      }
+    }
+
+    if (mismatches > 0) {
+      spdlog::error("GPU octree differs from the source world in {} voxels", mismatches);
+    } else {
+      spdlog::info("GPU octree matches the source world");
+    }
+  }
 
-    VK_CHECK(vkBindBufferMemory(_device, _worldBuffer, _worldBufferMemory, 0));
+  void Renderer::bind_world(FrameData& frame) {
+    if (frame._worldGeneration == _worldGeneration) return;
 
-    void* data;
-    VK_CHECK(vkMapMemory(_device, _worldBufferMemory, 0, bufferSize, 0, &data));
-    memcpy(data, &VOXEL_SIZE, sizeof(VOXEL_SIZE));
-    world.serialize(static_cast<char*>(data) + sizeof(VOXEL_SIZE));
+    VkDescriptorBufferInfo bufferInfo = {
+      .buffer = _worldBuffer.buffer,
+      .offset = 0,
+      .range = VK_WHOLE_SIZE
+    };
+    VkWriteDescriptorSet descriptorWrite = {
+      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+      .pNext = nullptr,
+      .dstSet = frame._descriptors,
+      .dstBinding = 1,
+      .dstArrayElement = 0,
+      .descriptorCount = 1,
+      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .pBufferInfo = &bufferInfo,
+    };
+    vkUpdateDescriptorSets(_device, 1, &descriptorWrite, 0, nullptr);
 
-    vkUnmapMemory(_device, _worldBufferMemory);
+    frame._worldGeneration = _worldGeneration;
+  }
+
+  void Renderer::bind_frame_images(FrameData& frame, VkImageView outputView, VkImageView hitView) {
+    std::pair<uint32_t, VkImageView> images[] = {
+      { 0, outputView },
+      { 2, hitView }
+    };
+    for (auto [binding, view] : images) {
+      if (frame._boundImageViews[binding] == view) continue;
+
+      VkDescriptorImageInfo imgInfo{
+        .imageView = view,
+        .imageLayout = VK_IMAGE_LAYOUT_GENERAL
+      };
+      VkWriteDescriptorSet imageWrite = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .pNext = nullptr,
+        .dstSet = frame._descriptors,
+        .dstBinding = binding,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+        .pImageInfo = &imgInfo
+      };
+      vkUpdateDescriptorSets(_device, 1, &imageWrite, 0, nullptr);
+      frame._boundImageViews[binding] = view;
+    }
   }
 
   void Renderer::init_commands() {
@@ -172,6 +633,19 @@ namespace cubik {
 
       VK_CHECK(vkAllocateCommandBuffers(_device, &cmdAllocInfo, &frame._mainCommandBuffer));
     }
+
+    VkCommandPoolCreateInfo asyncCommandPoolInfo = vkutil::command_pool_create_info(_asyncQueueFamily, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+    VK_CHECK(vkCreateCommandPool(_device, &asyncCommandPoolInfo, nullptr, &_asyncCommandPool));
+    _mainDeletionQueue.push_function([&]() {
+      vkDestroyCommandPool(_device, _asyncCommandPool, nullptr);
+    });
+
+    _profiler.init(_device, _chosenGPU, _graphicsQueue, _graphicsQueueFamily, FRAME_OVERLAP);
+    _frameGraph.init(_device, _allocator);
+    _mainDeletionQueue.push_function([&]() {
+      _profiler.destroy(_device);
+      _frameGraph.destroy();
+    });
   }
 
   void Renderer::init_sync_structures() {
@@ -184,72 +658,159 @@ namespace cubik {
       VK_CHECK(vkCreateSemaphore(_device, &semaphoreCreateInfo, nullptr, &frame._swapchainSemaphore));
       VK_CHECK(vkCreateSemaphore(_device, &semaphoreCreateInfo, nullptr, &frame._renderSemaphore));
     }
+
+    VkSemaphoreTypeCreateInfo timelineCreateInfo {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+      .pNext = nullptr,
+      .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+      .initialValue = 0
+    };
+    VkSemaphoreCreateInfo timelineSemaphoreInfo = vkutil::semaphore_create_info();
+    timelineSemaphoreInfo.pNext = &timelineCreateInfo;
+    VK_CHECK(vkCreateSemaphore(_device, &timelineSemaphoreInfo, nullptr, &_asyncTimeline));
+    _mainDeletionQueue.push_function([&]() {
+      vkDestroySemaphore(_device, _asyncTimeline, nullptr);
+    });
   }
 
   void Renderer::init_descriptors() {
     std::vector<vkutil::DescriptorAllocator::PoolSizeRatio> sizes = {
-      { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 }
+      { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 4 },
+      { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 9 + MAX_MODELS }
     };
 
     globalDescriptorAllocator.init_pool(_device, 10, sizes);
 
+    // Every binding but the model array is always written before the frame draws
+    VkDescriptorBindingFlags bindingFlags[13] {};
+    bindingFlags[8] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT;
+    VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsInfo {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+      .bindingCount = static_cast<uint32_t>(std::size(bindingFlags)),
+      .pBindingFlags = bindingFlags
+    };
     _drawImageDescriptorLayout =
       vkutil::DescriptorLayoutBuilder {}
       .add_binding(0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE)
       .add_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
-      .build(_device, VK_SHADER_STAGE_COMPUTE_BIT);
-
-    _drawImageDescriptors = globalDescriptorAllocator.allocate(_device,_drawImageDescriptorLayout);
+      .add_binding(2, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE)
+      .add_binding(3, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE)
+      .add_binding(4, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE)
+      .add_binding(5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+      .add_binding(6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+      .add_binding(7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+      .add_binding(8, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, MAX_MODELS)
+      .add_binding(9, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+      .add_binding(10, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+      .add_binding(11, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+      .add_binding(12, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+      // The greedy mesh's fragment shader shades with the palette too
+      .build(_device, VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, &bindingFlagsInfo);
 
-    // Image binding
-    VkDescriptorImageInfo imgInfo{
-      .imageView = _drawImage.imageView,
-      .imageLayout = VK_IMAGE_LAYOUT_GENERAL
-    };
-    VkWriteDescriptorSet drawImageWrite = {
-      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-      .pNext = nullptr,
-      .dstSet = _drawImageDescriptors,
-      .dstBinding = 0,
-      .descriptorCount = 1, // TODO: What is this???
-      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
-      .pImageInfo = &imgInfo
-    };
-    vkUpdateDescriptorSets(_device, 1, &drawImageWrite, 0, nullptr);
+    for (auto & frame : _frames) {
+      frame._descriptors = globalDescriptorAllocator.allocate(_device, _drawImageDescriptorLayout);
+
+      // Persistent image bindings. The world is written by bind_world once it has been uploaded and the
+      // frame graph's images by bind_frame_images
+      std::pair<uint32_t, const AllocatedImage*> images[] = {
+        { 3, &_shadowImage },
+        { 4, &_aoImage }
+      };
+      for (auto [binding, image] : images) {
+        VkDescriptorImageInfo imgInfo{
+          .imageView = image->imageView,
+          .imageLayout = VK_IMAGE_LAYOUT_GENERAL
+        };
+        VkWriteDescriptorSet imageWrite = {
+          .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+          .pNext = nullptr,
+          .dstSet = frame._descriptors,
+          .dstBinding = binding,
+          .descriptorCount = 1, // TODO: What is this???
+          .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+          .pImageInfo = &imgInfo
+        };
+        vkUpdateDescriptorSets(_device, 1, &imageWrite, 0, nullptr);
+      }
+
+      // Bound even when statistics are off, variants without them just never write to it
+      frame._statistics = create_buffer(sizeof(TraversalStatistics),
+                                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                        VMA_MEMORY_USAGE_GPU_ONLY);
+      frame._statisticsReadback = create_buffer(sizeof(TraversalStatistics), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+      frame._palette = create_buffer(sizeof(Palette), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+      std::pair<uint32_t, VkBuffer> buffers[] = {
+        { 5, frame._statistics.buffer },
+        { 11, _rayDepth.buffer },
+        { 12, frame._palette.buffer }
+      };
+      for (auto [binding, buffer] : buffers) {
+        VkDescriptorBufferInfo bufferInfo {
+          .buffer = buffer,
+          .offset = 0,
+          .range = VK_WHOLE_SIZE
+        };
+        VkWriteDescriptorSet bufferWrite = {
+          .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+          .pNext = nullptr,
+          .dstSet = frame._descriptors,
+          .dstBinding = binding,
+          .descriptorCount = 1,
+          .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+          .pBufferInfo = &bufferInfo
+        };
+        vkUpdateDescriptorSets(_device, 1, &bufferWrite, 0, nullptr);
+      }
+
+      frame._instances = create_buffer(MIN_INSTANCE_CAPACITY * sizeof(GpuInstance), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+      frame._instanceNodes = create_buffer(2 * MIN_INSTANCE_CAPACITY * sizeof(BvhNode), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+      bind_instance_buffers(frame);
+    }
 
-    // World binding
-    VkDescriptorBufferInfo bufferInfo = {
-      .buffer = _worldBuffer,
-      .offset = 0,
-      .range = VK_WHOLE_SIZE
-    };
-    VkWriteDescriptorSet descriptorWrite = {
-      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-      .pNext = nullptr,
-      .dstSet = _drawImageDescriptors,
-      .dstBinding = 1,
-      .dstArrayElement = 0,
-      .descriptorCount = 1,
-      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-      .pBufferInfo = &bufferInfo,
-    };
-    vkUpdateDescriptorSets(_device, 1, &descriptorWrite, 0, nullptr);
+    // The marchers always use the query bindings, so every batch has buffers even before the first query
+    for (auto& batch : _rayQueryBatches) {
+      create_ray_query_batch(batch, MIN_RAY_QUERY_CAPACITY);
+    }
 
     _mainDeletionQueue.push_function([&]() {
+      for (auto& frame : _frames) {
+        destroy_buffer(frame._statistics);
+        destroy_buffer(frame._statisticsReadback);
+        destroy_buffer(frame._instances);
+        destroy_buffer(frame._instanceNodes);
+        destroy_buffer(frame._palette);
+        destroy_buffer(frame._animationStaging);
+      }
+      for (auto& batch : _rayQueryBatches) {
+        destroy_ray_query_batch(batch);
+      }
       globalDescriptorAllocator.destroy_pool(_device);
       vkDestroyDescriptorSetLayout(_device, _drawImageDescriptorLayout, nullptr);
     });
   }
 
-  void Renderer::init_pipelines(const cubik::World& world) {
-    init_background_pipelines(world.getCompatibleShader());
+  void Renderer::init_pipelines() {
+    _pipelineCachePath = vkutil::pipeline_cache_path(_chosenGPU);
+    _pipelineCache = vkutil::load_pipeline_cache(_pipelineCachePath.c_str(), _chosenGPU, _device);
+    _mainDeletionQueue.push_function([&]() {
+      vkutil::save_pipeline_cache(_pipelineCachePath.c_str(), _device, _pipelineCache);
+      vkDestroyPipelineCache(_device, _pipelineCache, nullptr);
+    });
+
+    init_background_pipelines();
+    init_raster_pipeline();
+
+    _svoBuilder.init(_device, _pipelineCache, SHADER_DIRECTORY);
+    _mainDeletionQueue.push_function([&]() {
+      _svoBuilder.destroy(_device);
+    });
   }
 
-  void Renderer::init_background_pipelines(const std::string& shaderName) {
+  void Renderer::init_background_pipelines() {
     VkPushConstantRange pushConstant {
       .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
       .offset = 0,
-      .size = sizeof(CameraPushConstants)
+      .size = sizeof(MarcherPushConstants)
     };
 
     VkPipelineLayoutCreateInfo computeLayout {
@@ -262,20 +823,200 @@ namespace cubik {
     };
     VK_CHECK(vkCreatePipelineLayout(_device, &computeLayout, nullptr, &_gradientPipelineLayout));
 
+
+    _mainDeletionQueue.push_function([&]() {
+      vkDestroyPipelineLayout(_device, _gradientPipelineLayout, nullptr);
+      for (auto& [key, pipeline] : _backgroundPipelines) {
+        vkDestroyPipeline(_device, pipeline, nullptr);
+      }
+      _backgroundPipelines.clear();
+    });
+  }
+
+  // Draws into the marchers' output, so its format follows whether they write straight into the swapchain.
+  // Greedy meshes share the layout and state, only their vertices and culling differ
+  void Renderer::init_raster_pipeline() {
+    VkPushConstantRange pushConstant {
+      .stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+      .offset = 0,
+      .size = sizeof(RasterPushConstants)
+    };
+    VkPipelineLayoutCreateInfo layoutInfo {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .pNext = nullptr,
+      .setLayoutCount = 1,
+      .pSetLayouts = &_drawImageDescriptorLayout,
+      .pushConstantRangeCount = 1,
+      .pPushConstantRanges = &pushConstant
+    };
+    VK_CHECK(vkCreatePipelineLayout(_device, &layoutInfo, nullptr, &_rasterPipelineLayout));
+
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+      .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST
+    };
+    VkPipelineViewportStateCreateInfo viewportState {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+      .viewportCount = 1,
+      .scissorCount = 1
+    };
+    VkPipelineMultisampleStateCreateInfo multisample {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+      .minSampleShading = 1.f
+    };
+    // Reverse Z, nearer is greater
+    VkPipelineDepthStencilStateCreateInfo depthStencil {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+      .depthTestEnable = VK_TRUE,
+      .depthWriteEnable = VK_TRUE,
+      .depthCompareOp = VK_COMPARE_OP_GREATER,
+      .minDepthBounds = 0.f,
+      .maxDepthBounds = 1.f
+    };
+    VkPipelineColorBlendAttachmentState colorBlendAttachment {
+      .blendEnable = VK_FALSE,
+      .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT
+    };
+    VkPipelineColorBlendStateCreateInfo colorBlend {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+      .attachmentCount = 1,
+      .pAttachments = &colorBlendAttachment
+    };
+    VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+    VkPipelineDynamicStateCreateInfo dynamicState {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+      .dynamicStateCount = static_cast<uint32_t>(std::size(dynamicStates)),
+      .pDynamicStates = dynamicStates
+    };
+    VkFormat colorFormat = _writesToSwapchain ? DisplayFormat : DRAW_FORMAT;
+    VkPipelineRenderingCreateInfo renderingInfo {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO,
+      .colorAttachmentCount = 1,
+      .pColorAttachmentFormats = &colorFormat,
+      .depthAttachmentFormat = DEPTH_FORMAT
+    };
+
+    auto createPipeline = [&](const std::string& shaderName, VkVertexInputBindingDescription vertexBinding,
+                              VkVertexInputAttributeDescription vertexAttribute, VkCullModeFlags cullMode) {
+      VkShaderModule vertexShader, fragmentShader;
+      std::string vertexPath = SHADER_DIRECTORY + shaderName + ".vert.spv";
+      std::string fragmentPath = SHADER_DIRECTORY + shaderName + ".frag.spv";
+      if (!vkutil::load_shader_module(vertexPath.c_str(), _device, &vertexShader)
+          || !vkutil::load_shader_module(fragmentPath.c_str(), _device, &fragmentShader)) {
+        spdlog::error("Couldn't load the {} shaders from {}", shaderName, SHADER_DIRECTORY);
+        abort();
+      }
+
+      VkPipelineShaderStageCreateInfo stages[] = {
+        { .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, .stage = VK_SHADER_STAGE_VERTEX_BIT, .module = vertexShader, .pName = "main" },
+        { .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO, .stage = VK_SHADER_STAGE_FRAGMENT_BIT, .module = fragmentShader, .pName = "main" }
+      };
+      VkPipelineVertexInputStateCreateInfo vertexInput {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+        .vertexBindingDescriptionCount = 1,
+        .pVertexBindingDescriptions = &vertexBinding,
+        .vertexAttributeDescriptionCount = 1,
+        .pVertexAttributeDescriptions = &vertexAttribute
+      };
+      VkPipelineRasterizationStateCreateInfo rasterization {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+        .polygonMode = VK_POLYGON_MODE_FILL,
+        .cullMode = cullMode,
+        .frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE,
+        .lineWidth = 1.f
+      };
+      VkGraphicsPipelineCreateInfo pipelineInfo {
+        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        .pNext = &renderingInfo,
+        .stageCount = static_cast<uint32_t>(std::size(stages)),
+        .pStages = stages,
+        .pVertexInputState = &vertexInput,
+        .pInputAssemblyState = &inputAssembly,
+        .pViewportState = &viewportState,
+        .pRasterizationState = &rasterization,
+        .pMultisampleState = &multisample,
+        .pDepthStencilState = &depthStencil,
+        .pColorBlendState = &colorBlend,
+        .pDynamicState = &dynamicState,
+        .layout = _rasterPipelineLayout
+      };
+      VkPipeline pipeline;
+      VK_CHECK(vkCreateGraphicsPipelines(_device, _pipelineCache, 1, &pipelineInfo, nullptr, &pipeline));
+      vkDestroyShaderModule(_device, vertexShader, nullptr);
+      vkDestroyShaderModule(_device, fragmentShader, nullptr);
+      return pipeline;
+    };
+
+    // The importers don't agree on a winding, so both sides are drawn
+    _rasterPipeline = createPipeline("raster",
+                                     { .binding = 0, .stride = sizeof(glm::vec3), .inputRate = VK_VERTEX_INPUT_RATE_VERTEX },
+                                     { .location = 0, .binding = 0, .format = VK_FORMAT_R32G32B32_SFLOAT, .offset = 0 },
+                                     VK_CULL_MODE_NONE);
+    // Greedy quads are all counter clockwise from outside
+    _greedyMeshPipeline = createPipeline(GREEDY_MESH_SHADER,
+                                         { .binding = 0, .stride = sizeof(PackedVertex), .inputRate = VK_VERTEX_INPUT_RATE_VERTEX },
+                                         { .location = 0, .binding = 0, .format = VK_FORMAT_R32G32_UINT, .offset = 0 },
+                                         VK_CULL_MODE_BACK_BIT);
+
+    _mainDeletionQueue.push_function([&]() {
+      vkDestroyPipeline(_device, _rasterPipeline, nullptr);
+      vkDestroyPipeline(_device, _greedyMeshPipeline, nullptr);
+      vkDestroyPipelineLayout(_device, _rasterPipelineLayout, nullptr);
+    });
+  }
+
+  VkPipeline Renderer::get_background_pipeline(const PipelineVariantKey& key) {
+    if (auto existing = _backgroundPipelines.find(key); existing != _backgroundPipelines.end()) {
+      return existing->second;
+    }
+
     VkShaderModule computeDrawShader;
-    std::string shaderPath = "../shaders/" + shaderName + ".comp.spv";
+    std::string shaderPath = SHADER_DIRECTORY + key.shaderName + ".comp.spv";
 //    if (!vkutil::load_shader_module("../shaders/sphere.comp.spv", _device, &computeDrawShader))
     if (!vkutil::load_shader_module(shaderPath.c_str(), _device, &computeDrawShader))
     {
       fmt::print("Error when building the compute shader \n");
     }
 
+    VkPipeline pipeline = create_background_pipeline(key, computeDrawShader);
+    vkDestroyShaderModule(_device, computeDrawShader, nullptr);
+
+    _backgroundPipelines[key] = pipeline;
+    return pipeline;
+  }
+
+  VkPipeline Renderer::create_background_pipeline(const PipelineVariantKey& key, VkShaderModule shaderModule) {
+    CUBIK_TRACE_ZONE("create_background_pipeline");
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    // World dimensions are baked into the shader so the compiler can fold them and unroll the tree descent
+    WorldSpecializationConstants specializationConstants {
+      .voxelSize = VOXEL_SIZE,
+      .worldSize = key.worldSize,
+      .treeDepth = key.treeDepth,
+      .collectStatistics = key.collectStatistics
+    };
+    VkSpecializationMapEntry specializationEntries[] = {
+      { .constantID = 0, .offset = offsetof(WorldSpecializationConstants, voxelSize), .size = sizeof(float) },
+      { .constantID = 1, .offset = offsetof(WorldSpecializationConstants, worldSize), .size = sizeof(int) },
+      { .constantID = 2, .offset = offsetof(WorldSpecializationConstants, treeDepth), .size = sizeof(int) },
+      { .constantID = 3, .offset = offsetof(WorldSpecializationConstants, collectStatistics), .size = sizeof(VkBool32) },
+    };
+    VkSpecializationInfo specializationInfo {
+      .mapEntryCount = static_cast<uint32_t>(std::size(specializationEntries)),
+      .pMapEntries = specializationEntries,
+      .dataSize = sizeof(WorldSpecializationConstants),
+      .pData = &specializationConstants
+    };
+
     VkPipelineShaderStageCreateInfo stageInfo {
       .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
       .pNext = nullptr,
       .stage = VK_SHADER_STAGE_COMPUTE_BIT,
-      .module = computeDrawShader,
-      .pName = "main"
+      .module = shaderModule,
+      .pName = "main",
+      .pSpecializationInfo = &specializationInfo
     };
     VkComputePipelineCreateInfo computePipelineCreateInfo {
       .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
@@ -284,62 +1025,139 @@ namespace cubik {
       .layout = _gradientPipelineLayout
     };
 
-    VK_CHECK(vkCreateComputePipelines(_device,VK_NULL_HANDLE,1,&computePipelineCreateInfo, nullptr, &_gradientPipeline));
+    VkPipeline pipeline;
+    VK_CHECK(vkCreateComputePipelines(_device, _pipelineCache, 1, &computePipelineCreateInfo, nullptr, &pipeline));
 
-    vkDestroyShaderModule(_device, computeDrawShader, nullptr);
-    _mainDeletionQueue.push_function([&]() {
-      vkDestroyPipelineLayout(_device, _gradientPipelineLayout, nullptr);
-      vkDestroyPipeline(_device, _gradientPipeline, nullptr);
-    });
+    std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+    spdlog::info("Built {} variant for size {} and depth {}{} in {:.2f}ms", key.shaderName, key.worldSize, key.treeDepth,
+                 key.collectStatistics ? " with statistics" : "", elapsed.count());
+    return pipeline;
+  }
+
+#ifdef CUBIK_SHADER_HOT_RELOAD
+  void Renderer::reload_changed_shaders() {
+    for (const std::string& shaderName : _shaderWatcher.poll()) {
+      VkShaderModule shaderModule;
+      if (!vkutil::compile_shader_module(_shaderWatcher.sourcePath(shaderName).c_str(), _device, &shaderModule)) {
+        spdlog::warn("Keeping the previous {} pipelines", shaderName);
+        continue;
+      }
+
+      for (auto& [key, pipeline] : _backgroundPipelines) {
+        if (key.shaderName != shaderName) continue;
+
+        // The other frame in flight may still be using the old pipeline, so it goes through this frame's deletion queue
+        VkPipeline oldPipeline = pipeline;
+        get_current_frame()._deletionQueue.push_function([=, this]() {
+          vkDestroyPipeline(_device, oldPipeline, nullptr);
+        });
+        pipeline = create_background_pipeline(key, shaderModule);
+      }
+      vkDestroyShaderModule(_device, shaderModule, nullptr);
+
+      if (!_activeBackgroundVariant.isRasterized()) {
+        _gradientPipeline = _backgroundPipelines[_activeBackgroundVariant];
+      }
+      spdlog::info("Reloaded {}", shaderName);
+    }
   }
+#endif
 
 
   // Main
   void Renderer::draw(const Camera& camera) {
-    VK_CHECK(vkWaitForFences(_device, 1, &get_current_frame()._renderFence, true, 1000000000));
+    if (!is_world_ready()) {
+      // The first world still has to make progress, and there is no old world to retire when it's swapped in
+      retire_async_submissions();
+      poll_world_upload();
+      if (!is_world_ready()) {
+        _rasterDraws.clear();
+        return;
+      }
+    }
+
+    CUBIK_TRACE_ZONE("Renderer::draw");
+    {
+      CUBIK_TRACE_ZONE("wait for frame fence");
+      VK_CHECK(vkWaitForFences(_device, 1, &get_current_frame()._renderFence, true, 1000000000));
+    }
     get_current_frame()._deletionQueue.flush();
     VK_CHECK(vkResetFences(_device, 1, &get_current_frame()._renderFence));
+    if (get_current_frame()._hasStatistics) {
+      read_statistics(get_current_frame());
+    }
+    complete_ray_queries();
+
+    retire_async_submissions();
+    poll_world_upload();
+    bind_world(get_current_frame());
+    bind_models(get_current_frame());
+
+#ifdef CUBIK_SHADER_HOT_RELOAD
+    if (_frameNumber % SHADER_POLL_INTERVAL == 0) {
+      reload_changed_shaders();
+    }
+#endif
 
     uint32_t swapchainImageIndex;
-    VK_CHECK(vkAcquireNextImageKHR(_device, _swapchain, 1000000000, get_current_frame()._swapchainSemaphore, nullptr, &swapchainImageIndex));
+    {
+      CUBIK_TRACE_ZONE("acquire swapchain image");
+      VK_CHECK(vkAcquireNextImageKHR(_device, _swapchain, 1000000000, get_current_frame()._swapchainSemaphore, nullptr, &swapchainImageIndex));
+    }
 
-    CameraPushConstants pc {
+    upload_animation(get_current_frame());
+    MarcherPushConstants pc {
       .position = camera.Position,
       .forward = camera.Forward,
-      .up = camera.Up
+      .up = camera.Up,
+      .view = _debugView
     };
+    update_accumulation(camera, pc);
+    pc.rayQueryCount = upload_ray_queries(get_current_frame()).count;
+    pc.instanceNodeCount = upload_instances(get_current_frame());
+    upload_palette(get_current_frame());
+    // Meshes still being copied are skipped instead of stalling the frame
+    std::erase_if(_rasterDraws, [&](const RasterDraw& rasterDraw) {
+      return !is_async_complete(_rasterMeshes[rasterDraw.mesh].readyValue);
+    });
 
     VkCommandBuffer cmd = get_current_frame()._mainCommandBuffer;
     VK_CHECK(vkResetCommandBuffer(cmd, 0));
     VkCommandBufferBeginInfo cmdBeginInfo = vkutil::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
     VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
+    _profiler.begin_frame(_device, cmd, _frameNumber % FRAME_OVERLAP);
 
-    _drawExtent.width = _drawImage.imageExtent.width;
-    _drawExtent.height = _drawImage.imageExtent.height;
+    build_frame_graph(pc, swapchainImageIndex);
+    _frameGraph.compile(get_current_frame()._deletionQueue);
 
-    vkutil::transition_image(cmd, _drawImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
 //    draw_background(cmd);
-    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _gradientPipeline);
-    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _gradientPipelineLayout, 0, 1, &_drawImageDescriptors, 0, nullptr);
-    vkCmdPushConstants(cmd, _gradientPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CameraPushConstants), &pc);
-    vkCmdDispatch(cmd, std::ceil(_drawExtent.width / 16.0), std::ceil(_drawExtent.height / 16.0), 1);
-    vkutil::transition_image(cmd, _drawImage.image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
-
-    vkutil::transition_image(cmd, _swapchainImages[swapchainImageIndex], VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-    vkutil::copy_image_to_image(cmd, _drawImage.image, _swapchainImages[swapchainImageIndex], _drawExtent, _swapchainExtent);
-    vkutil::transition_image(cmd, _swapchainImages[swapchainImageIndex],VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+    // Rasterized worlds have no marcher, their passes bind the graphics pipelines themselves
+    if (!_activeBackgroundVariant.isRasterized()) {
+      bind_frame_images(get_current_frame(), _frameGraph.get_image_view(_frameOutput), _frameGraph.get_image_view(_frameHits));
+      vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _gradientPipeline);
+      vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _gradientPipelineLayout, 0, 1, &get_current_frame()._descriptors, 0, nullptr);
+    }
+    _frameGraph.execute(cmd);
 
     VK_CHECK(vkEndCommandBuffer(cmd));
 
     VkCommandBufferSubmitInfo cmdSubmitInfo = vkutil::command_buffer_submit_info(cmd);
 
-    VkSemaphoreSubmitInfo waitInfo = vkutil::semaphore_submit_info(VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR,get_current_frame()._swapchainSemaphore);
-    VkSemaphoreSubmitInfo signalInfo = vkutil::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_GRAPHICS_BIT, get_current_frame()._renderSemaphore);
+    VkSemaphoreSubmitInfo waitInfos[] = {
+      vkutil::semaphore_submit_info(swapchain_wait_stage(), get_current_frame()._swapchainSemaphore),
+      // Only holds the GPU back while the first world is still being copied
+      vkutil::semaphore_submit_info(VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_VERTEX_INPUT_BIT,
+                                    _asyncTimeline, _worldReadyValue)
+    };
+    // The present layout transition is the last thing in the command buffer and isn't tied to any stage
+    VkSemaphoreSubmitInfo signalInfo = vkutil::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, get_current_frame()._renderSemaphore);
 
-    VkSubmitInfo2 submit = vkutil::submit_info(&cmdSubmitInfo, &signalInfo, &waitInfo);
+    VkSubmitInfo2 submit = vkutil::submit_info(&cmdSubmitInfo, &signalInfo, waitInfos);
+    submit.waitSemaphoreInfoCount = static_cast<uint32_t>(std::size(waitInfos));
 
 
     VK_CHECK(vkQueueSubmit2(_graphicsQueue, 1, &submit, get_current_frame()._renderFence));
+    _rasterDraws.clear();
 
     VkPresentInfoKHR presentInfo = {
       .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
@@ -351,17 +1169,763 @@ namespace cubik {
       .pImageIndices = &swapchainImageIndex
     };
 
-    VK_CHECK(vkQueuePresentKHR(_graphicsQueue, &presentInfo));
+    {
+      CUBIK_TRACE_ZONE("present");
+      VK_CHECK(vkQueuePresentKHR(_graphicsQueue, &presentInfo));
+    }
 
     _frameNumber++;
   }
 
-  void Renderer::draw_background(VkCommandBuffer cmd) {
+  VkPipelineStageFlags2 Renderer::swapchain_wait_stage() const {
+    if (!_writesToSwapchain) return VK_PIPELINE_STAGE_2_BLIT_BIT;
+    return _activeBackgroundVariant.isRasterized() ? VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT : VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  }
+
+  void Renderer::build_frame_graph(MarcherPushConstants& pc, uint32_t swapchainImageIndex) {
+    constexpr VkPipelineStageFlags2 compute = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    auto read = [](FrameResource resource) {
+      return ResourceUse { resource, compute, VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_IMAGE_LAYOUT_GENERAL };
+    };
+    auto write = [](FrameResource resource) {
+      return ResourceUse { resource, compute, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL };
+    };
+    auto readWrite = [](FrameResource resource) {
+      return ResourceUse { resource, compute, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL };
+    };
+
+    _frameGraph.reset();
+    VkExtent3D drawExtent = { _drawExtent.width, _drawExtent.height, 1 };
+
+    // Freshly acquired, so its contents are discarded and the first use only waits on the acquire semaphore
+    FrameResource swapchain = _frameGraph.import_image("swapchain", _swapchainImages[swapchainImageIndex], _swapchainImageViews[swapchainImageIndex],
+                                                       ResourceState { .writeStages = swapchain_wait_stage() });
+    _frameGraph.set_final_layout(swapchain, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+    FrameResource world = _frameGraph.import_buffer("world", _worldBuffer.buffer);
+    FrameData& frame = get_current_frame();
+    if (!_animationCopies.empty()) {
+      _frameGraph.add_pass("animation upload", {
+        { world, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT }
+      }, [this, source = frame._animationStaging.buffer, destination = _worldBuffer.buffer](VkCommandBuffer cmd) {
+        // The graph only orders passes within the frame, the last frame's marchers may still read the old root
+        vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+        _profiler.begin_zone(cmd, "animation upload");
+        vkCmdCopyBuffer(cmd, source, destination, static_cast<uint32_t>(_animationCopies.size()), _animationCopies.data());
+        _profiler.end_zone(cmd);
+      });
+    }
+    _frameOutput = _writesToSwapchain
+      ? swapchain
+      : _frameGraph.create_image("draw", drawExtent, DRAW_FORMAT, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+    auto addBlit = [&]() {
+      if (_writesToSwapchain) return;
+      FrameResource output = _frameOutput;
+      _frameGraph.add_pass("blit", {
+        { output, VK_PIPELINE_STAGE_2_BLIT_BIT, VK_ACCESS_2_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL },
+        { swapchain, VK_PIPELINE_STAGE_2_BLIT_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL }
+      }, [this, output, swapchain](VkCommandBuffer cmd) {
+        _profiler.begin_zone(cmd, "blit");
+        vkutil::copy_image_to_image(cmd, _frameGraph.get_image(output), _frameGraph.get_image(swapchain), _drawExtent, _swapchainExtent);
+        _profiler.end_zone(cmd);
+      });
+    };
+
+    // A single draw of the whole world straight out of its buffer, with the meshes in the same rendering.
+    // There is nothing to trace, so no secondary effects or statistics either
+    if (_activeBackgroundVariant.isRasterized()) {
+      frame._hasStatistics = false;
+
+      _frameDepth = _frameGraph.create_image("depth", drawExtent, DEPTH_FORMAT, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
+      _frameGraph.add_pass("greedy mesh", {
+        { world, VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_VERTEX_INPUT_BIT,
+          VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_2_INDEX_READ_BIT },
+        { _frameOutput, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL },
+        { _frameDepth, VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+          VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL }
+      }, [&](VkCommandBuffer cmd) {
+        draw_greedy_mesh(cmd, pc);
+      });
+      addBlit();
+      return;
+    }
+
+    FrameResource shadows = _frameGraph.import_image("shadows", _shadowImage.image, _shadowImage.imageView);
+    FrameResource ambientOcclusion = _frameGraph.import_image("ambient occlusion", _aoImage.image, _aoImage.imageView);
+    _frameHits = _frameGraph.create_image("hits", drawExtent, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT);
+    FrameResource rayDepth = _frameGraph.import_buffer("ray depth", _rayDepth.buffer);
+    bool isRasterizing = !_rasterDraws.empty();
+
+    // Tracing passes also count into the statistics buffer when the variant collects them
+    bool collectStatistics = _activeBackgroundVariant.collectStatistics;
+    FrameResource statistics = _frameGraph.import_buffer("statistics", frame._statistics.buffer);
+    auto traceUses = [&](std::vector<ResourceUse> uses) {
+      if (collectStatistics) uses.push_back(readWrite(statistics));
+      return uses;
+    };
+    frame._hasStatistics = collectStatistics;
+    if (collectStatistics) {
+      _frameGraph.add_pass("clear statistics", {
+        { statistics, VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT }
+      }, [buffer = frame._statistics.buffer](VkCommandBuffer cmd) {
+        vkCmdFillBuffer(cmd, buffer, 0, VK_WHOLE_SIZE, 0);
+      });
+    }
+
+    if (pc.rayQueryCount > 0) {
+      const RayQueryBatch& batch = _rayQueryBatches[_frameNumber % RAY_QUERY_RING_SIZE];
+      FrameResource queries = _frameGraph.import_buffer("ray queries", batch.queries.buffer);
+      FrameResource hits = _frameGraph.import_buffer("ray query hits", batch.hits.buffer);
+      _frameGraph.add_pass("ray queries", { read(world), read(queries), write(hits) }, [&](VkCommandBuffer cmd) {
+        pc.pass = MarcherPass::RayQuery;
+        vkCmdPushConstants(cmd, _gradientPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(MarcherPushConstants), &pc);
+
+        _profiler.begin_zone(cmd, "ray queries");
+        vkCmdDispatch(cmd, (pc.rayQueryCount + RAY_QUERY_GROUP_SIZE - 1) / RAY_QUERY_GROUP_SIZE, 1, 1);
+        _profiler.end_zone(cmd);
+        vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
+      });
+    }
+
+    _frameGraph.add_pass("primary", traceUses({ read(world), write(_frameHits), write(rayDepth) }), [&](VkCommandBuffer cmd) {
+      dispatch_marcher_pass(cmd, pc, MarcherPass::Primary, "primary");
+    });
+
+    // Depth formats can't be storage images, so the marchers write a buffer that's copied into the attachment
+    if (isRasterizing) {
+      _frameDepth = _frameGraph.create_image("depth", drawExtent, DEPTH_FORMAT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
+      _frameGraph.add_pass("depth", {
+        { rayDepth, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT },
+        { _frameDepth, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL }
+      }, [this, source = _rayDepth.buffer, depth = _frameDepth, drawExtent](VkCommandBuffer cmd) {
+        VkBufferImageCopy copy {
+          .bufferOffset = 0,
+          .bufferRowLength = 0,
+          .bufferImageHeight = 0,
+          .imageSubresource = { .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT, .mipLevel = 0, .baseArrayLayer = 0, .layerCount = 1 },
+          .imageOffset = { 0, 0, 0 },
+          .imageExtent = drawExtent
+        };
+        _profiler.begin_zone(cmd, "depth");
+        vkCmdCopyBufferToImage(cmd, source, _frameGraph.get_image(depth), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+        _profiler.end_zone(cmd);
+      });
+    }
+
+    std::vector<ResourceUse> resolveUses = { read(_frameHits), write(_frameOutput) };
+    if (pc.shadowRays > 0) {
+      _frameGraph.add_pass("shadows", traceUses({ read(world), read(_frameHits), readWrite(shadows) }), [&](VkCommandBuffer cmd) {
+        dispatch_marcher_pass(cmd, pc, MarcherPass::Shadows, "shadows");
+      });
+      resolveUses.push_back(read(shadows));
+    }
+    if (pc.aoRays > 0) {
+      _frameGraph.add_pass("ambient occlusion", traceUses({ read(world), read(_frameHits), readWrite(ambientOcclusion) }), [&](VkCommandBuffer cmd) {
+        dispatch_marcher_pass(cmd, pc, MarcherPass::AmbientOcclusion, "ambient occlusion");
+      });
+      resolveUses.push_back(read(ambientOcclusion));
+    }
+
+    if (collectStatistics) {
+      FrameResource readback = _frameGraph.import_buffer("statistics readback", frame._statisticsReadback.buffer);
+      _frameGraph.add_pass("read back statistics", {
+        { statistics, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT },
+        { readback, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT }
+      }, [source = frame._statistics.buffer, destination = frame._statisticsReadback.buffer](VkCommandBuffer cmd) {
+        VkBufferCopy copy { .srcOffset = 0, .dstOffset = 0, .size = sizeof(TraversalStatistics) };
+        vkCmdCopyBuffer(cmd, source, destination, 1, &copy);
+        // The fence doesn't make device writes visible to the host on its own
+        vkutil::memory_barrier(cmd, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
+      });
+    }
+
+    _frameGraph.add_pass("resolve", std::move(resolveUses), [&](VkCommandBuffer cmd) {
+      dispatch_marcher_pass(cmd, pc, MarcherPass::Resolve, "resolve");
+    });
+
+    // Over the shaded voxels, which only show where they're nearer than the meshes
+    if (isRasterizing) {
+      _frameGraph.add_pass("raster", {
+        { _frameOutput, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+          VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL },
+        { _frameDepth, VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+          VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL }
+      }, [&](VkCommandBuffer cmd) {
+        draw_raster_meshes(cmd, pc);
+      });
+    }
+
+    addBlit();
+  }
+
+  void Renderer::dispatch_marcher_pass(VkCommandBuffer cmd, MarcherPushConstants& pc, MarcherPass pass, const char* zoneName) {
+    pc.pass = pass;
+    vkCmdPushConstants(cmd, _gradientPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(MarcherPushConstants), &pc);
+
+    _profiler.begin_zone(cmd, zoneName);
+    vkCmdDispatch(cmd, std::ceil(_drawExtent.width / 16.0), std::ceil(_drawExtent.height / 16.0), 1);
+    _profiler.end_zone(cmd);
+  }
+
+  RasterPushConstants Renderer::raster_push_constants(const MarcherPushConstants& pc) const {
+    return {
+      .cameraPosition = pc.position,
+      .aspectRatio = static_cast<float>(_drawExtent.width) / _drawExtent.height,
+      .cameraForward = pc.forward,
+      .cameraUp = pc.up
+    };
+  }
+
+  void Renderer::draw_raster_meshes(VkCommandBuffer cmd, const MarcherPushConstants& pc) {
+    VkRenderingAttachmentInfo colorAttachment {
+      .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+      .imageView = _frameGraph.get_image_view(_frameOutput),
+      .imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+      .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+      .storeOp = VK_ATTACHMENT_STORE_OP_STORE
+    };
+    VkRenderingAttachmentInfo depthAttachment {
+      .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+      .imageView = _frameGraph.get_image_view(_frameDepth),
+      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+      .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+      .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE
+    };
+    VkRenderingInfo renderingInfo {
+      .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+      .renderArea = { { 0, 0 }, _drawExtent },
+      .layerCount = 1,
+      .colorAttachmentCount = 1,
+      .pColorAttachments = &colorAttachment,
+      .pDepthAttachment = &depthAttachment
+    };
+
+    _profiler.begin_zone(cmd, "raster");
+    vkCmdBeginRendering(cmd, &renderingInfo);
+    VkViewport viewport { 0, 0, static_cast<float>(_drawExtent.width), static_cast<float>(_drawExtent.height), 0, 1 };
+    VkRect2D scissor { { 0, 0 }, _drawExtent };
+    vkCmdSetViewport(cmd, 0, 1, &viewport);
+    vkCmdSetScissor(cmd, 0, 1, &scissor);
+
+    RasterPushConstants constants = raster_push_constants(pc);
+    record_raster_draws(cmd, constants);
+    vkCmdEndRendering(cmd);
+    _profiler.end_zone(cmd);
+  }
+
+  void Renderer::record_raster_draws(VkCommandBuffer cmd, RasterPushConstants& constants) {
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _rasterPipeline);
+    for (const RasterDraw& rasterDraw : _rasterDraws) {
+      const RasterMesh& mesh = _rasterMeshes[rasterDraw.mesh];
+      constants.objectToWorld = rasterDraw.transform;
+      constants.color = glm::vec4(rasterDraw.color, 1.f);
+      vkCmdPushConstants(cmd, _rasterPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(RasterPushConstants), &constants);
+
+      VkDeviceSize vertexOffset = 0;
+      vkCmdBindVertexBuffers(cmd, 0, 1, &mesh.buffer.buffer, &vertexOffset);
+      vkCmdBindIndexBuffer(cmd, mesh.buffer.buffer, mesh.indexOffset, VK_INDEX_TYPE_UINT32);
+      vkCmdDrawIndexed(cmd, mesh.indexCount, 1, 0, 0, 0);
+    }
+  }
+
+  // The mesh sits right after the voxel size in the world buffer, see GreedyMeshWorld::serialize
+  void Renderer::draw_greedy_mesh(VkCommandBuffer cmd, const MarcherPushConstants& pc) {
+    VkRenderingAttachmentInfo colorAttachment {
+      .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+      .imageView = _frameGraph.get_image_view(_frameOutput),
+      .imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+      .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+      .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+      .clearValue = { .color = { { 1.f, 0.8196f, 0.4f, 1.f } } } // The marchers' sky
+    };
+    VkRenderingAttachmentInfo depthAttachment {
+      .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+      .imageView = _frameGraph.get_image_view(_frameDepth),
+      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+      .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+      .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+      .clearValue = { .depthStencil = { .depth = 0.f } } // Reverse Z, so the far plane
+    };
+    VkRenderingInfo renderingInfo {
+      .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+      .renderArea = { { 0, 0 }, _drawExtent },
+      .layerCount = 1,
+      .colorAttachmentCount = 1,
+      .pColorAttachments = &colorAttachment,
+      .pDepthAttachment = &depthAttachment
+    };
+
+    _profiler.begin_zone(cmd, "greedy mesh");
+    vkCmdBeginRendering(cmd, &renderingInfo);
+    VkViewport viewport { 0, 0, static_cast<float>(_drawExtent.width), static_cast<float>(_drawExtent.height), 0, 1 };
+    VkRect2D scissor { { 0, 0 }, _drawExtent };
+    vkCmdSetViewport(cmd, 0, 1, &viewport);
+    vkCmdSetScissor(cmd, 0, 1, &scissor);
+
+    RasterPushConstants constants = raster_push_constants(pc);
+    if (_worldMesh.drawCount > 0) {
+      constants.objectToWorld = glm::scale(glm::mat4(1.f), glm::vec3(VOXEL_SIZE));
+      vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _greedyMeshPipeline);
+      vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _rasterPipelineLayout, 0, 1, &get_current_frame()._descriptors, 0, nullptr);
+      vkCmdPushConstants(cmd, _rasterPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(RasterPushConstants), &constants);
+
+      VkDeviceSize meshOffset = sizeof(VOXEL_SIZE);
+      VkDeviceSize vertexOffset = meshOffset + _worldMesh.verticesOffset();
+      vkCmdBindVertexBuffers(cmd, 0, 1, &_worldBuffer.buffer, &vertexOffset);
+      vkCmdBindIndexBuffer(cmd, _worldBuffer.buffer, meshOffset + _worldMesh.indicesOffset(), VK_INDEX_TYPE_UINT32);
+      vkCmdDrawIndexedIndirect(cmd, _worldBuffer.buffer, meshOffset + _worldMesh.drawsOffset(), _worldMesh.drawCount, sizeof(MeshDrawCommand));
+    }
+    record_raster_draws(cmd, constants);
+    vkCmdEndRendering(cmd);
+    _profiler.end_zone(cmd);
+  }
+
+  void Renderer::update_accumulation(const Camera& camera, MarcherPushConstants& pc) {
+    const ShadingSettings& settings = SHADING_QUALITY_TIERS[static_cast<int>(_shadingQuality)];
+    pc.shadowRays = settings.shadows.raysPerPixel;
+    pc.aoRays = settings.ambientOcclusion.raysPerPixel;
+    pc.aoRadius = settings.ambientOcclusion.distance;
+    pc.frameIndex = _frameNumber;
+
+    // Without reprojection the history is only valid while neither the camera nor the world change
+    bool isHistoryValid = camera.Position == _accumulatedCameraPosition
+                          && camera.Forward == _accumulatedCameraForward
+                          && _worldGeneration == _accumulatedWorldGeneration
+                          && _instanceGeneration == _accumulatedInstanceGeneration;
+    if (!isHistoryValid) {
+      _accumulatedCameraPosition = camera.Position;
+      _accumulatedCameraForward = camera.Forward;
+      _accumulatedWorldGeneration = _worldGeneration;
+      _accumulatedInstanceGeneration = _instanceGeneration;
+      _accumulatedFrames = 0;
+    }
+
+    float historyWeight = std::min(_accumulatedFrames / (_accumulatedFrames + 1.f), MAX_HISTORY_WEIGHT);
+    pc.shadowHistoryWeight = settings.shadows.temporalAccumulation ? historyWeight : 0.f;
+    pc.aoHistoryWeight = settings.ambientOcclusion.temporalAccumulation ? historyWeight : 0.f;
+    _accumulatedFrames++;
+  }
+
+  void Renderer::set_shading_quality(ShadingQuality quality) {
+    _shadingQuality = quality;
+    _accumulatedFrames = 0;
+  }
+
+  void Renderer::set_palette(const Palette& palette) {
+    _palette = palette;
+    _paletteGeneration++;
+  }
+
+  void Renderer::set_statistics_enabled(bool enabled) {
+    _collectStatistics = enabled;
+    if (_pendingWorld) _pendingWorld->variant.collectStatistics = enabled;
+
+    // Before the first world is ready there is no variant to switch, and rasterized worlds don't trace
+    if (_activeBackgroundVariant.shaderName.empty() || _activeBackgroundVariant.isRasterized()
+        || _activeBackgroundVariant.collectStatistics == enabled) return;
+    _activeBackgroundVariant.collectStatistics = enabled;
+    _gradientPipeline = get_background_pipeline(_activeBackgroundVariant);
+  }
+
+  void Renderer::read_statistics(FrameData& frame) {
+    VK_CHECK(vmaInvalidateAllocation(_allocator, frame._statisticsReadback.allocation, 0, VK_WHOLE_SIZE));
+    memcpy(&_statistics, frame._statisticsReadback.info.pMappedData, sizeof(TraversalStatistics));
+    frame._hasStatistics = false;
+
+    if (_frameNumber % STATISTICS_REPORT_INTERVAL != 0) return;
+
+    std::pair<const char*, const RayStatistics*> rayKinds[] = {
+      { "Primary", &_statistics.primary },
+      { "Secondary", &_statistics.secondary }
+    };
+    for (auto [name, stats] : rayKinds) {
+      if (stats->rays == 0) continue;
+
+      std::string histogram;
+      for (uint64_t bucket : stats->stepHistogram) {
+        if (!histogram.empty()) histogram += ' ';
+        histogram += std::to_string(bucket);
+      }
+      spdlog::info("{} rays: {}, {:.1f} steps and {:.1f} nodes per ray, {} over budget, steps histogram [{}]", name, stats->rays,
+                   static_cast<double>(stats->steps) / stats->rays, static_cast<double>(stats->nodesFetched) / stats->rays,
+                   stats->raysOverBudget, histogram);
+    }
+  }
+
+  void Renderer::create_ray_query_batch(RayQueryBatch& batch, uint32_t capacity) {
+    batch.queries = create_buffer(capacity * sizeof(RayQuery), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+    batch.hits = create_buffer(capacity * sizeof(RayQueryHit), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+    batch.capacity = capacity;
+  }
+
+  void Renderer::destroy_ray_query_batch(RayQueryBatch& batch) {
+    destroy_buffer(batch.queries);
+    destroy_buffer(batch.hits);
+    batch.capacity = 0;
+  }
+
+  RayQueryTicket Renderer::submit_ray_queries(std::span<const RayQuery> queries) {
+    if (_pendingRayQueries.size() + queries.size() > MAX_RAY_QUERIES) {
+      spdlog::error("Can't trace more than {} ray queries in a frame", MAX_RAY_QUERIES);
+      abort();
+    }
+
+    RayQueryTicket ticket {
+      .frame = static_cast<uint64_t>(_frameNumber),
+      .first = static_cast<uint32_t>(_pendingRayQueries.size()),
+      .count = static_cast<uint32_t>(queries.size())
+    };
+    _pendingRayQueries.insert(_pendingRayQueries.end(), queries.begin(), queries.end());
+    return ticket;
+  }
+
+  std::optional<std::span<const RayQueryHit>> Renderer::get_ray_query_results(const RayQueryTicket& ticket) const {
+    const RayQueryBatch& batch = _rayQueryBatches[ticket.frame % RAY_QUERY_RING_SIZE];
+    if (ticket.frame < batch.frame) {
+      spdlog::error("Ray queries submitted on frame {} were read after their batch was reused", ticket.frame);
+      abort();
+    }
+    if (ticket.frame > batch.frame || !batch.isComplete) return std::nullopt;
+
+    auto hits = static_cast<const RayQueryHit*>(batch.hits.info.pMappedData);
+    return std::span<const RayQueryHit>(hits + ticket.first, ticket.count);
+  }
+
+  // Called after the frame's fence wait, which means the frame FRAME_OVERLAP frames ago has finished
+  void Renderer::complete_ray_queries() {
+    if (_frameNumber < static_cast<int>(FRAME_OVERLAP)) return;
+
+    uint64_t completedFrame = _frameNumber - FRAME_OVERLAP;
+    RayQueryBatch& batch = _rayQueryBatches[completedFrame % RAY_QUERY_RING_SIZE];
+    if (batch.frame != completedFrame || batch.isComplete) return;
+
+    if (batch.count > 0) {
+      VK_CHECK(vmaInvalidateAllocation(_allocator, batch.hits.allocation, 0, batch.count * sizeof(RayQueryHit)));
+    }
+    batch.isComplete = true;
+  }
+
+  // Takes over the batch the frame RAY_QUERY_RING_SIZE frames ago used, which finished before the last frame started
+  RayQueryBatch& Renderer::upload_ray_queries(FrameData& frame) {
+    RayQueryBatch& batch = _rayQueryBatches[_frameNumber % RAY_QUERY_RING_SIZE];
+    auto count = static_cast<uint32_t>(_pendingRayQueries.size());
+    if (count > batch.capacity) {
+      destroy_ray_query_batch(batch);
+      create_ray_query_batch(batch, std::bit_ceil(count));
+    }
+
+    batch.frame = _frameNumber;
+    batch.count = count;
+    batch.isComplete = false;
+    if (count > 0) {
+      if (_activeBackgroundVariant.isRasterized()) {
+        // Nothing traces the queries, so their misses are written straight into the readback buffer
+        auto hits = static_cast<RayQueryHit*>(batch.hits.info.pMappedData);
+        for (uint32_t i = 0; i < count; i++) {
+          hits[i] = {
+            .position = glm::vec3(0),
+            .distance = _pendingRayQueries[i].maxDistance,
+            .voxel = glm::ivec3(-1),
+            .face = 0,
+            .instance = -1,
+            .material = 0
+          };
+        }
+        VK_CHECK(vmaFlushAllocation(_allocator, batch.hits.allocation, 0, count * sizeof(RayQueryHit)));
+      } else {
+        memcpy(batch.queries.info.pMappedData, _pendingRayQueries.data(), count * sizeof(RayQuery));
+        VK_CHECK(vmaFlushAllocation(_allocator, batch.queries.allocation, 0, count * sizeof(RayQuery)));
+      }
+      _pendingRayQueries.clear();
+    }
+
+    if (frame._boundRayQueries != batch.queries.buffer) {
+      VkDescriptorBufferInfo bufferInfos[] = {
+        { .buffer = batch.queries.buffer, .offset = 0, .range = VK_WHOLE_SIZE },
+        { .buffer = batch.hits.buffer, .offset = 0, .range = VK_WHOLE_SIZE }
+      };
+      VkWriteDescriptorSet writes[2];
+      for (uint32_t i = 0; i < 2; i++) {
+        writes[i] = {
+          .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+          .pNext = nullptr,
+          .dstSet = frame._descriptors,
+          .dstBinding = 6 + i,
+          .descriptorCount = 1,
+          .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+          .pBufferInfo = &bufferInfos[i]
+        };
+      }
+      vkUpdateDescriptorSets(_device, 2, writes, 0, nullptr);
+      frame._boundRayQueries = batch.queries.buffer;
+    }
+    return batch;
+  }
+
+  ModelHandle Renderer::add_model(const World& model) {
+    if (model.getCompatibleShader() != SVO_SHADER || model.isBuiltOnGpu()) {
+      spdlog::error("Instanced models have to be octrees built on the CPU");
+      abort();
+    }
+    auto svo = dynamic_cast<const SvoWorld*>(&model);
+    if (svo && svo->hasLeafBricks()) {
+      spdlog::error("Instanced models can't have leaf bricks");
+      abort();
+    }
+    if (_models.size() >= MAX_MODELS) {
+      spdlog::error("Can't have more than {} instanced models", MAX_MODELS);
+      abort();
+    }
+
+    // Same header as the world, the marchers read the model's size from it
+    size_t bufferSize = sizeof(VOXEL_SIZE) + model.calculateSerializedSize();
+    AllocatedBuffer stagingBuffer = create_buffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+    memcpy(stagingBuffer.info.pMappedData, &VOXEL_SIZE, sizeof(VOXEL_SIZE));
+    model.serialize(static_cast<char*>(stagingBuffer.info.pMappedData) + sizeof(VOXEL_SIZE));
+    AllocatedBuffer buffer = create_buffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, 0, true);
+
+    VkBuffer source = stagingBuffer.buffer;
+    VkBuffer destination = buffer.buffer;
+    vkutil::DeletionQueue onComplete;
+    onComplete.push_function([=, this]() {
+      destroy_buffer(stagingBuffer);
+    });
+    uint64_t readyValue = submit_async([=](VkCommandBuffer cmd) {
+      VkBufferCopy copyRegion { .srcOffset = 0, .dstOffset = 0, .size = bufferSize };
+      vkCmdCopyBuffer(cmd, source, destination, 1, &copyRegion);
+    }, std::move(onComplete));
+
+    _models.push_back({ buffer, model.getSize(), readyValue });
+    return static_cast<ModelHandle>(_models.size() - 1);
+  }
+
+  RasterMeshHandle Renderer::add_raster_mesh(const Mesh& mesh) {
+    if (mesh.triangles.empty()) {
+      spdlog::error("Raster meshes need at least a triangle");
+      abort();
+    }
+
+    // The triangles' indices are read as a uint32 index buffer right after the positions
+    size_t vertexSize = mesh.positions.size() * sizeof(glm::vec3);
+    size_t indexSize = mesh.triangles.size() * sizeof(glm::ivec3);
+    size_t bufferSize = vertexSize + indexSize;
+    AllocatedBuffer stagingBuffer = create_buffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+    auto staging = static_cast<char*>(stagingBuffer.info.pMappedData);
+    memcpy(staging, mesh.positions.data(), vertexSize);
+    memcpy(staging + vertexSize, mesh.triangles.data(), indexSize);
+    AllocatedBuffer buffer = create_buffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                           VMA_MEMORY_USAGE_GPU_ONLY, 0, true);
+
+    VkBuffer source = stagingBuffer.buffer;
+    VkBuffer destination = buffer.buffer;
+    vkutil::DeletionQueue onComplete;
+    onComplete.push_function([=, this]() {
+      destroy_buffer(stagingBuffer);
+    });
+    uint64_t readyValue = submit_async([=](VkCommandBuffer cmd) {
+      VkBufferCopy copyRegion { .srcOffset = 0, .dstOffset = 0, .size = bufferSize };
+      vkCmdCopyBuffer(cmd, source, destination, 1, &copyRegion);
+    }, std::move(onComplete));
+
+    _rasterMeshes.push_back({ buffer, vertexSize, static_cast<uint32_t>(3 * mesh.triangles.size()), readyValue });
+    return static_cast<RasterMeshHandle>(_rasterMeshes.size() - 1);
+  }
+
+  void Renderer::draw_raster_mesh(RasterMeshHandle mesh, const glm::mat4& transform, glm::vec3 color) {
+    if (mesh < 0 || mesh >= static_cast<int>(_rasterMeshes.size())) {
+      spdlog::error("Raster mesh {} doesn't exist", mesh);
+      abort();
+    }
+    _rasterDraws.push_back({ mesh, transform, color });
+  }
+
+  InstanceHandle Renderer::add_instance(ModelHandle model, const glm::mat4& transform) {
+    if (model < 0 || model >= static_cast<int>(_models.size())) {
+      spdlog::error("Model {} doesn't exist", model);
+      abort();
+    }
+
+    _instanceGeneration++;
+    ModelInstance instance { model, transform, true };
+    if (!_freeInstances.empty()) {
+      InstanceHandle handle = _freeInstances.back();
+      _freeInstances.pop_back();
+      _instances[handle] = instance;
+      return handle;
+    }
+    _instances.push_back(instance);
+    return static_cast<InstanceHandle>(_instances.size() - 1);
+  }
+
+  void Renderer::set_instance_transform(InstanceHandle instance, const glm::mat4& transform) {
+    _instances[instance].transform = transform;
+    _instanceGeneration++;
+  }
+
+  void Renderer::remove_instance(InstanceHandle instance) {
+    _instances[instance].isAlive = false;
+    _freeInstances.push_back(instance);
+    _instanceGeneration++;
+  }
+
+  // Models are only ever appended, so a frame's set only needs the ones that finished uploading since it last drew
+  void Renderer::bind_models(FrameData& frame) {
+    while (frame._boundModelCount < static_cast<int>(_models.size()) && is_async_complete(_models[frame._boundModelCount].readyValue)) {
+      VkDescriptorBufferInfo bufferInfo {
+        .buffer = _models[frame._boundModelCount].buffer.buffer,
+        .offset = 0,
+        .range = VK_WHOLE_SIZE
+      };
+      VkWriteDescriptorSet descriptorWrite = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .pNext = nullptr,
+        .dstSet = frame._descriptors,
+        .dstBinding = 8,
+        .dstArrayElement = static_cast<uint32_t>(frame._boundModelCount),
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pBufferInfo = &bufferInfo
+      };
+      vkUpdateDescriptorSets(_device, 1, &descriptorWrite, 0, nullptr);
+      frame._boundModelCount++;
+    }
+  }
+
+  void Renderer::bind_instance_buffers(FrameData& frame) {
+    VkDescriptorBufferInfo bufferInfos[] = {
+      { .buffer = frame._instances.buffer, .offset = 0, .range = VK_WHOLE_SIZE },
+      { .buffer = frame._instanceNodes.buffer, .offset = 0, .range = VK_WHOLE_SIZE }
+    };
+    VkWriteDescriptorSet writes[2];
+    for (uint32_t i = 0; i < 2; i++) {
+      writes[i] = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .pNext = nullptr,
+        .dstSet = frame._descriptors,
+        .dstBinding = 9 + i,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pBufferInfo = &bufferInfos[i]
+      };
+    }
+    vkUpdateDescriptorSets(_device, 2, writes, 0, nullptr);
+  }
+
+  // Bounds the model cubes of the drawable instances, refits or rebuilds the BVH over them and writes both in leaf
+  // order for the frame. Returns the node count
+  uint32_t Renderer::upload_instances(FrameData& frame) {
+    CUBIK_TRACE_ZONE("upload instances");
+    _instanceBounds.clear();
+    _drawnInstances.clear();
+    for (int i = 0; i < static_cast<int>(_instances.size()); i++) {
+      const ModelInstance& instance = _instances[i];
+      if (!instance.isAlive || instance.model >= frame._boundModelCount) continue;
+
+      auto size = static_cast<float>(_models[instance.model].size);
+      Aabb bounds { glm::vec3(std::numeric_limits<float>::infinity()), glm::vec3(-std::numeric_limits<float>::infinity()) };
+      for (int corner = 0; corner < 8; corner++) {
+        glm::vec3 point = glm::vec3(corner & 1, (corner >> 1) & 1, (corner >> 2) & 1) * size;
+        glm::vec3 position = glm::vec3(instance.transform * glm::vec4(point, 1.f));
+        bounds.min = glm::min(bounds.min, position);
+        bounds.max = glm::max(bounds.max, position);
+      }
+      _instanceBounds.push_back(bounds);
+      _drawnInstances.push_back(i);
+    }
+    if (_drawnInstances.empty()) return 0;
+
+    _instanceBvh.update(_instanceBounds);
+    const std::vector<BvhNode>& nodes = _instanceBvh.getNodes();
+    const std::vector<int>& order = _instanceBvh.getOrder();
+
+    // The frame's last submission has finished, so its buffers can be replaced right away
+    size_t instancesSize = order.size() * sizeof(GpuInstance);
+    size_t nodesSize = nodes.size() * sizeof(BvhNode);
+    if (instancesSize > frame._instances.info.size || nodesSize > frame._instanceNodes.info.size) {
+      destroy_buffer(frame._instances);
+      destroy_buffer(frame._instanceNodes);
+      frame._instances = create_buffer(std::bit_ceil(instancesSize), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+      frame._instanceNodes = create_buffer(std::bit_ceil(nodesSize), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+      bind_instance_buffers(frame);
+    }
+
+    auto gpuInstances = static_cast<GpuInstance*>(frame._instances.info.pMappedData);
+    for (size_t i = 0; i < order.size(); i++) {
+      InstanceHandle handle = _drawnInstances[order[i]];
+      const ModelInstance& instance = _instances[handle];
+      gpuInstances[i] = { glm::inverse(instance.transform), instance.model, handle };
+    }
+    memcpy(frame._instanceNodes.info.pMappedData, nodes.data(), nodesSize);
+    VK_CHECK(vmaFlushAllocation(_allocator, frame._instances.allocation, 0, instancesSize));
+    VK_CHECK(vmaFlushAllocation(_allocator, frame._instanceNodes.allocation, 0, nodesSize));
+    return static_cast<uint32_t>(nodes.size());
+  }
+
+  // The frame's fence has been waited on, so its copy isn't being read anymore
+  void Renderer::upload_palette(FrameData& frame) {
+    if (frame._paletteGeneration == _paletteGeneration) return;
+    memcpy(frame._palette.info.pMappedData, _palette.data(), sizeof(Palette));
+    VK_CHECK(vmaFlushAllocation(_allocator, frame._palette.allocation, 0, sizeof(Palette)));
+    frame._paletteGeneration = _paletteGeneration;
+  }
+
+  void Renderer::upload_animation(FrameData& frame) {
+    _animationCopies.clear();
+    _animationUploadBytes = 0;
+    if (!_animation) return;
+
+    CUBIK_TRACE_ZONE("upload animation");
+    const std::vector<LinearOctreeNode>& nodes = _animation->getNodes();
+    const SvoAnimationFrame& shown = _animation->getFrame(_animationFrame);
+    auto shownEnd = static_cast<size_t>(shown.firstNode + shown.addedNodes);
+    bool hasHeader = _residentAnimationRoot >= 0;
+    size_t newNodes = shownEnd > _residentAnimationNodes ? shownEnd - _residentAnimationNodes : 0;
+    bool hasNewRoot = shown.root != _residentAnimationRoot;
+    if (!hasNewRoot && newNodes == 0) return;
+
+    size_t headerSize = hasHeader ? 0 : WORLD_HEADER_SIZE;
+    size_t size = headerSize + (newNodes + 1) * sizeof(LinearOctreeNode);
+    // The frame's last submission has finished, so its staging buffer can be replaced right away
+    if (size > frame._animationStaging.info.size) {
+      destroy_buffer(frame._animationStaging);
+      frame._animationStaging = create_buffer(std::bit_ceil(size), VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, VMA_ALLOCATION_CREATE_MAPPED_BIT);
+    }
+
+    // Laid out like a serialized world, the shown root sits in the first node slot and the pool after it
+    auto data = static_cast<char*>(frame._animationStaging.info.pMappedData);
+    size_t offset = 0;
+    if (!hasHeader) {
+      int worldSize = _animation->getSize();
+      memcpy(data, &VOXEL_SIZE, sizeof(VOXEL_SIZE));
+      memcpy(data + sizeof(VOXEL_SIZE), &worldSize, sizeof(worldSize));
+      _animationCopies.push_back({ .srcOffset = 0, .dstOffset = 0, .size = WORLD_HEADER_SIZE });
+      offset += WORLD_HEADER_SIZE;
+    }
+    if (newNodes > 0) {
+      size_t nodesSize = newNodes * sizeof(LinearOctreeNode);
+      memcpy(data + offset, &nodes[_residentAnimationNodes], nodesSize);
+      _animationCopies.push_back({ .srcOffset = offset, .dstOffset = WORLD_HEADER_SIZE + (1 + _residentAnimationNodes) * sizeof(LinearOctreeNode), .size = nodesSize });
+      offset += nodesSize;
+      _residentAnimationNodes = shownEnd;
+    }
+    if (hasNewRoot) {
+      LinearOctreeNode root = _animation->getRootCopy(_animationFrame);
+      memcpy(data + offset, &root, sizeof(root));
+      _animationCopies.push_back({ .srcOffset = offset, .dstOffset = WORLD_HEADER_SIZE, .size = sizeof(root) });
+      offset += sizeof(root);
+      _residentAnimationRoot = shown.root;
+      // The shadows and occlusion of the last frame's voxels don't hold anymore
+      _accumulatedFrames = 0;
+    }
+    VK_CHECK(vmaFlushAllocation(_allocator, frame._animationStaging.allocation, 0, offset));
+    _animationUploadBytes = offset;
+  }
+
+  void Renderer::draw_background(VkCommandBuffer cmd, VkImage image) {
     float flash = std::abs(std::sin(_frameNumber / 120.f));
     VkClearColorValue clearValue = { { 0.0f, 0.0f, flash, 1.0f } };
 
     VkImageSubresourceRange clearRange = vkutil::image_subresource_range(VK_IMAGE_ASPECT_COLOR_BIT);
-    vkCmdClearColorImage(cmd, _drawImage.image, VK_IMAGE_LAYOUT_GENERAL, &clearValue, 1, &clearRange);
+    vkCmdClearColorImage(cmd, image, VK_IMAGE_LAYOUT_GENERAL, &clearValue, 1, &clearRange);
   }
 
 
@@ -380,6 +1944,16 @@ namespace cubik {
   Renderer::~Renderer() {
     vkDeviceWaitIdle(_device);
 
+    if (_pendingWorld) discard_pending_world();
+    retire_async_submissions();
+    if (is_world_ready()) destroy_buffer(_worldBuffer);
+    for (const GpuModel& model : _models) {
+      destroy_buffer(model.buffer);
+    }
+    for (const RasterMesh& mesh : _rasterMeshes) {
+      destroy_buffer(mesh.buffer);
+    }
+
     for (auto & frame : _frames) {
       vkDestroyCommandPool(_device, frame._commandPool, nullptr);
 
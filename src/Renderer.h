@@ -1,7 +1,15 @@
 #pragma once
 
 #include <vector>
+#include <map>
+#include <deque>
+#include <future>
+#include <optional>
+#include <chrono>
+#include <memory>
+#include <span>
 #include <glm/vec4.hpp>
+#include <glm/mat4x4.hpp>
 #include "vulkan/vulkan_core.h"
 #include "Window.h"
 #include "VulkanHelper.h"
@@ -9,6 +17,17 @@
 #include "vk_mem_alloc.h"
 #include "Camera.h"
 #include "World.h"
+#include "GpuSvoBuilder.h"
+#include "GpuProfiler.h"
+#include "FrameGraph.h"
+#include "InstanceBvh.h"
+#include "MeshLoader.h"
+#include "GreedyMeshWorld.h"
+#include "Palette.h"
+#include "SvoAnimation.h"
+#ifdef CUBIK_SHADER_HOT_RELOAD
+#include "ShaderCompiler.h"
+#endif
 
 namespace cubik {
   struct AllocatedImage {
@@ -19,6 +38,12 @@ namespace cubik {
     VkFormat imageFormat;
   };
 
+  struct AllocatedBuffer {
+    VkBuffer buffer;
+    VmaAllocation allocation;
+    VmaAllocationInfo info;
+  };
+
 
   struct FrameData {
     VkCommandPool _commandPool;
@@ -26,20 +51,273 @@ namespace cubik {
     VkSemaphore _swapchainSemaphore, _renderSemaphore;
     VkFence _renderFence;
 
+    // Each frame has its own set so the world binding can be swapped while the other frame is in flight
+    VkDescriptorSet _descriptors;
+    uint64_t _worldGeneration {0};
+    VkImageView _boundImageViews[3] {}; // Frame graph images, by binding
+    VkBuffer _boundRayQueries {VK_NULL_HANDLE};
+    int _boundModelCount {0};
+
+    // The palette as this frame shades with it, rewritten when the renderer's changes
+    AllocatedBuffer _palette;
+    uint64_t _paletteGeneration {0};
+
+    // Instances and their BVH as this frame traces them, written before each submission
+    AllocatedBuffer _instances;
+    AllocatedBuffer _instanceNodes;
+
+    // Header, new animation nodes and root of the shown frame, copied into the world buffer at the start of the frame
+    AllocatedBuffer _animationStaging;
+
+    // Traversal counters written by the marcher, copied to the readback buffer at the end of the frame
+    AllocatedBuffer _statistics;
+    AllocatedBuffer _statisticsReadback;
+    bool _hasStatistics {false}; // Whether the last submission of this frame recorded them
+
     vkutil::DeletionQueue _deletionQueue;
   };
 
-  struct CameraPushConstants {
+  // Command buffer running on the async queue, retired once the timeline semaphore reaches timelineValue
+  struct AsyncSubmission {
+    VkCommandBuffer commandBuffer;
+    uint64_t timelineValue;
+    vkutil::DeletionQueue deletionQueue;
+  };
+
+  // Each frame runs the ray marcher once per pass, matching the PASS_* constants in the shaders
+  enum class MarcherPass : int {
+    Primary = 0,
+    Shadows = 1,
+    AmbientOcclusion = 2,
+    Resolve = 3,
+    RayQuery = 4 // Only on frames with ray queries, over the queries instead of the image
+  };
+
+  // What the primary pass shows, matching the VIEW_* constants in the shaders
+  enum class DebugView : int {
+    Shaded = 0,
+    StepHeatmap = 1, // Traversal steps of the primary ray
+    NodeHeatmap = 2 // Nodes the primary ray fetched
+  };
+
+  struct MarcherPushConstants {
     glm::vec3 position;
     uint8_t padding1;
     glm::vec3 forward;
     uint8_t padding2;
     glm::vec3 up;
+    MarcherPass pass;
+    int shadowRays;
+    int aoRays;
+    float aoRadius; // In voxels
+    float shadowHistoryWeight;
+    float aoHistoryWeight;
+    uint32_t frameIndex;
+    DebugView view;
+    uint32_t rayQueryCount;
+    uint32_t instanceNodeCount;
+  };
+
+  // Secondary rays use the any hit traversal, which stops at the first solid node
+  struct SecondaryRayBudget {
+    int raysPerPixel; // 0 skips the effect's pass
+    float distance; // In voxels, 0 for the world bounds
+    bool temporalAccumulation;
+  };
+
+  struct ShadingSettings {
+    SecondaryRayBudget shadows;
+    SecondaryRayBudget ambientOcclusion;
+  };
+
+  enum class ShadingQuality {
+    Flat,
+    Low,
+    High
+  };
+
+  constexpr ShadingSettings SHADING_QUALITY_TIERS[] = {
+    { .shadows = { 0, 0, false }, .ambientOcclusion = { 0, 0, false } },
+    { .shadows = { 1, 0, false }, .ambientOcclusion = { 1, 4, true } },
+    { .shadows = { 1, 0, true }, .ambientOcclusion = { 4, 8, true } }
+  };
+
+
+  // Mirrors the constant_id declarations at the top of the ray marchers
+  struct WorldSpecializationConstants {
+    float voxelSize;
+    int worldSize;
+    int treeDepth;
+    VkBool32 collectStatistics;
+  };
+
+  struct PipelineVariantKey {
+    std::string shaderName;
+    int worldSize;
+    int treeDepth;
+    bool collectStatistics {false};
+
+    // Drawn by the greedy mesh pipeline instead of a marcher
+    bool isRasterized() const { return shaderName == GREEDY_MESH_SHADER; }
+
+    auto operator<=>(const PipelineVariantKey&) const = default;
+  };
+
+  constexpr int STEP_HISTOGRAM_BUCKETS = 16;
+
+  // Mirrors RayStatistics in the ray marchers. Bucket i > 0 of the histogram counts rays that took
+  // [2^(i-1), 2^i) steps, and the last bucket everything above
+  struct RayStatistics {
+    uint64_t rays;
+    uint64_t steps;
+    uint64_t nodesFetched;
+    uint64_t raysOverBudget; // Ran out of steps before hitting or leaving the world
+    uint64_t stepHistogram[STEP_HISTOGRAM_BUCKETS];
+  };
+
+  struct TraversalStatistics {
+    RayStatistics primary;
+    RayStatistics secondary; // Shadow and ambient occlusion rays
+  };
+
+  // Mirrors RayQuery in the ray marchers. In world units, the direction doesn't have to be normalized
+  struct RayQuery {
+    glm::vec3 origin;
+    float maxDistance;
+    glm::vec3 direction;
+    float padding;
+  };
+
+  // Mirrors RayQueryHit in the ray marchers
+  struct RayQueryHit {
+    glm::vec3 position;
+    float distance; // maxDistance on a miss
+    glm::ivec3 voxel; // -1 on a miss
+    int face; // 0 on a miss, otherwise encoded like in the hit image
+    int instance; // -1 for the world
+    int material; // Palette index of the voxel, 0 on a miss
+    int padding[2];
+
+    bool is_hit() const { return face != 0; }
+  };
+
+  // Where a submission's hits will be, see Renderer::get_ray_query_results
+  struct RayQueryTicket {
+    uint64_t frame;
+    uint32_t first;
+    uint32_t count;
+  };
+
+  // Persistently mapped buffers of the ray queries traced by one frame
+  struct RayQueryBatch {
+    AllocatedBuffer queries {};
+    AllocatedBuffer hits {};
+    uint32_t capacity {0};
+    uint32_t count {0};
+    uint64_t frame {0};
+    bool isComplete {false}; // The frame's fence has been waited on and the hits are visible to the host
+  };
+
+  using ModelHandle = int;
+  using InstanceHandle = int;
+
+  // Octree of an instanced model, drawable once the async timeline reaches readyValue
+  struct GpuModel {
+    AllocatedBuffer buffer;
+    int size;
+    uint64_t readyValue;
+  };
+
+  struct ModelInstance {
+    ModelHandle model;
+    glm::mat4 transform; // From the model's voxels to world units
+    bool isAlive;
+  };
+
+  // Mirrors Instance in the ray marchers
+  struct GpuInstance {
+    glm::mat4 worldToObject;
+    int model;
+    int id;
+    int padding[2];
+  };
+
+  using RasterMeshHandle = int;
+
+  // Positions followed by the triangles' indices in one buffer, drawable once the async timeline reaches readyValue
+  struct RasterMesh {
+    AllocatedBuffer buffer;
+    VkDeviceSize indexOffset;
+    uint32_t indexCount;
+    uint64_t readyValue;
+  };
+
+  struct RasterDraw {
+    RasterMeshHandle mesh;
+    glm::mat4 transform;
+    glm::vec3 color;
+  };
+
+  // Mirrors the push constants of the raster shaders, which project with the marchers' camera
+  struct RasterPushConstants {
+    glm::mat4 objectToWorld;
+    glm::vec4 color;
+    glm::vec3 cameraPosition;
+    float aspectRatio;
+    glm::vec3 cameraForward;
+    float padding1;
+    glm::vec3 cameraUp;
+    float padding2;
+  };
+
+  struct GpuSvoBuild {
+    GpuSvoBuildLayout layout;
+    AllocatedBuffer input {};
+    AllocatedBuffer pyramid {};
+    AllocatedBuffer scan {};
+    AllocatedBuffer blockSums {};
+    AllocatedBuffer readback {};
+    AllocatedBuffer validation {};
+    int nodeCount {0};
+    uint64_t countValue {0}; // 0 until the counting passes have been submitted
+    std::chrono::high_resolution_clock::time_point startTime;
+  };
+
+  struct WorldUpload {
+    AllocatedBuffer buffer {}; // Allocated once the size is known, which takes a counting pass for GPU builds
+    AllocatedBuffer stagingBuffer;
+    PipelineVariantKey variant;
+    const World* source;
+    std::future<void> serialization;
+    uint64_t timelineValue {0}; // 0 until the final copy or build has been submitted
+    std::unique_ptr<GpuSvoBuild> gpuBuild;
+    GreedyMeshHeader meshHeader {}; // Read back from the staging buffer for rasterized worlds
   };
 
 
   constexpr unsigned int FRAME_OVERLAP = 2;
   constexpr float VOXEL_SIZE = 0.125;
+  constexpr size_t WORLD_HEADER_SIZE = sizeof(float) + sizeof(int); // Voxel size and world size
+  constexpr bool VALIDATE_GPU_SVO_BUILDS = false;
+#ifdef CUBIK_SHADER_DIRECTORY
+  constexpr const char* SHADER_DIRECTORY = CUBIK_SHADER_DIRECTORY;
+#else
+  constexpr const char* SHADER_DIRECTORY = "../shaders/";
+#endif
+  constexpr int SHADER_POLL_INTERVAL = 30; // In frames
+  constexpr int STATISTICS_REPORT_INTERVAL = 240; // In frames
+  constexpr float MAX_HISTORY_WEIGHT = 0.95;
+  // A batch is complete FRAME_OVERLAP frames after it's traced and stays readable for one more frame
+  constexpr uint32_t RAY_QUERY_RING_SIZE = FRAME_OVERLAP + 1;
+  constexpr uint32_t MIN_RAY_QUERY_CAPACITY = 1024;
+  constexpr uint32_t RAY_QUERY_GROUP_SIZE = 256; // Matches the marchers' 16x16 workgroups
+  constexpr uint32_t MAX_RAY_QUERIES = 65535 * RAY_QUERY_GROUP_SIZE; // Per frame, the guaranteed dispatch limit
+  constexpr int MAX_MODELS = 256; // Size of the marchers' model array
+  constexpr uint32_t MIN_INSTANCE_CAPACITY = 64;
+  // Reverse Z with an infinite far plane, in world units. Mirrors DEPTH_NEAR_PLANE in the marchers and raster.vert
+  constexpr float DEPTH_NEAR_PLANE = 0.01f;
+  constexpr VkFormat DEPTH_FORMAT = VK_FORMAT_D32_SFLOAT;
+  constexpr VkFormat DRAW_FORMAT = VK_FORMAT_R16G16B16A16_SFLOAT; // Of the intermediate image
 
 
   class Renderer {
@@ -47,20 +325,80 @@ namespace cubik {
     const VkFormat DisplayFormat = VK_FORMAT_B8G8R8A8_UNORM;
     const Window DisplayWindow;
 
-    VkBuffer _worldBuffer;
-    VkDeviceMemory _worldBufferMemory;
+    AllocatedBuffer _worldBuffer {};
+    uint64_t _worldReadyValue {0};
+    uint64_t _worldGeneration {0};
+    GreedyMeshHeader _worldMesh {}; // Where the bound world's mesh is, if it's rasterized
+    std::optional<WorldUpload> _pendingWorld;
+
+    // Bound in place of a world. Frames add their nodes to the world buffer as they're first shown and swap the root
+    const SvoAnimation* _animation {nullptr};
+    int _animationFrame {0};
+    size_t _residentAnimationNodes {0}; // Pool nodes already copied, the pool is filled in frame order
+    int _residentAnimationRoot {-1}; // Pool index of the root in the world buffer
+    std::vector<VkBufferCopy> _animationCopies; // Out of the current frame's staging buffer, recorded by the next frame graph
+    size_t _animationUploadBytes {0}; // Of the last drawn frame
 
     VmaAllocator _allocator;
     vkutil::DeletionQueue _mainDeletionQueue = {}; // const? readonly?
-    AllocatedImage _drawImage;
     VkExtent2D _drawExtent;
+    bool _writesToSwapchain;
+
+    // Hits and the draw image are transient and come from the frame graph. The visibility images persist
+    // between frames so the secondary effects can accumulate while the camera is still
+    FrameGraph _frameGraph;
+    FrameResource _frameHits;
+    FrameResource _frameOutput;
+    FrameResource _frameDepth;
+    AllocatedImage _shadowImage;
+    AllocatedImage _aoImage;
+    // Reverse Z depth of the primary hits, copied into the raster depth attachment when there are meshes to draw
+    AllocatedBuffer _rayDepth;
+
+    ShadingQuality _shadingQuality {ShadingQuality::High};
+    glm::vec3 _accumulatedCameraPosition {};
+    glm::vec3 _accumulatedCameraForward {};
+    uint64_t _accumulatedWorldGeneration {0};
+    int _accumulatedFrames {0};
+    GpuProfiler _profiler;
+
+    DebugView _debugView {DebugView::Shaded};
+    bool _collectStatistics {false};
+    TraversalStatistics _statistics {};
+
+    std::vector<RayQuery> _pendingRayQueries; // Traced by the next frame
+    RayQueryBatch _rayQueryBatches[RAY_QUERY_RING_SIZE];
+
+    std::vector<GpuModel> _models;
+    std::vector<ModelInstance> _instances;
+    std::vector<InstanceHandle> _freeInstances;
+    InstanceBvh _instanceBvh;
+    std::vector<Aabb> _instanceBounds; // Of the drawn instances, in world units
+    std::vector<int> _drawnInstances;
+    uint64_t _instanceGeneration {0}; // Bumped by every instance change, which invalidates the accumulated history
+    uint64_t _accumulatedInstanceGeneration {0};
+
+    Palette _palette = defaultPalette();
+    uint64_t _paletteGeneration {1};
+
+    std::vector<RasterMesh> _rasterMeshes;
+    std::vector<RasterDraw> _rasterDraws; // Drawn by the next frame
+    VkPipeline _rasterPipeline;
+    VkPipeline _greedyMeshPipeline; // Same layout, with packed vertices and back face culling
+    VkPipelineLayout _rasterPipelineLayout; // Has the marchers' set, for the palette
 
     vkutil::DescriptorAllocator globalDescriptorAllocator;
-    VkDescriptorSet _drawImageDescriptors;
     VkDescriptorSetLayout _drawImageDescriptorLayout;
 
     VkPipeline _gradientPipeline;
     VkPipelineLayout _gradientPipelineLayout;
+    VkPipelineCache _pipelineCache;
+    std::string _pipelineCachePath;
+    std::map<PipelineVariantKey, VkPipeline> _backgroundPipelines;
+    PipelineVariantKey _activeBackgroundVariant;
+#ifdef CUBIK_SHADER_HOT_RELOAD
+    ShaderWatcher _shaderWatcher { SHADER_DIRECTORY };
+#endif
 
     VkInstance _instance;
     VkDebugUtilsMessengerEXT _debug_messenger;
@@ -79,22 +417,133 @@ namespace cubik {
     VkQueue _graphicsQueue;
     uint32_t _graphicsQueueFamily;
 
+    // Separate compute family when the device has one, otherwise an alias of the graphics queue
+    VkQueue _asyncQueue;
+    uint32_t _asyncQueueFamily;
+    VkCommandPool _asyncCommandPool;
+    VkSemaphore _asyncTimeline;
+    uint64_t _asyncTimelineValue {0};
+    std::deque<AsyncSubmission> _asyncSubmissions;
+
+    GpuSvoBuilder _svoBuilder;
+
     void create_swapchain(glm::ivec2 size);
-    void init_world(const World& world);
+    AllocatedImage create_image(VkExtent3D extent, VkFormat format, VkImageUsageFlags usage);
+    void destroy_image(const AllocatedImage& image);
     void init_commands();
     void init_sync_structures();
     void init_descriptors();
-    void init_pipelines(const cubik::World& world);
-    void init_background_pipelines(const std::string& shaderName);
+    void init_pipelines();
+    void init_background_pipelines();
+    void init_raster_pipeline();
+    VkPipeline get_background_pipeline(const PipelineVariantKey& key);
+    VkPipeline create_background_pipeline(const PipelineVariantKey& key, VkShaderModule shaderModule);
+#ifdef CUBIK_SHADER_HOT_RELOAD
+    void reload_changed_shaders();
+#endif
 
-    void draw_background(VkCommandBuffer cmd);
+    AllocatedBuffer create_buffer(size_t size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage, VmaAllocationCreateFlags flags = 0, bool sharedWithAsyncQueue = false);
+    void destroy_buffer(const AllocatedBuffer& buffer);
+    VkDeviceAddress get_buffer_address(const AllocatedBuffer& buffer) const;
+
+    uint64_t submit_async(std::function<void(VkCommandBuffer)>&& record, vkutil::DeletionQueue&& onComplete);
+    bool is_async_complete(uint64_t timelineValue) const;
+    void wait_async(uint64_t timelineValue);
+    void retire_async_submissions();
+
+    void begin_world_upload(const World& world);
+    void discard_pending_world();
+    void poll_world_upload();
+    void submit_gpu_svo_count(WorldUpload& upload);
+    void submit_gpu_svo_emit(WorldUpload& upload);
+    void release_gpu_svo_build(GpuSvoBuild& build);
+    void validate_gpu_svo_build(const WorldUpload& upload);
+    void bind_world(FrameData& frame);
+
+    void draw_background(VkCommandBuffer cmd, VkImage image);
+    VkPipelineStageFlags2 swapchain_wait_stage() const;
+    void build_frame_graph(MarcherPushConstants& pc, uint32_t swapchainImageIndex);
+    void bind_frame_images(FrameData& frame, VkImageView outputView, VkImageView hitView);
+    void update_accumulation(const Camera& camera, MarcherPushConstants& pc);
+    void dispatch_marcher_pass(VkCommandBuffer cmd, MarcherPushConstants& pc, MarcherPass pass, const char* zoneName);
+    void draw_raster_meshes(VkCommandBuffer cmd, const MarcherPushConstants& pc);
+    void record_raster_draws(VkCommandBuffer cmd, RasterPushConstants& constants);
+    void draw_greedy_mesh(VkCommandBuffer cmd, const MarcherPushConstants& pc);
+    RasterPushConstants raster_push_constants(const MarcherPushConstants& pc) const;
+    void read_statistics(FrameData& frame);
+    void create_ray_query_batch(RayQueryBatch& batch, uint32_t capacity);
+    void destroy_ray_query_batch(RayQueryBatch& batch);
+    void complete_ray_queries();
+    RayQueryBatch& upload_ray_queries(FrameData& frame);
+    void bind_models(FrameData& frame);
+    void bind_instance_buffers(FrameData& frame);
+    uint32_t upload_instances(FrameData& frame);
+    void upload_palette(FrameData& frame);
+    void upload_animation(FrameData& frame);
 
     void destroy_swapchain();
   public:
-    explicit Renderer(const Window& window, const World& world);
+    // Starts without a world so it can be created while the world is still loading, see update_world
+    explicit Renderer(const Window& window);
     ~Renderer();
 
+    // Does nothing until the first world has been uploaded
     void draw(const Camera& camera);
     void cleanup();
+
+    // Serializes and uploads the world in the background and swaps it in once the GPU copy finishes.
+    // The world has to outlive the upload, see is_world_update_pending
+    void update_world(const World& world);
+    bool is_world_update_pending() const { return _pendingWorld.has_value(); }
+    bool is_world_ready() const { return _worldGeneration > 0; }
+
+    // Binds the animation as the world right away. Its buffer holds the whole pool, which is copied a frame's new
+    // nodes at a time as the frames are first shown, then only the root changes. The animation can't get more frames
+    // and has to outlive its use, until another world or animation replaces it
+    void set_animation(const SvoAnimation& animation);
+    // Drawn from the next frame on
+    void show_animation_frame(int frame) { _animationFrame = frame; }
+    // Copied into the world buffer by the last drawn frame, 0 once every shown frame is resident and the root is kept
+    size_t get_animation_upload_bytes() const { return _animationUploadBytes; }
+
+    void set_shading_quality(ShadingQuality quality);
+    void set_debug_view(DebugView view) { _debugView = view; }
+    // Colors of the voxel values, which shading looks up on hits. Frames drawn from then on use it
+    void set_palette(const Palette& palette);
+
+    // Switches to marcher variants that count the work of every ray. The counters are read back a
+    // frame later and logged every STATISTICS_REPORT_INTERVAL frames
+    void set_statistics_enabled(bool enabled);
+    // Counters of the last frame that had them
+    const TraversalStatistics& get_traversal_statistics() const { return _statistics; }
+
+    // Closest hits against the bound world, traced by the next frame with the same traversal as its marcher.
+    // The hits are ready FRAME_OVERLAP frames later, once that frame's fence has been waited on. Rasterized
+    // worlds have nothing to trace, so their queries all come back as misses
+    RayQueryTicket submit_ray_queries(std::span<const RayQuery> queries);
+    // Empty until the hits are ready. They're read straight from the mapped readback buffer, which is reused
+    // a frame after that, so the span has to be consumed before the next draw
+    std::optional<std::span<const RayQueryHit>> get_ray_query_results(const RayQueryTicket& ticket) const;
+    // Models are traced by the marchers as octrees, so they have to be SvoWorlds. The world is copied right away,
+    // and its instances show up once the copy on the async queue finishes. Models live as long as the renderer
+    ModelHandle add_model(const World& model);
+    // The transform goes from the model's voxels to world units. Instances are drawn and hit by ray queries, which
+    // report their handle
+    InstanceHandle add_instance(ModelHandle model, const glm::mat4& transform);
+    void set_instance_transform(InstanceHandle instance, const glm::mat4& transform);
+    void remove_instance(InstanceHandle instance);
+
+    // Triangle meshes drawn over the voxels after they're shaded, depth tested against the primary hits both ways.
+    // They're copied right away and drawable once the copy on the async queue finishes
+    RasterMeshHandle add_raster_mesh(const Mesh& mesh);
+    // Draws the mesh in the next frame only, with the transform going from its positions to world units
+    void draw_raster_mesh(RasterMeshHandle mesh, const glm::mat4& transform, glm::vec3 color);
+
+    // Average GPU time of the ray query pass, in milliseconds over the last profiler report interval
+    float get_ray_query_milliseconds() const { return _profiler.average("ray queries"); }
+    // Same for the hybrid passes, copying the ray marched depth and drawing the meshes. 0 while nothing is drawn
+    float get_raster_milliseconds() const { return _profiler.average("depth") + _profiler.average("raster"); }
+    // Same for drawing a rasterized world, meshes included
+    float get_greedy_mesh_milliseconds() const { return _profiler.average("greedy mesh"); }
   };
 }
@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <shaderc/shaderc.hpp>
+#include "ShaderCompiler.h"
+#include "Pipeline.h"
+#include "spdlog/spdlog.h"
+
+namespace {
+  std::optional<std::string> read_file(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) return {};
+
+    std::stringstream source;
+    source << file.rdbuf();
+    return source.str();
+  }
+
+  // Paths of the files a source pulls in with #include "...", next to it like glslangValidator looks for them
+  std::vector<std::filesystem::path> find_includes(const std::filesystem::path& sourcePath) {
+    std::vector<std::filesystem::path> includes;
+    std::ifstream file(sourcePath);
+    std::string line;
+    while (std::getline(file, line)) {
+      if (!line.starts_with("#include \"")) continue;
+      size_t end = line.find('"', 10);
+      if (end != std::string::npos) includes.push_back(sourcePath.parent_path() / line.substr(10, end - 10));
+    }
+    return includes;
+  }
+
+  // Resolves #include "..." next to the including file
+  class FileIncluder : public shaderc::CompileOptions::IncluderInterface {
+  public:
+    shaderc_include_result* GetInclude(const char* requestedSource, shaderc_include_type type, const char* requestingSource,
+                                       size_t includeDepth) override {
+      auto include = new Include;
+      include->path = (std::filesystem::path(requestingSource).parent_path() / requestedSource).string();
+      if (std::optional<std::string> content = read_file(include->path)) {
+        include->content = std::move(*content);
+      } else {
+        // An empty name tells shaderc the include failed, the content is the error message
+        include->content = "Failed to open " + include->path;
+        include->path.clear();
+      }
+      include->result = { include->path.c_str(), include->path.size(), include->content.c_str(), include->content.size(), include };
+      return &include->result;
+    }
+
+    void ReleaseInclude(shaderc_include_result* data) override {
+      delete static_cast<Include*>(data->user_data);
+    }
+
+  private:
+    struct Include {
+      std::string path;
+      std::string content;
+      shaderc_include_result result;
+    };
+  };
+}
+
+namespace vkutil {
+  bool compile_shader_module(const char* filePath, VkDevice device, VkShaderModule* outShaderModule) {
+    std::optional<std::string> source = read_file(filePath);
+    if (!source) {
+      spdlog::error("Failed to open shader source {}", filePath);
+      return false;
+    }
+
+    shaderc::CompileOptions options;
+    options.SetTargetEnvironment(shaderc_target_env_vulkan, shaderc_env_version_vulkan_1_3);
+    options.SetOptimizationLevel(shaderc_optimization_level_performance);
+    options.SetIncluder(std::make_unique<FileIncluder>());
+
+    shaderc::Compiler compiler;
+    shaderc::SpvCompilationResult result = compiler.CompileGlslToSpv(*source, shaderc_compute_shader, filePath, options);
+    if (result.GetCompilationStatus() != shaderc_compilation_status_success) {
+      spdlog::error("Failed to compile {}:\n{}", filePath, result.GetErrorMessage());
+      return false;
+    }
+
+    std::vector<uint32_t> spirv(result.cbegin(), result.cend());
+    return create_shader_module(spirv, device, outShaderModule);
+  }
+}
+
+namespace cubik {
+  ShaderWatcher::ShaderWatcher(std::string directory)
+    : _directory(std::move(directory)) {}
+
+  std::string ShaderWatcher::sourcePath(const std::string& shaderName) const {
+    return _directory + shaderName + ".comp";
+  }
+
+  // Includes count as part of the source, so editing the code the marchers share reloads all of them
+  std::filesystem::file_time_type ShaderWatcher::sourceWriteTime(const std::string& shaderName, std::error_code& error) const {
+    auto lastWriteTime = std::filesystem::last_write_time(sourcePath(shaderName), error);
+    for (const std::filesystem::path& include : find_includes(sourcePath(shaderName))) {
+      if (error) break;
+      lastWriteTime = std::max(lastWriteTime, std::filesystem::last_write_time(include, error));
+    }
+    return lastWriteTime;
+  }
+
+  void ShaderWatcher::watch(const std::string& shaderName) {
+    std::error_code error;
+    auto lastWriteTime = sourceWriteTime(shaderName, error);
+    if (error) {
+      spdlog::warn("Can't watch {}: {}", sourcePath(shaderName), error.message());
+      return;
+    }
+    _lastWriteTimes[shaderName] = lastWriteTime;
+  }
+
+  std::vector<std::string> ShaderWatcher::poll() {
+    std::vector<std::string> changedShaders;
+    for (auto& [shaderName, lastWriteTime] : _lastWriteTimes) {
+      std::error_code error;
+      auto currentWriteTime = sourceWriteTime(shaderName, error);
+      // Editors often replace the file on save, so a missing file is just skipped until it shows up again
+      if (error || currentWriteTime == lastWriteTime) continue;
+
+      lastWriteTime = currentWriteTime;
+      changedShaders.push_back(shaderName);
+    }
+    return changedShaders;
+  }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <unordered_map>
+#include "vulkan/vulkan_core.h"
+
+namespace vkutil {
+  // Compiles a GLSL compute shader to SPIR-V in process. Errors are logged and leave outShaderModule untouched
+  bool compile_shader_module(const char* filePath, VkDevice device, VkShaderModule* outShaderModule);
+}
+
+namespace cubik {
+  // Polls the modification time of GLSL sources so changed shaders can be rebuilt between frames
+  class ShaderWatcher {
+  public:
+    explicit ShaderWatcher(std::string directory);
+
+    void watch(const std::string& shaderName);
+
+    // Returns the names of the watched shaders whose source changed since the last call
+    std::vector<std::string> poll();
+
+    std::string sourcePath(const std::string& shaderName) const;
+
+  private:
+    std::string _directory;
+
+    std::filesystem::file_time_type sourceWriteTime(const std::string& shaderName, std::error_code& error) const;
+    std::unordered_map<std::string, std::filesystem::file_time_type> _lastWriteTimes;
+  };
+}
@@ -0,0 +1,121 @@
+#include "SvoAnimation.h"
+#include "spdlog/spdlog.h"
+#include "Trace.h"
+#include <bit>
+#include <cstring>
+
+namespace cubik {
+  size_t SvoAnimation::NodeKeyHash::operator()(const LinearOctreeNode& node) const {
+    size_t hash = std::hash<int>()(node.LeafMask);
+    for (int child : node.childrenOffsets) {
+      hash ^= std::hash<int>()(child) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    }
+    return hash;
+  }
+
+  bool SvoAnimation::NodeKeyEqual::operator()(const LinearOctreeNode& a, const LinearOctreeNode& b) const {
+    return memcmp(&a, &b, sizeof(LinearOctreeNode)) == 0;
+  }
+
+  SvoAnimation::SvoAnimation(int worldSize) : _worldSize(worldSize) {
+
+  }
+
+  void SvoAnimation::addFrame(const std::vector<int>& worldData) {
+    CUBIK_TRACE_ZONE("SvoAnimation::addFrame");
+    SvoWorld frame(worldData, _worldSize);
+    std::span<const LinearOctreeNode> nodes = frame.getNodes();
+
+    int firstNode = static_cast<int>(_nodes.size());
+    int root = intern(nodes, 0);
+    _frames.push_back({
+      .root = root,
+      .firstNode = firstNode,
+      .addedNodes = static_cast<int>(_nodes.size()) - firstNode,
+      .treeNodes = static_cast<int>(nodes.size())
+    });
+  }
+
+  // Children are interned before their parent, so a node is keyed by the pool indices of its children and a subtree
+  // the pool already has comes back as its old index
+  int SvoAnimation::intern(std::span<const LinearOctreeNode> nodes, int index) {
+    const LinearOctreeNode& node = nodes[index];
+    if (node.LeafMask >> LEAF_BRICK_MASK_SHIFT) {
+      spdlog::error("Animation frames can't have leaf bricks");
+      abort();
+    }
+
+    LinearOctreeNode key { node.LeafMask, {} };
+    for (int i = 0; i < 8; i++) {
+      bool isLeaf = node.LeafMask & (1 << i);
+      key.childrenOffsets[i] = isLeaf ? node.childrenOffsets[i] : intern(nodes, index + node.childrenOffsets[i]);
+    }
+    if (auto found = _nodeIndices.find(key); found != _nodeIndices.end()) return found->second;
+
+    int poolIndex = static_cast<int>(_nodes.size());
+    LinearOctreeNode pooled = key;
+    for (int i = 0; i < 8; i++) {
+      if (!(node.LeafMask & (1 << i))) pooled.childrenOffsets[i] -= poolIndex;
+    }
+    _nodes.push_back(pooled);
+    _nodeIndices.emplace(key, poolIndex);
+    return poolIndex;
+  }
+
+  LinearOctreeNode SvoAnimation::getRootCopy(int frame) const {
+    int root = _frames[frame].root;
+    LinearOctreeNode copy = _nodes[root];
+    for (int i = 0; i < 8; i++) {
+      if (!(copy.LeafMask & (1 << i))) copy.childrenOffsets[i] += root + 1;
+    }
+    return copy;
+  }
+
+  size_t SvoAnimation::calculateSerializedSize() const {
+    return sizeof(_worldSize) + (1 + _nodes.size()) * sizeof(LinearOctreeNode);
+  }
+
+  void SvoAnimation::serialize(void* target) const {
+    auto data = static_cast<char*>(target);
+    memcpy(data, &_worldSize, sizeof(_worldSize));
+    data += sizeof(_worldSize);
+
+    LinearOctreeNode root = getRootCopy(_currentFrame);
+    memcpy(data, &root, sizeof(LinearOctreeNode));
+    memcpy(data + sizeof(LinearOctreeNode), _nodes.data(), _nodes.size() * sizeof(LinearOctreeNode));
+  }
+
+  const std::string& SvoAnimation::getCompatibleShader() const {
+    static const std::string compatibleShader = SVO_SHADER;
+    return compatibleShader;
+  }
+
+  int SvoAnimation::getDepth() const {
+    return std::countr_zero(static_cast<unsigned int>(_worldSize));
+  }
+
+  int SvoAnimation::get(glm::ivec3 position) const {
+    return SvoWorld::lookup(_nodes, _worldSize, position, _frames[_currentFrame].root);
+  }
+
+  WorldBox SvoAnimation::findBox(glm::ivec3 position) const {
+    if (!contains(position)) return World::findBox(position);
+
+    glm::ivec3 origin(0);
+    int size = _worldSize;
+    int nodeIndex = _frames[_currentFrame].root;
+    while (size > 1) {
+      size /= 2;
+      glm::ivec3 offset = position - origin;
+      int index = (offset.x >= size ? 1 : 0) | (offset.y >= size ? 2 : 0) | (offset.z >= size ? 4 : 0);
+      origin += glm::ivec3((index & 1) ? size : 0, (index & 2) ? size : 0, (index & 4) ? size : 0);
+
+      const LinearOctreeNode& node = _nodes[nodeIndex];
+      if (node.LeafMask & (1 << index)) return { origin, size, node.childrenOffsets[index] };
+      nodeIndex += node.childrenOffsets[index];
+    }
+
+    spdlog::error("Failed to find the box of a position in animation frame {}", _currentFrame);
+    abort();
+  }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "SvoWorld.h"
+#include <unordered_map>
+#include <vector>
+
+namespace cubik {
+  // Where a frame's tree sits in the animation's node pool
+  struct SvoAnimationFrame {
+    int root; // Pool index of the frame's root
+    int firstNode; // The nodes the frame added to the pool, right before the next frame's
+    int addedNodes;
+    int treeNodes; // Nodes the frame takes as an octree of its own
+  };
+
+  // Frames of a voxel animation as octrees sharing one node pool. Every node is only stored once, so a frame only
+  // adds the nodes its changes touch, and the untouched subtrees are the ones of the frames before it. Pool nodes
+  // address their children relative to themselves, like the linear nodes of SvoWorld. Serialized like an SvoWorld
+  // whose root is a copy of the current frame's root and whose other nodes are the pool, so the SVO marcher reads it
+  // as is and switching frames only rewrites the root
+  class SvoAnimation : public World {
+  public:
+    explicit SvoAnimation(int worldSize);
+
+    // Frames have to be added in playback order, their nodes are appended to the pool
+    void addFrame(const std::vector<int>& worldData);
+
+    [[nodiscard]] size_t calculateSerializedSize() const override;
+
+    void serialize(void* target) const override;
+
+    const std::string& getCompatibleShader() const override;
+
+    // Queries read the current frame
+    int get(glm::ivec3 position) const override;
+    WorldBox findBox(glm::ivec3 position) const override;
+
+    int getSize() const override { return _worldSize; }
+
+    int getDepth() const override;
+
+    void setFrame(int frame) { _currentFrame = frame; }
+    int getCurrentFrame() const { return _currentFrame; }
+    int getFrameCount() const { return static_cast<int>(_frames.size()); }
+    const SvoAnimationFrame& getFrame(int frame) const { return _frames[frame]; }
+
+    const std::vector<LinearOctreeNode>& getNodes() const { return _nodes; }
+
+    // The frame's root rewritten to address the pool from the slot before it, where it's serialized
+    LinearOctreeNode getRootCopy(int frame) const;
+
+  private:
+    struct NodeKeyHash {
+      size_t operator()(const LinearOctreeNode& node) const;
+    };
+    struct NodeKeyEqual {
+      bool operator()(const LinearOctreeNode& a, const LinearOctreeNode& b) const;
+    };
+
+    int _worldSize;
+    int _currentFrame { 0 };
+    std::vector<LinearOctreeNode> _nodes;
+    std::vector<SvoAnimationFrame> _frames;
+    // Pool nodes by their leaf mask, leaf values and absolute child indices
+    std::unordered_map<LinearOctreeNode, int, NodeKeyHash, NodeKeyEqual> _nodeIndices;
+
+    int intern(std::span<const LinearOctreeNode> nodes, int index);
+  };
+}
@@ -1,5 +1,11 @@
 #include "SvoWorld.h"
 #include "spdlog/spdlog.h"
+#include "Trace.h"
+#include "JobSystem.h"
+#include "Morton.h"
+#include <bit>
+#include <array>
+#include <fstream>
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/string_cast.hpp>
 
@@ -20,14 +26,105 @@ namespace cubik {
   }
 
   const std::string& SvoWorld::getCompatibleShader() const {
-    static const std::string compatibleShader = "svoRayMarcher";
+    static const std::string compatibleShader = SVO_SHADER;
     return compatibleShader;
   }
 
-  SvoWorld::SvoWorld(const std::vector<int> &worldData, int worldSize)
-    : _worldSize(worldSize) {
-    _svo = buildSvo(worldData, glm::ivec3(0), worldSize);
-    buildLinearizedSvo(*_svo);
+  SvoWorld::SvoWorld(const std::vector<int> &worldData, int worldSize, SvoNodeOrder nodeOrder, bool hasLeafBricks)
+    : _worldSize(worldSize), _nodeOrder(nodeOrder), _hasLeafBricks(hasLeafBricks) {
+    {
+      CUBIK_TRACE_ZONE("buildSvo");
+      _svo = buildSvo(worldData, glm::ivec3(0), worldSize);
+    }
+    buildLinearizedSvo();
+  }
+
+  SvoWorld::SvoWorld(const VoxelSource& source, SvoNodeOrder nodeOrder, bool hasLeafBricks)
+    : _worldSize(source.getSize()), _nodeOrder(nodeOrder), _hasLeafBricks(hasLeafBricks) {
+    {
+      CUBIK_TRACE_ZONE("buildSvo");
+      _svo = buildSvo(source, glm::ivec3(0), _worldSize);
+    }
+    buildLinearizedSvo();
+  }
+
+  SvoWorld::SvoWorld(int worldSize, std::vector<LinearOctreeNode> linearizedSvo)
+    : _linearizedSvo(std::move(linearizedSvo)), _worldSize(worldSize) {
+
+  }
+
+  std::unique_ptr<SvoWorld> SvoWorld::load(const std::filesystem::path& path) {
+    CUBIK_TRACE_ZONE("SvoWorld::load");
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      spdlog::error("Failed to open {}", path.string());
+      abort();
+    }
+
+    int worldSize = 0;
+    file.read(reinterpret_cast<char*>(&worldSize), sizeof(worldSize));
+    size_t nodeCount = (std::filesystem::file_size(path) - sizeof(worldSize)) / sizeof(LinearOctreeNode);
+    std::vector<LinearOctreeNode> nodes(nodeCount);
+    file.read(reinterpret_cast<char*>(nodes.data()), static_cast<std::streamsize>(nodeCount * sizeof(LinearOctreeNode)));
+    if (!file || nodeCount == 0) {
+      spdlog::error("Failed to read the octree in {}", path.string());
+      abort();
+    }
+
+    spdlog::info("Loaded {} nodes of a {} world from {}", nodeCount, worldSize, path.string());
+    return std::unique_ptr<SvoWorld>(new SvoWorld(worldSize, std::move(nodes)));
+  }
+
+  std::unique_ptr<OctreeNode> SvoWorld::buildSvo(const VoxelSource& source, glm::ivec3 position, int size) {
+    // The root always keeps its children, buildLinearizedSvo starts below it
+    bool isRoot = size == _worldSize;
+    if (!isRoot) {
+      if (std::optional<int> uniform = source.classifyBox(position, size)) return std::make_unique<OctreeNode>(uniform);
+    }
+
+    if (size == BRICK_SIZE) {
+      std::array<int, BRICK_VOLUME> brick;
+      std::optional<int> uniform = source.fillBrick(position, brick);
+      if (uniform && !isRoot) return std::make_unique<OctreeNode>(uniform);
+      if (uniform) brick.fill(*uniform);
+      return buildBrickSvo(brick, glm::ivec3(0), BRICK_SIZE);
+    }
+
+    int halfSize = size / 2;
+    auto node = std::make_unique<OctreeNode>();
+    if (size >= PARALLEL_BUILD_SIZE) {
+      JobSystem& jobs = JobSystem::global();
+      std::vector<JobHandle> octants;
+      for (int i = 0; i < 8; ++i) {
+        glm::ivec3 offset((i & 1) ? halfSize : 0, (i & 2) ? halfSize : 0, (i & 4) ? halfSize : 0);
+        octants.push_back(jobs.submit([&, i, offset]() {
+          node->children[i] = buildSvo(source, position + offset, halfSize);
+        }));
+      }
+      for (const JobHandle& octant : octants) {
+        jobs.wait(octant);
+      }
+    } else {
+      for (int i = 0; i < 8; ++i) {
+        glm::ivec3 offset((i & 1) ? halfSize : 0, (i & 2) ? halfSize : 0, (i & 4) ? halfSize : 0);
+        node->children[i] = buildSvo(source, position + offset, halfSize);
+      }
+    }
+    return collapse(std::move(node));
+  }
+
+  std::unique_ptr<OctreeNode> SvoWorld::buildBrickSvo(std::span<const int, BRICK_VOLUME> brick, glm::ivec3 position, int size) {
+    if (size == 1) {
+      return std::make_unique<OctreeNode>(std::optional<int>(brick[brickIndex(position.x, position.y, position.z)]));
+    }
+
+    int halfSize = size / 2;
+    auto node = std::make_unique<OctreeNode>();
+    for (int i = 0; i < 8; ++i) {
+      glm::ivec3 offset((i & 1) ? halfSize : 0, (i & 2) ? halfSize : 0, (i & 4) ? halfSize : 0);
+      node->children[i] = buildBrickSvo(brick, position + offset, halfSize);
+    }
+    return collapse(std::move(node));
   }
 
   std::unique_ptr<OctreeNode> SvoWorld::buildSvo(const std::vector<int> &worldData, glm::ivec3 position, int size) {
@@ -38,6 +135,22 @@ namespace cubik {
     int halfSize = size / 2;
     auto node = std::make_unique<OctreeNode>();
 
+    // The octants of big nodes are independent enough to be worth a job each. Nested nodes spawn their own
+    if (size >= PARALLEL_BUILD_SIZE) {
+      JobSystem& jobs = JobSystem::global();
+      std::vector<JobHandle> octants;
+      for (int i = 0; i < 8; ++i) {
+        glm::ivec3 offset((i & 1) ? halfSize : 0, (i & 2) ? halfSize : 0, (i & 4) ? halfSize : 0);
+        octants.push_back(jobs.submit([&, i, offset]() {
+          node->children[i] = buildSvo(worldData, position + offset, halfSize);
+        }));
+      }
+      for (const JobHandle& octant : octants) {
+        jobs.wait(octant);
+      }
+      return collapse(std::move(node));
+    }
+
     for (int i = 0; i < 8; ++i) {
       int offsetX = (i & 1) ? halfSize : 0;
       int offsetY = (i & 2) ? halfSize : 0;
@@ -55,6 +168,10 @@ namespace cubik {
       node->children[i] = buildSvo(worldData, position + glm::ivec3(offsetX, offsetY, offsetZ), halfSize);
     }
 
+    return collapse(std::move(node));
+  }
+
+  std::unique_ptr<OctreeNode> SvoWorld::collapse(std::unique_ptr<OctreeNode> node) {
     std::optional<int> childValue = node->children[0]->_value;
     for (const auto & child : node->children) {
       if (child->_value != childValue) return node;
@@ -88,38 +205,281 @@ namespace cubik {
     }
   }
 
-  int SvoWorld::buildLinearizedSvo(OctreeNode& nodeToLinearize) {
-    LinearOctreeNode node{
-      .LeafMask = 0
+  namespace {
+    // A node waiting for its place, with the slot of its parent that points to it
+    struct PendingNode {
+      const OctreeNode* node;
+      int parentIndex;
+      int slot;
+      int size;
+    };
+
+    void fillBrick(const OctreeNode& node, glm::ivec3 origin, int size, std::span<int, BRICK_VOLUME> voxels) {
+      if (node._value.has_value()) {
+        for (int z = origin.z; z < origin.z + size; z++) {
+          for (int y = origin.y; y < origin.y + size; y++) {
+            for (int x = origin.x; x < origin.x + size; x++) {
+              voxels[brickIndex(x, y, z)] = node._value.value();
+            }
+          }
+        }
+        return;
+      }
+      int halfSize = size / 2;
+      for (int i = 0; i < 8; i++) {
+        fillBrick(*node.children[i], origin + glm::ivec3((i & 1) ? halfSize : 0, (i & 2) ? halfSize : 0, (i & 4) ? halfSize : 0), halfSize, voxels);
+      }
+    }
+
+    // Parents are always placed before their children, so every order fills in the parent's offset once the child
+    // gets its index. Leaf bricks are placed like nodes, they just have no children to place after them
+    class NodeWriter {
+    public:
+      NodeWriter(std::vector<LinearOctreeNode>& nodes, bool hasLeafBricks) : _nodes(nodes), _hasLeafBricks(hasLeafBricks) {}
+
+      int place(const PendingNode& pending) {
+        int index = static_cast<int>(_nodes.size());
+        if (isBrick(pending)) {
+          placeBrick(*pending.node);
+        } else {
+          bool hasBrickChildren = _hasLeafBricks && pending.size / 2 == BRICK_SIZE;
+          LinearOctreeNode node { .LeafMask = 0 };
+          for (int i = 0; i < 8; i++) {
+            const OctreeNode& child = *pending.node->children[i];
+            if (child._value.has_value()) {
+              node.LeafMask |= 1 << i;
+              node.childrenOffsets[i] = child._value.value();
+            } else if (hasBrickChildren) {
+              node.LeafMask |= 1 << (LEAF_BRICK_MASK_SHIFT + i);
+            }
+          }
+          _nodes.push_back(node);
+        }
+        if (pending.parentIndex >= 0) _nodes[pending.parentIndex].childrenOffsets[pending.slot] = index - pending.parentIndex;
+        return index;
+      }
+
+      void appendChildren(const PendingNode& pending, int index, std::vector<PendingNode>& children) const {
+        if (isBrick(pending)) return;
+        for (int i = 0; i < 8; i++) {
+          if (!pending.node->children[i]->_value.has_value()) children.push_back({ pending.node->children[i].get(), index, i, pending.size / 2 });
+        }
+      }
+
+      void writeDepthFirst(const PendingNode& pending) {
+        int index = place(pending);
+        if (isBrick(pending)) return;
+        for (int i = 0; i < 8; i++) {
+          if (!pending.node->children[i]->_value.has_value()) writeDepthFirst({ pending.node->children[i].get(), index, i, pending.size / 2 });
+        }
+      }
+
+      void writeBreadthFirst(const PendingNode& root) {
+        std::vector<PendingNode> level { root }, nextLevel;
+        while (!level.empty()) {
+          for (const PendingNode& pending : level) {
+            appendChildren(pending, place(pending), nextLevel);
+          }
+          std::swap(level, nextLevel);
+          nextLevel.clear();
+        }
+      }
+
+      void writeSiblingGrouped(const PendingNode& root) {
+        writeSiblings(root, place(root));
+      }
+
+      // Lays out the first height levels of the subtree and leaves the nodes right below them in bottom
+      void writeVanEmdeBoas(const PendingNode& root, int height, std::vector<PendingNode>& bottom) {
+        if (height == 1) {
+          appendChildren(root, place(root), bottom);
+          return;
+        }
+        int topHeight = height / 2;
+        std::vector<PendingNode> middle;
+        writeVanEmdeBoas(root, topHeight, middle);
+        for (const PendingNode& pending : middle) {
+          writeVanEmdeBoas(pending, height - topHeight, bottom);
+        }
+      }
+
+    private:
+      std::vector<LinearOctreeNode>& _nodes;
+      bool _hasLeafBricks;
+      std::vector<uint32_t> _brickWords;
+
+      // The root stays a node whatever its size
+      bool isBrick(const PendingNode& pending) const {
+        return _hasLeafBricks && pending.size == BRICK_SIZE && pending.parentIndex >= 0;
+      }
+
+      void placeBrick(const OctreeNode& node) {
+        std::array<int, BRICK_VOLUME> voxels;
+        fillBrick(node, glm::ivec3(0), BRICK_SIZE, voxels);
+        _brickWords.clear();
+        encodeLeafBrick(voxels, _brickWords);
+
+        size_t first = _nodes.size();
+        _nodes.resize(first + (_brickWords.size() + NODE_WORDS - 1) / NODE_WORDS, LinearOctreeNode {});
+        memcpy(&_nodes[first], _brickWords.data(), _brickWords.size() * sizeof(uint32_t));
+      }
+
+      // Siblings get consecutive indices, bricks included, so their offsets follow from the first one's
+      void writeSiblings(const PendingNode& pending, int index) {
+        std::vector<PendingNode> children;
+        appendChildren(pending, index, children);
+        std::vector<int> indices;
+        for (const PendingNode& child : children) {
+          indices.push_back(place(child));
+        }
+        for (size_t i = 0; i < children.size(); i++) {
+          writeSiblings(children[i], indices[i]);
+        }
+      }
     };
-    _linearizedSvo.push_back(node);
-    int currentNodeIndex = static_cast<int>(_linearizedSvo.size()) - 1;
+  }
+
+  // The root always keeps its children, even when they all hold the same value
+  void SvoWorld::buildLinearizedSvo() {
+    CUBIK_TRACE_ZONE("buildLinearizedSvo");
+    _linearizedSvo.clear();
+    NodeWriter writer(_linearizedSvo, _hasLeafBricks);
+    PendingNode root { _svo.get(), -1, 0, _worldSize };
+    switch (_nodeOrder) {
+      case SvoNodeOrder::DepthFirst:
+        writer.writeDepthFirst(root);
+        break;
+      case SvoNodeOrder::BreadthFirst:
+        writer.writeBreadthFirst(root);
+        break;
+      case SvoNodeOrder::SiblingGrouped:
+        writer.writeSiblingGrouped(root);
+        break;
+      case SvoNodeOrder::VanEmdeBoas: {
+        // Nodes of size 2 hold only leaves, so the tree has one level of nodes per bit of the world size
+        std::vector<PendingNode> bottom;
+        writer.writeVanEmdeBoas(root, std::max(getDepth(), 1), bottom);
+        break;
+      }
+    }
+  }
+
+  void SvoWorld::relinearize() {
+    relinearize(_nodeOrder);
+  }
+
+  void SvoWorld::relinearize(SvoNodeOrder nodeOrder) {
+    relinearize(nodeOrder, _hasLeafBricks);
+  }
+
+  void SvoWorld::relinearize(SvoNodeOrder nodeOrder, bool hasLeafBricks) {
+    if (!_svo) {
+      spdlog::error("Loaded worlds don't have a pointer tree to relinearize");
+      abort();
+    }
+    _nodeOrder = nodeOrder;
+    _hasLeafBricks = hasLeafBricks;
+    buildLinearizedSvo();
+  }
 
-    // This should only happen for the root node. Actually, now that I think about this, this is probably unnecessary
-//    if (nodeToLinearize._value.has_value()) {
-//      node.Value = nodeToLinearize._value.value();
-//      return numberOfAllocatedNodes;
-//    }
+  int SvoWorld::getDepth() const {
+    return std::countr_zero(static_cast<unsigned int>(_worldSize));
+  }
+
+  int SvoWorld::get(glm::ivec3 position) const {
+    return lookup(_linearizedSvo, _worldSize, position);
+  }
+
+  void SvoWorld::getBatch(std::span<const glm::ivec3> positions, std::span<int> values) const {
+    SvoCursor lookups = cursor();
+    for (size_t i = 0; i < positions.size(); i++) {
+      values[i] = lookups.get(positions[i]);
+    }
+  }
 
-    int numberOfAllocatedNodes = 1;
+  WorldBox SvoWorld::findBox(glm::ivec3 position) const {
+    return cursor().findBox(position);
+  }
+
+  void SvoWorld::visitBoxes(glm::ivec3 min, glm::ivec3 max, const std::function<void(const WorldBox&)>& visit) const {
+    if (min.x >= max.x || min.y >= max.y || min.z >= max.z) return;
+    visitNode(0, glm::ivec3(0), _worldSize, min, max, visit);
+  }
+
+  void SvoWorld::visitNode(int nodeIndex, glm::ivec3 origin, int size, glm::ivec3 min, glm::ivec3 max, const std::function<void(const WorldBox&)>& visit) const {
+    const LinearOctreeNode& node = _linearizedSvo[nodeIndex];
+    int halfSize = size / 2;
     for (int i = 0; i < 8; i++) {
-      if (nodeToLinearize.children[i]->_value.has_value()) {
-        node.LeafMask |= 1 << i;
-        node.childrenOffsets[i] = nodeToLinearize.children[i]->_value.value();
+      glm::ivec3 childOrigin = origin + glm::ivec3((i & 1) ? halfSize : 0, (i & 2) ? halfSize : 0, (i & 4) ? halfSize : 0);
+      bool isOverlapping = childOrigin.x < max.x && childOrigin.y < max.y && childOrigin.z < max.z &&
+                           childOrigin.x + halfSize > min.x && childOrigin.y + halfSize > min.y && childOrigin.z + halfSize > min.z;
+      if (!isOverlapping) continue;
+
+      if (node.LeafMask & (1 << i)) {
+        visit({ childOrigin, halfSize, node.childrenOffsets[i] });
+      } else if (node.LeafMask & (1 << (LEAF_BRICK_MASK_SHIFT + i))) {
+        // Boxes of a brick are aligned, so each one is a run of Morton codes and the walk can skip over it
+        const uint32_t* brick = leafBrickWords(_linearizedSvo, nodeIndex + node.childrenOffsets[i]);
+        for (int code = 0; code < BRICK_VOLUME;) {
+          WorldBox box = findLeafBrickBox(brick, mortonDecode(code));
+          box.origin += childOrigin;
+          bool isBoxOverlapping = box.origin.x < max.x && box.origin.y < max.y && box.origin.z < max.z &&
+                                  box.origin.x + box.size > min.x && box.origin.y + box.size > min.y && box.origin.z + box.size > min.z;
+          if (isBoxOverlapping) visit(box);
+          code += box.size * box.size * box.size;
+        }
       } else {
-        node.childrenOffsets[i] = numberOfAllocatedNodes;
-        numberOfAllocatedNodes += buildLinearizedSvo(*nodeToLinearize.children[i]);
+        visitNode(nodeIndex + node.childrenOffsets[i], childOrigin, halfSize, min, max, visit);
       }
     }
+  }
+
+  SvoCursor::SvoCursor(std::span<const LinearOctreeNode> nodes, int worldSize)
+    : _nodes(nodes), _worldSize(worldSize), _depth(std::countr_zero(static_cast<unsigned int>(worldSize))) {
 
-    _linearizedSvo[currentNodeIndex] = node;
-    return numberOfAllocatedNodes;
   }
 
-  int SvoWorld::get(glm::ivec3 position) const {
+  WorldBox SvoCursor::descend(glm::ivec3 position) {
+    bool isInside = position.x >= 0 && position.y >= 0 && position.z >= 0 &&
+                    position.x < _worldSize && position.y < _worldSize && position.z < _worldSize;
+    if (!isInside) return { position, 1, 0 };
+
+    // Both positions are in the same node at every level whose size is above their highest differing bit
+    glm::ivec3 last = _box.origin;
+    auto difference = static_cast<unsigned int>((position.x ^ last.x) | (position.y ^ last.y) | (position.z ^ last.z));
+    int level = std::min(_boxLevel, _depth - static_cast<int>(std::bit_width(difference)));
+    int size = _worldSize >> level;
+    int nodeIndex = _path[level];
+
+    while (size > 1) {
+      size /= 2;
+      int index = ((position.x & size) ? 1 : 0) | ((position.y & size) ? 2 : 0) | ((position.z & size) ? 4 : 0);
+      const LinearOctreeNode& node = _nodes[nodeIndex];
+      glm::ivec3 childOrigin(position.x & ~(size - 1), position.y & ~(size - 1), position.z & ~(size - 1));
+      if (node.LeafMask & (1 << index)) {
+        _box = { childOrigin, size, node.childrenOffsets[index] };
+        _boxLevel = level;
+        return _box;
+      }
+      // The next lookup starts over from the brick's parent, bricks have no path below them
+      if (node.LeafMask & (1 << (LEAF_BRICK_MASK_SHIFT + index))) {
+        _box = findLeafBrickBox(leafBrickWords(_nodes, nodeIndex + node.childrenOffsets[index]), position - childOrigin);
+        _box.origin += childOrigin;
+        _boxLevel = level;
+        return _box;
+      }
+      nodeIndex += node.childrenOffsets[index];
+      _path[++level] = nodeIndex;
+    }
+
+    spdlog::error("Failed to get value for {}", glm::to_string(position));
+    abort();
+  }
+
+  int SvoWorld::lookup(std::span<const LinearOctreeNode> nodes, int worldSize, glm::ivec3 position, int root) {
     auto currentSearch = glm::ivec3(0);
-    int currentSize = _worldSize;
-    int currentLinearIndex = 0;
+    int currentSize = worldSize;
+    int currentLinearIndex = root;
 
     while (currentSize > 1) {
       currentSize = currentSize / 2;
@@ -130,8 +490,8 @@ namespace cubik {
       if (offset.y >= currentSize) index |= 2; // 2nd bit (Y axis)
       if (offset.z >= currentSize) index |= 4; // 3rd bit (Z axis)
 
-      if (_linearizedSvo[currentLinearIndex].LeafMask & (1 << index)) {
-        return _linearizedSvo[currentLinearIndex].childrenOffsets[index];
+      if (nodes[currentLinearIndex].LeafMask & (1 << index)) {
+        return nodes[currentLinearIndex].childrenOffsets[index];
       }
 
       // Move to the child node's position
@@ -140,7 +500,9 @@ namespace cubik {
         (index & 2) ? currentSize : 0,
         (index & 4) ? currentSize : 0
       );
-      currentLinearIndex += _linearizedSvo[currentLinearIndex].childrenOffsets[index];
+      bool isBrick = nodes[currentLinearIndex].LeafMask & (1 << (LEAF_BRICK_MASK_SHIFT + index));
+      currentLinearIndex += nodes[currentLinearIndex].childrenOffsets[index];
+      if (isBrick) return findLeafBrickBox(leafBrickWords(nodes, currentLinearIndex), position - currentSearch).value;
     }
 
     spdlog::error("Failed to get value for {}", glm::to_string(position));
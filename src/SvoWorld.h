@@ -1,12 +1,20 @@
 #pragma once
 
 #include "World.h"
+#include "VoxelSource.h"
+#include "LeafBrick.h"
+#include <array>
 #include <vector>
+#include <filesystem>
 #include <memory>
 #include <optional>
+#include <span>
 #include <glm/vec3.hpp>
 
 namespace cubik {
+  // Marches linear octrees, the layout instanced models have to be in too
+  constexpr const char* SVO_SHADER = "svoRayMarcher";
+
   class OctreeNode {
   public:
     std::optional<int> _value;
@@ -20,14 +28,66 @@ namespace cubik {
 
   struct LinearOctreeNode {
   public:
-    int LeafMask;
+    int LeafMask; // A bit per child holding a value, then a bit per child that is a leaf brick
 
     int childrenOffsets[8];
   };
 
+  // Leaf bricks sit in the node array like the node they replace, over as many node records as their words take
+  constexpr int LEAF_BRICK_MASK_SHIFT = 8;
+  constexpr int NODE_WORDS = sizeof(LinearOctreeNode) / sizeof(uint32_t);
+
+  inline const uint32_t* leafBrickWords(std::span<const LinearOctreeNode> nodes, int index) {
+    return reinterpret_cast<const uint32_t*>(&nodes[index]);
+  }
+
+  // How the linear nodes are laid out. Children are addressed relative to their parent, so the lookups and the
+  // marchers read every order the same way, only the distance between the nodes a descent fetches changes
+  enum class SvoNodeOrder {
+    DepthFirst, // Pre-order, each node's first child right after it
+    BreadthFirst, // Level by level
+    SiblingGrouped, // Each node's children next to each other, then their subtrees depth first
+    VanEmdeBoas // The top half of the levels, then every subtree hanging below them, each laid out the same way
+  };
+
+  // Nodes at least this big build their octants as separate jobs
+  constexpr int PARALLEL_BUILD_SIZE = 64;
+  constexpr int MAX_SVO_DEPTH = 30;
+
+  // Remembers the nodes the last lookup went through, so the next one only descends from the deepest node both
+  // positions share. Neighbouring lookups usually only redo the last level or two
+  class SvoCursor {
+  public:
+    SvoCursor(std::span<const LinearOctreeNode> nodes, int worldSize);
+
+    WorldBox findBox(glm::ivec3 position) {
+      bool isInLastBox = position.x >= _box.origin.x && position.y >= _box.origin.y && position.z >= _box.origin.z &&
+                         position.x < _box.origin.x + _box.size && position.y < _box.origin.y + _box.size && position.z < _box.origin.z + _box.size;
+      return isInLastBox ? _box : descend(position);
+    }
+    int get(glm::ivec3 position) { return findBox(position).value; }
+
+  private:
+    std::span<const LinearOctreeNode> _nodes;
+    int _worldSize;
+    int _depth;
+    std::array<int, MAX_SVO_DEPTH + 1> _path {}; // Index of the node at each level of the last lookup
+    WorldBox _box { glm::ivec3(0), 0, 0 }; // Leaf of the last lookup
+    int _boxLevel { 0 }; // Level of the node holding it
+
+    WorldBox descend(glm::ivec3 position);
+  };
+
   class SvoWorld : public World {
   public:
-    SvoWorld(const std::vector<int> &worldData, int worldSize);
+    // With leaf bricks, the nodes of BRICK_SIZE that aren't uniform are written as compressed bricks instead of
+    // their subtrees. The marchers decode them, instanced models can't have them
+    SvoWorld(const std::vector<int> &worldData, int worldSize, SvoNodeOrder nodeOrder = SvoNodeOrder::DepthFirst, bool hasLeafBricks = false);
+    // Builds straight from the source brick by brick, skipping the boxes it reports as uniform
+    explicit SvoWorld(const VoxelSource& source, SvoNodeOrder nodeOrder = SvoNodeOrder::DepthFirst, bool hasLeafBricks = false);
+
+    // Reads a file written by OutOfCoreSvoBuilder. Only the linear nodes are kept, so it can't be relinearized
+    static std::unique_ptr<SvoWorld> load(const std::filesystem::path& path);
 
     // Returns the serialized size of the world data
     [[nodiscard]] size_t calculateSerializedSize() const override;
@@ -40,14 +100,45 @@ namespace cubik {
     const std::string& getCompatibleShader() const override;
 
     int get(glm::ivec3 position) const override;
+    void getBatch(std::span<const glm::ivec3> positions, std::span<int> values) const override;
+    WorldBox findBox(glm::ivec3 position) const override;
+    void visitBoxes(glm::ivec3 min, glm::ivec3 max, const std::function<void(const WorldBox&)>& visit) const override;
+
+    // Keep the world alive and unchanged while the cursor is used
+    SvoCursor cursor() const { return SvoCursor(_linearizedSvo, _worldSize); }
+
+    std::span<const LinearOctreeNode> getNodes() const { return _linearizedSvo; }
 
+    // Looks a position up in any linearized octree, no matter which order its nodes were written in. Pools holding
+    // several trees pass the index of the one to read
+    static int lookup(std::span<const LinearOctreeNode> nodes, int worldSize, glm::ivec3 position, int root = 0);
+
+    int getSize() const override { return _worldSize; }
+
+    int getDepth() const override;
+
+    // Throws the linear nodes away and writes them again from the pointer tree, in the same order or another one
+    void relinearize();
+    void relinearize(SvoNodeOrder nodeOrder);
+    void relinearize(SvoNodeOrder nodeOrder, bool hasLeafBricks);
+    SvoNodeOrder getNodeOrder() const { return _nodeOrder; }
+    bool hasLeafBricks() const { return _hasLeafBricks; }
 
   private:
     std::unique_ptr<OctreeNode> _svo;
     std::vector<LinearOctreeNode> _linearizedSvo;
     int _worldSize;
+    SvoNodeOrder _nodeOrder { SvoNodeOrder::DepthFirst }; // Loaded files are always depth first
+    bool _hasLeafBricks { false };
+
+    SvoWorld(int worldSize, std::vector<LinearOctreeNode> linearizedSvo);
 
     std::unique_ptr<OctreeNode> buildSvo(const std::vector<int> &worldData, glm::ivec3 position, int size);
-    int buildLinearizedSvo(OctreeNode& nodeToLinearize);
+    std::unique_ptr<OctreeNode> buildSvo(const VoxelSource& source, glm::ivec3 position, int size);
+    static std::unique_ptr<OctreeNode> buildBrickSvo(std::span<const int, BRICK_VOLUME> brick, glm::ivec3 position, int size);
+    // Turns a node whose children all hold the same value into a leaf
+    static std::unique_ptr<OctreeNode> collapse(std::unique_ptr<OctreeNode> node);
+    void buildLinearizedSvo();
+    void visitNode(int nodeIndex, glm::ivec3 origin, int size, glm::ivec3 min, glm::ivec3 max, const std::function<void(const WorldBox&)>& visit) const;
   };
 }
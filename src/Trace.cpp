@@ -0,0 +1,129 @@
+#include "Trace.h"
+
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "spdlog/spdlog.h"
+#include "spdlog/fmt/fmt.h"
+
+namespace cubik::trace {
+  std::atomic<bool> isRecording {false};
+
+  namespace {
+    struct Event {
+      const char* name;
+      uint64_t start;
+      uint64_t end;
+    };
+
+    // Written by a single thread. head only grows, so the exporter knows which slots hold the newest events
+    struct Ring {
+      uint32_t threadId;
+      std::string threadName;
+      std::atomic<uint64_t> head {0};
+      std::array<Event, RING_CAPACITY> events;
+
+      void push(const char* name, uint64_t start, uint64_t end) {
+        uint64_t index = head.load(std::memory_order_relaxed);
+        events[index % RING_CAPACITY] = { name, start, end };
+        head.store(index + 1, std::memory_order_release);
+      }
+    };
+
+    constexpr uint32_t GPU_THREAD_ID = 0;
+
+    // Rings are never freed, so events of threads that already finished still make it into the export
+    std::mutex ringsMutex;
+    std::vector<std::unique_ptr<Ring>> rings;
+    thread_local Ring* threadRing = nullptr;
+    uint64_t sessionStart = 0;
+
+    Ring& register_ring(uint32_t threadId, std::string threadName) {
+      std::lock_guard lock(ringsMutex);
+      auto ring = std::make_unique<Ring>();
+      ring->threadId = threadId;
+      ring->threadName = std::move(threadName);
+      rings.push_back(std::move(ring));
+      return *rings.back();
+    }
+
+    Ring& thread_ring() {
+      if (!threadRing) {
+        static std::atomic<uint32_t> nextThreadId {GPU_THREAD_ID + 1};
+        uint32_t threadId = nextThreadId.fetch_add(1, std::memory_order_relaxed);
+        threadRing = &register_ring(threadId, fmt::format("Thread {}", threadId));
+      }
+      return *threadRing;
+    }
+
+    Ring& gpu_ring() {
+      static Ring& ring = register_ring(GPU_THREAD_ID, "GPU");
+      return ring;
+    }
+  }
+
+  void start() {
+    sessionStart = now();
+    gpu_ring();
+    isRecording.store(true, std::memory_order_relaxed);
+  }
+
+  void stop(const char* path) {
+    isRecording.store(false, std::memory_order_relaxed);
+
+    std::ofstream file(path);
+    if (!file) {
+      spdlog::error("Could not write the trace to {}", path);
+      return;
+    }
+
+    std::lock_guard lock(ringsMutex);
+    size_t eventCount = 0;
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool isFirst = true;
+    for (const auto& ring : rings) {
+      file << (isFirst ? "" : ",")
+           << fmt::format(R"({{"name":"thread_name","ph":"M","pid":1,"tid":{},"args":{{"name":"{}"}}}})", ring->threadId, ring->threadName);
+      isFirst = false;
+
+      // A zone closing on another thread right now could overwrite the oldest slot, so it is skipped when the ring wrapped
+      uint64_t head = ring->head.load(std::memory_order_acquire);
+      uint64_t first = head > RING_CAPACITY ? head - RING_CAPACITY + 1 : 0;
+      for (uint64_t i = first; i < head; i++) {
+        const Event& event = ring->events[i % RING_CAPACITY];
+        if (event.start < sessionStart) continue;
+
+        file << fmt::format(R"(,{{"name":"{}","ph":"X","pid":1,"tid":{},"ts":{:.3f},"dur":{:.3f}}})", event.name, ring->threadId,
+                            (event.start - sessionStart) / 1e3, (event.end - event.start) / 1e3);
+        eventCount++;
+      }
+    }
+    file << "]}";
+
+    spdlog::info("Wrote {} trace events to {}", eventCount, path);
+  }
+
+  uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void set_thread_name(const char* name) {
+    if (!is_recording()) return;
+    Ring& ring = thread_ring();
+    std::lock_guard lock(ringsMutex);
+    ring.threadName = name;
+  }
+
+  void record_zone(const char* name, uint64_t start, uint64_t end) {
+    thread_ring().push(name, start, end);
+  }
+
+  void record_gpu_zone(const char* name, uint64_t start, uint64_t end) {
+    if (!is_recording()) return;
+    gpu_ring().push(name, start, end);
+  }
+}
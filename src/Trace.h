@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Scoped CPU zones for the trace. Names have to be string literals, the trace only keeps the pointer
+#ifdef CUBIK_TRACING
+#define CUBIK_TRACE_CONCAT_INNER(a, b) a##b
+#define CUBIK_TRACE_CONCAT(a, b) CUBIK_TRACE_CONCAT_INNER(a, b)
+#define CUBIK_TRACE_ZONE(name) cubik::trace::Zone CUBIK_TRACE_CONCAT(traceZone, __LINE__) { name }
+#else
+#define CUBIK_TRACE_ZONE(name)
+#endif
+
+// Records CPU zones, and GPU zones converted to the same clock, into per-thread ring buffers and exports them as
+// Chrome trace JSON, which Perfetto and chrome://tracing load. Each ring only has its own thread writing to it, so
+// recording takes no locks, and a disabled trace costs a relaxed load per zone
+namespace cubik::trace {
+  constexpr uint64_t RING_CAPACITY = 1 << 17; // Events per thread, older ones get overwritten
+
+  extern std::atomic<bool> isRecording;
+
+  void start();
+  // Stops recording and writes everything still in the rings to path
+  void stop(const char* path);
+  inline bool is_recording() { return isRecording.load(std::memory_order_relaxed); }
+
+  // Nanoseconds on the clock every zone is recorded with
+  uint64_t now();
+  // Only takes effect while recording, like the zones
+  void set_thread_name(const char* name);
+
+  void record_zone(const char* name, uint64_t start, uint64_t end);
+  // GPU zones go to their own track. Only the thread reading the GPU timestamps may call it
+  void record_gpu_zone(const char* name, uint64_t start, uint64_t end);
+
+  class Zone {
+  public:
+    explicit Zone(const char* name) : _name(is_recording() ? name : nullptr), _start(_name ? now() : 0) {}
+    ~Zone() { if (_name) record_zone(_name, _start, now()); }
+
+    Zone(const Zone&) = delete;
+    Zone& operator=(const Zone&) = delete;
+
+  private:
+    const char* _name;
+    uint64_t _start;
+  };
+}
@@ -2,10 +2,15 @@
 
 namespace cubik {
   UncompressedGridWorld::UncompressedGridWorld(const std::vector<int> &worldData, int worldSize)
-    : _worldData(worldData), _worldSize(worldSize) {}
+    : UncompressedGridWorld(worldData, worldSize, true) {}
+
+  UncompressedGridWorld::UncompressedGridWorld(const std::vector<int> &worldData, int worldSize, bool isPacked)
+    : _worldData(worldData), _worldSize(worldSize) {
+    if (isPacked) _bricks.emplace(worldData, worldSize);
+  }
 
   size_t UncompressedGridWorld::calculateSerializedSize() const {
-    return sizeof(_worldSize) + sizeof(int) * _worldData.size();
+    return sizeof(_worldSize) + _bricks->calculateSerializedSize();
   }
 
   void UncompressedGridWorld::serialize(void *target) const {
@@ -13,7 +18,7 @@ namespace cubik {
 
     memcpy(dataPtr, &_worldSize, sizeof(_worldSize));
     dataPtr += sizeof(_worldSize);
-    memcpy(dataPtr, _worldData.data(), sizeof(int) * _worldData.size());
+    _bricks->serialize(dataPtr);
   }
 
   const std::string& UncompressedGridWorld::getCompatibleShader() const {
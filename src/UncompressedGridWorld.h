@@ -1,9 +1,12 @@
 #pragma once
 
+#include "PaletteBricks.h"
 #include "World.h"
+#include <optional>
 #include <vector>
 
 namespace cubik {
+  // Dense on the CPU. The GPU gets the voxels as palette bricks, which is what naiveRayMarcher steps through
   class UncompressedGridWorld : public World {
   public:
     UncompressedGridWorld(const std::vector<int> &worldData, int worldSize);
@@ -18,8 +21,21 @@ namespace cubik {
 
     int get(glm::ivec3 position) const override;
 
+    int getSize() const override { return _worldSize; }
+
+    int getDepth() const override { return 0; }
+
+    const PaletteBrickGrid& getBricks() const { return *_bricks; }
+
+  protected:
+    // For subclasses uploading something else than the bricks, which then aren't built
+    UncompressedGridWorld(const std::vector<int> &worldData, int worldSize, bool isPacked);
+
+    const std::vector<int>& getVoxels() const { return _worldData; }
+
   private:
     std::vector<int> _worldData;
     int _worldSize;
+    std::optional<PaletteBrickGrid> _bricks;
   };
 }
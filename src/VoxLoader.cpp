@@ -2,7 +2,11 @@
 #define OGT_VOX_IMPLEMENTATION
 #include "../vendor/ogt_vox.h"
 #include "spdlog/spdlog.h"
+#include "Trace.h"
+#include "JobSystem.h"
 #include <glm/glm.hpp>
+#include <algorithm>
+#include <limits>
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/string_cast.hpp>
 
@@ -20,7 +24,7 @@ namespace cubik {
     return x+1;
   }
 
-  std::vector<int> loadVoxFile(const char *filename, int& size) {
+  static const ogt_vox_scene* readVoxSceneFile(const char *filename, uint32_t flags) {
     FILE * fp;
     if (0 != fopen_s(&fp, filename, "rb"))
       fp = 0;
@@ -40,13 +44,22 @@ namespace cubik {
     fclose(fp);
 
     // construct the scene from the buffer
-    const ogt_vox_scene* scene = ogt_vox_read_scene_with_flags(buffer, buffer_size, k_read_scene_flags_groups);
-    const ogt_vox_model* model = scene->models[0];
+    const ogt_vox_scene* scene = ogt_vox_read_scene_with_flags(buffer, buffer_size, flags);
 
     // the buffer can be safely deleted once the scene is instantiated.
     delete[] buffer;
+    if (!scene) {
+      spdlog::error("Failed to read the scene in {}", filename);
+      abort();
+    }
+    return scene;
+  }
+
+  // Reads the scene and the bounds of its instances. The scene has to be destroyed by the caller
+  static const ogt_vox_scene* readVoxScene(const char *filename, glm::ivec3& minBounds, int& size) {
+    const ogt_vox_scene* scene = readVoxSceneFile(filename, k_read_scene_flags_groups);
 
-    auto minBounds = glm::ivec3(0);
+    minBounds = glm::ivec3(0);
     auto maxBounds = glm::ivec3(0);
     for (int i = 0; i < scene->num_models; i++) {
       auto currentModel = scene->models[i];
@@ -76,6 +89,24 @@ namespace cubik {
 //    }
 
     size = pow2roundup((int) std::max(totalSize.x, std::max(totalSize.y, totalSize.z)));
+    return scene;
+  }
+
+  static void readVoxPalette(const ogt_vox_scene* scene, Palette* palette) {
+    if (!palette) return;
+    for (int i = 0; i < PALETTE_SIZE; i++) {
+      const ogt_vox_rgba& color = scene->palette.color[i];
+      (*palette)[i] = packColor(color.r, color.g, color.b, color.a);
+    }
+  }
+
+  std::vector<int> loadVoxFile(const char *filename, int& size, Palette* palette) {
+    CUBIK_TRACE_ZONE("loadVoxFile");
+    glm::ivec3 minBounds;
+    const ogt_vox_scene* scene = readVoxScene(filename, minBounds, size);
+    readVoxPalette(scene, palette);
+    const ogt_vox_model* model = scene->models[0];
+
     std::vector<int> voxelData(size * size * size, 0);
 
     for (int i = 0; i < scene->num_models; i++) {
@@ -84,20 +115,129 @@ namespace cubik {
       auto modelSize = glm::ivec3(currentModel->size_x, currentModel->size_y, currentModel->size_z);
       auto position = glm::ivec3(currentInstance.transform.m30, currentInstance.transform.m31, currentInstance.transform.m32);
 
-      int iterationSize = (int) std::max(modelSize.x, std::max(modelSize.y, modelSize.z));
-      for (int x = 0; x < iterationSize; x++) {
-        for (int y = 0; y < iterationSize; y++) {
-          for (int z = 0; z < iterationSize; z++) {
-            int index = (y + position.y - minBounds.y) * size * size + (size - 1 - (z + position.z - minBounds.z)) * size + (x + position.x - minBounds.x);
-            if (x < modelSize.x && y < modelSize.y && z < modelSize.z) {
-              voxelData[index] = currentModel->voxel_data[x + (y * currentModel->size_x) + (z * currentModel->size_x * currentModel->size_y)] != 0;
+      // Blocks of a model write disjoint voxels. Models still go one after the other since they may overlap
+      JobSystem::global().parallel_for(modelSize, LOADER_GRAIN_SIZE, [&](glm::ivec3 begin, glm::ivec3 end) {
+        for (int z = begin.z; z < end.z; z++) {
+          for (int y = begin.y; y < end.y; y++) {
+            for (int x = begin.x; x < end.x; x++) {
+              int index = (y + position.y - minBounds.y) * size * size + (size - 1 - (z + position.z - minBounds.z)) * size + (x + position.x - minBounds.x);
+              voxelData[index] = currentModel->voxel_data[x + (y * currentModel->size_x) + (z * currentModel->size_x * currentModel->size_y)];
             }
           }
         }
-      }
+      });
     }
 
     spdlog::info("loaded: {} / {} {} {}", size, model->size_x, model->size_y, model->size_z);
     return voxelData;
   }
+
+  void streamVoxFile(const char *filename, int& size, const std::function<void(glm::ivec3, int)>& visitor, Palette* palette) {
+    CUBIK_TRACE_ZONE("streamVoxFile");
+    glm::ivec3 minBounds;
+    const ogt_vox_scene* scene = readVoxScene(filename, minBounds, size);
+    readVoxPalette(scene, palette);
+
+    for (int i = 0; i < scene->num_models; i++) {
+      auto currentModel = scene->models[i];
+      auto currentInstance = scene->instances[i];
+      auto position = glm::ivec3(currentInstance.transform.m30, currentInstance.transform.m31, currentInstance.transform.m32) - minBounds;
+
+      // Same axes as loadVoxFile, the file's z is up
+      for (int z = 0; z < currentModel->size_z; z++) {
+        for (int y = 0; y < currentModel->size_y; y++) {
+          for (int x = 0; x < currentModel->size_x; x++) {
+            uint8_t value = currentModel->voxel_data[x + (y * currentModel->size_x) + (z * currentModel->size_x * currentModel->size_y)];
+            if (value == 0) continue;
+            visitor(glm::ivec3(x + position.x, size - 1 - (z + position.z), y + position.y), value);
+          }
+        }
+      }
+    }
+
+    ogt_vox_destroy_scene(scene);
+  }
+
+  static uint32_t lastKeyframe(const ogt_vox_anim_transform& animation) {
+    return animation.num_keyframes ? animation.keyframes[animation.num_keyframes - 1].frame_index : 0;
+  }
+
+  void streamVoxAnimation(const char *filename, int& size, const std::function<void(int, const std::vector<int>&)>& visitor, Palette* palette) {
+    CUBIK_TRACE_ZONE("streamVoxAnimation");
+    const ogt_vox_scene* scene = readVoxSceneFile(filename, k_read_scene_flags_groups | k_read_scene_flags_keyframes);
+    readVoxPalette(scene, palette);
+
+    uint32_t lastFrame = 0;
+    for (uint32_t i = 0; i < scene->num_instances; i++) {
+      const ogt_vox_instance& instance = scene->instances[i];
+      lastFrame = std::max(lastFrame, lastKeyframe(instance.transform_anim));
+      if (instance.model_anim.num_keyframes) {
+        lastFrame = std::max(lastFrame, instance.model_anim.keyframes[instance.model_anim.num_keyframes - 1].frame_index);
+      }
+    }
+    for (uint32_t i = 0; i < scene->num_groups; i++) {
+      lastFrame = std::max(lastFrame, lastKeyframe(scene->groups[i].transform_anim));
+    }
+    int frameCount = static_cast<int>(lastFrame) + 1;
+
+    // Every frame's model and corner of each shown instance. Keyframes can swap in models of other sizes, so
+    // instances are placed by their center like MagicaVoxel does. Rotations are ignored, like loadVoxFile does
+    struct Placement {
+      const ogt_vox_model* model;
+      glm::ivec3 corner;
+    };
+    std::vector<std::vector<Placement>> frames(frameCount);
+    auto minBounds = glm::ivec3(std::numeric_limits<int>::max());
+    auto maxBounds = glm::ivec3(std::numeric_limits<int>::min());
+    for (int frame = 0; frame < frameCount; frame++) {
+      for (uint32_t i = 0; i < scene->num_instances; i++) {
+        const ogt_vox_instance& instance = scene->instances[i];
+        bool isLayerHidden = instance.layer_index < scene->num_layers && scene->layers[instance.layer_index].hidden;
+        if (instance.hidden || isLayerHidden) continue;
+
+        const ogt_vox_model* model = scene->models[ogt_vox_sample_instance_model(&instance, frame)];
+        if (!model) continue;
+
+        ogt_vox_transform transform = ogt_vox_sample_instance_transform_global(&instance, frame, scene);
+        auto modelSize = glm::ivec3(model->size_x, model->size_y, model->size_z);
+        glm::ivec3 corner = glm::ivec3(transform.m30, transform.m31, transform.m32) - modelSize / 2;
+        frames[frame].push_back({ model, corner });
+        minBounds = glm::min(corner, minBounds);
+        maxBounds = glm::max(corner + modelSize, maxBounds);
+      }
+    }
+    if (minBounds.x > maxBounds.x) {
+      spdlog::error("No visible voxels in {}", filename);
+      abort();
+    }
+
+    glm::ivec3 totalSize = maxBounds - minBounds;
+    size = pow2roundup(std::max(totalSize.x, std::max(totalSize.y, totalSize.z)));
+    spdlog::info("Animation of {} frames, bounds from {} to {}", frameCount, glm::to_string(minBounds), glm::to_string(maxBounds));
+
+    // One grid is refilled for every frame, the visitor has to be done with it when it returns
+    std::vector<int> voxelData(static_cast<size_t>(size) * size * size, 0);
+    for (int frame = 0; frame < frameCount; frame++) {
+      std::fill(voxelData.begin(), voxelData.end(), 0);
+      for (const Placement& placement : frames[frame]) {
+        const ogt_vox_model* model = placement.model;
+        glm::ivec3 position = placement.corner - minBounds;
+        JobSystem::global().parallel_for(glm::ivec3(model->size_x, model->size_y, model->size_z), LOADER_GRAIN_SIZE, [&](glm::ivec3 begin, glm::ivec3 end) {
+          for (int z = begin.z; z < end.z; z++) {
+            for (int y = begin.y; y < end.y; y++) {
+              for (int x = begin.x; x < end.x; x++) {
+                uint8_t value = model->voxel_data[x + (y * model->size_x) + (z * model->size_x * model->size_y)];
+                if (value == 0) continue;
+                int index = (y + position.y) * size * size + (size - 1 - (z + position.z)) * size + (x + position.x);
+                voxelData[index] = value;
+              }
+            }
+          }
+        });
+      }
+      visitor(frame, voxelData);
+    }
+
+    ogt_vox_destroy_scene(scene);
+  }
 }
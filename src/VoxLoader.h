@@ -1,7 +1,18 @@
 #pragma once
 
+#include <functional>
 #include <vector>
+#include <glm/vec3.hpp>
+#include "Palette.h"
 
 namespace cubik {
-  std::vector<int> loadVoxFile(const char *filename, int& size);
+  // Voxels keep the file's color index as their value, and palette gets the file's colors when given
+  std::vector<int> loadVoxFile(const char *filename, int& size, Palette* palette = nullptr);
+
+  // Calls visitor with the position and value of every solid voxel instead of filling a dense grid
+  void streamVoxFile(const char *filename, int& size, const std::function<void(glm::ivec3, int)>& visitor, Palette* palette = nullptr);
+
+  // Samples the keyframes of every instance and group once per frame and calls visitor with each frame as a grid
+  // laid out like loadVoxFile's, sized to fit every frame
+  void streamVoxAnimation(const char *filename, int& size, const std::function<void(int frame, const std::vector<int>& voxels)>& visitor, Palette* palette = nullptr);
 }
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <optional>
+#include <span>
+#include <glm/vec3.hpp>
+
+namespace cubik {
+  // Side of the bricks sources are evaluated in, one noise lane per voxel of a row
+  constexpr int BRICK_SIZE = 8;
+  constexpr int BRICK_VOLUME = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+
+  // World contents generated on demand, so builders can take them brick by brick instead of as a dense cube
+  class VoxelSource {
+  public:
+    virtual ~VoxelSource() = default;
+
+    // Voxels along each side of the world cube, a power of two
+    virtual int getSize() const = 0;
+
+    // Writes the brick at origin, x fastest then y then z. When the whole brick has one value it may return
+    // that value instead, without writing the brick
+    virtual std::optional<int> fillBrick(glm::ivec3 origin, std::span<int, BRICK_VOLUME> voxels) const = 0;
+
+    // The value of the whole box when the source can tell without evaluating it, so builders skip it. Conservative
+    virtual std::optional<int> classifyBox(glm::ivec3 origin, int size) const { return std::nullopt; }
+  };
+
+  inline int brickIndex(int x, int y, int z) {
+    return x + y * BRICK_SIZE + z * BRICK_SIZE * BRICK_SIZE;
+  }
+}
@@ -55,12 +55,12 @@ VkSemaphoreCreateInfo vkutil::semaphore_create_info(VkSemaphoreCreateFlags flags
   };
 }
 
-VkSemaphoreSubmitInfo vkutil::semaphore_submit_info(VkPipelineStageFlags2 stageMask, VkSemaphore semaphore) {
+VkSemaphoreSubmitInfo vkutil::semaphore_submit_info(VkPipelineStageFlags2 stageMask, VkSemaphore semaphore, uint64_t value) {
   return {
     .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
     .pNext = nullptr,
     .semaphore = semaphore,
-    .value = 1,
+    .value = value,
     .stageMask = stageMask,
     .deviceIndex = 0
   };
@@ -154,6 +154,26 @@ void vkutil::transition_image(VkCommandBuffer cmd, VkImage image, VkImageLayout
   vkCmdPipelineBarrier2(cmd, &depInfo);
 }
 
+void vkutil::memory_barrier(VkCommandBuffer cmd, VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 srcAccessMask, VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask) {
+  VkMemoryBarrier2 memoryBarrier {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+    .pNext = nullptr,
+    .srcStageMask = srcStageMask,
+    .srcAccessMask = srcAccessMask,
+    .dstStageMask = dstStageMask,
+    .dstAccessMask = dstAccessMask
+  };
+
+  VkDependencyInfo depInfo {
+    .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+    .pNext = nullptr,
+    .memoryBarrierCount = 1,
+    .pMemoryBarriers = &memoryBarrier
+  };
+
+  vkCmdPipelineBarrier2(cmd, &depInfo);
+}
+
 void vkutil::copy_image_to_image(VkCommandBuffer cmd, VkImage source, VkImage destination, VkExtent2D srcSize, VkExtent2D dstSize) {
   VkImageBlit2 blitRegion{ .sType = VK_STRUCTURE_TYPE_IMAGE_BLIT_2, .pNext = nullptr };
 
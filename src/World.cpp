@@ -0,0 +1,28 @@
+#include "World.h"
+#include <algorithm>
+
+namespace cubik {
+  void World::getBatch(std::span<const glm::ivec3> positions, std::span<int> values) const {
+    for (size_t i = 0; i < positions.size(); i++) {
+      values[i] = contains(positions[i]) ? get(positions[i]) : 0;
+    }
+  }
+
+  WorldBox World::findBox(glm::ivec3 position) const {
+    return { position, 1, contains(position) ? get(position) : 0 };
+  }
+
+  void World::visitBoxes(glm::ivec3 min, glm::ivec3 max, const std::function<void(const WorldBox&)>& visit) const {
+    int size = getSize();
+    min = glm::ivec3(std::max(min.x, 0), std::max(min.y, 0), std::max(min.z, 0));
+    max = glm::ivec3(std::min(max.x, size), std::min(max.y, size), std::min(max.z, size));
+    for (int z = min.z; z < max.z; z++) {
+      for (int y = min.y; y < max.y; y++) {
+        for (int x = min.x; x < max.x; x++) {
+          glm::ivec3 position(x, y, z);
+          visit({ position, 1, get(position) });
+        }
+      }
+    }
+  }
+}
@@ -1,9 +1,18 @@
 #pragma once
 
+#include <functional>
+#include <span>
 #include <string>
 #include <glm/vec3.hpp>
 
 namespace cubik {
+  // Aligned box of voxels that all hold value
+  struct WorldBox {
+    glm::ivec3 origin;
+    int size;
+    int value;
+  };
+
   class World {
   public:
     virtual ~World() = default;
@@ -14,6 +23,30 @@ namespace cubik {
 
     virtual const std::string& getCompatibleShader() const = 0;
 
+    // The position has to be inside the world, the queries below treat everything outside as empty
     virtual int get(glm::ivec3 pos) const = 0;
+
+    // Fills values with the value at each position
+    virtual void getBatch(std::span<const glm::ivec3> positions, std::span<int> values) const;
+
+    // Biggest uniform box the world stores around the position, a single voxel for flat grids
+    virtual WorldBox findBox(glm::ivec3 position) const;
+
+    // Calls visit with the uniform boxes overlapping [min, max), empty ones included. Boxes aren't clipped to the region
+    virtual void visitBoxes(glm::ivec3 min, glm::ivec3 max, const std::function<void(const WorldBox&)>& visit) const;
+
+    bool contains(glm::ivec3 position) const {
+      int size = getSize();
+      return position.x >= 0 && position.y >= 0 && position.z >= 0 && position.x < size && position.y < size && position.z < size;
+    }
+
+    // Number of voxels along each side of the world cube
+    virtual int getSize() const = 0;
+
+    // Number of levels the compatible shader has to descend before reaching a voxel (0 for flat grids)
+    virtual int getDepth() const = 0;
+
+    // Worlds built on the GPU serialize their raw input, which the renderer turns into the shader's layout
+    virtual bool isBuiltOnGpu() const { return false; }
   };
 }
@@ -0,0 +1,102 @@
+#include "WorldQuery.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <glm/common.hpp>
+
+namespace cubik {
+  std::optional<RaycastHit> raycast(const World& world, glm::vec3 origin, glm::vec3 direction, float maxDistance) {
+    // Clips the ray to the world cube first, outside of it there's nothing to hit
+    int size = world.getSize();
+    float enter = 0.f, exit = maxDistance;
+    int enterAxis = -1;
+    for (int axis = 0; axis < 3; axis++) {
+      if (direction[axis] == 0.f) {
+        if (origin[axis] < 0.f || origin[axis] >= static_cast<float>(size)) return std::nullopt;
+        continue;
+      }
+      float near = (0.f - origin[axis]) / direction[axis];
+      float far = (static_cast<float>(size) - origin[axis]) / direction[axis];
+      if (near > far) std::swap(near, far);
+      if (near > enter) {
+        enter = near;
+        enterAxis = axis;
+      }
+      exit = std::min(exit, far);
+    }
+    if (enter > exit) return std::nullopt;
+
+    float distance = enter;
+    glm::vec3 point = origin + direction * distance;
+    glm::ivec3 voxel = glm::clamp(glm::ivec3(glm::floor(point)), glm::ivec3(0), glm::ivec3(size - 1));
+    glm::ivec3 normal(0);
+    if (enterAxis >= 0) {
+      normal[enterAxis] = direction[enterAxis] > 0.f ? -1 : 1;
+      voxel[enterAxis] = direction[enterAxis] > 0.f ? 0 : size - 1;
+    }
+
+    while (true) {
+      WorldBox box = world.findBox(voxel);
+      if (box.value != 0) return RaycastHit { voxel, normal, distance, box.value };
+
+      // Leaves the box through the face the ray reaches first
+      float next = std::numeric_limits<float>::infinity();
+      int exitAxis = 0;
+      for (int axis = 0; axis < 3; axis++) {
+        if (direction[axis] == 0.f) continue;
+        int face = direction[axis] > 0.f ? box.origin[axis] + box.size : box.origin[axis];
+        float faceDistance = (static_cast<float>(face) - origin[axis]) / direction[axis];
+        if (faceDistance < next) {
+          next = faceDistance;
+          exitAxis = axis;
+        }
+      }
+      if (next >= exit) return std::nullopt;
+
+      distance = std::max(distance, next);
+      point = origin + direction * distance;
+      // The exit axis is stepped exactly. The others can only move forward, or rounding near an edge could send the
+      // ray back into a box it already left
+      for (int axis = 0; axis < 3; axis++) {
+        int rounded = std::clamp(static_cast<int>(std::floor(point[axis])), 0, size - 1);
+        if (direction[axis] > 0.f) voxel[axis] = std::max(voxel[axis], rounded);
+        if (direction[axis] < 0.f) voxel[axis] = std::min(voxel[axis], rounded);
+      }
+      voxel[exitAxis] = direction[exitAxis] > 0.f ? box.origin[exitAxis] + box.size : box.origin[exitAxis] - 1;
+      if (voxel[exitAxis] < 0 || voxel[exitAxis] >= size) return std::nullopt;
+      normal = glm::ivec3(0);
+      normal[exitAxis] = direction[exitAxis] > 0.f ? -1 : 1;
+    }
+  }
+
+  SweepResult sweep(const World& world, const Aabb& box, glm::vec3 motion) {
+    // Every solid box the motion could run into, gathered once
+    glm::vec3 sweptMin = glm::min(box.min, box.min + motion);
+    glm::vec3 sweptMax = glm::max(box.max, box.max + motion);
+    std::vector<Aabb> obstacles;
+    world.visitBoxes(glm::ivec3(glm::floor(sweptMin)), glm::ivec3(glm::ceil(sweptMax)), [&](const WorldBox& solid) {
+      if (solid.value != 0) obstacles.push_back({ glm::vec3(solid.origin), glm::vec3(solid.origin + solid.size) });
+    });
+
+    SweepResult result { glm::vec3(0.f), glm::bvec3(false) };
+    Aabb moved = box;
+    for (int axis : { 1, 0, 2 }) {
+      float step = motion[axis];
+      int u = (axis + 1) % 3, v = (axis + 2) % 3;
+      for (const Aabb& obstacle : obstacles) {
+        // Only boxes the moving one overlaps on the other two axes are in the way
+        bool isAcross = moved.min[u] < obstacle.max[u] && moved.max[u] > obstacle.min[u] &&
+                        moved.min[v] < obstacle.max[v] && moved.max[v] > obstacle.min[v];
+        if (!isAcross) continue;
+        if (step > 0.f && moved.max[axis] <= obstacle.min[axis]) step = std::min(step, obstacle.min[axis] - moved.max[axis]);
+        if (step < 0.f && moved.min[axis] >= obstacle.max[axis]) step = std::max(step, obstacle.max[axis] - moved.min[axis]);
+      }
+      result.motion[axis] = step;
+      result.isBlocked[axis] = step != motion[axis];
+      moved.min[axis] += step;
+      moved.max[axis] += step;
+    }
+    return result;
+  }
+}
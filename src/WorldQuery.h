@@ -0,0 +1,32 @@
+#pragma once
+
+#include <optional>
+#include <glm/vec3.hpp>
+#include "World.h"
+
+// Gameplay queries against any world, in voxel units. They step over the uniform boxes the world stores instead of
+// voxel by voxel, so they get cheaper the more a world compresses
+namespace cubik {
+  struct Aabb {
+    glm::vec3 min;
+    glm::vec3 max;
+  };
+
+  struct RaycastHit {
+    glm::ivec3 voxel;
+    glm::ivec3 normal; // Face the ray entered through, zero if it started inside the voxel
+    float distance; // In units of the direction's length
+    int value;
+  };
+
+  std::optional<RaycastHit> raycast(const World& world, glm::vec3 origin, glm::vec3 direction, float maxDistance);
+
+  struct SweepResult {
+    glm::vec3 motion; // How far the box could move along each axis before touching a solid voxel
+    glm::bvec3 isBlocked;
+  };
+
+  // Moves the box one axis at a time, y first so resting on the ground doesn't stop sliding along it. Voxels the box
+  // already overlaps don't block it, so it isn't pushed out of them either
+  SweepResult sweep(const World& world, const Aabb& box, glm::vec3 motion);
+}
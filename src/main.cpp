@@ -1,6 +1,12 @@
 #include <spdlog/spdlog.h>
 #include <glm/vec2.hpp>
 #include <chrono>
+#include <future>
+#include <optional>
+#include <atomic>
+#include <algorithm>
+#include <random>
+#include <cmath>
 #include "Window.h"
 #include "Renderer.h"
 #include "Camera.h"
@@ -8,39 +14,179 @@
 #include "VoxLoader.h"
 #include "UncompressedGridWorld.h"
 #include "SvoWorld.h"
+#include "OutOfCoreSvoBuilder.h"
+#include "MeshVoxelizer.h"
+#include "RawVolume.h"
+#include "WorldQuery.h"
+#include "GpuSvoWorld.h"
+#include "GreedyMeshWorld.h"
+#include "ColumnWorld.h"
+#include "SvoAnimation.h"
+#include "Trace.h"
+#include "JobSystem.h"
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/string_cast.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/constants.hpp>
 
 constexpr int PROCEDURAL_WORLD_SIZE = 32;
 constexpr bool isSvoEnabled = false;
+constexpr bool isGpuSvoBuildEnabled = false; // Builds the octree on the GPU instead of in SvoWorld
+constexpr cubik::SvoNodeOrder svoNodeOrder = cubik::SvoNodeOrder::DepthFirst; // Layout of the octree SvoWorld uploads
+constexpr bool isSvoLeafBrickEnabled = false; // Stores the octree's 8^3 bottom level as compressed leaf bricks
+constexpr bool isGreedyMeshEnabled = false; // Rasterizes a greedy mesh of the grid instead of ray marching it, without the SVO
+constexpr bool isColumnWorldEnabled = false; // Stores runs along the world's columns, for heightfield-like scenes, without the SVO
+constexpr cubik::ShadingQuality shadingQuality = cubik::ShadingQuality::High;
+constexpr bool isTraversalStatisticsEnabled = false; // Logs per ray step and node counts, at some cost
+constexpr cubik::DebugView debugView = cubik::DebugView::Shaded;
+constexpr bool isTraceEnabled = false; // Needs CUBIK_TRACING, the trace is written on shutdown
+constexpr const char* TRACE_PATH = "cubik-trace.json";
+constexpr bool isNoiseTerrainEnabled = false; // Streams a procedural terrain into the SVO or the columns instead of loading subject
+constexpr int NOISE_TERRAIN_SIZE = 1024;
+constexpr bool isOutOfCoreBuildEnabled = false; // Streams subject into an octree file instead of a dense grid, needs the SVO
+constexpr const char* OUT_OF_CORE_PATH = "world.svo";
+constexpr size_t OUT_OF_CORE_MEMORY_BUDGET = cubik::OUT_OF_CORE_MEMORY_BUDGET;
+constexpr bool isMeshImportEnabled = false; // Voxelizes MESH_FILE from the models directory instead of loading subject
+constexpr const char* MESH_FILE = "bunny.obj";
+constexpr int MESH_RESOLUTION = 1024;
+constexpr bool isMeshSolid = true; // Fills the inside too, the mesh has to be closed
+constexpr bool isRawVolumeEnabled = false; // Thresholds the scalar field of RAW_VOLUME_HEADER instead of loading subject
+constexpr const char* RAW_VOLUME_HEADER = "volume.mhd";
+constexpr int RAW_VOLUME_ISO_LEVEL = 300;
+constexpr int RAW_VOLUME_ISO_STEP = 50; // Page up and down move the iso level by this much and rebuild the world
+constexpr bool isAnimationEnabled = false; // Plays the keyframes of ANIMATION_FILE from the models directory instead of loading subject
+constexpr const char* ANIMATION_FILE = "animation.vox";
+constexpr float ANIMATION_FPS = 30;
+constexpr bool isCameraCollisionEnabled = false; // Stops the camera at solid voxels instead of flying through them
+constexpr float CAMERA_RADIUS = 0.5f; // Half the side of the camera's box, in voxels
+constexpr bool isRayQueryBenchmarkEnabled = false; // Traces batches of random GPU ray queries every frame and logs their throughput
+constexpr int RAY_QUERY_BATCH_SIZES[] = { 10000, 100000, 1000000 };
+// Each size runs for two profiler intervals so one of them only timed that size
+constexpr int RAY_QUERY_BENCHMARK_FRAMES = 2 * cubik::GpuProfiler::REPORT_INTERVAL;
+constexpr bool isInstanceDemoEnabled = false; // Orbits copies of a small staircase model around the world's center
+constexpr int INSTANCE_DEMO_COUNT = 200;
+constexpr int INSTANCE_MODEL_SIZE = 16;
+constexpr bool isRasterDemoEnabled = false; // Draws spinning triangle cubes through the voxels and logs what they cost
+constexpr int RASTER_DEMO_COUNT = 16;
+constexpr float PICK_DISTANCE = 100.f; // P logs the voxel at the center of the screen, in world units
+constexpr int JOB_THREAD_COUNT = 0; // Threads loading and building the world, 0 for one per core
 std::string subject = "pieta512.vox";
+std::unique_ptr<cubik::RawVolume> rawVolume; // Kept mapped to rebuild the world when the iso level changes
+cubik::Palette worldPalette = cubik::defaultPalette(); // Replaced by the subject's colors when it's loaded
 
 std::unique_ptr<cubik::World> createWorld(const std::vector<int>& rawWorld, int worldSize) {
-  if (isSvoEnabled) {
-    return std::make_unique<cubik::SvoWorld>(rawWorld, worldSize);
+  if (isSvoEnabled && isGpuSvoBuildEnabled) {
+    return std::make_unique<cubik::GpuSvoWorld>(rawWorld, worldSize);
+  } else if (isSvoEnabled) {
+    return std::make_unique<cubik::SvoWorld>(rawWorld, worldSize, svoNodeOrder, isSvoLeafBrickEnabled);
+  } else if (isColumnWorldEnabled) {
+    auto world = std::make_unique<cubik::ColumnWorld>(rawWorld, worldSize);
+    spdlog::info("Stored the columns as {} runs, {:.3f} bytes per voxel", world->getRunCount(), world->getBytesPerVoxel());
+    return world;
+  } else if (isGreedyMeshEnabled) {
+    auto world = std::make_unique<cubik::GreedyMeshWorld>(rawWorld, worldSize);
+    const cubik::GreedyMesh& mesh = world->getMesh();
+    spdlog::info("Greedy meshed {} quads in {} chunks, {:.2f}MB", mesh.indices.size() / 6, mesh.draws.size(),
+                 world->calculateSerializedSize() / (1024.f * 1024.f));
+    return world;
   } else {
-    return std::make_unique<cubik::UncompressedGridWorld>(rawWorld, worldSize);
+    auto world = std::make_unique<cubik::UncompressedGridWorld>(rawWorld, worldSize);
+    spdlog::info("Packed the grid into palette bricks, {:.3f} bytes per voxel", world->getBricks().getBytesPerVoxel());
+    return world;
   }
 }
 
-int main(int argc, char *argv[]) {
-  spdlog::info("Starting Cubik");
+std::unique_ptr<cubik::World> buildRawVolumeWorld() {
+  CUBIK_TRACE_ZONE("createWorld");
+  if (isSvoEnabled && !isGpuSvoBuildEnabled) return std::make_unique<cubik::SvoWorld>(*rawVolume, svoNodeOrder, isSvoLeafBrickEnabled);
+  return createWorld(cubik::loadSource(*rawVolume), rawVolume->getSize());
+}
+
+// Runs on a worker thread while the main thread creates the window and the renderer
+std::unique_ptr<cubik::World> loadWorld() {
+  cubik::trace::set_thread_name("World loader");
+
+  if (isNoiseTerrainEnabled && isSvoEnabled && !isGpuSvoBuildEnabled) {
+    // Never goes through a dense cube, which wouldn't fit in memory at this size
+    CUBIK_TRACE_ZONE("createWorld");
+    return std::make_unique<cubik::SvoWorld>(cubik::NoiseTerrainSource(NOISE_TERRAIN_SIZE), svoNodeOrder, isSvoLeafBrickEnabled);
+  }
+  if (isNoiseTerrainEnabled && isColumnWorldEnabled && !isSvoEnabled) {
+    CUBIK_TRACE_ZONE("createWorld");
+    return std::make_unique<cubik::ColumnWorld>(cubik::NoiseTerrainSource(NOISE_TERRAIN_SIZE));
+  }
+
+  if (isAnimationEnabled) {
+    CUBIK_TRACE_ZONE("createWorld");
+    int worldSize = 0;
+    std::unique_ptr<cubik::SvoAnimation> animation;
+    cubik::streamVoxAnimation((std::string("../models/") + ANIMATION_FILE).c_str(), worldSize, [&](int, const std::vector<int>& voxels) {
+      if (!animation) animation = std::make_unique<cubik::SvoAnimation>(worldSize);
+      animation->addFrame(voxels);
+    }, &worldPalette);
+
+    size_t treeNodes = 0;
+    int maxAddedNodes = 0;
+    for (int i = 0; i < animation->getFrameCount(); i++) {
+      treeNodes += animation->getFrame(i).treeNodes;
+      maxAddedNodes = std::max(maxAddedNodes, animation->getFrame(i).addedNodes);
+    }
+    double nodeKilobytes = sizeof(cubik::LinearOctreeNode) / 1024.;
+    double frameCount = animation->getFrameCount();
+    spdlog::info("{} frames share {} nodes, {:.1f}KB per frame and at most {:.1f}KB, against {:.1f}KB per frame as separate octrees",
+                 animation->getFrameCount(), animation->getNodes().size(), animation->getNodes().size() * nodeKilobytes / frameCount,
+                 maxAddedNodes * nodeKilobytes, treeNodes * nodeKilobytes / frameCount);
+    return animation;
+  }
+
+  if (isMeshImportEnabled) {
+    cubik::MeshVoxelizer voxelizer(cubik::loadMeshFile((std::string("../models/") + MESH_FILE).c_str()), MESH_RESOLUTION, isMeshSolid);
+    CUBIK_TRACE_ZONE("createWorld");
+    if (isSvoEnabled && !isGpuSvoBuildEnabled) return std::make_unique<cubik::SvoWorld>(voxelizer, svoNodeOrder, isSvoLeafBrickEnabled);
+    return createWorld(cubik::loadSource(voxelizer), MESH_RESOLUTION);
+  }
+
+  if (isRawVolumeEnabled) {
+    rawVolume = std::make_unique<cubik::RawVolume>(cubik::readMetaImageHeader(std::string("../models/") + RAW_VOLUME_HEADER));
+    rawVolume->setIsoLevel(RAW_VOLUME_ISO_LEVEL);
+    return buildRawVolumeWorld();
+  }
+
+  if (isOutOfCoreBuildEnabled && isSvoEnabled && !isGpuSvoBuildEnabled) {
+    CUBIK_TRACE_ZONE("createWorld");
+    int worldSize = 0;
+    // The size is only known once the file is open, which is before the first voxel comes in
+    std::optional<cubik::OutOfCoreSvoBuilder> builder;
+    cubik::streamVoxFile(("../models/" + subject).c_str(), worldSize, [&](glm::ivec3 position, int value) {
+      if (!builder) builder.emplace(worldSize, OUT_OF_CORE_PATH, OUT_OF_CORE_MEMORY_BUDGET);
+      builder->add(position, value);
+    }, &worldPalette);
+    if (!builder) builder.emplace(worldSize, OUT_OF_CORE_PATH, OUT_OF_CORE_MEMORY_BUDGET);
+    builder->finish();
+    return cubik::SvoWorld::load(OUT_OF_CORE_PATH);
+  }
 
   int worldSize = PROCEDURAL_WORLD_SIZE;
   auto rawWorld = cubik::loadStaircase(worldSize);
-  rawWorld = cubik::loadVoxFile(("../models/" + subject).c_str(), worldSize);
-  auto camera = cubik::Camera(subject);
+  rawWorld = cubik::loadVoxFile(("../models/" + subject).c_str(), worldSize, &worldPalette);
 
-  int numberOfSolidVoxels = 0;
-  for (int i = 0; i < rawWorld.size(); i++) {
-    if (rawWorld[i] > 0) numberOfSolidVoxels++;
-  }
-  spdlog::info("World contains {} solid voxels", numberOfSolidVoxels);
+  std::atomic<int> numberOfSolidVoxels {0};
+  cubik::JobSystem::global().parallel_for(static_cast<int>(rawWorld.size()), cubik::LOADER_GRAIN_SIZE, [&](int begin, int end) {
+    numberOfSolidVoxels += static_cast<int>(std::count_if(rawWorld.begin() + begin, rawWorld.begin() + end, [](int voxel) { return voxel > 0; }));
+  });
+  spdlog::info("World contains {} solid voxels", numberOfSolidVoxels.load());
 
 //  auto world = cubik::UncompressedGridWorld(rawWorld, worldSize);
 //  auto svoWorld = cubik::SvoWorld(rawWorld, worldSize);
-  auto world = createWorld(rawWorld, worldSize);
+  auto worldBuildStart = std::chrono::high_resolution_clock::now();
+  std::unique_ptr<cubik::World> world;
+  {
+    CUBIK_TRACE_ZONE("createWorld");
+    world = createWorld(rawWorld, worldSize);
+  }
+  std::chrono::duration<float, std::milli> worldBuildTime = std::chrono::high_resolution_clock::now() - worldBuildStart;
+  spdlog::info("Built the world on the CPU in {:.2f}ms", worldBuildTime.count());
 //  svoWorld.print();
 //
 //  for (int x = 0; x < worldSize; x++) {
@@ -57,9 +203,82 @@ int main(int argc, char *argv[]) {
 //    }
 //  }
 
+  return world;
+}
+
+cubik::Mesh cubeMesh() {
+  cubik::Mesh mesh;
+  for (int corner = 0; corner < 8; corner++) {
+    mesh.positions.emplace_back(corner & 1, (corner >> 1) & 1, (corner >> 2) & 1);
+  }
+  // Two triangles per face, indexed by corner bits
+  mesh.triangles = {
+    { 0, 2, 6 }, { 0, 6, 4 }, { 1, 5, 7 }, { 1, 7, 3 },
+    { 0, 4, 5 }, { 0, 5, 1 }, { 2, 3, 7 }, { 2, 7, 6 },
+    { 0, 1, 3 }, { 0, 3, 2 }, { 4, 6, 7 }, { 4, 7, 5 }
+  };
+  return mesh;
+}
+
+// Rays from random points of the world in random directions
+std::vector<cubik::RayQuery> randomRayQueries(int count, int worldSize) {
+  std::mt19937 random(count);
+  std::uniform_real_distribution<float> position(0.f, worldSize * cubik::VOXEL_SIZE);
+  std::normal_distribution<float> direction;
+  std::vector<cubik::RayQuery> queries(count);
+  for (cubik::RayQuery& query : queries) {
+    query.origin = glm::vec3(position(random), position(random), position(random));
+    query.direction = glm::vec3(direction(random), direction(random), direction(random));
+    query.maxDistance = 2 * worldSize * cubik::VOXEL_SIZE;
+  }
+  return queries;
+}
+
+int main(int argc, char *argv[]) {
+  spdlog::info("Starting Cubik");
+  if (isTraceEnabled) {
+    cubik::trace::start();
+    cubik::trace::set_thread_name("Main");
+  }
+
+  if (JOB_THREAD_COUNT > 0) cubik::JobSystem::global().set_thread_count(JOB_THREAD_COUNT);
+
+  // Loading and building the world doesn't need the GPU, so it overlaps with the window and Vulkan setup.
+  // The world upload starts on the first frame both are ready
+  auto startupStart = std::chrono::high_resolution_clock::now();
+  std::future<std::unique_ptr<cubik::World>> loadingWorld = std::async(std::launch::async, loadWorld);
+  std::unique_ptr<cubik::World> world;
+  auto camera = cubik::Camera(subject);
+
   const uint8_t* keyboardInput;
   auto window = cubik::Window(glm::ivec2(1700, 900), "Cubik", keyboardInput);
-  auto renderer = cubik::Renderer(window, *world);
+  auto renderer = cubik::Renderer(window);
+  renderer.set_shading_quality(shadingQuality);
+  renderer.set_statistics_enabled(isTraversalStatisticsEnabled);
+  renderer.set_debug_view(debugView);
+  int isoLevel = RAW_VOLUME_ISO_LEVEL;
+  int builtIsoLevel = RAW_VOLUME_ISO_LEVEL;
+  bool wasIsoKeyDown = false;
+  std::future<std::unique_ptr<cubik::World>> rebuildingWorld;
+  bool wasPickKeyDown = false;
+  std::optional<cubik::RayQueryTicket> pick;
+  int rayQueryBenchmarkFrame = 0;
+  std::vector<cubik::RayQuery> rayQueryBatch;
+  std::vector<cubik::InstanceHandle> demoInstances;
+  cubik::RasterMeshHandle demoCube = isRasterDemoEnabled ? renderer.add_raster_mesh(cubeMesh()) : -1;
+  int rasterDemoFrame = 0;
+  int animationFrame = 0;
+  size_t animationUploadBytes = 0;
+  float demoTime = 0;
+  if (isInstanceDemoEnabled) {
+    cubik::SvoWorld model(cubik::loadStaircase(INSTANCE_MODEL_SIZE), INSTANCE_MODEL_SIZE);
+    cubik::ModelHandle demoModel = renderer.add_model(model);
+    for (int i = 0; i < INSTANCE_DEMO_COUNT; i++) {
+      demoInstances.push_back(renderer.add_instance(demoModel, glm::mat4(1.f)));
+    }
+  }
+  std::chrono::duration<float, std::milli> rendererInitTime = std::chrono::high_resolution_clock::now() - startupStart;
+  spdlog::info("Created the window and renderer in {:.2f}ms", rendererInitTime.count());
 
   auto lastFrameTime = std::chrono::high_resolution_clock::now();
   while (!window.IsClosed()) {
@@ -67,11 +286,152 @@ int main(int argc, char *argv[]) {
     std::chrono::duration<float> deltaTime = currentFrameTime - lastFrameTime;
     lastFrameTime = currentFrameTime;
 
-    cubik::MouseInput mouseInput = window.processInputs();
-    camera.update(keyboardInput, mouseInput, deltaTime);
+    CUBIK_TRACE_ZONE("frame");
+    cubik::MouseInput mouseInput;
+    {
+      CUBIK_TRACE_ZONE("processInputs");
+      mouseInput = window.processInputs();
+    }
+    {
+      CUBIK_TRACE_ZONE("camera.update");
+      glm::vec3 previousPosition = camera.Position;
+      camera.update(keyboardInput, mouseInput, deltaTime);
+      if (isCameraCollisionEnabled && world) {
+        glm::vec3 center = previousPosition / cubik::VOXEL_SIZE;
+        cubik::Aabb box { center - CAMERA_RADIUS, center + CAMERA_RADIUS };
+        cubik::SweepResult collision = cubik::sweep(*world, box, (camera.Position - previousPosition) / cubik::VOXEL_SIZE);
+        camera.Position = previousPosition + collision.motion * cubik::VOXEL_SIZE;
+      }
+    }
+    // Waits a little for the world instead of spinning, the window still gets to process its events
+    if (!world && loadingWorld.wait_for(std::chrono::milliseconds(5)) == std::future_status::ready) {
+      world = loadingWorld.get();
+      double worldBytes = static_cast<double>(world->calculateSerializedSize());
+      double voxelCount = std::pow(static_cast<double>(world->getSize()), 3);
+      spdlog::info("World takes {:.2f}MB on the GPU, {:.3f} bytes per voxel", worldBytes / (1024 * 1024), worldBytes / voxelCount);
+      renderer.set_palette(worldPalette);
+      if (isAnimationEnabled) {
+        renderer.set_animation(static_cast<const cubik::SvoAnimation&>(*world));
+      } else {
+        renderer.update_world(*world);
+      }
+    }
+
+    if (isRawVolumeEnabled && world) {
+      bool isIsoKeyDown = keyboardInput[SDL_SCANCODE_PAGEUP] || keyboardInput[SDL_SCANCODE_PAGEDOWN];
+      if (isIsoKeyDown && !wasIsoKeyDown) {
+        isoLevel += keyboardInput[SDL_SCANCODE_PAGEUP] ? RAW_VOLUME_ISO_STEP : -RAW_VOLUME_ISO_STEP;
+        spdlog::info("Iso level {}", isoLevel);
+      }
+      wasIsoKeyDown = isIsoKeyDown;
+
+      // The volume is only reclassified between builds, and the old world is kept on screen until the new one is up
+      if (rebuildingWorld.valid() && rebuildingWorld.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        std::unique_ptr<cubik::World> rebuilt = rebuildingWorld.get();
+        renderer.update_world(*rebuilt);
+        world = std::move(rebuilt);
+      }
+      if (!rebuildingWorld.valid() && isoLevel != builtIsoLevel) {
+        rawVolume->setIsoLevel(isoLevel);
+        builtIsoLevel = isoLevel;
+        rebuildingWorld = std::async(std::launch::async, buildRawVolumeWorld);
+      }
+    }
+
+    bool isPickKeyDown = keyboardInput[SDL_SCANCODE_P];
+    if (isPickKeyDown && !wasPickKeyDown && !pick) {
+      cubik::RayQuery query { .origin = camera.Position, .maxDistance = PICK_DISTANCE, .direction = camera.Forward };
+      pick = renderer.submit_ray_queries({ &query, 1 });
+    }
+    wasPickKeyDown = isPickKeyDown;
+    if (pick) {
+      if (auto hits = renderer.get_ray_query_results(*pick)) {
+        const cubik::RayQueryHit& hit = (*hits)[0];
+        if (hit.is_hit() && hit.instance >= 0) {
+          spdlog::info("Picked voxel {} of instance {} at {:.2f}", glm::to_string(hit.voxel), hit.instance, hit.distance);
+        } else if (hit.is_hit()) {
+          spdlog::info("Picked voxel {} at {:.2f}", glm::to_string(hit.voxel), hit.distance);
+        } else spdlog::info("Nothing to pick");
+        pick.reset();
+      }
+    }
+
+    if (isRayQueryBenchmarkEnabled && renderer.is_world_ready()) {
+      int sizeIndex = rayQueryBenchmarkFrame / RAY_QUERY_BENCHMARK_FRAMES;
+      if (sizeIndex < static_cast<int>(std::size(RAY_QUERY_BATCH_SIZES))) {
+        int batchSize = RAY_QUERY_BATCH_SIZES[sizeIndex];
+        if (rayQueryBenchmarkFrame % RAY_QUERY_BENCHMARK_FRAMES == 0) {
+          rayQueryBatch = randomRayQueries(batchSize, world->getSize());
+        }
+        renderer.submit_ray_queries(rayQueryBatch);
+        rayQueryBenchmarkFrame++;
+
+        if (rayQueryBenchmarkFrame % RAY_QUERY_BENCHMARK_FRAMES == 0) {
+          float milliseconds = renderer.get_ray_query_milliseconds();
+          spdlog::info("{} ray queries per batch: {:.3f}ms, {:.1f} Mrays/s", batchSize, milliseconds,
+                       milliseconds > 0 ? batchSize / (milliseconds * 1000.f) : 0.f);
+        }
+      }
+    }
+
+    if (world) demoTime += deltaTime.count();
+    if (isInstanceDemoEnabled && world) {
+      // Rings of spinning staircases, each ring a little higher and orbiting the other way
+      glm::vec3 center = glm::vec3(world->getSize() * cubik::VOXEL_SIZE * 0.5f);
+      for (int i = 0; i < INSTANCE_DEMO_COUNT; i++) {
+        int ring = i / 20;
+        float direction = ring % 2 == 0 ? 1.f : -1.f;
+        float angle = direction * 0.3f * demoTime + glm::two_pi<float>() * (i % 20) / 20.f;
+        float radius = 0.5f * center.x + ring * INSTANCE_MODEL_SIZE * cubik::VOXEL_SIZE;
+        glm::vec3 position = center + glm::vec3(radius * glm::cos(angle), ring * 0.5f, radius * glm::sin(angle));
+        glm::mat4 transform = glm::translate(glm::mat4(1.f), position);
+        transform = glm::rotate(transform, demoTime + i, glm::normalize(glm::vec3(1.f, 2.f, 3.f)));
+        transform = glm::scale(transform, glm::vec3(cubik::VOXEL_SIZE));
+        transform = glm::translate(transform, glm::vec3(-0.5f * INSTANCE_MODEL_SIZE));
+        renderer.set_instance_transform(demoInstances[i], transform);
+      }
+    }
+
+    if (isRasterDemoEnabled && world) {
+      // A row of spinning cubes across the world, wherever they cross the voxels each hides part of the other
+      float worldSize = world->getSize() * cubik::VOXEL_SIZE;
+      for (int i = 0; i < RASTER_DEMO_COUNT; i++) {
+        glm::vec3 position = glm::vec3((i + 0.5f) / RASTER_DEMO_COUNT, 0.25f, 0.5f) * worldSize;
+        glm::mat4 transform = glm::translate(glm::mat4(1.f), position);
+        transform = glm::rotate(transform, demoTime + i, glm::normalize(glm::vec3(1.f, 2.f, 3.f)));
+        transform = glm::scale(transform, glm::vec3(0.5f * worldSize / RASTER_DEMO_COUNT));
+        transform = glm::translate(transform, glm::vec3(-0.5f));
+        renderer.draw_raster_mesh(demoCube, transform, glm::vec3(0.2f, 0.6f, 0.9f));
+      }
+      if (++rasterDemoFrame % cubik::GpuProfiler::REPORT_INTERVAL == 0) {
+        spdlog::info("Depth copy and raster pass: {:.3f}ms", renderer.get_raster_milliseconds());
+      }
+    }
+
+    if (isAnimationEnabled && world) {
+      // Collisions read the shown frame too
+      auto& animation = static_cast<cubik::SvoAnimation&>(*world);
+      int frame = static_cast<int>(demoTime * ANIMATION_FPS) % animation.getFrameCount();
+      animation.setFrame(frame);
+      renderer.show_animation_frame(frame);
+    }
+
+    bool hadFirstFrame = renderer.is_world_ready();
     renderer.draw(camera);
+    if (isAnimationEnabled && renderer.is_world_ready()) {
+      animationUploadBytes += renderer.get_animation_upload_bytes();
+      if (++animationFrame % cubik::GpuProfiler::REPORT_INTERVAL == 0) {
+        spdlog::info("Animation uploads: {:.1f}KB per frame", animationUploadBytes / (1024. * cubik::GpuProfiler::REPORT_INTERVAL));
+        animationUploadBytes = 0;
+      }
+    }
+    if (!hadFirstFrame && renderer.is_world_ready()) {
+      std::chrono::duration<float, std::milli> timeToFirstFrame = std::chrono::high_resolution_clock::now() - startupStart;
+      spdlog::info("First frame after {:.2f}ms", timeToFirstFrame.count());
+    }
   }
 
+  if (isTraceEnabled) cubik::trace::stop(TRACE_PATH);
   spdlog::info("Cubik has successfully shut down!");
   return 0;
 }
\ No newline at end of file